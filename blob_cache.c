@@ -0,0 +1,1067 @@
+#include "blob_cache.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "file.h"
+#include "messenger.h"
+#include "platform.h"
+
+#define min_value(a, b) (a < b ? a : b)
+
+#define BLOB_JOURNAL_MAGIC   0x4c4e524a424f4c42 // "BLOBJRNL"
+#define BLOB_JOURNAL_VERSION 1
+
+#define BLOB_NONE        UINT32_MAX
+#define BLOB_SHARD_COUNT 256
+#define BLOB_KEY_CHARS   32
+
+// how often the background thread writes the journal, in seconds
+#define BLOB_FLUSH_INTERVAL 1
+// journal records kept in memory before the background thread is woken early
+#define BLOB_JOURNAL_BATCH 4096
+// the journal is rewritten when it has this many more records than the blobs
+// it describes, on top of two for each blob
+#define BLOB_COMPACT_SLACK 4096
+
+// blobs are evicted until the cache is this far under budget, so eviction does
+// not run again after every put
+#define BLOB_EVICT_SLACK(budget) ((budget) / 16)
+// blobs evicted before other threads get a turn with the lock
+#define BLOB_EVICT_BATCH 64
+
+// blobs nobody is using that are kept mapped
+#define BLOB_MAX_IDLE_MAPS 1024
+
+//
+// Types
+//
+
+typedef enum JournalOp
+{
+    JOURNAL_HEADER = 0,
+    JOURNAL_PUT,
+    JOURNAL_TOUCH,
+    JOURNAL_REMOVE,
+} JournalOp;
+
+// the journal is a list of these, starting with a header
+struct JournalRecord
+{
+    CutilHash128 key;
+    u64 size;
+    u64 op; // JournalOp
+};
+
+// a mapped blob, shared by every view of it
+struct BlobMapping
+{
+    CutilFileMap map;
+    CutilHash128 key;
+    u32 references;
+    // the blob was evicted or removed, unmap it when the last view is released
+    bool detached;
+};
+
+struct BlobEntry
+{
+    CutilHash128 key;
+    u64 size;
+
+    // the least recently used list, BLOB_NONE at the ends
+    u32 newer;
+    u32 older;
+
+    struct BlobMapping *mapping; // NULL if not mapped
+};
+
+struct CutilBlobCache
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // wakes the background thread
+    pthread_t evictor;
+    bool running; // the background thread was started
+    bool stopping;
+
+    char *folder;
+    u32 folderLength;
+
+    u64 budget;
+    u64 totalSize;
+
+    struct BlobEntry *entries;
+    u32 entryCount;
+    u32 entryCapacity;
+
+    // open addressed index of the entries, each slot is an index + 1
+    u32 *slots;
+    u32 slotCount;
+
+    u32 newest;
+    u32 oldest;
+
+    // records not written to the journal yet
+    struct JournalRecord *pending;
+    u32 pendingCount;
+    u32 pendingCapacity;
+    u64 journalCount; // records in the journal file
+    bool journalIncomplete; // a record was lost, compact to write it again
+
+    u64 tempCounter;
+    u32 idleMaps;
+
+    u64 hits;
+    u64 misses;
+    u64 evictions;
+};
+
+//
+// Helper Declerations
+//
+
+// write the path of a blob into dest, which needs folderLength + 40 bytes
+static void blob_path(
+    const CutilBlobCache *cache, const CutilHash128 key, char *dest);
+
+// like cutil_read_file_exists, without logging missing files
+static bool file_exists(const char *filepath);
+
+// read a key from its file name
+static bool parse_key(const char *name, CutilHash128 *key);
+
+static u32 find_entry(const CutilBlobCache *cache, const CutilHash128 key);
+
+// add an entry as the most recently used one, or the least with oldest
+static u32 insert_entry(
+    CutilBlobCache *cache,
+    const CutilHash128 key,
+    const u64 size,
+    const bool oldest);
+
+// remove an entry, the last entry takes its index
+static void remove_entry(CutilBlobCache *cache, const u32 index);
+
+static void link_entry(CutilBlobCache *cache, const u32 index, bool oldest);
+
+static void unlink_entry(CutilBlobCache *cache, const u32 index);
+
+// mark an entry as the most recently used
+static void touch_entry(CutilBlobCache *cache, const u32 index);
+
+// unmap an entry's blob, or leave it to the last view if it is in use
+static void detach_mapping(CutilBlobCache *cache, struct BlobEntry *entry);
+
+// delete a blob's file and forget it, the lock must be held
+static void delete_blob(CutilBlobCache *cache, const u32 index);
+
+static void push_record(
+    CutilBlobCache *cache,
+    const JournalOp op,
+    const CutilHash128 key,
+    const u64 size);
+
+// replay the journal into the index
+static Result read_journal(CutilBlobCache *cache);
+
+// list the cache folder to find blobs the journal is missing, and forget
+// blobs that are gone
+static Result scan_blobs(CutilBlobCache *cache);
+
+static bool should_compact(const CutilBlobCache *cache);
+
+// add the pending records to the end of the journal
+static Result flush_journal(CutilBlobCache *cache);
+
+// rewrite the journal with one record for each blob, oldest first
+static Result compact_journal(CutilBlobCache *cache);
+
+// evict blobs until the cache is under budget, the lock must be held
+static void evict(CutilBlobCache *cache);
+
+static void *evictor(void *cache);
+
+//
+// Public methods
+//
+
+Result cutil_blob_cache_open(
+    CutilBlobCache **restrict cache,
+    const char *restrict folder,
+    const u64 budget)
+{
+    *cache = NULL;
+
+    u32 folderLength = strlen(folder);
+    while (folderLength > 1 && folder[folderLength - 1] == '/')
+        folderLength--;
+
+    CutilBlobCache *result = calloc(1, sizeof(CutilBlobCache));
+    if (!result)
+        return RS_FAILURE;
+    result->folder = malloc(folderLength + 1);
+    if (!result->folder)
+    {
+        free(result);
+        return RS_FAILURE;
+    }
+    memcpy(result->folder, folder, folderLength);
+    result->folder[folderLength] = '\0';
+    result->folderLength         = folderLength;
+    result->budget               = budget;
+    result->newest               = BLOB_NONE;
+    result->oldest               = BLOB_NONE;
+    pthread_mutex_init(&result->lock, NULL);
+    pthread_cond_init(&result->wake, NULL);
+
+    char tempFolder[folderLength + 8];
+    char journalPath[folderLength + 16];
+    char markerPath[folderLength + 16];
+    snprintf(tempFolder, sizeof(tempFolder), "%s/tmp", result->folder);
+    snprintf(journalPath, sizeof(journalPath), "%s/journal", result->folder);
+    snprintf(markerPath, sizeof(markerPath), "%s/open", result->folder);
+
+    // blobs that were being written when the cache was last open
+    if (file_exists(tempFolder))
+        cutil_platform_delete_folder(tempFolder);
+
+    char shards[BLOB_SHARD_COUNT + 1][folderLength + 8];
+    const char *shardPaths[BLOB_SHARD_COUNT + 1];
+    for (u32 i = 0; i < BLOB_SHARD_COUNT; i++)
+    {
+        snprintf(shards[i], sizeof(shards[i]), "%s/%02x", result->folder, i);
+        shardPaths[i] = shards[i];
+    }
+    shardPaths[BLOB_SHARD_COUNT] = tempFolder;
+
+    if (cutil_platform_create_folders(shardPaths, BLOB_SHARD_COUNT + 1))
+    {
+        cutil_blob_cache_close(result);
+        return RS_FAILURE;
+    }
+
+    // the marker is only there while the cache is open, so if it exists the
+    // journal may be missing the last blobs
+    bool clean = !file_exists(markerPath);
+    if (!file_exists(journalPath) || read_journal(result))
+        clean = false;
+
+    if ((!clean && (scan_blobs(result) || compact_journal(result))) ||
+        cutil_write_file_binary(markerPath, "", 0))
+    {
+        cutil_blob_cache_close(result);
+        return RS_FAILURE;
+    }
+
+    if (pthread_create(&result->evictor, NULL, evictor, result))
+    {
+        log_error("Failed to start the blob cache eviction thread");
+        cutil_blob_cache_close(result);
+        return RS_FAILURE;
+    }
+    result->running = true;
+
+    *cache = result;
+    return RS_SUCCESS;
+}
+
+void cutil_blob_cache_close(CutilBlobCache *cache)
+{
+    if (!cache)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->stopping = true;
+    pthread_cond_signal(&cache->wake);
+    pthread_mutex_unlock(&cache->lock);
+
+    if (cache->running)
+    {
+        pthread_join(cache->evictor, NULL);
+
+        // a complete journal means the folder does not have to be listed
+        const bool compact = should_compact(cache) || cache->journalIncomplete;
+        const Result written =
+            compact ? compact_journal(cache) : flush_journal(cache);
+        if (!written)
+        {
+            char markerPath[cache->folderLength + 16];
+            snprintf(markerPath, sizeof(markerPath), "%s/open", cache->folder);
+            cutil_platform_delete_file(markerPath);
+        }
+    }
+
+    for (u32 i = 0; i < cache->entryCount; i++)
+        detach_mapping(cache, &cache->entries[i]);
+
+    pthread_cond_destroy(&cache->wake);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->entries);
+    free(cache->slots);
+    free(cache->pending);
+    free(cache->folder);
+    free(cache);
+}
+
+Result cutil_blob_cache_put(
+    CutilBlobCache *restrict cache,
+    const CutilHash128 key,
+    const void *restrict data,
+    const u64 size)
+{
+    pthread_mutex_lock(&cache->lock);
+
+    // a key always has the same contents
+    u32 index = find_entry(cache, key);
+    if (index != BLOB_NONE)
+    {
+        touch_entry(cache, index);
+        pthread_mutex_unlock(&cache->lock);
+        return RS_SUCCESS;
+    }
+
+    if (size > cache->budget)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        log_error(
+            "A blob of %llu bytes does not fit in the cache",
+            (unsigned long long)size);
+        return RS_FAILURE;
+    }
+
+    const u64 tempId = cache->tempCounter++;
+    pthread_mutex_unlock(&cache->lock);
+
+    char path[cache->folderLength + 40];
+    char tempPath[cache->folderLength + 64];
+    blob_path(cache, key, path);
+    snprintf(
+        tempPath,
+        sizeof(tempPath),
+        "%s/tmp/%s.%llu",
+        cache->folder,
+        path + cache->folderLength + 4,
+        (unsigned long long)tempId);
+
+    // the slow part happens without the lock, and readers can not find the
+    // blob before it is complete
+    if (cutil_write_file_binary(tempPath, data, size))
+    {
+        if (file_exists(tempPath))
+            cutil_platform_delete_file(tempPath);
+        return RS_FAILURE;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    // another thread stored it first
+    if (find_entry(cache, key) != BLOB_NONE)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        cutil_platform_delete_file(tempPath);
+        return RS_SUCCESS;
+    }
+
+    if (cutil_platform_move_file(path, tempPath))
+    {
+        pthread_mutex_unlock(&cache->lock);
+        cutil_platform_delete_file(tempPath);
+        return RS_FAILURE;
+    }
+
+    index = insert_entry(cache, key, size, false);
+    if (index == BLOB_NONE)
+    {
+        cutil_platform_delete_file(path);
+        pthread_mutex_unlock(&cache->lock);
+        return RS_FAILURE;
+    }
+    push_record(cache, JOURNAL_PUT, key, size);
+
+    if (cache->totalSize > cache->budget)
+        pthread_cond_signal(&cache->wake);
+
+    pthread_mutex_unlock(&cache->lock);
+    return RS_SUCCESS;
+}
+
+bool cutil_blob_cache_get(
+    CutilBlobCache *restrict cache,
+    const CutilHash128 key,
+    CutilBlobView *restrict view)
+{
+    *view = (CutilBlobView){0};
+
+    pthread_mutex_lock(&cache->lock);
+
+    const u32 index = find_entry(cache, key);
+    if (index == BLOB_NONE)
+    {
+        cache->misses++;
+        pthread_mutex_unlock(&cache->lock);
+        return false;
+    }
+
+    struct BlobEntry *entry     = &cache->entries[index];
+    struct BlobMapping *mapping = entry->mapping;
+    if (!mapping)
+    {
+        char path[cache->folderLength + 40];
+        blob_path(cache, key, path);
+
+        mapping = calloc(1, sizeof(struct BlobMapping));
+        if (!mapping ||
+            cutil_file_map(&mapping->map, path, CUTIL_FILE_MAP_DEFAULT) ||
+            mapping->map.size != entry->size)
+        {
+            // the file was deleted or changed behind the cache's back
+            if (mapping)
+                cutil_file_unmap(&mapping->map);
+            free(mapping);
+            if (file_exists(path))
+                cutil_platform_delete_file(path);
+            push_record(cache, JOURNAL_REMOVE, key, 0);
+            remove_entry(cache, index);
+            cache->misses++;
+            pthread_mutex_unlock(&cache->lock);
+            return false;
+        }
+
+        mapping->key   = key;
+        entry->mapping = mapping;
+    }
+    else if (!mapping->references)
+        cache->idleMaps--;
+
+    mapping->references++;
+    touch_entry(cache, index);
+    cache->hits++;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    view->data     = mapping->map.data;
+    view->size     = mapping->map.size;
+    view->internal = mapping;
+    return true;
+}
+
+void cutil_blob_cache_release(
+    CutilBlobCache *restrict cache, CutilBlobView *restrict view)
+{
+    struct BlobMapping *mapping = view->internal;
+    *view                       = (CutilBlobView){0};
+    if (!mapping)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (!--mapping->references)
+    {
+        if (mapping->detached)
+        {
+            cutil_file_unmap(&mapping->map);
+            free(mapping);
+        }
+        else if (cache->idleMaps >= BLOB_MAX_IDLE_MAPS)
+        {
+            const u32 index = find_entry(cache, mapping->key);
+            cache->entries[index].mapping = NULL;
+            cutil_file_unmap(&mapping->map);
+            free(mapping);
+        }
+        else
+            cache->idleMaps++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+Result cutil_blob_cache_remove(
+    CutilBlobCache *restrict cache, const CutilHash128 key)
+{
+    pthread_mutex_lock(&cache->lock);
+
+    const u32 index = find_entry(cache, key);
+    if (index != BLOB_NONE)
+        delete_blob(cache, index);
+
+    pthread_mutex_unlock(&cache->lock);
+    return index != BLOB_NONE ? RS_SUCCESS : RS_FAILURE;
+}
+
+void cutil_blob_cache_set_budget(CutilBlobCache *cache, const u64 budget)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->budget = budget;
+    pthread_cond_signal(&cache->wake);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cutil_blob_cache_get_stats(
+    CutilBlobCache *restrict cache, CutilBlobCacheStats *restrict stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    *stats = (CutilBlobCacheStats){
+        .blobCount = cache->entryCount,
+        .totalSize = cache->totalSize,
+        .budget    = cache->budget,
+        .hits      = cache->hits,
+        .misses    = cache->misses,
+        .evictions = cache->evictions,
+    };
+    pthread_mutex_unlock(&cache->lock);
+}
+
+//
+// Helper implementations
+//
+
+static void blob_path(
+    const CutilBlobCache *cache, const CutilHash128 key, char *dest)
+{
+    // the first two characters of the name pick the sub folder
+    snprintf(
+        dest,
+        cache->folderLength + 40,
+        "%s/%02x/%016llx%016llx",
+        cache->folder,
+        (unsigned)(key.high >> 56),
+        (unsigned long long)key.high,
+        (unsigned long long)key.low);
+}
+
+static bool file_exists(const char *filepath)
+{
+    CutilFileInfo info;
+    return !cutil_read_file_info(filepath, &info) && info.exists;
+}
+
+static bool parse_key(const char *name, CutilHash128 *key)
+{
+    u64 halves[2] = {0};
+    for (u32 i = 0; i < BLOB_KEY_CHARS; i++)
+    {
+        const char c = name[i];
+        u64 digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else
+            return false;
+        halves[i / 16] = halves[i / 16] << 4 | digit;
+    }
+
+    if (name[BLOB_KEY_CHARS] != '\0')
+        return false;
+
+    key->high = halves[0];
+    key->low  = halves[1];
+    return true;
+}
+
+static u32 find_entry(const CutilBlobCache *cache, const CutilHash128 key)
+{
+    if (!cache->slotCount)
+        return BLOB_NONE;
+
+    // keys are hashes already
+    const u32 mask = cache->slotCount - 1;
+    for (u32 i = key.low & mask;; i = (i + 1) & mask)
+    {
+        const u32 slot = cache->slots[i];
+        if (!slot)
+            return BLOB_NONE;
+
+        const struct BlobEntry *entry = &cache->entries[slot - 1];
+        if (entry->key.low == key.low && entry->key.high == key.high)
+            return slot - 1;
+    }
+}
+
+static u32 insert_entry(
+    CutilBlobCache *cache,
+    const CutilHash128 key,
+    const u64 size,
+    const bool oldest)
+{
+    if (cache->entryCount == cache->entryCapacity)
+    {
+        u32 capacity = cache->entryCapacity ? cache->entryCapacity * 2 : 256;
+        struct BlobEntry *entries =
+            realloc(cache->entries, capacity * sizeof(struct BlobEntry));
+        if (!entries)
+            return BLOB_NONE;
+        cache->entries       = entries;
+        cache->entryCapacity = capacity;
+    }
+
+    // keep the index at most three quarters full
+    if ((cache->entryCount + 1) * 4 > cache->slotCount * 3)
+    {
+        const u32 slotCount = cache->slotCount ? cache->slotCount * 2 : 512;
+        u32 *slots          = calloc(slotCount, sizeof(u32));
+        if (!slots)
+            return BLOB_NONE;
+
+        const u32 mask = slotCount - 1;
+        for (u32 i = 0; i < cache->entryCount; i++)
+        {
+            u32 slot = cache->entries[i].key.low & mask;
+            while (slots[slot])
+                slot = (slot + 1) & mask;
+            slots[slot] = i + 1;
+        }
+
+        free(cache->slots);
+        cache->slots     = slots;
+        cache->slotCount = slotCount;
+    }
+
+    const u32 index         = cache->entryCount++;
+    cache->entries[index]   = (struct BlobEntry){.key = key, .size = size};
+    cache->totalSize       += size;
+
+    const u32 mask = cache->slotCount - 1;
+    u32 slot       = key.low & mask;
+    while (cache->slots[slot])
+        slot = (slot + 1) & mask;
+    cache->slots[slot] = index + 1;
+
+    link_entry(cache, index, oldest);
+    return index;
+}
+
+static void remove_entry(CutilBlobCache *cache, const u32 index)
+{
+    struct BlobEntry *entry = &cache->entries[index];
+    unlink_entry(cache, index);
+    detach_mapping(cache, entry);
+    cache->totalSize -= entry->size;
+
+    // empty the entry's slot, and move later entries of the same run back
+    // into the gap so lookups do not stop early
+    const u32 mask = cache->slotCount - 1;
+    u32 hole       = entry->key.low & mask;
+    while (cache->slots[hole] != index + 1)
+        hole = (hole + 1) & mask;
+
+    for (u32 i = (hole + 1) & mask; cache->slots[i]; i = (i + 1) & mask)
+    {
+        const u32 home = cache->entries[cache->slots[i] - 1].key.low & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            cache->slots[hole] = cache->slots[i];
+            hole               = i;
+        }
+    }
+    cache->slots[hole] = 0;
+
+    // fill the gap in the entries with the last one
+    const u32 last = --cache->entryCount;
+    if (index == last)
+        return;
+
+    *entry = cache->entries[last];
+
+    u32 slot = entry->key.low & mask;
+    while (cache->slots[slot] != last + 1)
+        slot = (slot + 1) & mask;
+    cache->slots[slot] = index + 1;
+
+    if (entry->newer != BLOB_NONE)
+        cache->entries[entry->newer].older = index;
+    else
+        cache->newest = index;
+    if (entry->older != BLOB_NONE)
+        cache->entries[entry->older].newer = index;
+    else
+        cache->oldest = index;
+}
+
+static void link_entry(CutilBlobCache *cache, const u32 index, bool oldest)
+{
+    struct BlobEntry *entry = &cache->entries[index];
+
+    if (oldest)
+    {
+        entry->newer = cache->oldest;
+        entry->older = BLOB_NONE;
+        if (cache->oldest != BLOB_NONE)
+            cache->entries[cache->oldest].older = index;
+        cache->oldest = index;
+        if (cache->newest == BLOB_NONE)
+            cache->newest = index;
+        return;
+    }
+
+    entry->older = cache->newest;
+    entry->newer = BLOB_NONE;
+    if (cache->newest != BLOB_NONE)
+        cache->entries[cache->newest].newer = index;
+    cache->newest = index;
+    if (cache->oldest == BLOB_NONE)
+        cache->oldest = index;
+}
+
+static void unlink_entry(CutilBlobCache *cache, const u32 index)
+{
+    const struct BlobEntry *entry = &cache->entries[index];
+
+    if (entry->newer != BLOB_NONE)
+        cache->entries[entry->newer].older = entry->older;
+    else
+        cache->newest = entry->older;
+
+    if (entry->older != BLOB_NONE)
+        cache->entries[entry->older].newer = entry->newer;
+    else
+        cache->oldest = entry->newer;
+}
+
+static void touch_entry(CutilBlobCache *cache, const u32 index)
+{
+    if (cache->newest == index)
+        return;
+
+    unlink_entry(cache, index);
+    link_entry(cache, index, false);
+    push_record(cache, JOURNAL_TOUCH, cache->entries[index].key, 0);
+}
+
+static void detach_mapping(CutilBlobCache *cache, struct BlobEntry *entry)
+{
+    struct BlobMapping *mapping = entry->mapping;
+    if (!mapping)
+        return;
+    entry->mapping = NULL;
+
+    if (mapping->references)
+    {
+        // views stay valid after the file is deleted
+        mapping->detached = true;
+        return;
+    }
+
+    cache->idleMaps--;
+    cutil_file_unmap(&mapping->map);
+    free(mapping);
+}
+
+static void delete_blob(CutilBlobCache *cache, const u32 index)
+{
+    const CutilHash128 key = cache->entries[index].key;
+
+    char path[cache->folderLength + 40];
+    blob_path(cache, key, path);
+    if (file_exists(path))
+        cutil_platform_delete_file(path);
+
+    push_record(cache, JOURNAL_REMOVE, key, 0);
+    remove_entry(cache, index);
+}
+
+static void push_record(
+    CutilBlobCache *cache,
+    const JournalOp op,
+    const CutilHash128 key,
+    const u64 size)
+{
+    if (cache->pendingCount == cache->pendingCapacity)
+    {
+        u32 capacity =
+            cache->pendingCapacity ? cache->pendingCapacity * 2 : 256;
+        struct JournalRecord *pending =
+            realloc(cache->pending, capacity * sizeof(struct JournalRecord));
+        if (!pending)
+        {
+            // the next compaction writes the journal from the entries
+            log_warning("Failed to add to the blob cache journal");
+            cache->journalIncomplete = true;
+            pthread_cond_signal(&cache->wake);
+            return;
+        }
+        cache->pending         = pending;
+        cache->pendingCapacity = capacity;
+    }
+
+    cache->pending[cache->pendingCount++] = (struct JournalRecord){
+        .key  = key,
+        .size = size,
+        .op   = op,
+    };
+
+    if (cache->pendingCount == BLOB_JOURNAL_BATCH)
+        pthread_cond_signal(&cache->wake);
+}
+
+static Result read_journal(CutilBlobCache *cache)
+{
+    char journalPath[cache->folderLength + 16];
+    snprintf(journalPath, sizeof(journalPath), "%s/journal", cache->folder);
+
+    CutilFileMap map;
+    if (cutil_file_map(&map, journalPath, CUTIL_FILE_MAP_SEQUENTIAL))
+        return RS_FAILURE;
+
+    // a record cut off by a crash is ignored
+    const u64 count = map.size / sizeof(struct JournalRecord);
+    const struct JournalRecord *records = map.data;
+
+    if (!count || records[0].op != JOURNAL_HEADER ||
+        records[0].key.low != BLOB_JOURNAL_MAGIC ||
+        records[0].key.high != BLOB_JOURNAL_VERSION)
+    {
+        log_warning("The blob cache journal '%s' is corrupted", journalPath);
+        cutil_file_unmap(&map);
+        return RS_FAILURE;
+    }
+
+    Result result = RS_SUCCESS;
+    for (u64 i = 1; i < count && !result; i++)
+    {
+        const struct JournalRecord *record = &records[i];
+        const u32 index = find_entry(cache, record->key);
+
+        switch (record->op)
+        {
+        case JOURNAL_PUT:
+            if (index != BLOB_NONE)
+                touch_entry(cache, index);
+            else if (
+                insert_entry(cache, record->key, record->size, false) ==
+                BLOB_NONE)
+                result = RS_FAILURE;
+            break;
+        case JOURNAL_TOUCH:
+            if (index != BLOB_NONE)
+                touch_entry(cache, index);
+            break;
+        case JOURNAL_REMOVE:
+            if (index != BLOB_NONE)
+                remove_entry(cache, index);
+            break;
+        default:
+            log_warning(
+                "The blob cache journal '%s' is corrupted", journalPath);
+            result = RS_FAILURE;
+            break;
+        }
+    }
+
+    // replaying made records of its own, they are already in the journal
+    cache->pendingCount = 0;
+    cache->journalCount = count;
+
+    cutil_file_unmap(&map);
+    return result;
+}
+
+static Result scan_blobs(CutilBlobCache *cache)
+{
+    const u32 knownCount = cache->entryCount;
+    bool *found          = calloc(knownCount + 1, sizeof(bool));
+    if (!found)
+        return RS_FAILURE;
+
+    CutilDirectoryIterator *iterator;
+    const CutilDirectoryOptions options = {.recursive = true, .maxDepth = 1};
+    if (cutil_platform_directory_open(&iterator, cache->folder, &options))
+    {
+        free(found);
+        return RS_FAILURE;
+    }
+
+    CutilDirectoryEntry entry;
+    while (cutil_platform_directory_next(iterator, &entry))
+    {
+        // blobs are named after their key, in the folder named after the
+        // first two characters of the key
+        CutilHash128 key;
+        if (entry.depth != 1 || entry.type != CUTIL_FILE_TYPE_REGULAR ||
+            !parse_key(entry.name, &key) ||
+            memcmp(entry.path, entry.name, 2) || entry.path[2] != '/')
+            continue;
+
+        const u32 index = find_entry(cache, key);
+        if (index != BLOB_NONE)
+        {
+            if (index < knownCount)
+                found[index] = true;
+            continue;
+        }
+
+        // nothing is known about when it was used, so it goes first
+        CutilFileInfo info;
+        if (!cutil_platform_directory_entry_info(iterator, &info) &&
+            insert_entry(cache, key, info.size, true) == BLOB_NONE)
+        {
+            cutil_platform_directory_close(iterator);
+            free(found);
+            return RS_FAILURE;
+        }
+    }
+
+    const Result result = cutil_platform_directory_close(iterator);
+
+    // going backwards, the entry moved into a removed one was already checked
+    for (u32 i = knownCount; i-- > 0;)
+        if (!found[i])
+            remove_entry(cache, i);
+
+    free(found);
+    cache->pendingCount = 0;
+    return result;
+}
+
+static bool should_compact(const CutilBlobCache *cache)
+{
+    const u64 records = cache->journalCount + cache->pendingCount;
+    return records > (u64)cache->entryCount * 2 + BLOB_COMPACT_SLACK;
+}
+
+static Result flush_journal(CutilBlobCache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    struct JournalRecord *pending = cache->pending;
+    const u32 count               = cache->pendingCount;
+    cache->pending                = NULL;
+    cache->pendingCount           = 0;
+    cache->pendingCapacity        = 0;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (!count)
+    {
+        free(pending);
+        return RS_SUCCESS;
+    }
+
+    char journalPath[cache->folderLength + 16];
+    snprintf(journalPath, sizeof(journalPath), "%s/journal", cache->folder);
+
+    const CutilFileSegment segment = {
+        .data = pending,
+        .size = count * sizeof(struct JournalRecord),
+    };
+    const Result result = cutil_write_file_iov(
+        journalPath, &segment, 1, CUTIL_FILE_WRITE_APPEND);
+    free(pending);
+
+    pthread_mutex_lock(&cache->lock);
+    cache->journalCount += count;
+    if (result)
+        cache->journalIncomplete = true;
+    pthread_mutex_unlock(&cache->lock);
+
+    return result;
+}
+
+static Result compact_journal(CutilBlobCache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+
+    const u32 count = cache->entryCount;
+    struct JournalRecord *records =
+        malloc((count + 1) * sizeof(struct JournalRecord));
+    if (!records)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        return RS_FAILURE;
+    }
+
+    records[0] = (struct JournalRecord){
+        .key = {.low = BLOB_JOURNAL_MAGIC, .high = BLOB_JOURNAL_VERSION},
+        .op  = JOURNAL_HEADER,
+    };
+
+    u32 written = 1;
+    for (u32 i = cache->oldest; i != BLOB_NONE; i = cache->entries[i].newer)
+        records[written++] = (struct JournalRecord){
+            .key  = cache->entries[i].key,
+            .size = cache->entries[i].size,
+            .op   = JOURNAL_PUT,
+        };
+
+    // the new journal holds everything that was pending
+    cache->pendingCount      = 0;
+    cache->journalCount      = written;
+    cache->journalIncomplete = false;
+    pthread_mutex_unlock(&cache->lock);
+
+    char journalPath[cache->folderLength + 16];
+    snprintf(journalPath, sizeof(journalPath), "%s/journal", cache->folder);
+
+    const Result result = cutil_write_file_atomic(
+        journalPath, records, written * sizeof(struct JournalRecord));
+    free(records);
+
+    if (result)
+    {
+        pthread_mutex_lock(&cache->lock);
+        cache->journalIncomplete = true;
+        pthread_mutex_unlock(&cache->lock);
+    }
+    return result;
+}
+
+static void evict(CutilBlobCache *cache)
+{
+    if (cache->totalSize <= cache->budget)
+        return;
+
+    const u64 slack  = BLOB_EVICT_SLACK(cache->budget);
+    const u64 target = cache->budget - min_value(slack, cache->budget);
+
+    u32 evicted = 0;
+    while (cache->totalSize > target && cache->oldest != BLOB_NONE &&
+           !cache->stopping)
+    {
+        delete_blob(cache, cache->oldest);
+        cache->evictions++;
+
+        if (++evicted % BLOB_EVICT_BATCH == 0)
+        {
+            pthread_mutex_unlock(&cache->lock);
+            pthread_mutex_lock(&cache->lock);
+        }
+    }
+}
+
+static void *evictor(void *data)
+{
+    CutilBlobCache *cache = data;
+
+    pthread_mutex_lock(&cache->lock);
+    while (!cache->stopping)
+    {
+        if (cache->totalSize <= cache->budget &&
+            cache->pendingCount < BLOB_JOURNAL_BATCH)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += BLOB_FLUSH_INTERVAL;
+            pthread_cond_timedwait(&cache->wake, &cache->lock, &deadline);
+        }
+        if (cache->stopping)
+            break;
+
+        evict(cache);
+
+        const bool compact = should_compact(cache) || cache->journalIncomplete;
+        const bool flush   = cache->pendingCount != 0;
+        pthread_mutex_unlock(&cache->lock);
+
+        // only this thread writes the journal while the cache is open
+        if (compact)
+            compact_journal(cache);
+        else if (flush)
+            flush_journal(cache);
+
+        pthread_mutex_lock(&cache->lock);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return NULL;
+}
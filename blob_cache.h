@@ -0,0 +1,141 @@
+#pragma once
+
+// Blob cache
+//
+// A cache of blobs on disk, found by a 128 bit key, for files derived from
+// other files that are expensive to make again. The key is usually the hash of
+// everything the blob was made from (see cutil_hash128), so a key always has
+// the same contents and is never changed once stored.
+//
+// Blobs are files spread over 256 sub folders of the cache folder. An index of
+// every blob is kept in memory, so looking up a blob never touches the disk,
+// and blobs that are in use stay mapped. The order blobs were used in is
+// written to a journal in the cache folder, so the cache can be opened again
+// without listing it. When the blobs take up more than the budget, a
+// background thread deletes the least recently used ones.
+//
+// A cache folder should only be open in one process at a time.
+//
+// Kael Johnston
+
+#include "types.h"
+#include "hash.h"
+
+/**
+ * A blob from cutil_blob_cache_get. It stays valid until it is released, even
+ * if the blob is evicted in the mean time.
+ */
+typedef struct CutilBlobView
+{
+    const void *data; // NULL for empty blobs
+    u64 size;
+    void *internal;
+} CutilBlobView;
+
+typedef struct CutilBlobCacheStats
+{
+    u32 blobCount;
+    u64 totalSize; // of every blob, in bytes
+    u64 budget;
+    u64 hits;
+    u64 misses;
+    u64 evictions;
+} CutilBlobCacheStats;
+
+typedef struct CutilBlobCache CutilBlobCache;
+
+/**
+ * Open a cache, creating it if needed. If the cache was not closed last time,
+ * its folder is listed to find blobs that were not in the journal yet.
+ *
+ * @param cache will be set to the cache
+ * @param folder the folder to keep the cache in, inside the executable folder
+ * @param budget the most bytes of blobs to keep
+ *
+ * @return Result
+ *
+ * @author Kael Johnston
+ */
+Result cutil_blob_cache_open(
+    CutilBlobCache **restrict cache,
+    const char *restrict folder,
+    const u64 budget);
+
+/**
+ * Stop evicting, write the rest of the journal and free the cache. Every view
+ * must have been released.
+ *
+ * @author Kael Johnston
+ */
+void cutil_blob_cache_close(CutilBlobCache *cache);
+
+/**
+ * Store a blob. It is written to a temporary file and renamed into place, so
+ * a partly written blob is never found. Storing a key that is already in the
+ * cache only marks it as used.
+ *
+ * @param cache the cache
+ * @param key the key of the blob
+ * @param data the contents of the blob
+ * @param size the size of data, at most the budget
+ *
+ * @return Result
+ *
+ * @author Kael Johnston
+ */
+Result cutil_blob_cache_put(
+    CutilBlobCache *restrict cache,
+    const CutilHash128 key,
+    const void *restrict data,
+    const u64 size);
+
+/**
+ * Find a blob and map it. Blobs that were mapped recently are still mapped,
+ * so getting them again costs no system calls.
+ *
+ * @param cache the cache
+ * @param key the key of the blob
+ * @param view set to the blob, pass it to cutil_blob_cache_release when done
+ *
+ * @return true if the blob was found
+ *
+ * @author Kael Johnston
+ */
+bool cutil_blob_cache_get(
+    CutilBlobCache *restrict cache,
+    const CutilHash128 key,
+    CutilBlobView *restrict view);
+
+/**
+ * Release a view from cutil_blob_cache_get. The view is zeroed.
+ *
+ * @author Kael Johnston
+ */
+void cutil_blob_cache_release(
+    CutilBlobCache *restrict cache, CutilBlobView *restrict view);
+
+/**
+ * Delete a blob.
+ *
+ * @return RS_FAILURE if the blob was not in the cache
+ *
+ * @author Kael Johnston
+ */
+Result cutil_blob_cache_remove(
+    CutilBlobCache *restrict cache, const CutilHash128 key);
+
+/**
+ * Change the most bytes of blobs to keep. Blobs are evicted in the background
+ * if the cache is now over budget.
+ *
+ * @author Kael Johnston
+ */
+void cutil_blob_cache_set_budget(CutilBlobCache *cache, const u64 budget);
+
+/**
+ * Get the size and hit rate of a cache.
+ *
+ * @author Kael Johnston
+ */
+void cutil_blob_cache_get_stats(
+    CutilBlobCache *restrict cache, CutilBlobCacheStats *restrict stats);
@@ -0,0 +1,706 @@
+#include "compress.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "messenger.h"
+
+#define min_value(a, b) (a < b ? a : b)
+
+// a sequence is a run of literals followed by a match. These are the same
+// limits as LZ4, so the end of a block is always literals and the decoder can
+// copy in large chunks without checking every byte
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_FIND_LIMIT 12
+#define MAX_OFFSET 65535
+
+#define HASH_BITS 14
+// skip ahead faster the longer no match has been found
+#define SKIP_SHIFT 6
+
+// "CUTZ"
+#define FRAME_MAGIC 0x5a545543u
+// set in the size of a block that is stored uncompressed
+#define FRAME_RAW_BLOCK 0x80000000u
+// the header is stored little endian, whatever the machine
+#define FRAME_HEADER_SIZE 24
+
+//
+// Types
+//
+
+typedef struct FrameHeader
+{
+    u32 magic;
+    u32 blockSize;
+    u64 contentSize;
+    u32 blockCount;
+    u32 reserved;
+    // followed by a u32 size for each block, then the blocks
+} FrameHeader;
+
+// blocks of a frame shared between threads
+struct FrameJob
+{
+    atomic_uint nextBlock;
+    atomic_bool failed;
+    u32 blockCount;
+    u32 blockSize;
+
+    u8 *dest;
+    u64 size; // of dest when decompressing
+    const u8 *src;
+    u64 contentSize;
+
+    u32 *blockSizes;
+    const u64 *blockOffsets; // in src when decompressing, in dest otherwise
+};
+
+//
+// Helper Declerations
+//
+
+static u32 read_u32(const u8 *p);
+static u64 read_u64(const u8 *p);
+static u32 hash_sequence(u32 sequence);
+
+// frame fields, in little endian
+static u32 read_le32(const u8 *p);
+static u64 read_le64(const u8 *p);
+static void write_le32(u8 *p, u32 value);
+static void write_le64(u8 *p, u64 value);
+
+static void write_frame_header(u8 *p, const FrameHeader *header);
+// read and check a header, p must hold FRAME_HEADER_SIZE bytes
+static Result read_frame_header(const u8 *p, FrameHeader *header);
+
+// count how many bytes are the same, stopping at limit
+static u64 count_match(const u8 *p, const u8 *match, const u8 *limit);
+
+// write the extra bytes of a literal or match length longer than 14
+static u8 *write_length(u8 *op, u64 length);
+// read the extra bytes of a length, returns NULL if it runs past end
+static const u8 *read_length(const u8 *ip, const u8 *end, u64 *length);
+
+// write one sequence, returns NULL if it does not fit
+static u8 *write_sequence(
+    u8 *op,
+    const u8 *oend,
+    const u8 *literals,
+    u64 literalLength,
+    u32 offset,
+    u64 matchLength);
+
+// run a worker on threadCount threads, including this one
+static void run_parallel(
+    void *(*worker)(void *), struct FrameJob *job, u32 threadCount);
+
+static void *compress_worker(void *job);
+static void *decompress_worker(void *job);
+
+//
+// Public methods
+//
+
+u64 cutil_compress_bound(const u64 size) { return size + size / 255 + 16; }
+
+u64 cutil_compress(
+    void *restrict dest,
+    const u64 destCapacity,
+    const void *restrict src,
+    const u64 size)
+{
+    if (size > UINT32_MAX)
+        return 0;
+
+    const u8 *base   = src;
+    const u8 *ip     = base;
+    const u8 *anchor = base;
+    const u8 *iend   = base + size;
+    u8 *op           = dest;
+    const u8 *oend   = op + destCapacity;
+
+    if (size > MATCH_FIND_LIMIT)
+    {
+        const u8 *findLimit  = iend - MATCH_FIND_LIMIT;
+        const u8 *matchLimit = iend - LAST_LITERALS;
+
+        // positions of recent sequences, relative to base
+        u32 table[1 << HASH_BITS] = {0};
+        ip++;
+
+        while (ip < findLimit)
+        {
+            const u32 sequence = read_u32(ip);
+            const u32 hash     = hash_sequence(sequence);
+            const u8 *match    = base + table[hash];
+            table[hash]        = ip - base;
+
+            if (ip - match > MAX_OFFSET || read_u32(match) != sequence)
+            {
+                ip += 1 + ((ip - anchor) >> SKIP_SHIFT);
+                continue;
+            }
+
+            // the match may have started earlier
+            while (ip > anchor && match > base && ip[-1] == match[-1])
+            {
+                ip--;
+                match--;
+            }
+
+            const u64 matchLength =
+                MIN_MATCH + count_match(
+                                ip + MIN_MATCH, match + MIN_MATCH, matchLimit);
+
+            op = write_sequence(
+                op, oend, anchor, ip - anchor, ip - match, matchLength);
+            if (!op)
+                return 0;
+
+            ip += matchLength;
+            anchor = ip;
+
+            if (ip < findLimit)
+                table[hash_sequence(read_u32(ip - 2))] = ip - 2 - base;
+        }
+    }
+
+    // the rest is literals
+    const u64 literalLength = iend - anchor;
+    if ((u64)(oend - op) < 2 + literalLength + literalLength / 255)
+        return 0;
+
+    if (literalLength >= 15)
+    {
+        *op++ = 15 << 4;
+        op    = write_length(op, literalLength);
+    }
+    else
+        *op++ = literalLength << 4;
+
+    memcpy(op, anchor, literalLength);
+    op += literalLength;
+
+    return op - (u8 *)dest;
+}
+
+Result cutil_decompress(
+    void *restrict dest,
+    const u64 size,
+    const void *restrict src,
+    const u64 srcSize)
+{
+    u8 *const start = dest;
+    u8 *op          = dest;
+    u8 *const oend  = op + size;
+    const u8 *ip    = src;
+    const u8 *iend  = ip + srcSize;
+
+    while (ip < iend)
+    {
+        const u8 token = *ip++;
+
+        u64 literalLength = token >> 4;
+
+        // most sequences are short, and far enough from the end that they
+        // can be copied in fixed size chunks with no loops
+        if (literalLength < 15 && (token & 15) < 15 && iend - ip >= 18 &&
+            oend - op >= 48)
+        {
+            const u64 offset = ip[literalLength] | (ip[literalLength + 1] << 8);
+            if (offset >= 16 && offset <= (u64)(op + literalLength - start))
+            {
+                memcpy(op, ip, 16);
+                op += literalLength;
+                ip += literalLength + 2;
+
+                memcpy(op, op - offset, 16);
+                memcpy(op + 16, op - offset + 16, 16);
+                op += (token & 15) + MIN_MATCH;
+                continue;
+            }
+        }
+
+        if (literalLength == 15 &&
+            !(ip = read_length(ip, iend, &literalLength)))
+            return RS_FAILURE;
+
+        if (literalLength > (u64)(iend - ip) ||
+            literalLength > (u64)(oend - op))
+            return RS_FAILURE;
+
+        // copy in 16 byte chunks when there is room to overrun
+        if (ip + literalLength + 16 <= iend && op + literalLength + 16 <= oend)
+            for (u64 i = 0; i < literalLength; i += 16)
+                memcpy(op + i, ip + i, 16);
+        else
+            memcpy(op, ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+
+        // the last sequence has no match
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return RS_FAILURE;
+        const u64 offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        u64 matchLength = token & 15;
+        if (matchLength == 15 && !(ip = read_length(ip, iend, &matchLength)))
+            return RS_FAILURE;
+        matchLength += MIN_MATCH;
+
+        if (offset == 0 || offset > (u64)(op - start) ||
+            matchLength > (u64)(oend - op))
+            return RS_FAILURE;
+
+        // a match closer than 16 bytes is a short repeating pattern. Once 16
+        // bytes of it are written, it can be copied in chunks from a whole
+        // number of patterns back
+        u64 distance = offset;
+        u64 i        = 0;
+        if (offset < 16)
+        {
+            distance = offset * ((16 + offset - 1) / offset);
+            for (; i < matchLength && i < 16; i++)
+                op[i] = op[i - offset];
+        }
+
+        // chunks may run past the end of the match, but not past dest
+        for (; i < matchLength && op + i + 16 <= oend; i += 16)
+            memcpy(op + i, op + i - distance, 16);
+        for (; i < matchLength; i++)
+            op[i] = op[i - distance];
+
+        op += matchLength;
+    }
+
+    return op == oend ? RS_SUCCESS : RS_FAILURE;
+}
+
+u64 cutil_compress_frame_bound(const u64 size)
+{
+    const u64 blockCount = (size + CUTIL_COMPRESS_FRAME_BLOCK_SIZE - 1) /
+                           CUTIL_COMPRESS_FRAME_BLOCK_SIZE;
+    return FRAME_HEADER_SIZE + blockCount * sizeof(u32) +
+           cutil_compress_bound(CUTIL_COMPRESS_FRAME_BLOCK_SIZE) * blockCount;
+}
+
+u64 cutil_compress_frame(
+    void *restrict dest,
+    const u64 destCapacity,
+    const void *restrict src,
+    const u64 size,
+    u32 threadCount)
+{
+    const u32 blockSize  = CUTIL_COMPRESS_FRAME_BLOCK_SIZE;
+    const u64 blockCount = (size + blockSize - 1) / blockSize;
+    if (blockCount > UINT32_MAX)
+        return 0;
+
+    // blocks are compressed into fixed slots first, then packed together
+    const u64 bound = cutil_compress_frame_bound(size);
+    u8 *staging     = destCapacity >= bound ? dest : malloc(bound);
+    if (!staging)
+    {
+        log_error("Failed to allocate %llu bytes", (unsigned long long)bound);
+        return 0;
+    }
+
+    const u64 dataStart = FRAME_HEADER_SIZE + blockCount * sizeof(u32);
+    u32 *blockSizes     = (u32 *)(staging + FRAME_HEADER_SIZE);
+
+    struct FrameJob job = {
+        .blockCount  = blockCount,
+        .blockSize   = blockSize,
+        .dest        = staging + dataStart,
+        .src         = src,
+        .contentSize = size,
+        .blockSizes  = blockSizes,
+    };
+    run_parallel(compress_worker, &job, threadCount);
+
+    const u64 slotSize = cutil_compress_bound(blockSize);
+    u64 offset         = dataStart;
+    for (u64 i = 0; i < blockCount; i++)
+    {
+        const u32 stored      = blockSizes[i];
+        const u64 blockLength = stored & ~FRAME_RAW_BLOCK;
+        memmove(staging + offset, job.dest + i * slotSize, blockLength);
+        offset += blockLength;
+
+        write_le32((u8 *)&blockSizes[i], stored);
+    }
+
+    const FrameHeader header = {
+        .magic       = FRAME_MAGIC,
+        .blockSize   = blockSize,
+        .contentSize = size,
+        .blockCount  = blockCount,
+    };
+    write_frame_header(staging, &header);
+
+    if (staging != dest)
+    {
+        if (offset <= destCapacity)
+            memcpy(dest, staging, offset);
+        else
+            offset = 0;
+        free(staging);
+    }
+
+    return offset;
+}
+
+Result cutil_compress_frame_content_size(
+    const void *restrict src, const u64 srcSize, u64 *restrict contentSize)
+{
+    FrameHeader header;
+    if (srcSize < FRAME_HEADER_SIZE || read_frame_header(src, &header))
+        return RS_FAILURE;
+
+    *contentSize = header.contentSize;
+    return RS_SUCCESS;
+}
+
+Result cutil_decompress_frame(
+    void *restrict dest,
+    const u64 size,
+    const void *restrict src,
+    const u64 srcSize,
+    u32 threadCount)
+{
+    FrameHeader header;
+    if (srcSize < FRAME_HEADER_SIZE || read_frame_header(src, &header))
+    {
+        log_error("Data is not a compressed frame");
+        return RS_FAILURE;
+    }
+
+    const u8 *table    = (const u8 *)src + FRAME_HEADER_SIZE;
+    const u64 tableEnd = FRAME_HEADER_SIZE + header.blockCount * sizeof(u32);
+    if (tableEnd > srcSize)
+    {
+        log_error("Compressed frame header is corrupted");
+        return RS_FAILURE;
+    }
+
+    // only decode the blocks that fit in dest
+    const u64 wanted = min_value(size, header.contentSize);
+    const u32 blockCount =
+        (wanted + header.blockSize - 1) / (u64)header.blockSize;
+
+    u32 *blockSizes   = malloc(blockCount * sizeof(u32) + 1);
+    u64 *blockOffsets = malloc(blockCount * sizeof(u64) + 1);
+    if (!blockSizes || !blockOffsets)
+    {
+        free(blockSizes);
+        free(blockOffsets);
+        return RS_FAILURE;
+    }
+
+    u64 offset = tableEnd;
+    for (u32 i = 0; i < blockCount; i++)
+    {
+        blockSizes[i]   = read_le32(table + i * sizeof(u32));
+        blockOffsets[i] = offset;
+        offset += blockSizes[i] & ~FRAME_RAW_BLOCK;
+    }
+    if (offset > srcSize)
+    {
+        log_error("Compressed frame is truncated");
+        free(blockSizes);
+        free(blockOffsets);
+        return RS_FAILURE;
+    }
+
+    struct FrameJob job = {
+        .blockCount   = blockCount,
+        .blockSize    = header.blockSize,
+        .dest         = dest,
+        .size         = wanted,
+        .src          = src,
+        .contentSize  = header.contentSize,
+        .blockSizes   = blockSizes,
+        .blockOffsets = blockOffsets,
+    };
+    run_parallel(decompress_worker, &job, threadCount);
+
+    free(blockSizes);
+    free(blockOffsets);
+
+    if (atomic_load(&job.failed))
+    {
+        log_error("Compressed frame is corrupted");
+        return RS_FAILURE;
+    }
+    return RS_SUCCESS;
+}
+
+//
+// Helper implementations
+//
+
+static u32 read_u32(const u8 *p)
+{
+    u32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static u64 read_u64(const u8 *p)
+{
+    u64 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static u32 read_le32(const u8 *p)
+{
+    return (u32)p[0] | (u32)p[1] << 8 | (u32)p[2] << 16 | (u32)p[3] << 24;
+}
+
+static u64 read_le64(const u8 *p)
+{
+    return (u64)read_le32(p) | (u64)read_le32(p + 4) << 32;
+}
+
+static void write_le32(u8 *p, u32 value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static void write_le64(u8 *p, u64 value)
+{
+    write_le32(p, value);
+    write_le32(p + 4, value >> 32);
+}
+
+static void write_frame_header(u8 *p, const FrameHeader *header)
+{
+    write_le32(p, header->magic);
+    write_le32(p + 4, header->blockSize);
+    write_le64(p + 8, header->contentSize);
+    write_le32(p + 16, header->blockCount);
+    write_le32(p + 20, header->reserved);
+}
+
+static Result read_frame_header(const u8 *p, FrameHeader *header)
+{
+    *header = (FrameHeader){
+        .magic       = read_le32(p),
+        .blockSize   = read_le32(p + 4),
+        .contentSize = read_le64(p + 8),
+        .blockCount  = read_le32(p + 16),
+        .reserved    = read_le32(p + 20),
+    };
+
+    if (header->magic != FRAME_MAGIC)
+        return RS_FAILURE;
+
+    // block sizes share a u32 with FRAME_RAW_BLOCK, and there are at most
+    // UINT32_MAX blocks. Checking this first keeps the count below from
+    // wrapping on a crafted header
+    if (header->blockSize == 0 || header->blockSize >= FRAME_RAW_BLOCK ||
+        header->contentSize > (u64)UINT32_MAX * header->blockSize)
+        return RS_FAILURE;
+
+    const u64 blockCount =
+        (header->contentSize + header->blockSize - 1) / header->blockSize;
+    return header->blockCount == blockCount ? RS_SUCCESS : RS_FAILURE;
+}
+
+static u32 hash_sequence(u32 sequence)
+{
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static u64 count_match(const u8 *p, const u8 *match, const u8 *limit)
+{
+    const u8 *start = p;
+
+    while (p + 8 <= limit)
+    {
+        const u64 difference = read_u64(p) ^ read_u64(match);
+        if (difference)
+        {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return p - start + (__builtin_ctzll(difference) >> 3);
+#else
+            break;
+#endif
+        }
+        p += 8;
+        match += 8;
+    }
+
+    while (p < limit && *p == *match)
+    {
+        p++;
+        match++;
+    }
+    return p - start;
+}
+
+static u8 *write_length(u8 *op, u64 length)
+{
+    length -= 15;
+    for (; length >= 255; length -= 255)
+        *op++ = 255;
+    *op++ = length;
+    return op;
+}
+
+static const u8 *read_length(const u8 *ip, const u8 *end, u64 *length)
+{
+    u8 byte;
+    do
+    {
+        if (ip >= end)
+            return NULL;
+        byte = *ip++;
+        *length += byte;
+    } while (byte == 255);
+    return ip;
+}
+
+static u8 *write_sequence(
+    u8 *op,
+    const u8 *oend,
+    const u8 *literals,
+    u64 literalLength,
+    u32 offset,
+    u64 matchLength)
+{
+    const u64 needed =
+        5 + literalLength + literalLength / 255 + matchLength / 255;
+    if ((u64)(oend - op) < needed)
+        return NULL;
+
+    matchLength -= MIN_MATCH;
+
+    *op++ = (min_value(literalLength, 15) << 4) | min_value(matchLength, 15);
+
+    if (literalLength >= 15)
+        op = write_length(op, literalLength);
+    memcpy(op, literals, literalLength);
+    op += literalLength;
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    if (matchLength >= 15)
+        op = write_length(op, matchLength);
+
+    return op;
+}
+
+static void run_parallel(
+    void *(*worker)(void *), struct FrameJob *job, u32 threadCount)
+{
+    if (threadCount == 0)
+    {
+        long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount   = cpuCount > 0 ? cpuCount : 1;
+    }
+    threadCount = min_value(threadCount, job->blockCount);
+
+    // this thread is one of the workers
+    pthread_t threads[threadCount ? threadCount : 1];
+    u32 started = 0;
+    for (; started + 1 < threadCount; started++)
+        if (pthread_create(&threads[started], NULL, worker, job))
+            break;
+
+    worker(job);
+
+    for (u32 i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+}
+
+static void *compress_worker(void *data)
+{
+    struct FrameJob *job = data;
+    const u64 slotSize   = cutil_compress_bound(job->blockSize);
+
+    for (;;)
+    {
+        const u32 i = atomic_fetch_add(&job->nextBlock, 1);
+        if (i >= job->blockCount)
+            break;
+
+        const u64 start  = (u64)i * job->blockSize;
+        const u64 length = min_value(job->blockSize, job->contentSize - start);
+        u8 *slot         = job->dest + i * slotSize;
+
+        u64 compressed =
+            cutil_compress(slot, slotSize, job->src + start, length);
+
+        // keep data that does not compress as it is
+        if (compressed == 0 || compressed >= length)
+        {
+            memcpy(slot, job->src + start, length);
+            compressed = length | FRAME_RAW_BLOCK;
+        }
+        job->blockSizes[i] = compressed;
+    }
+
+    return NULL;
+}
+
+static void *decompress_worker(void *data)
+{
+    struct FrameJob *job = data;
+
+    for (;;)
+    {
+        const u32 i = atomic_fetch_add(&job->nextBlock, 1);
+        if (i >= job->blockCount || atomic_load(&job->failed))
+            break;
+
+        const u64 start = (u64)i * job->blockSize;
+        const u64 length =
+            min_value(job->blockSize, job->contentSize - start);
+        const u64 wanted    = min_value(length, job->size - start);
+        const u8 *block     = job->src + job->blockOffsets[i];
+        const u32 blockSize = job->blockSizes[i];
+
+        if (blockSize & FRAME_RAW_BLOCK)
+        {
+            if ((blockSize & ~FRAME_RAW_BLOCK) != length)
+                atomic_store(&job->failed, true);
+            else
+                memcpy(job->dest + start, block, wanted);
+            continue;
+        }
+
+        // the last block is cut short when dest is smaller than the content
+        u8 *out = job->dest + start;
+        if (wanted < length && !(out = malloc(length)))
+        {
+            atomic_store(&job->failed, true);
+            continue;
+        }
+
+        if (cutil_decompress(out, length, block, blockSize))
+            atomic_store(&job->failed, true);
+
+        if (out != job->dest + start)
+        {
+            memcpy(job->dest + start, out, wanted);
+            free(out);
+        }
+    }
+
+    return NULL;
+}
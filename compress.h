@@ -0,0 +1,137 @@
+#pragma once
+
+// Fast LZ compression
+//
+// A byte oriented LZ77 codec in the style of LZ4. It trades ratio for speed,
+// decompression runs at several GB/s per core, so compressible data can be
+// read faster than the disk could give it uncompressed.
+//
+// Blocks are the raw codec. Frames split data into independent blocks with a
+// header holding the size of the content and of each block, so the reader can
+// size its buffer exactly and decode the blocks in parallel.
+//
+// Kael Johnston
+
+#include "types.h"
+
+// the amount of content in each block of a frame, except the last one
+#define CUTIL_COMPRESS_FRAME_BLOCK_SIZE (1024 * 1024)
+
+/**
+ * The largest size a block can grow to when compressed. Data that does not
+ * compress grows by a small amount.
+ *
+ * @param size the size of the uncompressed data
+ *
+ * @return the size of the buffer needed by cutil_compress
+ *
+ * @author Kael Johnston
+ */
+u64 cutil_compress_bound(const u64 size);
+
+/**
+ * Compress a single block.
+ *
+ * @param dest the compressed data is written here
+ * @param destCapacity the size of dest, use cutil_compress_bound to make sure
+ * compression can not fail
+ * @param src the data to compress
+ * @param size the size of src. It must be smaller than 4 GiB
+ *
+ * @return the size of the compressed data, or 0 if it did not fit in dest
+ *
+ * @author Kael Johnston
+ */
+u64 cutil_compress(
+    void *restrict dest,
+    const u64 destCapacity,
+    const void *restrict src,
+    const u64 size);
+
+/**
+ * Decompress a single block. The input is checked, so corrupted data fails
+ * instead of reading or writing out of bounds.
+ *
+ * @param dest the decompressed data is written here
+ * @param size the exact size of the uncompressed data
+ * @param src the compressed data
+ * @param srcSize the size of src
+ *
+ * @return RS_FAILURE if the data is corrupted, or does not decompress to
+ * exactly size bytes
+ *
+ * @author Kael Johnston
+ */
+Result cutil_decompress(
+    void *restrict dest,
+    const u64 size,
+    const void *restrict src,
+    const u64 srcSize);
+
+/**
+ * The largest size a frame can grow to. See cutil_compress_bound.
+ *
+ * @param size the size of the uncompressed data
+ *
+ * @return the size of the buffer needed by cutil_compress_frame
+ *
+ * @author Kael Johnston
+ */
+u64 cutil_compress_frame_bound(const u64 size);
+
+/**
+ * Compress data into a frame. Blocks are compressed by several threads at
+ * once, and blocks that do not compress are stored as is.
+ *
+ * @param dest the frame is written here
+ * @param destCapacity the size of dest, use cutil_compress_frame_bound to make
+ * sure compression can not fail
+ * @param src the data to compress
+ * @param size the size of src
+ * @param threadCount the number of threads to use, 0 picks one per cpu
+ *
+ * @return the size of the frame, or 0 if it did not fit in dest
+ *
+ * @author Kael Johnston
+ */
+u64 cutil_compress_frame(
+    void *restrict dest,
+    const u64 destCapacity,
+    const void *restrict src,
+    const u64 size,
+    u32 threadCount);
+
+/**
+ * Read the size of the content of a frame from its header.
+ *
+ * @param src the frame, only the header has to be valid
+ * @param srcSize the size of src
+ * @param contentSize the size of the decompressed data
+ *
+ * @return RS_FAILURE if src is not a frame, or its header is corrupted
+ *
+ * @author Kael Johnston
+ */
+Result cutil_compress_frame_content_size(
+    const void *restrict src, const u64 srcSize, u64 *restrict contentSize);
+
+/**
+ * Decompress a frame. Blocks are decompressed by several threads at once.
+ *
+ * @param dest the decompressed data is written here
+ * @param size the size of dest. If it is smaller than the content of the
+ * frame, the content is truncated at size
+ * @param src the frame
+ * @param srcSize the size of src
+ * @param threadCount the number of threads to use, 0 picks one per cpu
+ *
+ * @return RS_FAILURE if the frame is corrupted
+ *
+ * @author Kael Johnston
+ */
+Result cutil_decompress_frame(
+    void *restrict dest,
+    const u64 size,
+    const void *restrict src,
+    const u64 srcSize,
+    u32 threadCount);
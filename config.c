@@ -0,0 +1,565 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "hash.h"
+#include "line_iterator.h"
+#include "messenger.h"
+#include "platform.h"
+
+// entries allocated by the first parse of a config
+#define INITIAL_ENTRY_CAPACITY 32
+
+// numbers are copied here to be NULL terminated for strtoll and strtod
+#define NUMBER_BUFFER_SIZE 64
+
+//
+// Helper Declerations
+//
+
+// read a whole file into a new buffer. sizeHint is the expected size
+static Result read_text(
+    const char *restrict filepath,
+    const u64 sizeHint,
+    char **restrict text,
+    u64 *restrict length);
+
+// parse text into an empty config. name is used in errors. capacityHint is
+// the number of entries to allocate up front
+static Result parse_text(
+    CutilConfig *restrict config,
+    const char *restrict text,
+    const u64 length,
+    const char *restrict name,
+    const u32 capacityHint);
+
+// add a setting, replacing the value of an earlier one with the same key
+static Result add_entry(CutilConfig *config, const CutilConfigEntry *entry);
+
+// rebuild the index with slotCount slots, a power of two
+static Result resize_index(CutilConfig *config, const u32 slotCount);
+
+static const CutilConfigEntry *find_entry(
+    const CutilConfig *config,
+    const CutilStringView section,
+    const CutilStringView key);
+
+// the index hash of a key in a section
+static u64 entry_hash(const CutilStringView section, const CutilStringView key);
+
+static CutilStringView trim(CutilStringView view);
+
+static bool view_equal(const CutilStringView a, const CutilStringView b);
+
+// copy a setting into buffer as a NULL terminated string. Returns false if
+// the setting does not exist or does not fit
+static bool get_terminated(
+    const CutilConfig *restrict config,
+    const char *restrict section,
+    const char *restrict key,
+    char *restrict buffer);
+
+//
+// Public methods
+//
+
+Result cutil_config_parse(
+    CutilConfig *restrict config, const char *restrict text, const u64 length)
+{
+    *config = (CutilConfig){0};
+
+    if (parse_text(config, text, length, "(buffer)", 0))
+    {
+        cutil_config_free(config);
+        return RS_FAILURE;
+    }
+    return RS_SUCCESS;
+}
+
+Result cutil_config_load(
+    CutilConfig *restrict config, const char *restrict filepath)
+{
+    *config = (CutilConfig){0};
+
+    CutilFileInfo info;
+    if (cutil_platform_get_file_info(filepath, &info))
+        return RS_FAILURE;
+    if (!info.exists)
+    {
+        log_error("Config file '%s' does not exist", filepath);
+        return RS_FAILURE;
+    }
+
+    config->path = strdup(filepath);
+    if (!config->path)
+        return RS_FAILURE;
+    config->modifiedTime = info.modifiedTime;
+    config->size         = info.size;
+
+    if (read_text(filepath, info.size, &config->text, &config->length))
+    {
+        cutil_config_free(config);
+        return RS_FAILURE;
+    }
+    config->contentHash = cutil_hash64(config->text, config->length, 0);
+
+    if (parse_text(config, config->text, config->length, filepath, 0))
+    {
+        cutil_config_free(config);
+        return RS_FAILURE;
+    }
+    return RS_SUCCESS;
+}
+
+Result cutil_config_reload(
+    CutilConfig *restrict config, bool *restrict changed)
+{
+    if (changed)
+        *changed = false;
+
+    if (!config->path)
+        return RS_SUCCESS;
+
+    CutilFileInfo info;
+    if (cutil_platform_get_file_info(config->path, &info))
+        return RS_FAILURE;
+
+    // editors often delete and then recreate a file, keep the old settings
+    // until it is back
+    if (!info.exists)
+        return RS_SUCCESS;
+
+    if (info.modifiedTime == config->modifiedTime && info.size == config->size)
+        return RS_SUCCESS;
+
+    // remembered even if parsing fails, so a broken file is reported once
+    config->modifiedTime = info.modifiedTime;
+    config->size         = info.size;
+
+    char *text = NULL;
+    u64 length = 0;
+    if (read_text(config->path, info.size, &text, &length))
+        return RS_FAILURE;
+
+    // saved without changes, keep the old views valid
+    const u64 contentHash = cutil_hash64(text, length, 0);
+    if (contentHash == config->contentHash)
+    {
+        free(text);
+        return RS_SUCCESS;
+    }
+
+    CutilConfig next = {
+        .text         = text,
+        .length       = length,
+        .path         = config->path,
+        .modifiedTime = config->modifiedTime,
+        .size         = config->size,
+        .contentHash  = contentHash,
+    };
+    if (parse_text(&next, text, length, config->path, config->entryCount))
+    {
+        next.path = NULL;
+        cutil_config_free(&next);
+        return RS_FAILURE;
+    }
+
+    // the path moves to the new config
+    config->path = NULL;
+    cutil_config_free(config);
+    *config = next;
+
+    if (changed)
+        *changed = true;
+    return RS_SUCCESS;
+}
+
+void cutil_config_free(CutilConfig *config)
+{
+    free(config->text);
+    free(config->entries);
+    free(config->slots);
+    free(config->path);
+    *config = (CutilConfig){0};
+}
+
+bool cutil_config_get(
+    const CutilConfig *restrict config,
+    const char *restrict section,
+    const char *restrict key,
+    CutilStringView *restrict value)
+{
+    const CutilStringView sectionView = {
+        .data   = section,
+        .length = section ? strlen(section) : 0,
+    };
+    const CutilStringView keyView = {.data = key, .length = strlen(key)};
+
+    const CutilConfigEntry *entry = find_entry(config, sectionView, keyView);
+    if (!entry)
+        return false;
+
+    *value = entry->value;
+    return true;
+}
+
+i64 cutil_config_get_int(
+    const CutilConfig *restrict config,
+    const char *restrict section,
+    const char *restrict key,
+    const i64 defaultValue)
+{
+    char buffer[NUMBER_BUFFER_SIZE];
+    if (!get_terminated(config, section, key, buffer))
+        return defaultValue;
+
+    char *end        = NULL;
+    const i64 result = strtoll(buffer, &end, 0);
+    if (end == buffer || *end != '\0')
+    {
+        log_warning(
+            "Config value '%s' for '%s' is not an integer", buffer, key);
+        return defaultValue;
+    }
+    return result;
+}
+
+f64 cutil_config_get_float(
+    const CutilConfig *restrict config,
+    const char *restrict section,
+    const char *restrict key,
+    const f64 defaultValue)
+{
+    char buffer[NUMBER_BUFFER_SIZE];
+    if (!get_terminated(config, section, key, buffer))
+        return defaultValue;
+
+    char *end        = NULL;
+    const f64 result = strtod(buffer, &end);
+    if (end == buffer || *end != '\0')
+    {
+        log_warning("Config value '%s' for '%s' is not a number", buffer, key);
+        return defaultValue;
+    }
+    return result;
+}
+
+bool cutil_config_get_bool(
+    const CutilConfig *restrict config,
+    const char *restrict section,
+    const char *restrict key,
+    const bool defaultValue)
+{
+    char buffer[NUMBER_BUFFER_SIZE];
+    if (!get_terminated(config, section, key, buffer))
+        return defaultValue;
+
+    if (!strcasecmp(buffer, "true") || !strcasecmp(buffer, "yes") ||
+        !strcasecmp(buffer, "on") || !strcmp(buffer, "1"))
+        return true;
+    if (!strcasecmp(buffer, "false") || !strcasecmp(buffer, "no") ||
+        !strcasecmp(buffer, "off") || !strcmp(buffer, "0"))
+        return false;
+
+    log_warning("Config value '%s' for '%s' is not a bool", buffer, key);
+    return defaultValue;
+}
+
+u32 cutil_config_get_entry_count(const CutilConfig *config)
+{
+    return config->entryCount;
+}
+
+const CutilConfigEntry *cutil_config_get_entry(
+    const CutilConfig *config, const u32 index)
+{
+    return &config->entries[index];
+}
+
+//
+// Helper implementations
+//
+
+static Result read_text(
+    const char *restrict filepath,
+    const u64 sizeHint,
+    char **restrict text,
+    u64 *restrict length)
+{
+    u32 pathLength = 0;
+    cutil_platform_localize_file_name(NULL, filepath, &pathLength);
+    char path[pathLength];
+    cutil_platform_localize_file_name(path, filepath, &pathLength);
+
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        log_error("Failed to open file '%s'.", path);
+        return RS_FAILURE;
+    }
+
+    // one byte more than expected, so reaching the end takes one read
+    u64 capacity = sizeHint + 1;
+    u64 size     = 0;
+    char *buffer = malloc(capacity);
+    while (buffer)
+    {
+        size += fread(buffer + size, 1, capacity - size, file);
+        if (size < capacity)
+            break;
+
+        // the file grew since it was checked
+        capacity *= 2;
+        char *grown = realloc(buffer, capacity);
+        if (!grown)
+            free(buffer);
+        buffer = grown;
+    }
+
+    const bool failed = !buffer || ferror(file);
+    fclose(file);
+    if (failed)
+    {
+        log_error("Failed to read file '%s'.", path);
+        free(buffer);
+        return RS_FAILURE;
+    }
+
+    *text   = buffer;
+    *length = size;
+    return RS_SUCCESS;
+}
+
+static Result parse_text(
+    CutilConfig *restrict config,
+    const char *restrict text,
+    const u64 length,
+    const char *restrict name,
+    const u32 capacityHint)
+{
+    // a reload of a config the same size as before allocates once
+    if (capacityHint)
+    {
+        config->entries = malloc(capacityHint * sizeof(CutilConfigEntry));
+        if (config->entries)
+            config->entryCapacity = capacityHint;
+    }
+
+    u32 slotCount = 2 * INITIAL_ENTRY_CAPACITY;
+    while (slotCount < 2 * capacityHint)
+        slotCount <<= 1;
+    if (resize_index(config, slotCount))
+        return RS_FAILURE;
+
+    CutilLineIterator lines;
+    cutil_line_iterator_init_buffer(&lines, text, length);
+
+    CutilStringView section = {0};
+    CutilStringView line;
+    Result result = RS_SUCCESS;
+    while (result == RS_SUCCESS && cutil_line_iterator_next(&lines, &line))
+    {
+        // skip the byte order mark some editors add
+        if (lines.lineNumber == 1 && line.length >= 3 &&
+            memcmp(line.data, "\xEF\xBB\xBF", 3) == 0)
+        {
+            line.data += 3;
+            line.length -= 3;
+        }
+
+        line = trim(line);
+        if (!line.length || line.data[0] == ';' || line.data[0] == '#')
+            continue;
+
+        if (line.data[0] == '[')
+        {
+            if (line.data[line.length - 1] != ']')
+            {
+                log_error(
+                    "Config '%s' line %llu: section is missing ']'",
+                    name,
+                    (unsigned long long)lines.lineNumber);
+                result = RS_FAILURE;
+                break;
+            }
+            section = trim((CutilStringView){
+                .data = line.data + 1, .length = line.length - 2});
+            continue;
+        }
+
+        const char *equals =
+            cutil_string_find_char(line.data, line.length, '=');
+        const CutilStringView key = trim((CutilStringView){
+            .data   = line.data,
+            .length = equals ? (u64)(equals - line.data) : 0,
+        });
+        if (!key.length)
+        {
+            log_error(
+                "Config '%s' line %llu: expected 'key = value'",
+                name,
+                (unsigned long long)lines.lineNumber);
+            result = RS_FAILURE;
+            break;
+        }
+
+        CutilStringView value = trim((CutilStringView){
+            .data   = equals + 1,
+            .length = line.data + line.length - equals - 1,
+        });
+        if (value.length >= 2 && value.data[0] == '"' &&
+            value.data[value.length - 1] == '"')
+        {
+            value.data += 1;
+            value.length -= 2;
+        }
+
+        const CutilConfigEntry entry = {
+            .section = section,
+            .key     = key,
+            .value   = value,
+            .hash    = entry_hash(section, key),
+            .line    = lines.lineNumber,
+        };
+        result = add_entry(config, &entry);
+    }
+
+    cutil_line_iterator_free(&lines);
+    return result;
+}
+
+static Result add_entry(CutilConfig *config, const CutilConfigEntry *entry)
+{
+    const u32 mask = config->slotCount - 1;
+    u32 slot       = entry->hash & mask;
+    for (; config->slots[slot]; slot = (slot + 1) & mask)
+    {
+        CutilConfigEntry *existing = &config->entries[config->slots[slot] - 1];
+        if (existing->hash == entry->hash &&
+            view_equal(existing->section, entry->section) &&
+            view_equal(existing->key, entry->key))
+        {
+            existing->value = entry->value;
+            existing->line  = entry->line;
+            return RS_SUCCESS;
+        }
+    }
+
+    if (config->entryCount == config->entryCapacity)
+    {
+        const u32 capacity = config->entryCapacity
+                                 ? config->entryCapacity * 2
+                                 : INITIAL_ENTRY_CAPACITY;
+        CutilConfigEntry *entries =
+            realloc(config->entries, capacity * sizeof(CutilConfigEntry));
+        if (!entries)
+        {
+            log_error("Failed to allocate config entries");
+            return RS_FAILURE;
+        }
+        config->entries       = entries;
+        config->entryCapacity = capacity;
+    }
+
+    config->entries[config->entryCount++] = *entry;
+    config->slots[slot]                   = config->entryCount;
+
+    // keep the index at most half full
+    if (config->entryCount * 2 > config->slotCount)
+        return resize_index(config, config->slotCount * 2);
+    return RS_SUCCESS;
+}
+
+static Result resize_index(CutilConfig *config, const u32 slotCount)
+{
+    u32 *slots = calloc(slotCount, sizeof(u32));
+    if (!slots)
+    {
+        log_error("Failed to allocate config index");
+        return RS_FAILURE;
+    }
+
+    const u32 mask = slotCount - 1;
+    for (u32 i = 0; i < config->entryCount; i++)
+    {
+        u32 slot = config->entries[i].hash & mask;
+        while (slots[slot])
+            slot = (slot + 1) & mask;
+        slots[slot] = i + 1;
+    }
+
+    free(config->slots);
+    config->slots     = slots;
+    config->slotCount = slotCount;
+    return RS_SUCCESS;
+}
+
+static const CutilConfigEntry *find_entry(
+    const CutilConfig *config,
+    const CutilStringView section,
+    const CutilStringView key)
+{
+    if (!config->slotCount)
+        return NULL;
+
+    const u64 hash = entry_hash(section, key);
+    const u32 mask = config->slotCount - 1;
+    for (u32 slot = hash & mask; config->slots[slot]; slot = (slot + 1) & mask)
+    {
+        const CutilConfigEntry *entry =
+            &config->entries[config->slots[slot] - 1];
+        if (entry->hash == hash && view_equal(entry->section, section) &&
+            view_equal(entry->key, key))
+            return entry;
+    }
+    return NULL;
+}
+
+static u64 entry_hash(const CutilStringView section, const CutilStringView key)
+{
+    return cutil_hash64(
+        key.data, key.length, cutil_hash64(section.data, section.length, 0));
+}
+
+static CutilStringView trim(CutilStringView view)
+{
+    while (view.length && (view.data[0] == ' ' || view.data[0] == '\t'))
+    {
+        view.data++;
+        view.length--;
+    }
+    while (view.length && (view.data[view.length - 1] == ' ' ||
+                           view.data[view.length - 1] == '\t'))
+        view.length--;
+    return view;
+}
+
+static bool view_equal(const CutilStringView a, const CutilStringView b)
+{
+    return a.length == b.length &&
+           (!a.length || memcmp(a.data, b.data, a.length) == 0);
+}
+
+static bool get_terminated(
+    const CutilConfig *restrict config,
+    const char *restrict section,
+    const char *restrict key,
+    char *restrict buffer)
+{
+    CutilStringView value;
+    if (!cutil_config_get(config, section, key, &value))
+        return false;
+
+    if (value.length >= NUMBER_BUFFER_SIZE)
+    {
+        log_warning("Config value for '%s' is too long", key);
+        return false;
+    }
+
+    memcpy(buffer, value.data, value.length);
+    buffer[value.length] = '\0';
+    return true;
+}
@@ -0,0 +1,200 @@
+#pragma once
+
+// Config files
+//
+// Parses INI style config files without copying strings out of them. Values
+// are returned as views into the text, and found through a hash index built
+// while parsing, so a lookup is a hash and a compare. A loaded config can be
+// reloaded cheaply: nothing is read unless the file changed, and nothing is
+// parsed unless its contents did.
+//
+// The format is one setting per line:
+//
+//     ; comments start with ';' or '#'
+//     name = value
+//
+//     [section]
+//     key = "a value with the quotes removed"
+//
+// Keys before the first section are in the global section. Spaces around
+// names and values are ignored. If a key is set twice, the last value is used.
+//
+// Kael Johnston
+
+#include "types.h"
+#include "string_util.h"
+
+/**
+ * A setting. The views point into the text that was parsed.
+ */
+typedef struct CutilConfigEntry
+{
+    CutilStringView section; // empty in the global section
+    CutilStringView key;
+    CutilStringView value;
+    u64 hash; // of the section and key
+    u32 line; // where the value was set, starting at 1
+} CutilConfigEntry;
+
+/**
+ * A parsed config. The fields are internal, use the functions below.
+ */
+typedef struct CutilConfig
+{
+    // the text the views point into, NULL for buffers
+    char *text;
+    u64 length;
+
+    CutilConfigEntry *entries;
+    u32 entryCount;
+    u32 entryCapacity;
+
+    // open addressed index of the entries, each slot is an index + 1
+    u32 *slots;
+    u32 slotCount;
+
+    // the file to reload, NULL for buffers
+    char *path;
+    i64 modifiedTime;
+    u64 size;
+    u64 contentHash;
+} CutilConfig;
+
+/**
+ * Parse a config from a buffer. The buffer is not copied, so it has to stay
+ * valid until the config is freed.
+ *
+ * @param config will be set to the config
+ * @param text the config text, does not have to be NULL terminated
+ * @param length the length of text
+ *
+ * @return RS_FAILURE if a line could not be parsed, the line is logged
+ *
+ * @author Kael Johnston
+ */
+Result cutil_config_parse(
+    CutilConfig *restrict config, const char *restrict text, const u64 length);
+
+/**
+ * Read and parse a config file. The file is read into memory with one read,
+ * and not mapped, so the config stays valid if the file is rewritten in place.
+ *
+ * @param config will be set to the config
+ * @param filepath the file to load, it is localized like all other file
+ * utilities
+ *
+ * @return RS_FAILURE if the file could not be read, or a line could not be
+ * parsed
+ *
+ * @author Kael Johnston
+ */
+Result cutil_config_load(
+    CutilConfig *restrict config, const char *restrict filepath);
+
+/**
+ * Load the file of a config again if it changed. Checking an unchanged file
+ * costs one stat, so it can be called on every CutilWatcher event for the
+ * file, or on a timer. A file that was saved without changing its contents is
+ * not parsed again.
+ *
+ * If the file changed, views from the config are invalid after the call. If
+ * the new file fails to parse, the error is logged once and the config keeps
+ * the old settings.
+ *
+ * @param config a config from cutil_config_load. Configs parsed from a
+ * buffer are never changed
+ * @param changed set to true if the settings changed, may be NULL
+ *
+ * @return RS_FAILURE if the file changed but could not be read or parsed
+ *
+ * @author Kael Johnston
+ */
+Result cutil_config_reload(
+    CutilConfig *restrict config, bool *restrict changed);
+
+/**
+ * Free a config. Views from it are invalid after this.
+ *
+ * @author Kael Johnston
+ */
+void cutil_config_free(CutilConfig *config);
+
+/**
+ * Find a setting.
+ *
+ * @param config the config
+ * @param section the section of the key, NULL or "" for the global section
+ * @param key the name of the setting
+ * @param value set to the value if it was found
+ *
+ * @return true if the setting was found
+ *
+ * @author Kael Johnston
+ */
+bool cutil_config_get(
+    const CutilConfig *restrict config,
+    const char *restrict section,
+    const char *restrict key,
+    CutilStringView *restrict value);
+
+/**
+ * Find a setting and read it as an integer. Hex values start with 0x.
+ *
+ * @return the value, or defaultValue if it was not found or is not an integer
+ *
+ * @author Kael Johnston
+ */
+i64 cutil_config_get_int(
+    const CutilConfig *restrict config,
+    const char *restrict section,
+    const char *restrict key,
+    const i64 defaultValue);
+
+/**
+ * Find a setting and read it as a number.
+ *
+ * @return the value, or defaultValue if it was not found or is not a number
+ *
+ * @author Kael Johnston
+ */
+f64 cutil_config_get_float(
+    const CutilConfig *restrict config,
+    const char *restrict section,
+    const char *restrict key,
+    const f64 defaultValue);
+
+/**
+ * Find a setting and read it as a bool. true, yes, on and 1 are true, false,
+ * no, off and 0 are false, ignoring case.
+ *
+ * @return the value, or defaultValue if it was not found or is not a bool
+ *
+ * @author Kael Johnston
+ */
+bool cutil_config_get_bool(
+    const CutilConfig *restrict config,
+    const char *restrict section,
+    const char *restrict key,
+    const bool defaultValue);
+
+/**
+ * Get the number of settings, to iterate over them with
+ * cutil_config_get_entry.
+ *
+ * @author Kael Johnston
+ */
+u32 cutil_config_get_entry_count(const CutilConfig *config);
+
+/**
+ * Get a setting by index. Settings are in the order they first appear in the
+ * file.
+ *
+ * @param config the config
+ * @param index less than cutil_config_get_entry_count
+ *
+ * @return the setting, valid until the config is reloaded or freed
+ *
+ * @author Kael Johnston
+ */
+const CutilConfigEntry *cutil_config_get_entry(
+    const CutilConfig *config, const u32 index);
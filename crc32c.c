@@ -0,0 +1,229 @@
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// the reversed Castagnoli polynomial
+#define POLYNOMIAL 0x82f63b78u
+
+// the hardware path checks three streams of these lengths at once, then
+// shifts their checksums together. Long streams make the shifts cheap, short
+// ones keep buffers that are too small for them fast
+#define LONG_LENGTH  8192
+#define SHORT_LENGTH 256
+
+//
+// Types
+//
+
+// continues a checksum that has not been inverted
+typedef u32 (*UpdateFunction)(u32 crc, const u8 *data, u64 length);
+
+struct Crc32cTables
+{
+    // byte tables for 8 bytes at a time
+    u32 slice[8][256];
+
+    // add LONG_LENGTH or SHORT_LENGTH zero bytes to a checksum, a byte at a
+    // time
+    u32 longShift[4][256];
+    u32 shortShift[4][256];
+};
+
+static struct Crc32cTables g_tables;
+static pthread_once_t g_tablesOnce = PTHREAD_ONCE_INIT;
+static UpdateFunction g_update     = NULL;
+
+//
+// Helper Declerations
+//
+
+static void init_tables(void);
+
+// multiply two polynomials modulo the crc polynomial, bit 31 is x^0
+static u32 multiply_modulo(u32 a, u32 b);
+
+static void init_shift_table(u32 table[4][256], u64 length);
+
+static u32 shift(const u32 table[4][256], u32 crc);
+
+static u32 update_bytes(u32 crc, const u8 *data, u64 length);
+
+static u32 update_slice8(u32 crc, const u8 *data, u64 length);
+
+#if defined(__x86_64__) && defined(__GNUC__)
+static u32 update_sse42(u32 crc, const u8 *data, u64 length);
+#endif
+
+//
+// Public methods
+//
+
+u32 cutil_crc32c(const void *data, const u64 length)
+{
+    return cutil_crc32c_update(0, data, length);
+}
+
+u32 cutil_crc32c_update(u32 crc, const void *data, const u64 length)
+{
+    pthread_once(&g_tablesOnce, init_tables);
+
+    if (!length)
+        return crc;
+    return ~g_update(~crc, data, length);
+}
+
+//
+// Helper implementations
+//
+
+static void init_tables(void)
+{
+    for (u32 i = 0; i < 256; i++)
+    {
+        u32 crc = i;
+        for (u32 bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ POLYNOMIAL : crc >> 1;
+        g_tables.slice[0][i] = crc;
+    }
+
+    for (u32 i = 0; i < 256; i++)
+        for (u32 k = 1; k < 8; k++)
+        {
+            const u32 previous   = g_tables.slice[k - 1][i];
+            g_tables.slice[k][i] = (previous >> 8) ^
+                                   g_tables.slice[0][previous & 0xff];
+        }
+
+    init_shift_table(g_tables.longShift, LONG_LENGTH);
+    init_shift_table(g_tables.shortShift, SHORT_LENGTH);
+
+    g_update = update_slice8;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse4.2"))
+        g_update = update_sse42;
+#endif
+}
+
+static u32 multiply_modulo(u32 a, u32 b)
+{
+    u32 product = 0;
+    for (u32 bit = 1u << 31; bit; bit >>= 1)
+    {
+        if (a & bit)
+            product ^= b;
+        b = b & 1 ? (b >> 1) ^ POLYNOMIAL : b >> 1;
+    }
+    return product;
+}
+
+static void init_shift_table(u32 table[4][256], u64 length)
+{
+    // x^(8 * length), the factor that appends length zero bytes
+    u32 factor = 1u << 31;
+    for (u64 i = 0; i < length * 8; i++)
+        factor = factor & 1 ? (factor >> 1) ^ POLYNOMIAL : factor >> 1;
+
+    // shifting is linear, so each byte of the checksum is shifted on its own
+    for (u32 k = 0; k < 4; k++)
+        for (u32 i = 0; i < 256; i++)
+            table[k][i] = multiply_modulo(factor, i << (k * 8));
+}
+
+static u32 shift(const u32 table[4][256], u32 crc)
+{
+    return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+           table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+static u32 update_bytes(u32 crc, const u8 *data, u64 length)
+{
+    for (u64 i = 0; i < length; i++)
+        crc = g_tables.slice[0][(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static u32 update_slice8(u32 crc, const u8 *data, u64 length)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const u32(*t)[256] = g_tables.slice;
+
+    while (length >= 8)
+    {
+        u64 word;
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+
+        crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^
+              t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+              t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^
+              t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+
+        data   += 8;
+        length -= 8;
+    }
+#endif
+
+    return update_bytes(crc, data, length);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2"))) static u32
+update_sse42(u32 crc, const u8 *data, u64 length)
+{
+    // line the reads up to 8 bytes
+    while (length && ((uintptr_t)data & 7))
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+        length--;
+    }
+
+    // the instruction takes 3 cycles but can start every cycle, so three
+    // independent streams keep it busy. The checksums of the later streams
+    // start at 0 and are combined with the first one afterwards
+    const u64 lanes[2]            = {LONG_LENGTH, SHORT_LENGTH};
+    const u32(*shifts[2])[4][256] = {&g_tables.longShift, &g_tables.shortShift};
+    for (u32 size = 0; size < 2; size++)
+    {
+        const u64 lane = lanes[size];
+        while (length >= lane * 3)
+        {
+            u64 crc0 = crc, crc1 = 0, crc2 = 0;
+            for (const u8 *end = data + lane; data < end; data += 8)
+            {
+                u64 words[3];
+                memcpy(&words[0], data, 8);
+                memcpy(&words[1], data + lane, 8);
+                memcpy(&words[2], data + lane * 2, 8);
+                crc0 = _mm_crc32_u64(crc0, words[0]);
+                crc1 = _mm_crc32_u64(crc1, words[1]);
+                crc2 = _mm_crc32_u64(crc2, words[2]);
+            }
+
+            crc = shift(*shifts[size], crc0) ^ crc1;
+            crc = shift(*shifts[size], crc) ^ crc2;
+
+            data   += lane * 2;
+            length -= lane * 3;
+        }
+    }
+
+    u64 crc64 = crc;
+    for (; length >= 8; data += 8, length -= 8)
+    {
+        u64 word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+
+    while (length--)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
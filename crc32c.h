@@ -0,0 +1,40 @@
+#pragma once
+
+// CRC32C checksums
+//
+// The Castagnoli CRC, as used by iSCSI, ext4 and btrfs, for finding corrupted
+// data. On x86 cpus with SSE4.2 it uses the crc32 instruction on three streams
+// at once, which checks data faster than memory can deliver it. Other cpus use
+// a table lookup 8 bytes at a time. Unlike cutil_hash64, the checksum is a
+// standard one, so it can be checked by other tools.
+//
+// Kael Johnston
+
+#include "types.h"
+
+/**
+ * Compute the CRC32C of a buffer.
+ *
+ * @param data the data to check, may be NULL if length is 0
+ * @param length the size of data
+ *
+ * @return the checksum, 0xe3069283 for "123456789"
+ *
+ * @author Kael Johnston
+ */
+u32 cutil_crc32c(const void *data, const u64 length);
+
+/**
+ * Continue a CRC32C with more data, for data that is not in one buffer.
+ * Checking a buffer in several pieces gives the same checksum as checking it
+ * at once.
+ *
+ * @param crc the checksum of the data so far, 0 to start
+ * @param data the next data, may be NULL if length is 0
+ * @param length the size of data
+ *
+ * @return the checksum of all the data so far
+ *
+ * @author Kael Johnston
+ */
+u32 cutil_crc32c_update(u32 crc, const void *data, const u64 length);
@@ -1,13 +1,114 @@
 #include "file.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#ifdef __unix__
+#include <fcntl.h>
+#endif
 
+#include "compress.h"
+#include "crc32c.h"
+#include "function_timer.h"
 #include "platform.h"
 #include "messenger.h"
 
 #define min_value(a, b) (a < b ? a : b)
 #define max_value(a, b) (a > b ? a : b)
 
+// marks the footer CUTIL_FILE_WRITE_CHECKSUM adds to the end of a file
+#define CHECKSUM_MAGIC 0x4d534b43 // "CKSM"
+
+// checked files are copied in pieces this size, so each piece is still in
+// cache when it is checked
+#define CHECKED_COPY_SIZE (64 * 1024)
+
+struct ChecksumFooter
+{
+    u32 magic;
+    u32 crc; // of everything before the footer
+};
+
+// copy segments with a footer after them, into count + 1 segments that have
+// to be freed. There can be too many segments for the stack
+static CutilFileSegment *add_checksum(
+    const CutilFileSegment *restrict segments,
+    const u32 count,
+    struct ChecksumFooter *restrict footer)
+{
+    CutilFileSegment *checked =
+        count < UINT32_MAX ? malloc((count + 1) * sizeof(CutilFileSegment))
+                           : NULL;
+    if (!checked)
+    {
+        log_error("Failed to allocate %u file segments", count);
+        return NULL;
+    }
+
+    u32 crc = 0;
+    for (u32 i = 0; i < count; i++)
+    {
+        crc = cutil_crc32c_update(crc, segments[i].data, segments[i].size);
+        checked[i] = segments[i];
+    }
+
+    *footer = (struct ChecksumFooter){.magic = CHECKSUM_MAGIC, .crc = crc};
+    checked[count] =
+        (CutilFileSegment){.data = footer, .size = sizeof(*footer)};
+    return checked;
+}
+
+// find the footer at the end of a mapped file
+static Result read_checksum(
+    const CutilFileMap *restrict map,
+    const char *restrict path,
+    struct ChecksumFooter *restrict footer)
+{
+    if (map->size >= sizeof(*footer))
+    {
+        const u8 *end = (const u8 *)map->data + map->size;
+        memcpy(footer, end - sizeof(*footer), sizeof(*footer));
+        if (footer->magic == CHECKSUM_MAGIC)
+            return RS_SUCCESS;
+    }
+
+    log_error("File '%s' has no checksum.", path);
+    return RS_FAILURE;
+}
+
+// verify a mapped file, copying up to size bytes of it to dest on the way
+static Result verify_checksum(
+    void *restrict dest,
+    const u64 size,
+    const CutilFileMap *restrict map,
+    const char *restrict path)
+{
+    struct ChecksumFooter footer;
+    if (read_checksum(map, path, &footer))
+        return RS_FAILURE;
+
+    const u8 *contents    = map->data;
+    const u64 contentSize = map->size - sizeof(footer);
+    const u64 copySize    = dest ? min_value(size, contentSize) : 0;
+
+    u32 crc = 0;
+    for (u64 offset = 0; offset < copySize; offset += CHECKED_COPY_SIZE)
+    {
+        u8 *piece           = (u8 *)dest + offset;
+        const u64 pieceSize = min_value(copySize - offset, CHECKED_COPY_SIZE);
+        memcpy(piece, contents + offset, pieceSize);
+        crc = cutil_crc32c_update(crc, piece, pieceSize);
+    }
+    crc = cutil_crc32c_update(crc, contents + copySize, contentSize - copySize);
+
+    if (crc != footer.crc)
+    {
+        log_error("File '%s' is corrupted, its checksum does not match.", path);
+        return RS_FAILURE;
+    }
+    return RS_SUCCESS;
+}
+
 // just a wrapper, to help keep the file utilities organized
 u64 spread_file_size(const char *path)
 {
@@ -19,6 +120,12 @@ bool cutil_read_file_exists(const char *path)
     return cutil_platform_test_for_file(path);
 }
 
+Result cutil_read_file_info(
+    const char *restrict path, CutilFileInfo *restrict info)
+{
+    return cutil_platform_get_file_info(path, info);
+}
+
 Result cutil_read_file_binary(
     void *restrict dest, const char *restrict path, const u64 size)
 {
@@ -39,6 +146,11 @@ Result cutil_read_file_binary(
         return RS_FAILURE;
     }
 
+#ifdef __unix__
+    // the whole file is read front to back, so read ahead as far as possible
+    posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
     // get file size
     fseek(file, 0, SEEK_END);
     const u64 fileSize = ftell(file);
@@ -53,6 +165,137 @@ Result cutil_read_file_binary(
     return RS_SUCCESS;
 }
 
+Result cutil_file_hash(
+    const char *restrict path,
+    CutilHash128 *restrict hash,
+    const u32 threadCount)
+{
+    CutilFileMap map;
+    if (cutil_platform_map_file(&map, path, CUTIL_FILE_MAP_DEFAULT))
+        return RS_FAILURE;
+
+    const Result result =
+        cutil_hash128_parallel_checked(map.data, map.size, threadCount, hash);
+
+    cutil_platform_unmap_file(&map);
+    return result;
+}
+
+u64 cutil_read_file_compressed_size(const char *path)
+{
+    CutilFileMap map;
+    if (cutil_platform_map_file(&map, path, CUTIL_FILE_MAP_DEFAULT))
+        return 0;
+
+    u64 contentSize = 0;
+    if (cutil_compress_frame_content_size(map.data, map.size, &contentSize))
+        contentSize = 0;
+
+    cutil_platform_unmap_file(&map);
+    return contentSize;
+}
+
+Result cutil_read_file_compressed(
+    void *restrict dest, const char *restrict path, const u64 size)
+{
+    CutilFileMap map;
+    if (cutil_platform_map_file(&map, path, CUTIL_FILE_MAP_POPULATE))
+        return RS_FAILURE;
+
+    Result result = cutil_decompress_frame(dest, size, map.data, map.size, 0);
+    if (result)
+        log_error("Failed to decompress file '%s'.", path);
+
+    cutil_platform_unmap_file(&map);
+    return result;
+}
+
+u64 cutil_read_file_checked_size(const char *path)
+{
+    CutilFileMap map;
+    if (cutil_platform_map_file(&map, path, CUTIL_FILE_MAP_DEFAULT))
+        return 0;
+
+    struct ChecksumFooter footer;
+    u64 contentSize = 0;
+    if (!read_checksum(&map, path, &footer))
+        contentSize = map.size - sizeof(footer);
+
+    cutil_platform_unmap_file(&map);
+    return contentSize;
+}
+
+Result cutil_read_file_checked(
+    void *restrict dest, const char *restrict path, const u64 size)
+{
+    CutilFileMap map;
+    if (cutil_platform_map_file(&map, path, CUTIL_FILE_MAP_POPULATE))
+        return RS_FAILURE;
+
+    Result result = verify_checksum(dest, size, &map, path);
+
+    cutil_platform_unmap_file(&map);
+    return result;
+}
+
+Result cutil_file_verify(const char *path)
+{
+    CutilFileMap map;
+    if (cutil_platform_map_file(&map, path, CUTIL_FILE_MAP_POPULATE))
+        return RS_FAILURE;
+
+    Result result = verify_checksum(NULL, 0, &map, path);
+
+    cutil_platform_unmap_file(&map);
+    return result;
+}
+
+Result cutil_file_advise(const char *path, const CutilFileAccessHint hint)
+{
+    return cutil_platform_advise_file(path, hint);
+}
+
+Result cutil_file_map_advise(
+    const CutilFileMap *map, const CutilFileAccessHint hint)
+{
+    return cutil_platform_advise_map(map, hint);
+}
+
+Result cutil_read_file_direct(
+    void *restrict dest, const char *restrict path, const u64 size)
+{
+    Result result;
+    u64 bytesRead = 0;
+    time_function_throughput(
+        cutil_platform_read_file_direct(dest, path, size, &bytesRead),
+        result,
+        bytesRead);
+    return result;
+}
+
+void *cutil_file_alloc_aligned(const u64 size)
+{
+    return cutil_platform_alloc_aligned(size);
+}
+
+void cutil_file_free_aligned(void *buffer)
+{
+    cutil_platform_free_aligned(buffer);
+}
+
+Result cutil_file_prefetch(const char *const *paths, const u32 count)
+{
+    return cutil_platform_prefetch_files(paths, count);
+}
+
+Result cutil_file_map(
+    CutilFileMap *restrict map, const char *restrict path, u32 flags)
+{
+    return cutil_platform_map_file(map, path, flags);
+}
+
+void cutil_file_unmap(CutilFileMap *map) { cutil_platform_unmap_file(map); }
+
 Result cutil_read_file_text(
     char *restrict dest, const char *restrict path, const u64 length)
 {
@@ -88,13 +331,152 @@ Result cutil_read_file_text(
     return RS_SUCCESS;
 }
 
+Result cutil_file_reader_open(
+    CutilFileReader *restrict reader,
+    const char *restrict path,
+    const u64 chunkSize,
+    const CutilFileAccessHint hint)
+{
+    // localize filepath
+    u32 pathLength = 0;
+    cutil_platform_localize_file_name(NULL, path, &pathLength);
+    char filepath[pathLength];
+    cutil_platform_localize_file_name(filepath, path, &pathLength);
+
+    db_assert_msg(chunkSize, "Chunk size cannot be 0");
+
+    *reader = (CutilFileReader){0};
+
+    FILE *file = fopen(filepath, "rb");
+    if (!file)
+    {
+        log_error("Failed to open file '%s'.", filepath);
+        return RS_FAILURE;
+    }
+
+    // chunks are read straight into our buffers, a stdio buffer would only
+    // add another copy
+    setvbuf(file, NULL, _IONBF, 0);
+
+    // get file size
+    fseek(file, 0, SEEK_END);
+    const u64 fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    // both buffers share one allocation
+    u8 *buffer = malloc(chunkSize * 2);
+    if (!buffer)
+    {
+        log_error("Failed to allocate chunk buffers for '%s'", filepath);
+        fclose(file);
+        return RS_FAILURE;
+    }
+
+#ifdef __unix__
+    if (hint == CUTIL_FILE_ACCESS_RANDOM)
+        posix_fadvise(fileno(file), 0, 0, POSIX_FADV_RANDOM);
+    else
+        posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (hint == CUTIL_FILE_ACCESS_WILL_NEED)
+        posix_fadvise(fileno(file), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+
+    reader->file       = file;
+    reader->buffers[0] = buffer;
+    reader->buffers[1] = buffer + chunkSize;
+    reader->chunkSize  = chunkSize;
+    reader->fileSize   = fileSize;
+    reader->hint       = hint;
+
+    return RS_SUCCESS;
+}
+
+Result cutil_file_reader_next(
+    CutilFileReader *restrict reader,
+    const void **restrict chunk,
+    u64 *restrict length)
+{
+    db_assert_msg(reader->file, "Reader is not open");
+
+    *chunk  = NULL;
+    *length = 0;
+
+    if (reader->bytesRead >= reader->fileSize)
+        return RS_SUCCESS;
+
+    const u64 remaining = reader->fileSize - reader->bytesRead;
+    const u64 size      = min_value(remaining, reader->chunkSize);
+
+    u8 *buffer = reader->buffers[reader->current];
+    if (fread(buffer, 1, size, reader->file) != size)
+    {
+        log_error(
+            "Failed to read chunk at offset %llu",
+            (unsigned long long)reader->bytesRead);
+        return RS_FAILURE;
+    }
+
+    reader->bytesRead += size;
+    reader->current ^= 1;
+
+#ifdef __unix__
+    // start pulling the next chunk into the page cache while the caller works
+    if (reader->bytesRead < reader->fileSize &&
+        reader->hint != CUTIL_FILE_ACCESS_RANDOM)
+        posix_fadvise(
+            fileno(reader->file),
+            reader->bytesRead,
+            reader->chunkSize,
+            POSIX_FADV_WILLNEED);
+
+    // the chunk has been copied out, so the cache can let it go
+    if (reader->hint == CUTIL_FILE_ACCESS_DONT_NEED)
+        posix_fadvise(
+            fileno(reader->file),
+            reader->bytesRead - size,
+            size,
+            POSIX_FADV_DONTNEED);
+#endif
+
+    *chunk  = buffer;
+    *length = size;
+    return RS_SUCCESS;
+}
+
+Result cutil_file_reader_for_each(
+    CutilFileReader *reader, CutilFileChunkCallback callback, void *userData)
+{
+    const void *chunk = NULL;
+    u64 length        = 0;
+
+    for (;;)
+    {
+        if (cutil_file_reader_next(reader, &chunk, &length))
+            return RS_FAILURE;
+        if (length == 0)
+            return RS_SUCCESS;
+
+        if (callback(chunk, length, reader->bytesRead - length, userData))
+            return RS_FAILURE;
+    }
+}
+
+void cutil_file_reader_close(CutilFileReader *reader)
+{
+    if (reader->file)
+        fclose(reader->file);
+    free(reader->buffers[0]);
+    *reader = (CutilFileReader){0};
+}
+
 time_t cutil_read_file_modified_time(const char *path)
 {
     return cutil_platform_get_file_modified_date(path);
 }
 
-Result
-cutil_write_file_binary(const char *path, const void *contents, const u32 size)
+Result cutil_write_file_binary(
+    const char *restrict path, const void *restrict contents, const u64 size)
 {
     // localize filepath
     u32 pathLength = 0;
@@ -120,6 +502,103 @@ cutil_write_file_binary(const char *path, const void *contents, const u32 size)
     return RS_SUCCESS;
 }
 
+Result cutil_write_file_iov(
+    const char *restrict path,
+    const CutilFileSegment *restrict segments,
+    const u32 count,
+    const u32 flags)
+{
+    if (!(flags & CUTIL_FILE_WRITE_CHECKSUM))
+        return cutil_platform_write_file_iov(path, segments, count, flags);
+
+    // the footer would end up in the middle of the file
+    if (flags & CUTIL_FILE_WRITE_APPEND)
+    {
+        log_error("Cannot append to checked file '%s'.", path);
+        return RS_FAILURE;
+    }
+
+    struct ChecksumFooter footer;
+    CutilFileSegment *checked = add_checksum(segments, count, &footer);
+    if (!checked)
+        return RS_FAILURE;
+
+    const Result result = cutil_platform_write_file_iov(
+        path, checked, count + 1, flags & ~CUTIL_FILE_WRITE_CHECKSUM);
+    free(checked);
+    return result;
+}
+
+Result cutil_write_file_delta(
+    const char *restrict path,
+    const void *restrict contents,
+    const u64 size,
+    u64 *restrict bytesWritten)
+{
+    return cutil_platform_write_file_delta(path, contents, size, bytesWritten);
+}
+
+Result cutil_write_file_compressed(
+    const char *restrict path, const void *restrict contents, const u64 size)
+{
+    const u64 bound = cutil_compress_frame_bound(size);
+    void *frame     = malloc(bound);
+    if (!frame)
+    {
+        log_error("Failed to allocate %llu bytes", (unsigned long long)bound);
+        return RS_FAILURE;
+    }
+
+    const u64 frameSize = cutil_compress_frame(frame, bound, contents, size, 0);
+
+    Result result = RS_FAILURE;
+    if (frameSize)
+        result = cutil_write_file_binary(path, frame, frameSize);
+
+    free(frame);
+    return result;
+}
+
+Result cutil_write_file_direct(
+    const char *restrict path, const void *restrict contents, const u64 size)
+{
+    Result result;
+    time_function_throughput(
+        cutil_platform_write_file_direct(path, contents, size), result, size);
+    return result;
+}
+
+Result cutil_write_file_atomic(
+    const char *restrict path, const void *restrict contents, const u64 size)
+{
+    return cutil_platform_write_file_atomic(path, contents, size);
+}
+
+Result cutil_write_file_atomic_iov(
+    const char *restrict path,
+    const CutilFileSegment *restrict segments,
+    const u32 count,
+    const u32 flags)
+{
+    if (!(flags & CUTIL_FILE_WRITE_CHECKSUM))
+        return cutil_platform_write_file_atomic_iov(path, segments, count);
+
+    struct ChecksumFooter footer;
+    CutilFileSegment *checked = add_checksum(segments, count, &footer);
+    if (!checked)
+        return RS_FAILURE;
+
+    const Result result =
+        cutil_platform_write_file_atomic_iov(path, checked, count + 1);
+    free(checked);
+    return result;
+}
+
+Result cutil_file_copy(const char *restrict dest, const char *restrict src)
+{
+    return cutil_platform_copy_file(dest, src);
+}
+
 Result cutil_write_file_folder(const char *path)
 {
     return cutil_platform_create_folder(path);
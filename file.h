@@ -1,5 +1,7 @@
 #pragma once
 #include "types.h"
+#include "hash.h"
+#include "platform.h"
 // Utilities usefull in file I/O
 //
 //
@@ -27,6 +29,19 @@ u64 cutil_read_file_size(const char *filepath);
  */
 bool cutil_read_file_exists(const char *filepath);
 
+/**
+ * @brief Read a files existence, size, modification time, type and inode at
+ * once. This is much faster than calling cutil_read_file_exists,
+ * cutil_read_file_size and cutil_read_file_modified_time separately. See
+ * cutil_platform_get_file_info.
+ *
+ * @param filepath the file to query
+ * @param info the files info
+ * @return Result
+ */
+Result cutil_read_file_info(
+    const char *restrict filepath, CutilFileInfo *restrict info);
+
 /**
  * @brief Read a file into the memory of dest, with a maximum size of size.
  * If the file is larger then size, it will be truncated at size. You can check
@@ -40,6 +55,132 @@ bool cutil_read_file_exists(const char *filepath);
 Result cutil_read_file_binary(
     void *restrict dest, const char *restrict filepath, const u64 size);
 
+/**
+ * @brief Read a very large file with direct I/O, skipping the page cache. Use
+ * it for files that are read once, such as streaming in a large archive. Read
+ * into memory from cutil_file_alloc_aligned to avoid an extra copy. The
+ * throughput is recorded by the function timer. See
+ * cutil_platform_read_file_direct.
+ *
+ * @param dest the file will be read into this pointer
+ * @param filepath the file to read
+ * @param size the maximum number of bytes to read
+ * @return Result
+ */
+Result cutil_read_file_direct(
+    void *restrict dest, const char *restrict filepath, const u64 size);
+
+/**
+ * @brief Allocate memory aligned for direct I/O. See
+ * cutil_platform_alloc_aligned.
+ *
+ * @param size the size of the buffer
+ * @return the buffer, or NULL. Free it with cutil_file_free_aligned
+ */
+void *cutil_file_alloc_aligned(const u64 size);
+
+/**
+ * @brief Free memory from cutil_file_alloc_aligned.
+ *
+ * @param buffer the buffer, may be NULL
+ */
+void cutil_file_free_aligned(void *buffer);
+
+/**
+ * @brief Hash the contents of a file. Unlike the modified time, the hash only
+ * changes when the contents do, so it can tell if files derived from it have
+ * to be rebuilt. The file is mapped, and large files are hashed on several
+ * threads. See cutil_hash128_parallel.
+ *
+ * @param filepath the file to hash
+ * @param hash the hash of the file, the same as cutil_hash128_parallel of its
+ * contents
+ * @param threadCount the number of threads to use, 0 picks one per cpu
+ * @return Result
+ */
+Result cutil_file_hash(
+    const char *restrict filepath,
+    CutilHash128 *restrict hash,
+    const u32 threadCount);
+
+/**
+ * @brief Read the size a file written with cutil_write_file_compressed will
+ * have once it is decompressed. Only the header of the file is read.
+ *
+ * @param filepath the file to query
+ * @return u64 will be 0 for failure or if the file is not compressed
+ */
+u64 cutil_read_file_compressed_size(const char *filepath);
+
+/**
+ * @brief Read and decompress a file written with cutil_write_file_compressed.
+ * Like cutil_read_file_binary, the contents are truncated at size. Use
+ * cutil_read_file_compressed_size to size the buffer exactly. See compress.h.
+ *
+ * @param dest the decompressed contents are written here
+ * @param filepath the file to read
+ * @param size the maximum number of bytes to write
+ * @return Result
+ */
+Result cutil_read_file_compressed(
+    void *restrict dest, const char *restrict filepath, const u64 size);
+
+/**
+ * @brief Read the size of the contents of a file written with
+ * CUTIL_FILE_WRITE_CHECKSUM, without the checksum at the end. The contents are
+ * not verified.
+ *
+ * @param filepath the file to query
+ * @return u64 will be 0 for failure or if the file has no checksum
+ */
+u64 cutil_read_file_checked_size(const char *filepath);
+
+/**
+ * @brief Read a file written with CUTIL_FILE_WRITE_CHECKSUM, and verify its
+ * contents against the checksum. Like cutil_read_file_binary, the contents are
+ * truncated at size, but the whole file is still verified. The contents are
+ * verified while they are copied, so the file is only read once. See
+ * crc32c.h.
+ *
+ * @param dest the contents are written here, they may have been partly
+ * written even if the checksum does not match
+ * @param filepath the file to read
+ * @param size the maximum number of bytes to write
+ * @return Result. RS_FAILURE if the file has no checksum or it does not match
+ */
+Result cutil_read_file_checked(
+    void *restrict dest, const char *restrict filepath, const u64 size);
+
+/**
+ * @brief Verify a file written with CUTIL_FILE_WRITE_CHECKSUM without reading
+ * it into a buffer, for example before mapping it with cutil_file_map.
+ *
+ * @param filepath the file to verify
+ * @return Result. RS_FAILURE if the file has no checksum or it does not match
+ */
+Result cutil_file_verify(const char *filepath);
+
+/**
+ * @brief Map a file into memory instead of copying it into a buffer. Pages
+ * are read from disk the first time they are touched, so there is no need to
+ * know the size of the file ahead of time.
+ *
+ * @param map will be set to the files contents and size
+ * @param filepath the file to map
+ * @param flags CutilFileMapFlags, for example CUTIL_FILE_MAP_POPULATE to read
+ * the whole file up front
+ * @return Result
+ */
+Result cutil_file_map(
+    CutilFileMap *restrict map, const char *restrict filepath, u32 flags);
+
+/**
+ * @brief Release a file mapped with cutil_file_map.
+ *
+ * @param map the map to release
+ */
+void cutil_file_unmap(CutilFileMap *map);
+
 /**
  * @brief Read the contents of a text file into the string pointed to by dest.
  *
@@ -51,6 +192,172 @@ Result cutil_read_file_binary(
 Result cutil_read_file_text(
     char *restrict dest, const char *restrict path, const u64 length);
 
+/**
+ * @brief Reads a file in fixed size chunks, so files larger than memory can be
+ * processed. Two chunk buffers are allocated when the reader is opened, and
+ * reused for every chunk. bytesRead and fileSize can be used to report
+ * progress.
+ */
+typedef struct CutilFileReader
+{
+    void *file;               // internal file handle
+    u8 *buffers[2];           // chunks alternate between these
+    u32 current;              // the buffer the next chunk is read into
+    u64 chunkSize;            // maximum size of each chunk
+    u64 fileSize;             // total size of the file in bytes
+    u64 bytesRead;            // bytes handed out so far
+    CutilFileAccessHint hint; // how the file is read
+} CutilFileReader;
+
+/**
+ * @brief callback used by cutil_file_reader_for_each
+ *
+ * @param chunk the chunk contents, only valid during the call
+ * @param length the size of chunk in bytes
+ * @param offset the offset of chunk in the file
+ * @param userData the pointer passed to cutil_file_reader_for_each
+ * @return RS_FAILURE will stop reading the file
+ */
+typedef Result (*CutilFileChunkCallback)(
+    const void *chunk, u64 length, u64 offset, void *userData);
+
+/**
+ * @brief Open a file for reading in chunks. The file name is localized like
+ * all other file utilities.
+ *
+ * @param reader the reader to initialize
+ * @param filepath the file to read
+ * @param chunkSize the maximum size of each chunk, must not be 0
+ * @param hint CUTIL_FILE_ACCESS_NORMAL or CUTIL_FILE_ACCESS_SEQUENTIAL read
+ * the next chunk ahead while the current one is used.
+ * CUTIL_FILE_ACCESS_WILL_NEED starts reading the whole file when it is opened.
+ * CUTIL_FILE_ACCESS_DONT_NEED drops chunks from the page cache once they have
+ * been read, for large files that are only read once.
+ * CUTIL_FILE_ACCESS_RANDOM turns read ahead off.
+ * @return Result
+ */
+Result cutil_file_reader_open(
+    CutilFileReader *restrict reader,
+    const char *restrict filepath,
+    const u64 chunkSize,
+    const CutilFileAccessHint hint);
+
+/**
+ * @brief Read the next chunk of the file. The chunk stays valid until the
+ * second call after this one, so a chunk and the one following it can be used
+ * at the same time (for example, to handle a record split between them).
+ *
+ * @param reader an open reader
+ * @param chunk will point to the chunk contents
+ * @param length will be set to the size of the chunk. It is 0 at the end of
+ * the file.
+ * @return Result
+ */
+Result cutil_file_reader_next(
+    CutilFileReader *restrict reader,
+    const void **restrict chunk,
+    u64 *restrict length);
+
+/**
+ * @brief Pass every remaining chunk of the file to callback.
+ *
+ * @param reader an open reader
+ * @param callback called once per chunk
+ * @param userData passed to callback
+ * @return RS_FAILURE if reading fails or callback returns RS_FAILURE
+ */
+Result cutil_file_reader_for_each(
+    CutilFileReader *reader, CutilFileChunkCallback callback, void *userData);
+
+/**
+ * @brief Close a reader and free its buffers.
+ *
+ * @param reader the reader to close
+ */
+void cutil_file_reader_close(CutilFileReader *reader);
+
+/**
+ * @brief Tell the system to read a file into, or drop it from, the page
+ * cache. See cutil_platform_advise_file.
+ *
+ * @param filepath the file
+ * @param hint CUTIL_FILE_ACCESS_WILL_NEED or CUTIL_FILE_ACCESS_DONT_NEED
+ * @return Result
+ */
+Result cutil_file_advise(const char *filepath, const CutilFileAccessHint hint);
+
+/**
+ * @brief Tell the system how a view from cutil_file_map is going to be read.
+ * See cutil_platform_advise_map.
+ *
+ * @param map the view
+ * @param hint how the view will be read
+ * @return Result
+ */
+Result cutil_file_map_advise(
+    const CutilFileMap *map, const CutilFileAccessHint hint);
+
+/**
+ * @brief Read files into the page cache in the background, for example ahead
+ * of loading a level, so the loads do not wait on the disk. Returns right
+ * away. See cutil_platform_prefetch_files.
+ *
+ * @param filepaths the files to read, in the order they will be needed
+ * @param count the number of files
+ * @return Result
+ */
+Result cutil_file_prefetch(const char *const *filepaths, const u32 count);
+
+/**
+ * @brief One file read in a batch submitted with cutil_file_batch_submit.
+ * bytesRead and result are written when the read completes.
+ */
+typedef struct CutilFileReadRequest
+{
+    const char *filepath; // the file to read, it will be localized
+    void *dest;           // the file will be read into this pointer
+    u64 size;             // the maximum number of bytes to read
+    u64 bytesRead;        // set once the request has completed
+    Result result;        // set once the request has completed
+} CutilFileReadRequest;
+
+// an in flight batch of reads, see cutil_file_batch_submit
+typedef struct CutilFileBatch CutilFileBatch;
+
+/**
+ * @brief Start reading many files at once. On linux the reads are queued on an
+ * io_uring, otherwise (or if io_uring is not available) a pool of threads
+ * reads them. The requests array must stay valid until
+ * cutil_file_batch_wait returns.
+ *
+ * @param batch will be set to the new batch
+ * @param requests the files to read
+ * @param count the number of requests
+ * @return Result
+ */
+Result cutil_file_batch_submit(
+    CutilFileBatch **restrict batch,
+    CutilFileReadRequest *restrict requests,
+    const u32 count);
+
+/**
+ * @brief Check on a batch without blocking.
+ *
+ * @param batch the batch to check
+ * @return u32 the number of requests that have completed
+ */
+u32 cutil_file_batch_poll(CutilFileBatch *batch);
+
+/**
+ * @brief Block until every request in the batch has completed, then free the
+ * batch. This must be called for every batch, even if polling showed that
+ * every request was complete.
+ *
+ * @param batch the batch to wait for
+ * @return RS_FAILURE if any request failed
+ */
+Result cutil_file_batch_wait(CutilFileBatch *batch);
+
 /**
  * @brief get the last time a file was modified
  *
@@ -72,7 +379,237 @@ time_t cutil_read_file_modified_time(const char *filepath);
  * @return Result
  */
 Result cutil_write_file_binary(
-    const char *restrict path, const void *restrict contents, const u32 size);
+    const char *restrict path, const void *restrict contents, const u64 size);
+
+/**
+ * @brief Write several buffers to a file one after another, without copying
+ * them together first. For example a header, a table and the payload it
+ * describes can be written straight from where they already are.
+ *
+ * @param path the file path
+ * @param segments the buffers to write, in order
+ * @param count the number of segments
+ * @param flags CutilFileWriteFlags, CUTIL_FILE_WRITE_APPEND adds to the file,
+ * CUTIL_FILE_WRITE_PREALLOCATE reserves the space up front and
+ * CUTIL_FILE_WRITE_CHECKSUM ends the file with a checksum
+ * @return Result
+ */
+Result cutil_write_file_iov(
+    const char *restrict path,
+    const CutilFileSegment *restrict segments,
+    const u32 count,
+    const u32 flags);
+
+/**
+ * @brief Replace the contents of a file, only writing the 4 KiB blocks that
+ * changed. Use it for large files that are saved often but change little, to
+ * save disk bandwidth. A crash part way through can leave a mix of old and new
+ * contents. See cutil_platform_write_file_delta.
+ *
+ * @param path the file path
+ * @param contents the new contents
+ * @param size the size of contents
+ * @param bytesWritten set to the number of bytes that were actually written,
+ * may be NULL
+ * @return Result
+ */
+Result cutil_write_file_delta(
+    const char *restrict path,
+    const void *restrict contents,
+    const u64 size,
+    u64 *restrict bytesWritten);
+
+/**
+ * @brief Compress the contents of a pointer and write them to a file. Read it
+ * back with cutil_read_file_compressed. Compression uses every cpu, and is
+ * much faster than the disk for data that compresses well. See compress.h.
+ *
+ * @param path the file path
+ * @param contents the data to compress
+ * @param size the amount of data to write
+ * @return Result
+ */
+Result cutil_write_file_compressed(
+    const char *restrict path, const void *restrict contents, const u64 size);
+
+/**
+ * @brief Write a very large file with direct I/O, so writing it does not fill
+ * the page cache. The throughput is recorded by the function timer. See
+ * cutil_platform_write_file_direct.
+ *
+ * @param path the file path
+ * @param contents the data to write, ideally from cutil_file_alloc_aligned
+ * @param size the amount of data to write
+ * @return Result
+ */
+Result cutil_write_file_direct(
+    const char *restrict path, const void *restrict contents, const u64 size);
+
+/**
+ * @brief Write the contents of a pointer to a file, atomically replacing the
+ * file and making sure the data is on disk before returning. Much slower than
+ * cutil_write_file_binary, but a crash can never leave a partly written file.
+ * See cutil_platform_write_file_atomic.
+ *
+ * @param path the file path
+ * @param contents the data to write
+ * @param size the amount of data to write
+ * @return Result
+ */
+Result cutil_write_file_atomic(
+    const char *restrict path, const void *restrict contents, const u64 size);
+
+/**
+ * @brief Atomically replace a file with several buffers, like
+ * cutil_write_file_atomic. Use it with CUTIL_FILE_WRITE_CHECKSUM for files
+ * such as checkpoints, that must never be half written and should be verified
+ * when they are read. See cutil_platform_write_file_atomic_iov.
+ *
+ * @param path the file path
+ * @param segments the buffers to write, in order
+ * @param count the number of segments
+ * @param flags CutilFileWriteFlags, only CUTIL_FILE_WRITE_CHECKSUM is used
+ * @return Result
+ */
+Result cutil_write_file_atomic_iov(
+    const char *restrict path,
+    const CutilFileSegment *restrict segments,
+    const u32 count,
+    const u32 flags);
+
+/**
+ * @brief Tracks a single write submitted to a CutilWriteQueue. It is owned by
+ * the caller, and must stay valid until the write completes.
+ */
+typedef struct CutilWriteFuture
+{
+    u32 done;      // set once the write has completed, use the functions below
+    Result result; // the result of the write, valid once done is set
+} CutilWriteFuture;
+
+/**
+ * @brief Counters used to size a CutilWriteQueue. If blockedSubmits keeps
+ * growing the queue is too small, or the disk cannot keep up.
+ */
+typedef struct CutilWriteQueueStats
+{
+    u32 capacity;       // maximum number of queued writes
+    u32 depth;          // writes currently queued or being written
+    u32 maxDepth;       // the highest depth seen
+    u64 submitted;      // writes handed to the queue
+    u64 completed;      // writes finished, including failures
+    u64 failed;         // writes that failed
+    u64 bytesWritten;   // bytes written by successful writes
+    u64 blockedSubmits; // submits that had to wait for a free slot
+    f64 blockedTime;    // seconds spent waiting for a free slot
+    u64 poolMisses;     // copies too large for a pooled buffer
+} CutilWriteQueueStats;
+
+// a bounded queue of writes drained by a background thread
+typedef struct CutilWriteQueue CutilWriteQueue;
+
+/**
+ * @brief Create a write behind queue. Writes submitted to it are performed
+ * with cutil_write_file_binary on a dedicated thread, in the order they were
+ * submitted.
+ *
+ * @param queue will be set to the new queue
+ * @param capacity the most writes that can be queued before submitting blocks
+ * @param poolBufferSize the size of each pooled buffer used by
+ * cutil_write_queue_submit_copy. Larger copies allocate their own buffer.
+ * @return Result
+ */
+Result cutil_write_queue_create(
+    CutilWriteQueue **queue, const u32 capacity, const u64 poolBufferSize);
+
+/**
+ * @brief Flush the queue, stop its thread and free it.
+ *
+ * @param queue the queue to destroy
+ */
+void cutil_write_queue_destroy(CutilWriteQueue *queue);
+
+/**
+ * @brief Queue a write of a copy of contents. contents can be reused as soon
+ * as this returns. Blocks while the queue is full.
+ *
+ * @param queue the queue
+ * @param path the file to write
+ * @param contents the data to write
+ * @param size the amount of data to write
+ * @param future can be NULL, otherwise it is updated when the write completes
+ * @return Result
+ */
+Result cutil_write_queue_submit_copy(
+    CutilWriteQueue *restrict queue,
+    const char *restrict path,
+    const void *restrict contents,
+    const u64 size,
+    CutilWriteFuture *restrict future);
+
+/**
+ * @brief Queue a write of contents, without copying it. The queue takes
+ * ownership of contents, which must come from malloc, and frees it once it
+ * has been written. Blocks while the queue is full.
+ *
+ * @param queue the queue
+ * @param path the file to write
+ * @param contents the data to write, freed by the queue
+ * @param size the amount of data to write
+ * @param future can be NULL, otherwise it is updated when the write completes
+ * @return Result
+ */
+Result cutil_write_queue_submit_owned(
+    CutilWriteQueue *restrict queue,
+    const char *restrict path,
+    void *restrict contents,
+    const u64 size,
+    CutilWriteFuture *restrict future);
+
+/**
+ * @brief Block until every write submitted before this call has completed.
+ *
+ * @param queue the queue to flush
+ * @return RS_FAILURE if any write failed since the last flush
+ */
+Result cutil_write_queue_flush(CutilWriteQueue *queue);
+
+/**
+ * @brief Check if a write has completed without blocking.
+ *
+ * @param future the future passed when submitting the write
+ * @return true the write has completed, and future->result is valid
+ */
+bool cutil_write_future_is_done(const CutilWriteFuture *future);
+
+/**
+ * @brief Block until a write has completed.
+ *
+ * @param queue the queue the write was submitted to
+ * @param future the future passed when submitting the write
+ * @return Result the result of the write
+ */
+Result cutil_write_future_wait(
+    CutilWriteQueue *restrict queue, CutilWriteFuture *restrict future);
+
+/**
+ * @brief Read the queues counters.
+ *
+ * @param queue the queue
+ * @return CutilWriteQueueStats
+ */
+CutilWriteQueueStats cutil_write_queue_get_stats(CutilWriteQueue *queue);
+
+/**
+ * @brief Copy a file. The data is copied by the kernel, or shared with the
+ * source file on filesystems that support it, so there is no size limit and
+ * nothing is read into memory. See cutil_platform_copy_file.
+ *
+ * @param dest the file to create or overwrite
+ * @param src the file to copy
+ * @return Result
+ */
+Result cutil_file_copy(const char *restrict dest, const char *restrict src);
 
 /**
  * @brief Create a folder with the name path. It is recursive.
@@ -0,0 +1,692 @@
+// Asynchronous batch reads declared in file.h
+//
+// On linux every file goes through openat -> read -> close on an io_uring, so
+// the device sees as many requests as the ring can hold. When io_uring is
+// missing (old kernels, or blocked by a sandbox) a pool of threads does the
+// same work with regular syscalls.
+
+#include "file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "messenger.h"
+#include "platform.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define min_value(a, b) (a < b ? a : b)
+
+// the most reads a ring keeps in flight
+#define BATCH_RING_ENTRIES 256
+// the most threads the fallback pool will start
+#define BATCH_MAX_THREADS 16
+
+//
+// Types
+//
+
+enum BatchSlotState
+{
+    SLOT_OPENING,
+    SLOT_READING,
+    SLOT_CLOSING,
+    SLOT_DONE,
+};
+
+struct BatchSlot
+{
+    char *path; // localized path
+    int fd;
+    enum BatchSlotState state;
+};
+
+#ifdef __linux__
+struct AsyncRing
+{
+    int fd;
+
+    u32 *sqHead;
+    u32 *sqTail;
+    u32 sqMask;
+    u32 *sqArray;
+    u32 sqEntries;
+    struct io_uring_sqe *sqes;
+
+    u32 *cqHead;
+    u32 *cqTail;
+    u32 cqMask;
+    struct io_uring_cqe *cqes;
+
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+
+    u32 pending;  // sqes queued but not yet passed to the kernel
+    u32 inFlight; // requests with an operation on the ring
+    u32 inKernel; // sqes passed to the kernel that have not completed
+};
+#endif
+
+struct CutilFileBatch
+{
+    CutilFileReadRequest *requests;
+    struct BatchSlot *slots;
+    u32 count;
+    u32 nextRequest; // the next request that has not been started
+
+    atomic_uint completed;
+    atomic_bool failed;
+
+    bool useRing;
+#ifdef __linux__
+    struct AsyncRing ring;
+#endif
+
+    pthread_t threads[BATCH_MAX_THREADS];
+    u32 threadCount;
+    atomic_uint nextThreadRequest;
+};
+
+//
+// Helper Declerations
+//
+
+// mark a request as done
+static void complete_request(
+    CutilFileBatch *batch, CutilFileReadRequest *request, Result result);
+
+// read a single request with blocking syscalls
+static void read_request_blocking(
+    CutilFileBatch *batch,
+    CutilFileReadRequest *request,
+    struct BatchSlot *slot);
+
+// thread pool worker
+static void *batch_worker(void *batch);
+
+#ifdef __linux__
+// create a ring, fails if io_uring or the needed operations are unsupported
+static Result ring_init(struct AsyncRing *ring, u32 entries);
+static void ring_destroy(struct AsyncRing *ring);
+
+// queue an sqe on the ring. the ring never fills up, because each request
+// has at most one operation queued
+static struct io_uring_sqe *ring_get_sqe(struct AsyncRing *ring);
+
+// pass queued sqes to the kernel, optionally waiting for a completion
+static Result ring_enter(struct AsyncRing *ring, u32 waitCount);
+
+// start requests until the ring is full
+static void ring_start_requests(CutilFileBatch *batch);
+
+// queue the next operation for a slot
+static void ring_queue_read(CutilFileBatch *batch, u32 index);
+static void ring_queue_close(CutilFileBatch *batch, u32 index);
+
+// handle every completion on the ring
+static void ring_reap(CutilFileBatch *batch);
+
+// wait for every operation the kernel took to complete without starting any
+// more, and remember the files they opened. Used when the ring fails, so the
+// kernel is done with the requests before they are given up on
+static void ring_drain(CutilFileBatch *batch);
+#endif
+
+//
+// Public methods
+//
+
+Result cutil_file_batch_submit(
+    CutilFileBatch **restrict batch,
+    CutilFileReadRequest *restrict requests,
+    const u32 count)
+{
+    *batch = NULL;
+
+    // localized paths are stored after the batch, in the same allocation
+    u64 pathBytes = 0;
+    for (u32 i = 0; i < count; i++)
+    {
+        u32 pathLength = 0;
+        cutil_platform_localize_file_name(
+            NULL, requests[i].filepath, &pathLength);
+        pathBytes += pathLength; // includes the terminator
+    }
+
+    const u64 slotsOffset = sizeof(CutilFileBatch);
+    const u64 pathsOffset = slotsOffset + sizeof(struct BatchSlot) * count;
+
+    CutilFileBatch *b = calloc(1, pathsOffset + pathBytes);
+    if (!b)
+    {
+        log_error("Failed to allocate file batch of %u requests", count);
+        return RS_FAILURE;
+    }
+
+    b->requests = requests;
+    b->count    = count;
+    b->slots    = (struct BatchSlot *)((u8 *)b + slotsOffset);
+
+    char *path = (char *)b + pathsOffset;
+    for (u32 i = 0; i < count; i++)
+    {
+        u32 pathLength = 0;
+        cutil_platform_localize_file_name(
+            NULL, requests[i].filepath, &pathLength);
+        cutil_platform_localize_file_name(
+            path, requests[i].filepath, &pathLength);
+
+        b->slots[i] = (struct BatchSlot){.path = path, .fd = -1};
+        requests[i].bytesRead = 0;
+        requests[i].result    = RS_SUCCESS;
+
+        path += pathLength;
+    }
+
+    *batch = b;
+
+    if (count == 0)
+        return RS_SUCCESS;
+
+#ifdef __linux__
+    if (ring_init(&b->ring, min_value(count, BATCH_RING_ENTRIES)) ==
+        RS_SUCCESS)
+    {
+        b->useRing = true;
+        ring_start_requests(b);
+        if (ring_enter(&b->ring, 0) == RS_SUCCESS)
+            return RS_SUCCESS;
+
+        // the kernel may have taken some of the opens before failing. Once
+        // they are done and their files closed, the pool starts over
+        ring_drain(b);
+        ring_destroy(&b->ring);
+        b->useRing     = false;
+        b->nextRequest = 0;
+        for (u32 i = 0; i < count; i++)
+        {
+            if (b->slots[i].fd != -1)
+                close(b->slots[i].fd);
+            b->slots[i].fd        = -1;
+            b->slots[i].state     = SLOT_OPENING;
+            requests[i].bytesRead = 0;
+            requests[i].result    = RS_SUCCESS;
+        }
+    }
+#endif
+
+    long cpuCount  = sysconf(_SC_NPROCESSORS_ONLN);
+    u32 maxThreads = cpuCount > 0 ? (u32)cpuCount * 2 : 4;
+    maxThreads     = min_value(maxThreads, BATCH_MAX_THREADS);
+
+    for (u32 i = 0; i < min_value(count, maxThreads); i++)
+    {
+        if (pthread_create(&b->threads[i], NULL, batch_worker, b))
+            break;
+        b->threadCount++;
+    }
+
+    // without any threads, do the work on this thread instead
+    if (b->threadCount == 0)
+        batch_worker(b);
+
+    return RS_SUCCESS;
+}
+
+u32 cutil_file_batch_poll(CutilFileBatch *batch)
+{
+#ifdef __linux__
+    if (batch->useRing)
+    {
+        ring_reap(batch);
+        ring_start_requests(batch);
+        if (batch->ring.pending)
+            ring_enter(&batch->ring, 0);
+    }
+#endif
+
+    return atomic_load_explicit(&batch->completed, memory_order_acquire);
+}
+
+Result cutil_file_batch_wait(CutilFileBatch *batch)
+{
+#ifdef __linux__
+    if (batch->useRing)
+    {
+        while (atomic_load(&batch->completed) < batch->count)
+        {
+            ring_start_requests(batch);
+            if (ring_enter(&batch->ring, 1))
+            {
+                // the ring is broken. Once the kernel is done with what it
+                // has, fail whatever was on it and finish the requests that
+                // were never started by hand
+                ring_drain(batch);
+                for (u32 i = 0; i < batch->nextRequest; i++)
+                {
+                    struct BatchSlot *slot = &batch->slots[i];
+                    if (slot->state == SLOT_DONE)
+                        continue;
+                    if (slot->fd != -1)
+                        close(slot->fd);
+                    complete_request(batch, &batch->requests[i], RS_FAILURE);
+                }
+                for (u32 i = batch->nextRequest; i < batch->count; i++)
+                    read_request_blocking(
+                        batch, &batch->requests[i], &batch->slots[i]);
+                break;
+            }
+            ring_reap(batch);
+        }
+        ring_destroy(&batch->ring);
+    }
+#endif
+
+    for (u32 i = 0; i < batch->threadCount; i++)
+        pthread_join(batch->threads[i], NULL);
+
+    const bool failed = atomic_load(&batch->failed);
+    free(batch);
+
+    return failed ? RS_FAILURE : RS_SUCCESS;
+}
+
+//
+// Helper implementations
+//
+
+static void complete_request(
+    CutilFileBatch *batch, CutilFileReadRequest *request, Result result)
+{
+    request->result = result;
+    if (result)
+        atomic_store(&batch->failed, true);
+    atomic_fetch_add_explicit(&batch->completed, 1, memory_order_release);
+}
+
+static void read_request_blocking(
+    CutilFileBatch *batch,
+    CutilFileReadRequest *request,
+    struct BatchSlot *slot)
+{
+    int fd = open(slot->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        log_perror("Failed to open file '%s'", slot->path);
+        complete_request(batch, request, RS_FAILURE);
+        return;
+    }
+
+    Result result = RS_SUCCESS;
+    while (request->bytesRead < request->size)
+    {
+        ssize_t n = pread(
+            fd,
+            (u8 *)request->dest + request->bytesRead,
+            request->size - request->bytesRead,
+            request->bytesRead);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+        {
+            log_perror("Failed to read file '%s'", slot->path);
+            result = RS_FAILURE;
+            break;
+        }
+        if (n == 0)
+            break;
+        request->bytesRead += n;
+    }
+
+    close(fd);
+    complete_request(batch, request, result);
+}
+
+static void *batch_worker(void *data)
+{
+    CutilFileBatch *batch = data;
+
+    for (;;)
+    {
+        u32 i = atomic_fetch_add(&batch->nextThreadRequest, 1);
+        if (i >= batch->count)
+            return NULL;
+        read_request_blocking(batch, &batch->requests[i], &batch->slots[i]);
+    }
+}
+
+#ifdef __linux__
+
+static Result ring_init(struct AsyncRing *ring, u32 entries)
+{
+    *ring = (struct AsyncRing){.fd = -1};
+
+    struct io_uring_params params = {0};
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd == -1)
+        return RS_FAILURE; // not an error, the thread pool is used instead
+    ring->fd = fd;
+
+    // openat and close were added after io_uring itself, make sure they exist
+    const u32 probeOps = 256;
+    struct io_uring_probe *probe = calloc(
+        1, sizeof(*probe) + probeOps * sizeof(struct io_uring_probe_op));
+    if (!probe || syscall(
+                      __NR_io_uring_register,
+                      fd,
+                      IORING_REGISTER_PROBE,
+                      probe,
+                      probeOps) == -1)
+    {
+        free(probe);
+        ring_destroy(ring);
+        return RS_FAILURE;
+    }
+
+    const u8 requiredOps[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE};
+    for (u32 i = 0; i < array_length(requiredOps); i++)
+    {
+        if (requiredOps[i] > probe->last_op ||
+            !(probe->ops[requiredOps[i]].flags & IO_URING_OP_SUPPORTED))
+        {
+            free(probe);
+            ring_destroy(ring);
+            return RS_FAILURE;
+        }
+    }
+    free(probe);
+
+    ring->sqRingSize =
+        params.sq_off.array + params.sq_entries * sizeof(u32);
+    ring->cqRingSize =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->sqRingSize = ring->cqRingSize =
+            ring->sqRingSize > ring->cqRingSize ? ring->sqRingSize
+                                                : ring->cqRingSize;
+
+    ring->sqRing = mmap(
+        NULL,
+        ring->sqRingSize,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        fd,
+        IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED)
+    {
+        ring->sqRing = NULL;
+        ring_destroy(ring);
+        return RS_FAILURE;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cqRing = ring->sqRing;
+    else
+    {
+        ring->cqRing = mmap(
+            NULL,
+            ring->cqRingSize,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            fd,
+            IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED)
+        {
+            ring->cqRing = NULL;
+            ring_destroy(ring);
+            return RS_FAILURE;
+        }
+    }
+
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes     = mmap(
+        NULL,
+        ring->sqesSize,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        fd,
+        IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        ring_destroy(ring);
+        return RS_FAILURE;
+    }
+
+    u8 *sq          = ring->sqRing;
+    u8 *cq          = ring->cqRing;
+    ring->sqHead    = (u32 *)(sq + params.sq_off.head);
+    ring->sqTail    = (u32 *)(sq + params.sq_off.tail);
+    ring->sqMask    = *(u32 *)(sq + params.sq_off.ring_mask);
+    ring->sqArray   = (u32 *)(sq + params.sq_off.array);
+    ring->sqEntries = params.sq_entries;
+    ring->cqHead    = (u32 *)(cq + params.cq_off.head);
+    ring->cqTail    = (u32 *)(cq + params.cq_off.tail);
+    ring->cqMask    = *(u32 *)(cq + params.cq_off.ring_mask);
+    ring->cqes      = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return RS_SUCCESS;
+}
+
+static void ring_destroy(struct AsyncRing *ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing && ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqRing)
+        munmap(ring->sqRing, ring->sqRingSize);
+    if (ring->fd != -1)
+        close(ring->fd);
+    *ring = (struct AsyncRing){.fd = -1};
+}
+
+static struct io_uring_sqe *ring_get_sqe(struct AsyncRing *ring)
+{
+    // only this thread writes the tail
+    const u32 tail = *ring->sqTail;
+    const u32 index = tail & ring->sqMask;
+
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return sqe;
+}
+
+static Result ring_enter(struct AsyncRing *ring, u32 waitCount)
+{
+    for (;;)
+    {
+        int submitted = syscall(
+            __NR_io_uring_enter,
+            ring->fd,
+            ring->pending,
+            waitCount,
+            waitCount ? IORING_ENTER_GETEVENTS : 0,
+            NULL,
+            0);
+        if (submitted == -1 && errno == EINTR)
+            continue;
+        if (submitted == -1)
+        {
+            log_perror("io_uring_enter failed");
+            return RS_FAILURE;
+        }
+
+        ring->pending -= min_value((u32)submitted, ring->pending);
+        ring->inKernel += submitted;
+        if (ring->pending == 0 || waitCount)
+            return RS_SUCCESS;
+    }
+}
+
+static void ring_start_requests(CutilFileBatch *batch)
+{
+    struct AsyncRing *ring = &batch->ring;
+
+    while (batch->nextRequest < batch->count &&
+           ring->inFlight + ring->pending < ring->sqEntries)
+    {
+        const u32 i           = batch->nextRequest++;
+        struct BatchSlot *slot = &batch->slots[i];
+
+        struct io_uring_sqe *sqe = ring_get_sqe(ring);
+        sqe->opcode              = IORING_OP_OPENAT;
+        sqe->fd                  = AT_FDCWD;
+        sqe->addr                = (u64)(uintptr_t)slot->path;
+        sqe->open_flags          = O_RDONLY | O_CLOEXEC;
+        sqe->user_data           = i;
+
+        slot->state = SLOT_OPENING;
+        ring->inFlight++;
+    }
+}
+
+static void ring_queue_read(CutilFileBatch *batch, u32 index)
+{
+    CutilFileReadRequest *request = &batch->requests[index];
+    struct BatchSlot *slot        = &batch->slots[index];
+
+    struct io_uring_sqe *sqe = ring_get_sqe(&batch->ring);
+    sqe->opcode              = IORING_OP_READ;
+    sqe->fd                  = slot->fd;
+    sqe->addr      = (u64)(uintptr_t)((u8 *)request->dest + request->bytesRead);
+    sqe->len       = min_value(request->size - request->bytesRead, 1u << 30);
+    sqe->off       = request->bytesRead;
+    sqe->user_data = index;
+
+    slot->state = SLOT_READING;
+}
+
+static void ring_queue_close(CutilFileBatch *batch, u32 index)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(&batch->ring);
+    sqe->opcode              = IORING_OP_CLOSE;
+    sqe->fd                  = batch->slots[index].fd;
+    sqe->user_data           = index;
+
+    batch->slots[index].state = SLOT_CLOSING;
+}
+
+static void ring_reap(CutilFileBatch *batch)
+{
+    struct AsyncRing *ring = &batch->ring;
+
+    u32 head       = *ring->cqHead;
+    const u32 tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+    {
+        const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqMask];
+        const u32 i                    = cqe->user_data;
+        const int res                  = cqe->res;
+        ring->inKernel--;
+
+        CutilFileReadRequest *request = &batch->requests[i];
+        struct BatchSlot *slot        = &batch->slots[i];
+
+        switch (slot->state)
+        {
+        case SLOT_OPENING:
+            if (res < 0)
+            {
+                errno = -res;
+                log_perror("Failed to open file '%s'", slot->path);
+                slot->state = SLOT_DONE;
+                ring->inFlight--;
+                complete_request(batch, request, RS_FAILURE);
+                break;
+            }
+            slot->fd = res;
+            if (request->size)
+                ring_queue_read(batch, i);
+            else
+                ring_queue_close(batch, i);
+            break;
+
+        case SLOT_READING:
+            if (res < 0)
+            {
+                errno = -res;
+                log_perror("Failed to read file '%s'", slot->path);
+                request->result = RS_FAILURE;
+                ring_queue_close(batch, i);
+                break;
+            }
+            request->bytesRead += res;
+            // a short read from a regular file means the end was reached
+            if (res == 0 || request->bytesRead >= request->size)
+                ring_queue_close(batch, i);
+            else
+                ring_queue_read(batch, i);
+            break;
+
+        case SLOT_CLOSING:
+            slot->fd    = -1;
+            slot->state = SLOT_DONE;
+            ring->inFlight--;
+            complete_request(batch, request, request->result);
+            break;
+
+        case SLOT_DONE:
+            break;
+        }
+    }
+
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+static void ring_drain(CutilFileBatch *batch)
+{
+    struct AsyncRing *ring = &batch->ring;
+
+    while (ring->inKernel)
+    {
+        // sqes that were queued but not taken stay on the ring
+        const int waited = syscall(
+            __NR_io_uring_enter,
+            ring->fd,
+            0,
+            1,
+            IORING_ENTER_GETEVENTS,
+            NULL,
+            0);
+
+        // completions still arrive while io_uring_enter fails, just slower
+        if (waited == -1 && errno != EINTR)
+            usleep(1000);
+
+        u32 head       = *ring->cqHead;
+        const u32 tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqMask];
+            struct BatchSlot *slot         = &batch->slots[cqe->user_data];
+            ring->inKernel--;
+
+            // the caller closes the files that are still open
+            if (slot->state == SLOT_OPENING && cqe->res >= 0)
+                slot->fd = cqe->res;
+            else if (slot->state == SLOT_CLOSING)
+                slot->fd = -1;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+}
+
+#endif // __linux__
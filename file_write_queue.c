@@ -0,0 +1,404 @@
+// Write behind queue declared in file.h
+//
+// Writes are stored in a fixed ring of slots and performed by one thread, so
+// they reach the disk in the order they were submitted. Copies go into a pool
+// of buffers that is allocated lazily and reused, and paths are kept in per
+// slot buffers that only grow, so steady state submits do not allocate.
+
+#include "file.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "messenger.h"
+#include "platform.h"
+
+//
+// Types
+//
+
+struct WriteSlot
+{
+    char *path;
+    u32 pathCapacity;
+
+    const void *contents;
+    u64 size;
+    void *owned;    // freed once the write completes
+    u8 *poolBuffer; // returned to the pool once the write completes
+
+    CutilWriteFuture *future;
+    bool ready;       // published, the io thread may write it
+    bool allocFailed; // no buffer could be allocated, fail the write
+};
+
+struct CutilWriteQueue
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;  // signaled when a write is queued
+    pthread_cond_t progress;  // signaled when a write completes
+
+    struct WriteSlot *slots;
+    u32 capacity;
+    u32 head; // next slot to write
+    u32 count;
+    bool running;
+
+    // slots ever reserved. Slots are written in the order they are reserved,
+    // which can differ from the order they are published in
+    u64 reserved;
+
+    // pooled buffers, allocated on first use
+    u8 **pool;
+    u32 poolCount;
+    u64 poolBufferSize;
+
+    bool failedSinceFlush;
+    CutilWriteQueueStats stats;
+};
+
+//
+// Helper Declerations
+//
+
+// the io thread
+static void *write_queue_thread(void *queue);
+
+// wait for a free slot and fill in its path. the lock must be held
+static struct WriteSlot *
+write_queue_reserve(CutilWriteQueue *queue, const char *path);
+
+// hand a reserved slot to the io thread. the lock must be held
+static void write_queue_publish(
+    CutilWriteQueue *queue, struct WriteSlot *slot, CutilWriteFuture *future);
+
+//
+// Public methods
+//
+
+Result cutil_write_queue_create(
+    CutilWriteQueue **queue, const u32 capacity, const u64 poolBufferSize)
+{
+    db_assert_msg(capacity, "Capacity cannot be 0");
+
+    *queue = NULL;
+
+    CutilWriteQueue *q = calloc(1, sizeof(CutilWriteQueue));
+    if (!q)
+        return RS_FAILURE;
+
+    q->slots = calloc(capacity, sizeof(struct WriteSlot));
+    q->pool  = calloc(capacity, sizeof(u8 *));
+    if (!q->slots || !q->pool)
+    {
+        log_error("Failed to allocate write queue of %u slots", capacity);
+        free(q->slots);
+        free(q->pool);
+        free(q);
+        return RS_FAILURE;
+    }
+
+    q->capacity       = capacity;
+    q->poolBufferSize = poolBufferSize;
+    q->running        = true;
+    q->stats.capacity = capacity;
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notEmpty, NULL);
+    pthread_cond_init(&q->progress, NULL);
+
+    if (pthread_create(&q->thread, NULL, write_queue_thread, q))
+    {
+        log_error("Failed to start write queue thread");
+        pthread_cond_destroy(&q->progress);
+        pthread_cond_destroy(&q->notEmpty);
+        pthread_mutex_destroy(&q->lock);
+        free(q->slots);
+        free(q->pool);
+        free(q);
+        return RS_FAILURE;
+    }
+
+    *queue = q;
+    return RS_SUCCESS;
+}
+
+void cutil_write_queue_destroy(CutilWriteQueue *queue)
+{
+    cutil_write_queue_flush(queue);
+
+    pthread_mutex_lock(&queue->lock);
+    queue->running = false;
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_join(queue->thread, NULL);
+
+    for (u32 i = 0; i < queue->capacity; i++)
+        free(queue->slots[i].path);
+    // every pooled buffer is back in the pool once the queue is flushed
+    for (u32 i = 0; i < queue->poolCount; i++)
+        free(queue->pool[i]);
+
+    pthread_cond_destroy(&queue->progress);
+    pthread_cond_destroy(&queue->notEmpty);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->slots);
+    free(queue->pool);
+    free(queue);
+}
+
+Result cutil_write_queue_submit_copy(
+    CutilWriteQueue *restrict queue,
+    const char *restrict path,
+    const void *restrict contents,
+    const u64 size,
+    CutilWriteFuture *restrict future)
+{
+    pthread_mutex_lock(&queue->lock);
+
+    struct WriteSlot *slot = write_queue_reserve(queue, path);
+    if (!slot)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        return RS_FAILURE;
+    }
+
+    u8 *buffer = NULL;
+    if (size <= queue->poolBufferSize)
+    {
+        // there is always a pooled buffer or room to make one, because at
+        // most capacity buffers can be in use
+        buffer = queue->poolCount ? queue->pool[--queue->poolCount]
+                                  : malloc(queue->poolBufferSize);
+        slot->poolBuffer = buffer;
+    }
+    else
+    {
+        buffer      = malloc(size);
+        slot->owned = buffer;
+        queue->stats.poolMisses++;
+    }
+
+    if (!buffer && size)
+    {
+        log_error(
+            "Failed to allocate %llu byte write buffer",
+            (unsigned long long)size);
+        // the slot is already reserved, so it is published as a failed write
+        slot->poolBuffer  = NULL;
+        slot->owned       = NULL;
+        slot->allocFailed = true;
+        write_queue_publish(queue, slot, future);
+        pthread_mutex_unlock(&queue->lock);
+        return RS_FAILURE;
+    }
+
+    // the copy happens outside the lock, the slot is not visible to the io
+    // thread until it is published
+    pthread_mutex_unlock(&queue->lock);
+    memcpy(buffer, contents, size);
+    pthread_mutex_lock(&queue->lock);
+
+    slot->contents = buffer;
+    slot->size     = size;
+    write_queue_publish(queue, slot, future);
+
+    pthread_mutex_unlock(&queue->lock);
+    return RS_SUCCESS;
+}
+
+Result cutil_write_queue_submit_owned(
+    CutilWriteQueue *restrict queue,
+    const char *restrict path,
+    void *restrict contents,
+    const u64 size,
+    CutilWriteFuture *restrict future)
+{
+    pthread_mutex_lock(&queue->lock);
+
+    struct WriteSlot *slot = write_queue_reserve(queue, path);
+    if (!slot)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        free(contents);
+        return RS_FAILURE;
+    }
+
+    slot->contents = contents;
+    slot->size     = size;
+    slot->owned    = contents;
+    write_queue_publish(queue, slot, future);
+
+    pthread_mutex_unlock(&queue->lock);
+    return RS_SUCCESS;
+}
+
+Result cutil_write_queue_flush(CutilWriteQueue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+
+    // writes are completed in the order their slots were reserved, so
+    // waiting for the count of completed writes to reach the count of
+    // reserved slots covers every write submitted before the call, including
+    // copies that were not published yet
+    const u64 target = queue->reserved;
+    while (queue->stats.completed < target)
+        pthread_cond_wait(&queue->progress, &queue->lock);
+
+    const bool failed       = queue->failedSinceFlush;
+    queue->failedSinceFlush = false;
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return failed ? RS_FAILURE : RS_SUCCESS;
+}
+
+bool cutil_write_future_is_done(const CutilWriteFuture *future)
+{
+    return __atomic_load_n(&future->done, __ATOMIC_ACQUIRE);
+}
+
+Result cutil_write_future_wait(
+    CutilWriteQueue *restrict queue, CutilWriteFuture *restrict future)
+{
+    if (!cutil_write_future_is_done(future))
+    {
+        pthread_mutex_lock(&queue->lock);
+        while (!cutil_write_future_is_done(future))
+            pthread_cond_wait(&queue->progress, &queue->lock);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    return future->result;
+}
+
+CutilWriteQueueStats cutil_write_queue_get_stats(CutilWriteQueue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    CutilWriteQueueStats stats = queue->stats;
+    pthread_mutex_unlock(&queue->lock);
+    return stats;
+}
+
+//
+// Helper implementations
+//
+
+static struct WriteSlot *
+write_queue_reserve(CutilWriteQueue *queue, const char *path)
+{
+    if (queue->count == queue->capacity)
+    {
+        const f64 start = cutil_platform_get_time();
+        queue->stats.blockedSubmits++;
+        while (queue->count == queue->capacity)
+            pthread_cond_wait(&queue->progress, &queue->lock);
+        queue->stats.blockedTime += cutil_platform_get_time() - start;
+    }
+
+    struct WriteSlot *slot =
+        &queue->slots[(queue->head + queue->count) % queue->capacity];
+
+    const u32 pathLength = strlen(path) + 1;
+    if (pathLength > slot->pathCapacity)
+    {
+        char *newPath = realloc(slot->path, pathLength);
+        if (!newPath)
+        {
+            log_error("Failed to store path '%s'", path);
+            return NULL;
+        }
+        slot->path         = newPath;
+        slot->pathCapacity = pathLength;
+    }
+    memcpy(slot->path, path, pathLength);
+
+    slot->contents    = NULL;
+    slot->size        = 0;
+    slot->owned       = NULL;
+    slot->poolBuffer  = NULL;
+    slot->ready       = false;
+    slot->allocFailed = false;
+
+    // keep the slot reserved while the lock is dropped for copying
+    queue->count++;
+    queue->reserved++;
+    return slot;
+}
+
+static void write_queue_publish(
+    CutilWriteQueue *queue, struct WriteSlot *slot, CutilWriteFuture *future)
+{
+    if (future)
+        *future = (CutilWriteFuture){0};
+    slot->future = future;
+    slot->ready  = true;
+
+    queue->stats.submitted++;
+    queue->stats.depth = queue->count;
+    if (queue->stats.depth > queue->stats.maxDepth)
+        queue->stats.maxDepth = queue->stats.depth;
+
+    pthread_cond_signal(&queue->notEmpty);
+}
+
+static void *write_queue_thread(void *data)
+{
+    CutilWriteQueue *queue = data;
+
+    pthread_mutex_lock(&queue->lock);
+    for (;;)
+    {
+        // a slot can be reserved while its contents are still being copied,
+        // so wait for the slot at the head to be published
+        struct WriteSlot *slot = &queue->slots[queue->head];
+        while (!(queue->count && slot->ready) &&
+               (queue->running || queue->count))
+            pthread_cond_wait(&queue->notEmpty, &queue->lock);
+
+        if (!queue->count)
+            break;
+
+        pthread_mutex_unlock(&queue->lock);
+
+        const Result result =
+            slot->allocFailed
+                ? RS_FAILURE
+                : cutil_write_file_binary(
+                      slot->path, slot->contents, slot->size);
+
+        pthread_mutex_lock(&queue->lock);
+
+        free(slot->owned);
+        if (slot->poolBuffer)
+            queue->pool[queue->poolCount++] = slot->poolBuffer;
+
+        if (slot->future)
+        {
+            slot->future->result = result;
+            __atomic_store_n(&slot->future->done, 1, __ATOMIC_RELEASE);
+        }
+
+        queue->stats.completed++;
+        if (result)
+        {
+            queue->stats.failed++;
+            queue->failedSinceFlush = true;
+        }
+        else
+            queue->stats.bytesWritten += slot->size;
+
+        slot->ready = false;
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        queue->stats.depth = queue->count;
+
+        pthread_cond_broadcast(&queue->progress);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
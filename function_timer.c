@@ -1,5 +1,6 @@
 #include "function_timer.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -29,6 +30,7 @@ struct TimerData
     // remember blank
     u64 totalExecutionCount; // used for average
     f64 totalExecutionTime;  // used for average
+    u64 totalBytes;          // used for throughput, 0 if it was not timed
 };
 
 struct FunctionListNode_t
@@ -41,19 +43,22 @@ struct
 {
     bool initialized;
 
+    // library io paths time themselves, so timers can end on any thread
+    pthread_mutex_t lock;
     LIST_HEAD(FunctionListHead_t, FunctionListNode_t) functions;
 
-} g_timerData = {};
+} g_timerData = {.lock = PTHREAD_MUTEX_INITIALIZER};
 
 //
 // Helper Declerations
 //
 
 // update avg, min and max for an existing element
-void add_data_point(struct FunctionListNode_t *node, f64 executionTime);
+void add_data_point(
+    struct FunctionListNode_t *node, f64 executionTime, u64 bytes);
 
 // add a new element to the list
-void add_new_element(const char *name, f64 executionTime);
+void add_new_element(const char *name, f64 executionTime, u64 bytes);
 
 // check to see if a node has been created, if so get a reference
 struct FunctionListNode_t *find_function_data(const char *functionName);
@@ -85,6 +90,8 @@ void __attribute__((destructor)) terminate_timer(void)
 {
     // TODO
 
+    pthread_mutex_lock(&g_timerData.lock);
+
     // write data to file
     export_list_to_file(&g_timerData.functions, FUNCTION_TIMER_CACHE);
 
@@ -98,6 +105,8 @@ void __attribute__((destructor)) terminate_timer(void)
     };
 
     g_timerData.initialized = false;
+
+    pthread_mutex_unlock(&g_timerData.lock);
 }
 
 #endif
@@ -124,7 +133,9 @@ struct FunctionTimerData start_timer(const char *func)
     return t;
 }
 
-void end_timer(struct FunctionTimerData t)
+void end_timer(struct FunctionTimerData t) { end_timer_bytes(t, 0); }
+
+void end_timer_bytes(struct FunctionTimerData t, unsigned long long bytes)
 {
 
     if (!g_timerData.initialized)
@@ -144,16 +155,20 @@ void end_timer(struct FunctionTimerData t)
 
     const f64 executionTime = sec_to_ms(endTime - t.startTime);
 
+    pthread_mutex_lock(&g_timerData.lock);
+
     struct FunctionListNode_t *node = find_function_data(t.functionName);
 
     if (node)
     {
-        add_data_point(node, executionTime);
+        add_data_point(node, executionTime, bytes);
     }
     else
     {
-        add_new_element(t.functionName, executionTime);
+        add_new_element(t.functionName, executionTime, bytes);
     }
+
+    pthread_mutex_unlock(&g_timerData.lock);
 }
 
 //
@@ -162,21 +177,29 @@ void end_timer(struct FunctionTimerData t)
 
 void create_timer_string(char *restrict buf, struct TimerData data)
 {
-    // func,avgTime,maxTime,minTime, ,totalExecutionCount,totalExecutionTime
+    // MB/s, from bytes per ms
+    f64 throughput = 0;
+    if (data.totalExecutionTime > 0)
+        throughput = data.totalBytes / data.totalExecutionTime / 1000;
+
+    // func,avgTime,maxTime,minTime,throughput
     snprintf(
         buf,
         LINE_LENGTH_BUFFER,
-        "%s,%f,%f,%f\n",
+        "%s,%f,%f,%f,%f\n",
         data.functionName,
         data.avgTime,
         data.maxTime,
-        data.minTime);
+        data.minTime,
+        throughput);
 }
 
-void add_data_point(struct FunctionListNode_t *node, f64 executionTime)
+void add_data_point(
+    struct FunctionListNode_t *node, f64 executionTime, u64 bytes)
 {
     struct TimerData *data = &node->timerData;
 
+    data->totalBytes += bytes;
     data->totalExecutionTime += executionTime;
     data->totalExecutionCount++;
     data->avgTime = data->totalExecutionTime / data->totalExecutionCount;
@@ -186,7 +209,7 @@ void add_data_point(struct FunctionListNode_t *node, f64 executionTime)
 }
 
 // add a new element to the list
-void add_new_element(const char *name, f64 executionTime)
+void add_new_element(const char *name, f64 executionTime, u64 bytes)
 {
     struct FunctionListNode_t *node = malloc(sizeof(struct FunctionListNode_t));
     node->timerData                 = (struct TimerData){
@@ -195,7 +218,8 @@ void add_new_element(const char *name, f64 executionTime)
                         .maxTime             = executionTime,
                         .minTime             = executionTime,
                         .totalExecutionCount = 1,
-                        .totalExecutionTime  = executionTime};
+                        .totalExecutionTime  = executionTime,
+                        .totalBytes          = bytes};
     strncpy(node->timerData.functionName, name, FUNCTION_LENGTH_BUFFER);
 
     LIST_INSERT_HEAD(&g_timerData.functions, node, data);
@@ -230,8 +254,13 @@ void export_list_to_file(
     cutil_platform_localize_file_name(path, filepath, &pathLength);
 
     FILE *file = fopen(path, "w");
-    fprintf(file, "Function Name,Avg Time(CPU ticks),Max Time, Min Time\n");
-    fprintf(file, "Function Name,Avg Time(ms),Max Time(ms), Min Time(ms)\n");
+    fprintf(
+        file,
+        "Function Name,Avg Time(CPU ticks),Max Time, Min Time,Throughput\n");
+    fprintf(
+        file,
+        "Function Name,Avg Time(ms),Max Time(ms), Min Time(ms),"
+        "Throughput(MB/s)\n");
 
     printf("Data:");
     // write each element to string
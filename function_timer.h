@@ -54,11 +54,33 @@
     } while (0)
 #endif
 
+/**
+ * @brief time a function that moves data, and set variable to be the return
+ * of the function. bytes is read after the function returns, and the
+ * throughput is added to the spreadsheet.
+ *
+ */
+#ifndef FUNCTION_TIMER_NO_DIAGNOSTIC
+#define time_function_throughput(function, variable, bytes)  \
+    do                                                       \
+    {                                                        \
+        struct FunctionTimerData t = start_timer(#function); \
+        variable                   = function;               \
+        end_timer_bytes(t, bytes);                           \
+    } while (0)
+#else
+#define time_function_throughput(function, variable, bytes) \
+    do                                                      \
+    {                                                       \
+        variable = function;                                \
+    } while (0)
+#endif
+
 #ifndef FUNCTION_TIMER_NO_DIAGNOSTIC
 
 struct FunctionTimerData
 {
-    unsigned long long startTime;
+    double startTime;
     char functionName[128];
 };
 
@@ -79,4 +101,14 @@ struct FunctionTimerData start_timer(const char *func);
  */
 void end_timer(struct FunctionTimerData t);
 
+/**
+ * @brief End the function timer and store data, including the amount of data
+ * the function moved, so its throughput can be calculated.
+ *
+ * @param t the object returned by start_timer, to calulate duration
+ * @param bytes the number of bytes the function read or wrote
+ *
+ */
+void end_timer_bytes(struct FunctionTimerData t, unsigned long long bytes);
+
 #endif
@@ -0,0 +1,496 @@
+#include "hash.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "messenger.h"
+
+#define min_value(a, b) (a < b ? a : b)
+
+#ifdef __SIZEOF_INT128__
+__extension__ typedef unsigned __int128 u128;
+#endif
+
+#define PRIME32_1 0x9e3779b1u
+#define PRIME32_2 0x85ebca77u
+#define PRIME32_3 0xc2b2ae3du
+#define PRIME64_1 0x9e3779b185ebca87ull
+#define PRIME64_2 0xc2b2ae3d27d4eb4full
+#define PRIME64_3 0x165667b19e3779f9ull
+#define PRIME64_4 0x85ebca77c2b2ae63ull
+#define PRIME64_5 0x27d4eb2f165667c5ull
+
+// inputs up to this size are mixed directly, larger ones use accumulators
+#define SHORT_LENGTH 128
+
+#define STRIPE_LENGTH 64
+#define STRIPE_LANES 8
+// the accumulators are scrambled after this many stripes
+#define BLOCK_STRIPES 16
+#define SECRET_LANES 24
+
+// the most threads the parallel functions use
+#define HASH_MAX_THREADS 64
+
+//
+// Types
+//
+
+// mixes a run of stripes into the accumulators, each with the next key
+typedef void (*AccumulateFunction)(
+    u64 *restrict acc, const u8 *restrict data, u32 stripes, const u64 *key);
+typedef void (*ScrambleFunction)(u64 *restrict acc, const u64 *restrict key);
+
+struct HashJob
+{
+    atomic_ullong nextChunk;
+    const u8 *data;
+    u64 length;
+    u64 chunkCount;
+    CutilHash128 *chunkHashes;
+};
+
+// random keys the input is mixed with. Seeds are added to them
+static const u64 g_secret[SECRET_LANES] = {
+    0x2cb0f69f4abea221ull, 0x9417034723148989ull, 0xdd555950609dfe03ull,
+    0xdbafb150deb12800ull, 0x7e789b2e6c442cb6ull, 0xf41e5636c7e4f8c4ull,
+    0x0959d150f8fba7e4ull, 0xa97316f13cdb9eeaull, 0x74cd8258f9520068ull,
+    0x55c74a62e116868bull, 0xd2f4c799a2023cbdull, 0xdf98cb79a37b51b9ull,
+    0x396f5885524f3905ull, 0xaf1d56386ca3b276ull, 0xa9ffbe6b5104e85aull,
+    0x6bd0c51b9fd533b3ull, 0x980ce91c50ab4b56ull, 0x28ac395780fe62c5ull,
+    0x768912e3a6bcedc7ull, 0x50b3e8c9332c7c88ull, 0xce3bbfe520bd47daull,
+    0xcba6c8e8e0bb7c4full, 0xbf194db8434a346dull, 0x7d8f2a7b60416d7full,
+};
+
+// the fastest accumulate and scramble the cpu supports, see init_dispatch
+static AccumulateFunction g_accumulate = NULL;
+static ScrambleFunction g_scramble     = NULL;
+static pthread_once_t g_dispatchOnce   = PTHREAD_ONCE_INIT;
+
+//
+// Helper Declerations
+//
+
+static u64 read_u64(const u8 *p);
+static u32 read_u32(const u8 *p);
+
+// multiply two 64 bit numbers, and xor the halves of the 128 bit result
+static u64 multiply_fold(u64 a, u64 b);
+
+// spread the bits of the final hash
+static u64 avalanche(u64 hash);
+
+static u64 hash_short(const u8 *data, u64 length, u64 seed);
+
+// fill the accumulators, and return the seeded secret in secret
+static void hash_long(
+    u64 acc[STRIPE_LANES],
+    u64 secret[SECRET_LANES],
+    const u8 *data,
+    u64 length,
+    u64 seed);
+
+// reduce the accumulators into 64 bits
+static u64 merge_accumulators(const u64 *acc, const u64 *secret, u64 start);
+
+static void accumulate_scalar(
+    u64 *restrict acc, const u8 *restrict data, u32 stripes, const u64 *key);
+static void scramble_scalar(u64 *restrict acc, const u64 *restrict key);
+
+static void *hash_worker(void *job);
+
+// pick the accumulate and scramble functions
+static void init_dispatch(void);
+
+//
+// Public methods
+//
+
+u64 cutil_hash64(const void *data, const u64 length, const u64 seed)
+{
+    if (length <= SHORT_LENGTH)
+        return hash_short(data, length, seed);
+
+    u64 acc[STRIPE_LANES];
+    u64 secret[SECRET_LANES];
+    hash_long(acc, secret, data, length, seed);
+    return merge_accumulators(acc, secret + 1, length * PRIME64_1);
+}
+
+CutilHash128 cutil_hash128(const void *data, const u64 length, const u64 seed)
+{
+    if (length <= SHORT_LENGTH)
+        return (CutilHash128){
+            .low  = hash_short(data, length, seed),
+            .high = hash_short(data, length, seed + PRIME64_5),
+        };
+
+    u64 acc[STRIPE_LANES];
+    u64 secret[SECRET_LANES];
+    hash_long(acc, secret, data, length, seed);
+    return (CutilHash128){
+        .low  = merge_accumulators(acc, secret + 1, length * PRIME64_1),
+        .high = merge_accumulators(acc, secret + 13, ~(length * PRIME64_2)),
+    };
+}
+
+CutilHash128 cutil_hash128_parallel(
+    const void *data, const u64 length, u32 threadCount)
+{
+    CutilHash128 hash;
+    if (cutil_hash128_parallel_checked(data, length, threadCount, &hash))
+        return (CutilHash128){0};
+    return hash;
+}
+
+Result cutil_hash128_parallel_checked(
+    const void *restrict data,
+    const u64 length,
+    u32 threadCount,
+    CutilHash128 *restrict hash)
+{
+    if (length <= CUTIL_HASH_CHUNK_SIZE)
+    {
+        *hash = cutil_hash128(data, length, 0);
+        return RS_SUCCESS;
+    }
+
+    struct HashJob job = {
+        .data       = data,
+        .length     = length,
+        .chunkCount = (length + CUTIL_HASH_CHUNK_SIZE - 1) /
+                      CUTIL_HASH_CHUNK_SIZE,
+    };
+
+    job.chunkHashes = malloc(job.chunkCount * sizeof(CutilHash128));
+    if (!job.chunkHashes)
+    {
+        log_error("Failed to hash %llu bytes", (unsigned long long)length);
+        return RS_FAILURE;
+    }
+
+    if (threadCount == 0)
+    {
+        long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount   = cpuCount > 0 ? cpuCount : 1;
+    }
+    threadCount = min_value(threadCount, HASH_MAX_THREADS);
+    threadCount = min_value(threadCount, job.chunkCount);
+
+    // this thread is one of the workers
+    pthread_t threads[HASH_MAX_THREADS];
+    u32 started = 0;
+    for (; started + 1 < threadCount; started++)
+        if (pthread_create(&threads[started], NULL, hash_worker, &job))
+            break;
+
+    hash_worker(&job);
+
+    for (u32 i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    // the chunk hashes are hashed together, seeded with the length
+    *hash = cutil_hash128(
+        job.chunkHashes, job.chunkCount * sizeof(CutilHash128), length);
+
+    free(job.chunkHashes);
+    return RS_SUCCESS;
+}
+
+bool cutil_hash128_equal(const CutilHash128 a, const CutilHash128 b)
+{
+    return a.low == b.low && a.high == b.high;
+}
+
+//
+// Helper implementations
+//
+
+static u64 read_u64(const u8 *p)
+{
+    u64 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static u32 read_u32(const u8 *p)
+{
+    u32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static u64 multiply_fold(u64 a, u64 b)
+{
+#ifdef __SIZEOF_INT128__
+    const u128 product = (u128)a * b;
+    return (u64)product ^ (u64)(product >> 64);
+#else
+    const u64 lowLow   = (a & 0xffffffff) * (b & 0xffffffff);
+    const u64 highLow  = (a >> 32) * (b & 0xffffffff);
+    const u64 lowHigh  = (a & 0xffffffff) * (b >> 32);
+    const u64 highHigh = (a >> 32) * (b >> 32);
+    const u64 cross = (lowLow >> 32) + (highLow & 0xffffffff) + lowHigh;
+    const u64 upper = (highLow >> 32) + (cross >> 32) + highHigh;
+    const u64 lower = (cross << 32) | (lowLow & 0xffffffff);
+    return lower ^ upper;
+#endif
+}
+
+static u64 avalanche(u64 hash)
+{
+    hash ^= hash >> 37;
+    hash *= 0x165667919e3779f9ull;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// mix 16 bytes with two keys
+static u64 mix16(const u8 *data, const u64 *key, u64 seed)
+{
+    return multiply_fold(
+        read_u64(data) ^ (key[0] + seed), read_u64(data + 8) ^ (key[1] - seed));
+}
+
+static u64 hash_short(const u8 *data, u64 length, u64 seed)
+{
+    const u64 *key = g_secret;
+
+    if (length > 16)
+    {
+        // 16 byte pieces from both ends, so every byte is used at least once
+        u64 acc = length * PRIME64_1;
+        if (length > 32)
+        {
+            if (length > 64)
+            {
+                if (length > 96)
+                {
+                    acc += mix16(data + 48, key + 12, seed);
+                    acc += mix16(data + length - 64, key + 14, seed);
+                }
+                acc += mix16(data + 32, key + 8, seed);
+                acc += mix16(data + length - 48, key + 10, seed);
+            }
+            acc += mix16(data + 16, key + 4, seed);
+            acc += mix16(data + length - 32, key + 6, seed);
+        }
+        acc += mix16(data, key, seed);
+        acc += mix16(data + length - 16, key + 2, seed);
+        return avalanche(acc);
+    }
+
+    if (length > 8)
+    {
+        const u64 low  = read_u64(data) ^ (key[0] + seed);
+        const u64 high = read_u64(data + length - 8) ^ (key[1] - seed);
+        const u64 acc =
+            length + __builtin_bswap64(low) + high + multiply_fold(low, high);
+        return avalanche(acc);
+    }
+
+    if (length >= 4)
+    {
+        const u64 joined =
+            read_u32(data + length - 4) + ((u64)read_u32(data) << 32);
+        u64 hash = joined ^ (key[2] - seed);
+
+        hash ^= ((hash << 49) | (hash >> 15)) ^ ((hash << 24) | (hash >> 40));
+        hash *= 0x9fb21c651e98df25ull;
+        hash ^= (hash >> 35) + length;
+        hash *= 0x9fb21c651e98df25ull;
+        return hash ^ (hash >> 28);
+    }
+
+    u64 hash = key[4] ^ seed;
+    if (length)
+    {
+        const u32 joined = ((u32)data[0] << 16) |
+                           ((u32)data[length >> 1] << 24) |
+                           data[length - 1] | ((u32)length << 8);
+        hash = joined ^ ((u32)key[3] + seed);
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static void accumulate_scalar(
+    u64 *restrict acc, const u8 *restrict data, u32 stripes, const u64 *key)
+{
+    for (u32 s = 0; s < stripes; s++)
+    {
+        const u8 *stripe = data + s * STRIPE_LENGTH;
+        for (u32 i = 0; i < STRIPE_LANES; i++)
+        {
+            const u64 value = read_u64(stripe + i * 8);
+            const u64 keyed = value ^ key[s + i];
+            acc[i ^ 1] += value;
+            acc[i] += (keyed & 0xffffffff) * (keyed >> 32);
+        }
+    }
+}
+
+static void scramble_scalar(u64 *restrict acc, const u64 *restrict key)
+{
+    for (u32 i = 0; i < STRIPE_LANES; i++)
+    {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= key[i];
+        acc[i] *= PRIME32_1;
+    }
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2"))) static void accumulate_avx2(
+    u64 *restrict acc, const u8 *restrict data, u32 stripes, const u64 *key)
+{
+    __m256i acc0 = _mm256_loadu_si256((const __m256i *)acc);
+    __m256i acc1 = _mm256_loadu_si256((const __m256i *)(acc + 4));
+
+    for (u32 s = 0; s < stripes; s++)
+    {
+        const u8 *stripe = data + s * STRIPE_LENGTH;
+        __m256i value0   = _mm256_loadu_si256((const __m256i *)stripe);
+        __m256i value1   = _mm256_loadu_si256((const __m256i *)(stripe + 32));
+        __m256i key0     = _mm256_loadu_si256((const __m256i *)(key + s));
+        __m256i key1     = _mm256_loadu_si256((const __m256i *)(key + s + 4));
+
+        __m256i keyed0 = _mm256_xor_si256(value0, key0);
+        __m256i keyed1 = _mm256_xor_si256(value1, key1);
+
+        // low half of each lane times the high half
+        __m256i product0 =
+            _mm256_mul_epu32(keyed0, _mm256_srli_epi64(keyed0, 32));
+        __m256i product1 =
+            _mm256_mul_epu32(keyed1, _mm256_srli_epi64(keyed1, 32));
+
+        // each lane is added to its neighbour
+        acc0 = _mm256_add_epi64(
+            acc0, _mm256_shuffle_epi32(value0, _MM_SHUFFLE(1, 0, 3, 2)));
+        acc1 = _mm256_add_epi64(
+            acc1, _mm256_shuffle_epi32(value1, _MM_SHUFFLE(1, 0, 3, 2)));
+        acc0 = _mm256_add_epi64(acc0, product0);
+        acc1 = _mm256_add_epi64(acc1, product1);
+    }
+
+    _mm256_storeu_si256((__m256i *)acc, acc0);
+    _mm256_storeu_si256((__m256i *)(acc + 4), acc1);
+}
+
+__attribute__((target("avx2"))) static void
+scramble_avx2(u64 *restrict acc, const u64 *restrict key)
+{
+    const __m256i prime = _mm256_set1_epi32(PRIME32_1);
+
+    for (u32 i = 0; i < STRIPE_LANES; i += 4)
+    {
+        __m256i lanes = _mm256_loadu_si256((const __m256i *)(acc + i));
+        lanes         = _mm256_xor_si256(lanes, _mm256_srli_epi64(lanes, 47));
+        lanes         = _mm256_xor_si256(
+            lanes, _mm256_loadu_si256((const __m256i *)(key + i)));
+
+        // 64 bit multiply by a 32 bit number, from two 32 bit multiplies
+        __m256i low  = _mm256_mul_epu32(lanes, prime);
+        __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(lanes, 32), prime);
+        lanes        = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+
+        _mm256_storeu_si256((__m256i *)(acc + i), lanes);
+    }
+}
+#endif
+
+static void init_dispatch(void)
+{
+    g_scramble   = scramble_scalar;
+    g_accumulate = accumulate_scalar;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        g_scramble   = scramble_avx2;
+        g_accumulate = accumulate_avx2;
+    }
+#endif
+}
+
+static void hash_long(
+    u64 acc[STRIPE_LANES],
+    u64 secret[SECRET_LANES],
+    const u8 *data,
+    u64 length,
+    u64 seed)
+{
+    // the parallel hashes can get here from several threads at once
+    pthread_once(&g_dispatchOnce, init_dispatch);
+    const AccumulateFunction accumulate = g_accumulate;
+    const ScrambleFunction scramble     = g_scramble;
+
+    const u64 initial[STRIPE_LANES] = {
+        PRIME32_3,
+        PRIME64_1,
+        PRIME64_2,
+        PRIME64_3,
+        PRIME64_4,
+        PRIME32_2,
+        PRIME64_5,
+        PRIME32_1,
+    };
+    memcpy(acc, initial, sizeof(initial));
+
+    for (u32 i = 0; i < SECRET_LANES; i++)
+        secret[i] = g_secret[i] + (i & 1 ? -seed : seed);
+
+    const u64 blockLength = STRIPE_LENGTH * BLOCK_STRIPES;
+    const u64 blockCount  = (length - 1) / blockLength;
+
+    for (u64 b = 0; b < blockCount; b++)
+    {
+        accumulate(acc, data + b * blockLength, BLOCK_STRIPES, secret);
+        scramble(acc, secret + SECRET_LANES - STRIPE_LANES);
+    }
+
+    // the last stripe always ends at the end of the data, so it may overlap
+    const u64 rest    = length - blockCount * blockLength;
+    const u32 stripes = (rest - 1) / STRIPE_LENGTH;
+    accumulate(acc, data + blockCount * blockLength, stripes, secret);
+    accumulate(acc, data + length - STRIPE_LENGTH, 1, secret + 15);
+}
+
+static u64 merge_accumulators(const u64 *acc, const u64 *secret, u64 start)
+{
+    u64 result = start;
+    for (u32 i = 0; i < STRIPE_LANES; i += 2)
+        result += multiply_fold(acc[i] ^ secret[i], acc[i + 1] ^ secret[i + 1]);
+    return avalanche(result);
+}
+
+static void *hash_worker(void *data)
+{
+    struct HashJob *job = data;
+
+    for (;;)
+    {
+        const u64 i = atomic_fetch_add(&job->nextChunk, 1);
+        if (i >= job->chunkCount)
+            break;
+
+        const u64 start = i * CUTIL_HASH_CHUNK_SIZE;
+        job->chunkHashes[i] = cutil_hash128(
+            job->data + start,
+            min_value(CUTIL_HASH_CHUNK_SIZE, job->length - start),
+            0);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+// Fast content hashing
+//
+// A non cryptographic hash in the style of XXH3. Large inputs are hashed 64
+// bytes at a time into eight accumulators, using AVX2 when the cpu supports
+// it, so hashing runs at about the speed memory can be read. It is meant to
+// tell if contents changed, for example to validate caches, not for security.
+//
+// Kael Johnston
+
+#include "types.h"
+
+// inputs larger than this are hashed in chunks by the parallel functions
+#define CUTIL_HASH_CHUNK_SIZE (4 * 1024 * 1024)
+
+typedef struct CutilHash128
+{
+    u64 low;
+    u64 high;
+} CutilHash128;
+
+/**
+ * Hash a buffer into 64 bits.
+ *
+ * @param data the data to hash, may be NULL if length is 0
+ * @param length the size of data
+ * @param seed changes the result, use 0 if there is no need for it
+ *
+ * @return the hash
+ *
+ * @author Kael Johnston
+ */
+u64 cutil_hash64(const void *data, const u64 length, const u64 seed);
+
+/**
+ * Hash a buffer into 128 bits. It is a little slower than cutil_hash64, but
+ * collisions are practically impossible, even with many hashes.
+ *
+ * @param data the data to hash, may be NULL if length is 0
+ * @param length the size of data
+ * @param seed changes the result, use 0 if there is no need for it
+ *
+ * @return the hash
+ *
+ * @author Kael Johnston
+ */
+CutilHash128 cutil_hash128(const void *data, const u64 length, const u64 seed);
+
+/**
+ * Hash a buffer into 128 bits on several threads. Data is split into
+ * CUTIL_HASH_CHUNK_SIZE chunks, which are hashed at once and then combined.
+ * The result does not depend on the number of threads. It is the same as
+ * cutil_hash128 with a seed of 0 for data that fits in one chunk, but not for
+ * larger data.
+ *
+ * The chunk hashes are kept in memory. If they can not be allocated, an error
+ * is logged and the hash is 0.
+ *
+ * @param data the data to hash, may be NULL if length is 0
+ * @param length the size of data
+ * @param threadCount the number of threads to use, 0 picks one per cpu. At
+ * most 64 are used
+ *
+ * @return the hash
+ *
+ * @author Kael Johnston
+ */
+CutilHash128 cutil_hash128_parallel(
+    const void *data, const u64 length, u32 threadCount);
+
+/**
+ * Like cutil_hash128_parallel, but fail instead of returning 0 when the chunk
+ * hashes can not be allocated.
+ *
+ * @param data the data to hash, may be NULL if length is 0
+ * @param length the size of data
+ * @param threadCount the number of threads to use, 0 picks one per cpu
+ * @param hash set to the hash
+ *
+ * @return Result
+ *
+ * @author Kael Johnston
+ */
+Result cutil_hash128_parallel_checked(
+    const void *restrict data,
+    const u64 length,
+    u32 threadCount,
+    CutilHash128 *restrict hash);
+
+/**
+ * Compare two 128 bit hashes.
+ *
+ * @return true if the hashes are the same
+ *
+ * @author Kael Johnston
+ */
+bool cutil_hash128_equal(const CutilHash128 a, const CutilHash128 b);
@@ -0,0 +1,900 @@
+#include "kv_store.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file.h"
+#include "hash.h"
+#include "messenger.h"
+#include "platform.h"
+
+#define min_value(a, b) (a < b ? a : b)
+#define max_value(a, b) (a > b ? a : b)
+
+#define KV_MAGIC          0x45524f5453564b43 // "CKVSTORE"
+#define KV_FORMAT_VERSION 1
+
+// the two headers each have a page, records start after them
+#define KV_HEADER_SIZE 4096
+#define KV_DATA_START  (2 * KV_HEADER_SIZE)
+
+// address space reserved for the mapping up front, so it never moves while
+// other threads read from it. This is also the largest a store can grow
+#define KV_MAP_SIZE ((u64)64 << 30)
+
+// how much the file grows by at a time, it doubles between these
+#define KV_MIN_GROWTH ((u64)1 << 20)
+#define KV_MAX_GROWTH ((u64)1 << 30)
+
+#define KV_MIN_SLOTS 64
+
+// slot offsets that do not point at a record
+#define KV_SLOT_EMPTY   0
+#define KV_SLOT_REMOVED 1
+
+#define align_up(x) (((x) + 7) & ~(u64)7)
+
+//
+// Types
+//
+
+typedef enum KvRecordType
+{
+    KV_RECORD_PUT = 1,
+    KV_RECORD_REMOVE,
+    KV_RECORD_TABLE,
+} KvRecordType;
+
+// everything after the headers is a list of records. The key follows the
+// record, and the value follows the key on an 8 byte boundary
+struct KvRecord
+{
+    u32 type; // KvRecordType
+    u32 keyLength;
+    u64 valueLength;
+};
+
+struct KvSlot
+{
+    _Atomic u64 hash;
+    _Atomic u64 offset; // of the newest record of the key
+};
+
+// the value of a table record
+struct KvTable
+{
+    u64 slotCount; // a power of 2
+    u64 reserved;
+    struct KvSlot slots[];
+};
+
+struct KvHeader
+{
+    u64 magic;
+    u32 version;
+    u32 dirty;       // the table may have changes that were not committed
+    u64 generation;  // the valid header with the highest generation is used
+    u64 tableOffset; // of the table record
+    u64 dataEnd;     // where the committed records end
+    u64 entryCount;
+    u64 usedSlots; // slots that are not empty, including removed keys
+    u64 checksum;  // of everything above
+};
+
+struct CutilKvStore
+{
+    CutilSharedFileMap map;
+    bool readOnly;
+
+    // readers load the table once per lookup, the writer replaces it when it
+    // grows
+    _Atomic(struct KvTable *) table;
+    u64 tableOffset;
+    _Atomic u64 entryCount;
+    u64 usedSlots;
+
+    // where the next record goes. Readers load it after a slot, so it covers
+    // every record a slot can point at
+    _Atomic u64 dataEnd;
+    u64 committedEnd;
+    u64 generation;
+    u32 activeHeader;
+    bool dirty; // the header in use says the table has changed
+
+    pthread_mutex_t writeLock;
+};
+
+//
+// Helper Declerations
+//
+
+// 0 if the record is too large to address
+static u64 record_size(const u64 keyLength, const u64 valueLength);
+
+// check a slot points at a whole put record. The table comes from the file,
+// so a corrupted one could point anywhere in the mapping
+static bool record_valid(const CutilKvStore *store, const u64 offset);
+
+static const void *record_value(const struct KvRecord *record);
+
+static bool key_matches(
+    const CutilKvStore *store,
+    const u64 offset,
+    const void *key,
+    const u32 keyLength);
+
+// read a header, false if it is not valid
+static bool read_header(
+    const CutilKvStore *store, const u32 index, struct KvHeader *header);
+
+// write and sync the header that is not in use, then use it
+static Result write_header(CutilKvStore *store, const bool dirty);
+
+// the header has to say the table is changing before it is changed
+static Result mark_dirty(CutilKvStore *store);
+
+// grow the file so size more bytes can be appended
+static Result reserve(CutilKvStore *store, const u64 size);
+
+// append a record, returning its offset or 0 on failure
+static u64 append_record(
+    CutilKvStore *store,
+    const KvRecordType type,
+    const void *key,
+    const u32 keyLength,
+    const void *value,
+    const u64 valueLength);
+
+// append an empty table, returning its offset or 0 on failure
+static u64 append_table(CutilKvStore *store, const u64 slotCount);
+
+// find the slot of a key, or UINT64_MAX. Only for the writer
+static u64 find_slot(
+    const CutilKvStore *store,
+    const u64 hash,
+    const void *key,
+    const u32 keyLength);
+
+// point a key at a record, adding the key if it is new
+static void set_slot(
+    CutilKvStore *store,
+    const u64 hash,
+    const void *key,
+    const u32 keyLength,
+    const u64 offset);
+
+// move the keys to a new table with room for more, then switch to it
+static Result grow_table(CutilKvStore *store);
+
+// start a new file
+static Result create_store(CutilKvStore *store);
+
+// use the newest valid header, rebuilding the table if it has to be
+static Result load_store(CutilKvStore *store, const char *path);
+
+// make a new table from the committed records
+static Result rebuild_table(CutilKvStore *store, const char *path);
+
+static Result commit(CutilKvStore *store);
+
+//
+// Public methods
+//
+
+Result cutil_kv_open(
+    CutilKvStore **restrict store, const char *restrict filepath, u32 flags)
+{
+    *store = NULL;
+
+    const bool readOnly = flags & CUTIL_KV_READ_ONLY;
+
+    u32 pathLength = 0;
+    cutil_platform_localize_file_name(NULL, filepath, &pathLength);
+    char path[pathLength];
+    cutil_platform_localize_file_name(path, filepath, &pathLength);
+
+    if (!readOnly)
+    {
+        if (!cutil_platform_is_allowed_file_operation(path))
+            return RS_FAILURE;
+
+        // make the folder the store goes in
+        const char *end = strrchr(filepath, '/');
+        if (end && end != filepath)
+        {
+            char folder[end - filepath + 1];
+            memcpy(folder, filepath, end - filepath);
+            folder[end - filepath] = '\0';
+            cutil_write_file_folder(folder);
+        }
+    }
+
+    CutilKvStore *result = calloc(1, sizeof(CutilKvStore));
+    if (!result)
+        return RS_FAILURE;
+
+    // the whole size is reserved up front, so the mapping never moves
+    if (cutil_platform_map_file_shared(
+            &result->map,
+            filepath,
+            KV_MAP_SIZE,
+            readOnly ? CUTIL_SHARED_MAP_READ_ONLY : CUTIL_SHARED_MAP_DEFAULT))
+    {
+        free(result);
+        return RS_FAILURE;
+    }
+    result->readOnly = readOnly;
+    pthread_mutex_init(&result->writeLock, NULL);
+
+    Result loaded;
+    if (result->map.size)
+        loaded = load_store(result, path);
+    else if (readOnly)
+    {
+        log_error("Store '%s' is empty", path);
+        loaded = RS_FAILURE;
+    }
+    else
+        loaded = create_store(result);
+
+    if (loaded)
+    {
+        // nothing was changed that a commit would save
+        result->readOnly = true;
+        cutil_kv_close(result);
+        return RS_FAILURE;
+    }
+
+    *store = result;
+    return RS_SUCCESS;
+}
+
+void cutil_kv_close(CutilKvStore *store)
+{
+    if (!store)
+        return;
+
+    if (!store->readOnly && !commit(store))
+    {
+        // give back the space reserved for records that were never written
+        cutil_platform_shrink_shared_map(&store->map, store->dataEnd);
+    }
+
+    cutil_platform_unmap_file_shared(&store->map);
+    pthread_mutex_destroy(&store->writeLock);
+    free(store);
+}
+
+const void *cutil_kv_get(
+    const CutilKvStore *restrict store,
+    const void *restrict key,
+    const u32 keyLength,
+    u64 *restrict valueLength)
+{
+    const u64 hash = cutil_hash64(key, keyLength, 0);
+
+    const struct KvTable *table =
+        atomic_load_explicit(&store->table, memory_order_acquire);
+    const u64 mask = table->slotCount - 1;
+
+    for (u64 i = hash & mask, probes = 0; probes < table->slotCount;
+         i = (i + 1) & mask, probes++)
+    {
+        const struct KvSlot *slot = &table->slots[i];
+
+        // the hash is written before the offset is published
+        const u64 offset =
+            atomic_load_explicit(&slot->offset, memory_order_acquire);
+        if (offset == KV_SLOT_EMPTY)
+            return NULL;
+        if (offset == KV_SLOT_REMOVED ||
+            atomic_load_explicit(&slot->hash, memory_order_relaxed) != hash ||
+            !record_valid(store, offset) ||
+            !key_matches(store, offset, key, keyLength))
+            continue;
+
+        const struct KvRecord *record =
+            (const struct KvRecord *)(store->map.data + offset);
+        if (valueLength)
+            *valueLength = record->valueLength;
+        return record_value(record);
+    }
+
+    return NULL;
+}
+
+Result cutil_kv_put(
+    CutilKvStore *restrict store,
+    const void *restrict key,
+    const u32 keyLength,
+    const void *restrict value,
+    const u64 valueLength)
+{
+    if (store->readOnly)
+    {
+        log_error("Cannot change a read only store");
+        return RS_FAILURE;
+    }
+
+    const u64 hash = cutil_hash64(key, keyLength, 0);
+
+    pthread_mutex_lock(&store->writeLock);
+
+    const struct KvTable *table =
+        atomic_load_explicit(&store->table, memory_order_relaxed);
+
+    // keep the table at most 70% full, counting removed keys
+    Result result = mark_dirty(store);
+    if (!result && (store->usedSlots + 1) * 10 > table->slotCount * 7)
+        result = grow_table(store);
+
+    if (!result)
+    {
+        const u64 offset = append_record(
+            store, KV_RECORD_PUT, key, keyLength, value, valueLength);
+        if (offset)
+            set_slot(store, hash, key, keyLength, offset);
+        else
+            result = RS_FAILURE;
+    }
+
+    pthread_mutex_unlock(&store->writeLock);
+    return result;
+}
+
+Result cutil_kv_remove(
+    CutilKvStore *restrict store,
+    const void *restrict key,
+    const u32 keyLength)
+{
+    if (store->readOnly)
+    {
+        log_error("Cannot change a read only store");
+        return RS_FAILURE;
+    }
+
+    const u64 hash = cutil_hash64(key, keyLength, 0);
+
+    pthread_mutex_lock(&store->writeLock);
+
+    const u64 index = find_slot(store, hash, key, keyLength);
+
+    // the record lets a rebuilt table forget the key too
+    Result result = index == UINT64_MAX ? RS_FAILURE : mark_dirty(store);
+    if (!result &&
+        !append_record(store, KV_RECORD_REMOVE, key, keyLength, NULL, 0))
+        result = RS_FAILURE;
+
+    if (!result)
+    {
+        struct KvTable *table =
+            atomic_load_explicit(&store->table, memory_order_relaxed);
+        atomic_store_explicit(
+            &table->slots[index].offset, KV_SLOT_REMOVED, memory_order_release);
+        atomic_fetch_sub_explicit(&store->entryCount, 1, memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&store->writeLock);
+    return result;
+}
+
+Result cutil_kv_commit(CutilKvStore *store)
+{
+    if (store->readOnly)
+        return RS_SUCCESS;
+
+    return commit(store);
+}
+
+u64 cutil_kv_get_count(const CutilKvStore *store)
+{
+    return atomic_load_explicit(&store->entryCount, memory_order_relaxed);
+}
+
+Result cutil_kv_compact(const char *filepath)
+{
+    // writable, so a store that crashed is recovered first
+    CutilKvStore *old;
+    if (cutil_kv_open(&old, filepath, CUTIL_KV_DEFAULT))
+        return RS_FAILURE;
+
+    const u32 length = strlen(filepath);
+    char tempPath[length + 16];
+    memcpy(tempPath, filepath, length);
+    memcpy(tempPath + length, ".compact", sizeof(".compact"));
+
+    CutilFileInfo info;
+    if (!cutil_read_file_info(tempPath, &info) && info.exists)
+        cutil_platform_delete_file(tempPath);
+
+    CutilKvStore *new;
+    if (cutil_kv_open(&new, tempPath, CUTIL_KV_DEFAULT))
+    {
+        cutil_kv_close(old);
+        return RS_FAILURE;
+    }
+
+    const struct KvTable *table =
+        atomic_load_explicit(&old->table, memory_order_relaxed);
+
+    Result result = RS_SUCCESS;
+    for (u64 i = 0; i < table->slotCount && !result; i++)
+    {
+        const u64 offset = table->slots[i].offset;
+        if (offset == KV_SLOT_EMPTY || offset == KV_SLOT_REMOVED ||
+            !record_valid(old, offset))
+            continue;
+
+        const struct KvRecord *record =
+            (const struct KvRecord *)(old->map.data + offset);
+        result = cutil_kv_put(
+            new,
+            record + 1,
+            record->keyLength,
+            record_value(record),
+            record->valueLength);
+    }
+
+    if (!result)
+        result = cutil_kv_commit(new);
+    cutil_kv_close(new);
+    cutil_kv_close(old);
+
+    if (result)
+    {
+        cutil_platform_delete_file(tempPath);
+        return RS_FAILURE;
+    }
+
+    return cutil_platform_move_file(filepath, tempPath);
+}
+
+//
+// Helper implementations
+//
+
+static u64 record_size(const u64 keyLength, const u64 valueLength)
+{
+    const u64 keyEnd = align_up(sizeof(struct KvRecord) + keyLength);
+    if (valueLength > UINT64_MAX - 7 - keyEnd)
+        return 0;
+    return align_up(keyEnd + valueLength);
+}
+
+static bool record_valid(const CutilKvStore *store, const u64 offset)
+{
+    const u64 end = atomic_load_explicit(&store->dataEnd, memory_order_acquire);
+    if (offset < KV_DATA_START || offset & 7 || offset >= end ||
+        end - offset < sizeof(struct KvRecord))
+        return false;
+
+    const struct KvRecord *record =
+        (const struct KvRecord *)(store->map.data + offset);
+    const u64 size = record_size(record->keyLength, record->valueLength);
+    return record->type == KV_RECORD_PUT && size && size <= end - offset;
+}
+
+static const void *record_value(const struct KvRecord *record)
+{
+    return (const u8 *)record +
+           align_up(sizeof(struct KvRecord) + record->keyLength);
+}
+
+static bool key_matches(
+    const CutilKvStore *store,
+    const u64 offset,
+    const void *key,
+    const u32 keyLength)
+{
+    const struct KvRecord *record =
+        (const struct KvRecord *)(store->map.data + offset);
+    return record->keyLength == keyLength &&
+           !memcmp(record + 1, key, keyLength);
+}
+
+static bool read_header(
+    const CutilKvStore *store, const u32 index, struct KvHeader *header)
+{
+    memcpy(header, store->map.data + index * KV_HEADER_SIZE, sizeof(*header));
+
+    // a header torn by a crash fails the checksum
+    return header->magic == KV_MAGIC && header->version == KV_FORMAT_VERSION &&
+           header->checksum ==
+               cutil_hash64(header, offsetof(struct KvHeader, checksum), 0);
+}
+
+static Result write_header(CutilKvStore *store, const bool dirty)
+{
+    struct KvHeader header = {
+        .magic       = KV_MAGIC,
+        .version     = KV_FORMAT_VERSION,
+        .dirty       = dirty,
+        .generation  = store->generation + 1,
+        .tableOffset = store->tableOffset,
+        .dataEnd     = dirty ? store->committedEnd : store->dataEnd,
+        .entryCount  = atomic_load(&store->entryCount),
+        .usedSlots   = store->usedSlots,
+    };
+    header.checksum =
+        cutil_hash64(&header, offsetof(struct KvHeader, checksum), 0);
+
+    const u32 next = !store->activeHeader;
+    memcpy(store->map.data + next * KV_HEADER_SIZE, &header, sizeof(header));
+    if (cutil_platform_sync_shared_map(&store->map))
+        return RS_FAILURE;
+
+    store->activeHeader = next;
+    store->generation   = header.generation;
+    store->dirty        = dirty;
+    if (!dirty)
+        store->committedEnd = store->dataEnd;
+    return RS_SUCCESS;
+}
+
+static Result mark_dirty(CutilKvStore *store)
+{
+    return store->dirty ? RS_SUCCESS : write_header(store, true);
+}
+
+static Result reserve(CutilKvStore *store, const u64 size)
+{
+    if (size > KV_MAP_SIZE - store->dataEnd)
+    {
+        log_error("The store is full");
+        return RS_FAILURE;
+    }
+
+    const u64 needed = store->dataEnd + size;
+    if (needed <= store->map.size)
+        return RS_SUCCESS;
+
+    u64 growth  = max_value(store->map.size, KV_MIN_GROWTH);
+    growth      = min_value(growth, KV_MAX_GROWTH);
+    u64 newSize = max_value(needed, store->map.size + growth);
+    newSize     = min_value(newSize, KV_MAP_SIZE);
+
+    // the blocks are allocated now, see cutil_platform_grow_shared_map
+    return cutil_platform_grow_shared_map(&store->map, newSize);
+}
+
+static u64 append_record(
+    CutilKvStore *store,
+    const KvRecordType type,
+    const void *key,
+    const u32 keyLength,
+    const void *value,
+    const u64 valueLength)
+{
+    const u64 size = record_size(keyLength, valueLength);
+    if (!size)
+    {
+        log_error("The value is too large for the store");
+        return 0;
+    }
+    if (reserve(store, size))
+        return 0;
+
+    // readers can not reach the record until a slot points at it
+    const u64 offset        = store->dataEnd;
+    struct KvRecord *record = (struct KvRecord *)(store->map.data + offset);
+    record->type            = type;
+    record->keyLength       = keyLength;
+    record->valueLength     = valueLength;
+    if (keyLength)
+        memcpy(record + 1, key, keyLength);
+
+    // tables are filled in by the caller
+    if (value && valueLength)
+        memcpy((void *)record_value(record), value, valueLength);
+
+    store->dataEnd += size;
+    return offset;
+}
+
+static u64 append_table(CutilKvStore *store, const u64 slotCount)
+{
+    const u64 valueLength =
+        sizeof(struct KvTable) + slotCount * sizeof(struct KvSlot);
+    const u64 offset = append_record(
+        store, KV_RECORD_TABLE, NULL, 0, NULL, valueLength);
+    if (!offset)
+        return 0;
+
+    // the space may hold records that were never committed
+    struct KvRecord *record = (struct KvRecord *)(store->map.data + offset);
+    struct KvTable *table   = (struct KvTable *)record_value(record);
+    memset(table, 0, valueLength);
+    table->slotCount = slotCount;
+    return offset;
+}
+
+static u64 find_slot(
+    const CutilKvStore *store,
+    const u64 hash,
+    const void *key,
+    const u32 keyLength)
+{
+    const struct KvTable *table =
+        atomic_load_explicit(&store->table, memory_order_relaxed);
+    const u64 mask = table->slotCount - 1;
+
+    for (u64 i = hash & mask;; i = (i + 1) & mask)
+    {
+        const u64 offset = table->slots[i].offset;
+        if (offset == KV_SLOT_EMPTY)
+            return UINT64_MAX;
+        if (offset != KV_SLOT_REMOVED && table->slots[i].hash == hash &&
+            record_valid(store, offset) &&
+            key_matches(store, offset, key, keyLength))
+            return i;
+    }
+}
+
+static void set_slot(
+    CutilKvStore *store,
+    const u64 hash,
+    const void *key,
+    const u32 keyLength,
+    const u64 offset)
+{
+    struct KvTable *table =
+        atomic_load_explicit(&store->table, memory_order_relaxed);
+    const u64 mask = table->slotCount - 1;
+
+    // a new key goes in the first removed slot on its path, if any
+    u64 target = UINT64_MAX;
+    for (u64 i = hash & mask;; i = (i + 1) & mask)
+    {
+        struct KvSlot *slot = &table->slots[i];
+        const u64 current   = slot->offset;
+
+        if (current == KV_SLOT_EMPTY)
+        {
+            if (target == UINT64_MAX)
+            {
+                target = i;
+                store->usedSlots++;
+            }
+            break;
+        }
+
+        if (current == KV_SLOT_REMOVED)
+        {
+            if (target == UINT64_MAX)
+                target = i;
+            continue;
+        }
+
+        if (slot->hash == hash && record_valid(store, current) &&
+            key_matches(store, current, key, keyLength))
+        {
+            // readers see the old value or the new one
+            atomic_store_explicit(&slot->offset, offset, memory_order_release);
+            return;
+        }
+    }
+
+    struct KvSlot *slot = &table->slots[target];
+    atomic_store_explicit(&slot->hash, hash, memory_order_relaxed);
+    atomic_store_explicit(&slot->offset, offset, memory_order_release);
+    atomic_fetch_add_explicit(&store->entryCount, 1, memory_order_relaxed);
+}
+
+static Result grow_table(CutilKvStore *store)
+{
+    const struct KvTable *old =
+        atomic_load_explicit(&store->table, memory_order_relaxed);
+    const u64 entryCount = atomic_load(&store->entryCount);
+
+    // at most half full afterwards. If the table only filled up with removed
+    // keys, it is rebuilt at the same size without them
+    u64 slotCount = old->slotCount;
+    while ((entryCount + 1) * 2 > slotCount)
+        slotCount *= 2;
+
+    const u64 offset = append_table(store, slotCount);
+    if (!offset)
+        return RS_FAILURE;
+
+    struct KvRecord *record = (struct KvRecord *)(store->map.data + offset);
+    struct KvTable *table   = (struct KvTable *)record_value(record);
+
+    // the old table is not in the way, it stays in the file
+    const u64 mask = slotCount - 1;
+    for (u64 i = 0; i < old->slotCount; i++)
+    {
+        const u64 current = old->slots[i].offset;
+        if (current == KV_SLOT_EMPTY || current == KV_SLOT_REMOVED)
+            continue;
+
+        u64 j = old->slots[i].hash & mask;
+        while (table->slots[j].offset != KV_SLOT_EMPTY)
+            j = (j + 1) & mask;
+        table->slots[j].hash   = old->slots[i].hash;
+        table->slots[j].offset = current;
+    }
+
+    store->tableOffset = offset;
+    store->usedSlots   = entryCount;
+    atomic_store_explicit(&store->table, table, memory_order_release);
+    return RS_SUCCESS;
+}
+
+static Result create_store(CutilKvStore *store)
+{
+    store->dataEnd      = KV_DATA_START;
+    store->activeHeader = 1;
+
+    const u64 offset = append_table(store, KV_MIN_SLOTS);
+    if (!offset)
+        return RS_FAILURE;
+
+    // the second header is left empty, which is not valid
+    store->tableOffset = offset;
+    store->table       = (struct KvTable *)record_value(
+        (struct KvRecord *)(store->map.data + offset));
+    return write_header(store, false);
+}
+
+static Result load_store(CutilKvStore *store, const char *path)
+{
+    struct KvHeader headers[2];
+    bool valid[2] = {false, false};
+    if (store->map.size >= KV_DATA_START)
+    {
+        valid[0] = read_header(store, 0, &headers[0]);
+        valid[1] = read_header(store, 1, &headers[1]);
+    }
+
+    if (!valid[0] && !valid[1])
+    {
+        log_error("'%s' is not a store", path);
+        return RS_FAILURE;
+    }
+
+    const u32 active = !valid[0] || (valid[1] && headers[1].generation >
+                                                     headers[0].generation);
+    const struct KvHeader *header = &headers[active];
+
+    store->activeHeader = active;
+    store->generation   = header->generation;
+    store->dataEnd      = header->dataEnd;
+    store->committedEnd = header->dataEnd;
+
+    if (header->dataEnd < KV_DATA_START || header->dataEnd > store->map.size)
+    {
+        log_error("Store '%s' is corrupted", path);
+        return RS_FAILURE;
+    }
+
+    if (header->dirty)
+    {
+        if (store->readOnly)
+        {
+            log_error(
+                "Store '%s' was not closed, open it to write once to recover",
+                path);
+            return RS_FAILURE;
+        }
+        return rebuild_table(store, path);
+    }
+
+    // check the table is inside the committed records
+    const u64 tableOffset         = header->tableOffset;
+    const struct KvRecord *record = NULL;
+    const struct KvTable *table   = NULL;
+    if (tableOffset >= KV_DATA_START &&
+        tableOffset + sizeof(struct KvRecord) + sizeof(struct KvTable) <=
+            header->dataEnd)
+    {
+        record = (const struct KvRecord *)(store->map.data + tableOffset);
+        table  = record_value(record);
+    }
+
+    if (!table || record->type != KV_RECORD_TABLE || !table->slotCount ||
+        (table->slotCount & (table->slotCount - 1)) ||
+        table->slotCount > header->dataEnd / sizeof(struct KvSlot) ||
+        tableOffset + record_size(0, record->valueLength) > header->dataEnd ||
+        record->valueLength !=
+            sizeof(struct KvTable) + table->slotCount * sizeof(struct KvSlot))
+    {
+        log_error("Store '%s' is corrupted", path);
+        return RS_FAILURE;
+    }
+
+    store->tableOffset = tableOffset;
+    store->usedSlots   = header->usedSlots;
+    atomic_store(&store->entryCount, header->entryCount);
+    atomic_store(&store->table, (struct KvTable *)table);
+    return RS_SUCCESS;
+}
+
+static Result rebuild_table(CutilKvStore *store, const char *path)
+{
+    log_warning("Store '%s' was not closed, rebuilding it", path);
+
+    // size the table for every key being different
+    u64 putCount = 0;
+    for (u64 offset = KV_DATA_START; offset < store->committedEnd;)
+    {
+        const struct KvRecord *record =
+            (const struct KvRecord *)(store->map.data + offset);
+        // a size of 0 would never move past the record
+        const u64 left = store->committedEnd - offset;
+        const u64 size =
+            left < sizeof(struct KvRecord)
+                ? 0
+                : record_size(record->keyLength, record->valueLength);
+        if (!size || size > left || !record->type ||
+            record->type > KV_RECORD_TABLE)
+        {
+            log_error("Store '%s' is corrupted", path);
+            return RS_FAILURE;
+        }
+
+        putCount += record->type == KV_RECORD_PUT;
+        offset   += size;
+    }
+
+    u64 slotCount = KV_MIN_SLOTS;
+    while ((putCount + 1) * 2 > slotCount)
+        slotCount *= 2;
+
+    // records after the last commit are thrown away
+    const u64 end    = store->committedEnd;
+    const u64 offset = append_table(store, slotCount);
+    if (!offset)
+        return RS_FAILURE;
+    store->tableOffset = offset;
+    store->usedSlots   = 0;
+    atomic_store(&store->entryCount, 0);
+    atomic_store(
+        &store->table,
+        (struct KvTable *)record_value(
+            (const struct KvRecord *)(store->map.data + offset)));
+
+    for (u64 i = KV_DATA_START; i < end;)
+    {
+        const struct KvRecord *record =
+            (const struct KvRecord *)(store->map.data + i);
+        const void *key = record + 1;
+        const u64 hash  = cutil_hash64(key, record->keyLength, 0);
+
+        if (record->type == KV_RECORD_PUT)
+            set_slot(store, hash, key, record->keyLength, i);
+        else if (record->type == KV_RECORD_REMOVE)
+        {
+            const u64 index = find_slot(store, hash, key, record->keyLength);
+            if (index != UINT64_MAX)
+            {
+                store->table->slots[index].offset = KV_SLOT_REMOVED;
+                atomic_fetch_sub(&store->entryCount, 1);
+            }
+        }
+
+        i += record_size(record->keyLength, record->valueLength);
+    }
+
+    store->dirty = true;
+    return commit(store);
+}
+
+static Result commit(CutilKvStore *store)
+{
+    pthread_mutex_lock(&store->writeLock);
+
+    Result result = RS_SUCCESS;
+    if (store->dirty)
+    {
+        // the records and table have to be on disk before the header
+        result = cutil_platform_sync_shared_map(&store->map);
+        if (!result)
+            result = write_header(store, false);
+    }
+
+    pthread_mutex_unlock(&store->writeLock);
+    return result;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+// Key value store
+//
+// A persistent hash table in one file, for lookups that need more than reading
+// a whole file but less than a database. The file is mapped, and a lookup is a
+// hash and a probe of the table in the mapping, with no system calls and no
+// locks, so any number of threads can read while one thread writes.
+//
+// Keys and values are appended to the file and never changed, so a value
+// returned by cutil_kv_get stays valid until the store is closed. Values start
+// on an 8 byte boundary, so a fixed size struct can be used in place. The
+// table points at the newest value of each key, and is updated in place.
+//
+// Changes are saved with cutil_kv_commit. The file has two headers, and a
+// commit writes the one that is not in use and syncs it, so a crash leaves the
+// last commit intact. If the store crashes with changes that were not
+// committed, the table is rebuilt from the appended keys and values the next
+// time it is opened.
+//
+// Old values take up space until cutil_kv_compact is called. A store can only
+// be open in one process at a time.
+//
+// Kael Johnston
+
+#include "types.h"
+
+typedef enum CutilKvFlags
+{
+    CUTIL_KV_DEFAULT = 0,
+    // open an existing store without changing it
+    CUTIL_KV_READ_ONLY = 1 << 0,
+} CutilKvFlags;
+
+typedef struct CutilKvStore CutilKvStore;
+
+/**
+ * Open a store, creating it if it does not exist.
+ *
+ * @param store will be set to the store
+ * @param filepath the file of the store, it is localized like all other file
+ * utilities
+ * @param flags CutilKvFlags
+ *
+ * @return RS_FAILURE if the file could not be opened, is corrupted, or is
+ * open in another process
+ *
+ * @author Kael Johnston
+ */
+Result cutil_kv_open(
+    CutilKvStore **restrict store, const char *restrict filepath, u32 flags);
+
+/**
+ * Commit the store and close it. Values from cutil_kv_get are invalid after
+ * this.
+ *
+ * @author Kael Johnston
+ */
+void cutil_kv_close(CutilKvStore *store);
+
+/**
+ * Find the value of a key. It is safe to call while another thread writes.
+ *
+ * @param store the store
+ * @param key the key
+ * @param keyLength the length of key
+ * @param valueLength set to the length of the value, may be NULL
+ *
+ * @return the value inside the mapped file, or NULL if the key is not in the
+ * store
+ *
+ * @author Kael Johnston
+ */
+const void *cutil_kv_get(
+    const CutilKvStore *restrict store,
+    const void *restrict key,
+    const u32 keyLength,
+    u64 *restrict valueLength);
+
+/**
+ * Set the value of a key. Writes from several threads take turns.
+ *
+ * @param store a store that is not read only
+ * @param key the key
+ * @param keyLength the length of key
+ * @param value the value
+ * @param valueLength the length of value
+ *
+ * @return RS_FAILURE if the file could not grow
+ *
+ * @author Kael Johnston
+ */
+Result cutil_kv_put(
+    CutilKvStore *restrict store,
+    const void *restrict key,
+    const u32 keyLength,
+    const void *restrict value,
+    const u64 valueLength);
+
+/**
+ * Remove a key.
+ *
+ * @return RS_FAILURE if the key was not in the store
+ *
+ * @author Kael Johnston
+ */
+Result cutil_kv_remove(
+    CutilKvStore *restrict store,
+    const void *restrict key,
+    const u32 keyLength);
+
+/**
+ * Make every change so far survive a crash.
+ *
+ * @return Result
+ *
+ * @author Kael Johnston
+ */
+Result cutil_kv_commit(CutilKvStore *store);
+
+/**
+ * Get the number of keys in the store.
+ *
+ * @author Kael Johnston
+ */
+u64 cutil_kv_get_count(const CutilKvStore *store);
+
+/**
+ * Rewrite a store with only the newest value of each key. The store must not
+ * be open.
+ *
+ * @param filepath the file of the store
+ *
+ * @return Result
+ *
+ * @author Kael Johnston
+ */
+Result cutil_kv_compact(const char *filepath);
@@ -0,0 +1,175 @@
+#include "line_iterator.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "messenger.h"
+
+//
+// Helper Declerations
+//
+
+// remove a trailing '\r', so "\r\n" line breaks are handled
+static CutilStringView trim_carriage_return(CutilStringView line);
+
+// append text to the carry buffer
+static Result carry_append(
+    CutilLineIterator *restrict iterator, const char *restrict text, u64 length);
+
+// pull the next chunk from the reader. returns false at the end of the file
+static bool next_chunk(CutilLineIterator *iterator);
+
+//
+// Public methods
+//
+
+void cutil_line_iterator_init_buffer(
+    CutilLineIterator *restrict iterator,
+    const char *restrict buffer,
+    const u64 length)
+{
+    *iterator = (CutilLineIterator){
+        .cursor = buffer,
+        .end    = buffer + length,
+    };
+}
+
+void cutil_line_iterator_init_reader(
+    CutilLineIterator *restrict iterator, CutilFileReader *restrict reader)
+{
+    *iterator = (CutilLineIterator){.reader = reader};
+}
+
+bool cutil_line_iterator_next(
+    CutilLineIterator *restrict iterator, CutilStringView *restrict line)
+{
+    iterator->carryLength = 0;
+
+    for (;;)
+    {
+        const u64 remaining = iterator->end - iterator->cursor;
+        const char *lineEnd =
+            cutil_string_find_char(iterator->cursor, remaining, '\n');
+
+        if (lineEnd)
+        {
+            CutilStringView view = {
+                .data   = iterator->cursor,
+                .length = lineEnd - iterator->cursor,
+            };
+            iterator->cursor = lineEnd + 1;
+
+            // finish a line that started in an earlier chunk
+            if (iterator->carryLength)
+            {
+                if (carry_append(iterator, view.data, view.length))
+                    return false;
+                view = (CutilStringView){
+                    .data   = iterator->carry,
+                    .length = iterator->carryLength,
+                };
+            }
+
+            *line = trim_carriage_return(view);
+            iterator->lineNumber++;
+            return true;
+        }
+
+        // the rest of the chunk is the start of a line
+        if (iterator->reader)
+        {
+            if (remaining &&
+                carry_append(iterator, iterator->cursor, remaining))
+                return false;
+            iterator->cursor = iterator->end;
+            if (next_chunk(iterator))
+                continue;
+            if (iterator->failed)
+                return false;
+
+            // the last line has no line break
+            if (!iterator->carryLength)
+                return false;
+            *line = trim_carriage_return((CutilStringView){
+                .data   = iterator->carry,
+                .length = iterator->carryLength,
+            });
+            iterator->lineNumber++;
+            return true;
+        }
+
+        if (!remaining)
+            return false;
+
+        *line = trim_carriage_return((CutilStringView){
+            .data   = iterator->cursor,
+            .length = remaining,
+        });
+        iterator->cursor = iterator->end;
+        iterator->lineNumber++;
+        return true;
+    }
+}
+
+void cutil_line_iterator_free(CutilLineIterator *iterator)
+{
+    free(iterator->carry);
+    iterator->carry         = NULL;
+    iterator->carryLength   = 0;
+    iterator->carryCapacity = 0;
+}
+
+//
+// Helper implementations
+//
+
+static CutilStringView trim_carriage_return(CutilStringView line)
+{
+    if (line.length && line.data[line.length - 1] == '\r')
+        line.length--;
+    return line;
+}
+
+static Result carry_append(
+    CutilLineIterator *restrict iterator, const char *restrict text, u64 length)
+{
+    const u64 needed = iterator->carryLength + length;
+    if (needed > iterator->carryCapacity)
+    {
+        u64 capacity = iterator->carryCapacity ? iterator->carryCapacity : 256;
+        while (capacity < needed)
+            capacity *= 2;
+
+        char *carry = realloc(iterator->carry, capacity);
+        if (!carry)
+        {
+            log_error(
+                "Failed to allocate %llu byte line",
+                (unsigned long long)capacity);
+            iterator->failed = true;
+            return RS_FAILURE;
+        }
+        iterator->carry         = carry;
+        iterator->carryCapacity = capacity;
+    }
+
+    memcpy(iterator->carry + iterator->carryLength, text, length);
+    iterator->carryLength = needed;
+    return RS_SUCCESS;
+}
+
+static bool next_chunk(CutilLineIterator *iterator)
+{
+    const void *chunk = NULL;
+    u64 length        = 0;
+
+    if (cutil_file_reader_next(iterator->reader, &chunk, &length))
+    {
+        iterator->failed = true;
+        return false;
+    }
+
+    iterator->cursor = chunk;
+    iterator->end    = iterator->cursor + length;
+    return length != 0;
+}
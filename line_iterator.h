@@ -0,0 +1,74 @@
+#pragma once
+
+// Split text into lines without copying it
+//
+// Lines are returned as views into the original buffer, with the line break
+// ('\n' or "\r\n") removed. Text can come from a buffer or a CutilFileReader,
+// so files larger than memory can be split too.
+//
+// Kael Johnston
+
+#include "types.h"
+#include "file.h"
+#include "string_util.h"
+
+typedef struct CutilLineIterator
+{
+    // the part of the buffer (or current chunk) that has not been split yet
+    const char *cursor;
+    const char *end;
+
+    // the reader chunks are pulled from, NULL when iterating over a buffer
+    CutilFileReader *reader;
+
+    // a line split between two chunks is joined here. It only grows, so it is
+    // only allocated for lines longer than any before them
+    char *carry;
+    u64 carryLength;
+    u64 carryCapacity;
+
+    u64 lineNumber; // the number of lines returned so far
+    bool failed;    // reading the file failed, iteration stopped early
+} CutilLineIterator;
+
+/**
+ * @brief Iterate over the lines of a buffer. The buffer must stay valid as
+ * long as the lines are being used.
+ *
+ * @param iterator the iterator to initialize
+ * @param buffer the text to split, does not have to be NULL terminated
+ * @param length the length of buffer in bytes
+ */
+void cutil_line_iterator_init_buffer(
+    CutilLineIterator *restrict iterator,
+    const char *restrict buffer,
+    const u64 length);
+
+/**
+ * @brief Iterate over the lines of a file. The reader must be open, and stay
+ * open until the iterator is freed.
+ *
+ * @param iterator the iterator to initialize
+ * @param reader an open reader, see cutil_file_reader_open
+ */
+void cutil_line_iterator_init_reader(
+    CutilLineIterator *restrict iterator, CutilFileReader *restrict reader);
+
+/**
+ * @brief Get the next line. For buffers the line points into the buffer. For
+ * readers it is valid until the next call.
+ *
+ * @param iterator the iterator
+ * @param line will be set to the line, without its line break
+ * @return true if a line was returned, false at the end of the text or if
+ * reading failed (check iterator->failed)
+ */
+bool cutil_line_iterator_next(
+    CutilLineIterator *restrict iterator, CutilStringView *restrict line);
+
+/**
+ * @brief Free memory used by the iterator. It does not close the reader.
+ *
+ * @param iterator the iterator to free
+ */
+void cutil_line_iterator_free(CutilLineIterator *iterator);
@@ -0,0 +1,499 @@
+#include "pack.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "messenger.h"
+#include "string_util.h"
+
+#define min_value(a, b) (a < b ? a : b)
+
+// "CUTP"
+#define PACK_MAGIC 0x50545543u
+#define PACK_VERSION 1
+
+//
+// Types
+//
+
+typedef struct PackHeader
+{
+    u32 magic;
+    u32 version;
+    u32 fileCount;
+    u32 bucketBits;
+    u64 entriesOffset;
+    u64 bucketsOffset;
+    u64 namesOffset;
+    u64 namesSize;
+} PackHeader;
+
+// sorted by hash, then name
+typedef struct PackEntry
+{
+    u64 hash;
+    u64 offset;
+    u64 size;
+    u32 nameOffset;
+    u32 nameLength;
+} PackEntry;
+
+struct BuilderFile
+{
+    char *name;
+    u32 nameLength;
+    u64 hash;
+
+    // either a file to read when the pack is written, or a copy of the data
+    char *source;
+    void *data;
+    u64 size;
+};
+
+struct CutilPackBuilder
+{
+    struct BuilderFile *files;
+    u32 fileCount;
+    u32 fileCapacity;
+    u32 alignment;
+};
+
+//
+// Helper Declerations
+//
+
+// the key of a localized path, the part after the executable folder
+static const char *strip_executable_folder(const char *localized);
+
+// add a file with no contents yet
+static struct BuilderFile *
+add_builder_file(CutilPackBuilder *builder, const char *name);
+
+// the bucket of a hash, the top bits so buckets keep the sort order
+static u32 bucket_of(u64 hash, u32 bucketBits);
+
+static int compare_files(const void *a, const void *b);
+
+// write size zero bytes
+static Result write_padding(FILE *file, u64 size);
+
+//
+// Public methods
+//
+
+Result cutil_pack_builder_create(CutilPackBuilder **builder, u32 alignment)
+{
+    if (alignment == 0)
+        alignment = CUTIL_PACK_DEFAULT_ALIGNMENT;
+    if (alignment & (alignment - 1))
+    {
+        log_error("Pack alignment %u is not a power of two", alignment);
+        return RS_FAILURE;
+    }
+
+    *builder = calloc(1, sizeof(CutilPackBuilder));
+    if (!*builder)
+        return RS_FAILURE;
+    (*builder)->alignment = alignment;
+    return RS_SUCCESS;
+}
+
+void cutil_pack_builder_destroy(CutilPackBuilder *builder)
+{
+    if (!builder)
+        return;
+
+    for (u32 i = 0; i < builder->fileCount; i++)
+    {
+        free(builder->files[i].name);
+        free(builder->files[i].source);
+        free(builder->files[i].data);
+    }
+    free(builder->files);
+    free(builder);
+}
+
+Result cutil_pack_builder_add_file(
+    CutilPackBuilder *restrict builder,
+    const char *restrict name,
+    const char *restrict filepath)
+{
+    struct BuilderFile *file = add_builder_file(builder, name);
+    if (!file)
+        return RS_FAILURE;
+
+    file->source = strdup(filepath);
+    if (!file->source)
+    {
+        free(file->name);
+        builder->fileCount--;
+        return RS_FAILURE;
+    }
+    return RS_SUCCESS;
+}
+
+Result cutil_pack_builder_add_memory(
+    CutilPackBuilder *restrict builder,
+    const char *restrict name,
+    const void *restrict data,
+    const u64 size)
+{
+    struct BuilderFile *file = add_builder_file(builder, name);
+    if (!file)
+        return RS_FAILURE;
+
+    file->data = malloc(size ? size : 1);
+    if (!file->data)
+    {
+        free(file->name);
+        builder->fileCount--;
+        return RS_FAILURE;
+    }
+    memcpy(file->data, data, size);
+    file->size = size;
+    return RS_SUCCESS;
+}
+
+Result cutil_pack_builder_write(
+    CutilPackBuilder *restrict builder, const char *restrict filepath)
+{
+    qsort(
+        builder->files,
+        builder->fileCount,
+        sizeof(struct BuilderFile),
+        compare_files);
+
+    for (u32 i = 1; i < builder->fileCount; i++)
+    {
+        if (compare_files(&builder->files[i - 1], &builder->files[i]) == 0)
+        {
+            log_error("Pack has two files named '%s'", builder->files[i].name);
+            return RS_FAILURE;
+        }
+    }
+
+    // localize filepath
+    u32 pathLength = 0;
+    cutil_platform_localize_file_name(NULL, filepath, &pathLength);
+    char path[pathLength];
+    cutil_platform_localize_file_name(path, filepath, &pathLength);
+
+    PackEntry *entries = calloc(builder->fileCount + 1, sizeof(PackEntry));
+    if (!entries)
+        return RS_FAILURE;
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        log_error("Failed to open file '%s'.", path);
+        free(entries);
+        return RS_FAILURE;
+    }
+
+    // the header is written last, once the offsets are known
+    PackHeader header = {
+        .magic     = PACK_MAGIC,
+        .version   = PACK_VERSION,
+        .fileCount = builder->fileCount,
+    };
+    Result result = write_padding(file, sizeof(header));
+    u64 offset    = sizeof(header);
+
+    // data section
+    u64 namesSize = 0;
+    for (u32 i = 0; i < builder->fileCount && !result; i++)
+    {
+        struct BuilderFile *source = &builder->files[i];
+
+        const u64 aligned =
+            (offset + builder->alignment - 1) & ~(u64)(builder->alignment - 1);
+        result = write_padding(file, aligned - offset);
+        offset = aligned;
+
+        CutilFileMap map = {.data = source->data, .size = source->size};
+        const bool mapped = !result && source->source &&
+                            !cutil_platform_map_file(&map, source->source, 0);
+        if (!result && source->source && !mapped)
+        {
+            log_error("Failed to read file '%s' into pack", source->source);
+            result = RS_FAILURE;
+        }
+
+        if (!result && map.size && fwrite(map.data, map.size, 1, file) != 1)
+            result = RS_FAILURE;
+
+        entries[i] = (PackEntry){
+            .hash       = source->hash,
+            .offset     = offset,
+            .size       = map.size,
+            .nameOffset = namesSize,
+            .nameLength = source->nameLength,
+        };
+        offset += map.size;
+        namesSize += source->nameLength + 1;
+
+        if (mapped)
+            cutil_platform_unmap_file(&map);
+    }
+
+    // enough buckets for about one file each
+    while ((1ull << header.bucketBits) < builder->fileCount)
+        header.bucketBits++;
+    const u32 bucketCount = 1u << header.bucketBits;
+
+    u32 *buckets = malloc((bucketCount + 1) * sizeof(u32));
+    if (!buckets)
+        result = RS_FAILURE;
+
+    for (u32 b = 0, i = 0; !result && b <= bucketCount; b++)
+    {
+        while (i < builder->fileCount &&
+               bucket_of(entries[i].hash, header.bucketBits) < b)
+            i++;
+        buckets[b] = i;
+    }
+
+    // index
+    if (!result)
+    {
+        const u64 aligned = (offset + 7) & ~7ull;
+        result            = write_padding(file, aligned - offset);
+        offset            = aligned;
+
+        header.entriesOffset = offset;
+        header.bucketsOffset =
+            header.entriesOffset + builder->fileCount * sizeof(PackEntry);
+        header.namesOffset =
+            header.bucketsOffset + (bucketCount + 1) * sizeof(u32);
+        header.namesSize = namesSize;
+
+        if (builder->fileCount &&
+            fwrite(entries, sizeof(PackEntry), builder->fileCount, file) !=
+                builder->fileCount)
+            result = RS_FAILURE;
+        if (fwrite(buckets, sizeof(u32), bucketCount + 1, file) !=
+            bucketCount + 1)
+            result = RS_FAILURE;
+
+        for (u32 i = 0; i < builder->fileCount && !result; i++)
+            if (fwrite(
+                    builder->files[i].name,
+                    builder->files[i].nameLength + 1,
+                    1,
+                    file) != 1)
+                result = RS_FAILURE;
+    }
+
+    if (!result && (fseek(file, 0, SEEK_SET) ||
+                    fwrite(&header, sizeof(header), 1, file) != 1))
+        result = RS_FAILURE;
+
+    if (fclose(file))
+        result = RS_FAILURE;
+    if (result)
+        log_error("Failed to write pack '%s'", path);
+
+    free(buckets);
+    free(entries);
+    return result;
+}
+
+Result cutil_pack_open(
+    CutilPack *restrict pack, const char *restrict filepath, u32 flags)
+{
+    *pack = (CutilPack){0};
+
+    if (cutil_platform_map_file(&pack->map, filepath, flags))
+        return RS_FAILURE;
+
+    const u8 *data = pack->map.data;
+    const u64 size = pack->map.size;
+
+    PackHeader header;
+    if (size < sizeof(header))
+        goto corrupted;
+    memcpy(&header, data, sizeof(header));
+
+    const u64 bucketCount = 1ull << min_value(header.bucketBits, 32);
+    if (header.magic != PACK_MAGIC || header.version != PACK_VERSION ||
+        header.bucketBits > 31 || header.entriesOffset > size ||
+        header.entriesOffset % 8 ||
+        header.bucketsOffset !=
+            header.entriesOffset + header.fileCount * sizeof(PackEntry) ||
+        header.namesOffset !=
+            header.bucketsOffset + (bucketCount + 1) * sizeof(u32) ||
+        header.namesOffset > size ||
+        header.namesSize > size - header.namesOffset)
+        goto corrupted;
+
+    pack->entries    = data + header.entriesOffset;
+    pack->buckets    = (const u32 *)(data + header.bucketsOffset);
+    pack->names      = (const char *)(data + header.namesOffset);
+    pack->fileCount  = header.fileCount;
+    pack->bucketBits = header.bucketBits;
+
+    // check the index once, so lookups do not have to
+    const PackEntry *entries = pack->entries;
+    for (u32 i = 0; i < header.fileCount; i++)
+    {
+        const PackEntry *entry = &entries[i];
+        if (entry->offset > size || entry->size > size - entry->offset ||
+            (u64)entry->nameOffset + entry->nameLength >= header.namesSize ||
+            pack->names[entry->nameOffset + entry->nameLength] != '\0')
+            goto corrupted;
+    }
+    for (u64 b = 0; b < bucketCount; b++)
+        if (pack->buckets[b] > pack->buckets[b + 1])
+            goto corrupted;
+    if (pack->buckets[bucketCount] != header.fileCount)
+        goto corrupted;
+
+    return RS_SUCCESS;
+
+corrupted:
+    log_error("Pack '%s' is corrupted", filepath);
+    cutil_pack_close(pack);
+    return RS_FAILURE;
+}
+
+void cutil_pack_close(CutilPack *pack)
+{
+    cutil_platform_unmap_file(&pack->map);
+    *pack = (CutilPack){0};
+}
+
+bool cutil_pack_find(
+    const CutilPack *restrict pack,
+    const char *restrict filepath,
+    CutilPackFile *restrict file)
+{
+    // localize filepath
+    u32 pathLength = 0;
+    cutil_platform_localize_file_name(NULL, filepath, &pathLength);
+    char path[pathLength];
+    cutil_platform_localize_file_name(path, filepath, &pathLength);
+
+    const char *name     = strip_executable_folder(path);
+    const u32 nameLength = strlen(name);
+    const u64 hash       = cutil_string_hash(name, nameLength);
+
+    if (!pack->fileCount)
+        return false;
+
+    const u32 bucket         = bucket_of(hash, pack->bucketBits);
+    const PackEntry *entries = pack->entries;
+    for (u32 i = pack->buckets[bucket]; i < pack->buckets[bucket + 1]; i++)
+    {
+        if (entries[i].hash != hash || entries[i].nameLength != nameLength ||
+            memcmp(pack->names + entries[i].nameOffset, name, nameLength))
+            continue;
+
+        cutil_pack_get_file(pack, i, file);
+        return true;
+    }
+
+    return false;
+}
+
+void cutil_pack_get_file(
+    const CutilPack *restrict pack, u32 index, CutilPackFile *restrict file)
+{
+    db_assert_msg(index < pack->fileCount, "Pack file index out of range");
+
+    const PackEntry *entry = (const PackEntry *)pack->entries + index;
+
+    *file = (CutilPackFile){
+        .name       = pack->names + entry->nameOffset,
+        .nameLength = entry->nameLength,
+        .data       = (const u8 *)pack->map.data + entry->offset,
+        .size       = entry->size,
+    };
+}
+
+u32 cutil_pack_get_file_count(const CutilPack *pack)
+{
+    return pack->fileCount;
+}
+
+//
+// Helper implementations
+//
+
+static const char *strip_executable_folder(const char *localized)
+{
+    const char *folder     = cutil_platform_get_executable_folder();
+    const u64 folderLength = strlen(folder);
+
+    if (strncmp(localized, folder, folderLength) == 0)
+        return localized + folderLength;
+    return localized;
+}
+
+static struct BuilderFile *
+add_builder_file(CutilPackBuilder *builder, const char *name)
+{
+    if (builder->fileCount == builder->fileCapacity)
+    {
+        const u32 capacity =
+            builder->fileCapacity ? builder->fileCapacity * 2 : 64;
+        struct BuilderFile *files =
+            realloc(builder->files, capacity * sizeof(struct BuilderFile));
+        if (!files)
+            return NULL;
+        builder->files        = files;
+        builder->fileCapacity = capacity;
+    }
+
+    // localize name
+    u32 pathLength = 0;
+    cutil_platform_localize_file_name(NULL, name, &pathLength);
+    char path[pathLength];
+    cutil_platform_localize_file_name(path, name, &pathLength);
+
+    const char *key = strip_executable_folder(path);
+
+    const u32 keyLength = strlen(key);
+
+    struct BuilderFile *file = &builder->files[builder->fileCount];
+
+    *file = (struct BuilderFile){
+        .name       = strdup(key),
+        .nameLength = keyLength,
+        .hash       = cutil_string_hash(key, keyLength),
+    };
+    if (!file->name)
+        return NULL;
+
+    builder->fileCount++;
+    return file;
+}
+
+static u32 bucket_of(u64 hash, u32 bucketBits)
+{
+    return bucketBits ? hash >> (64 - bucketBits) : 0;
+}
+
+static int compare_files(const void *a, const void *b)
+{
+    const struct BuilderFile *fileA = a;
+    const struct BuilderFile *fileB = b;
+
+    if (fileA->hash != fileB->hash)
+        return fileA->hash < fileB->hash ? -1 : 1;
+    return strcmp(fileA->name, fileB->name);
+}
+
+static Result write_padding(FILE *file, u64 size)
+{
+    static const u8 zeros[4096] = {0};
+
+    while (size)
+    {
+        const u64 length = min_value(size, sizeof(zeros));
+        if (fwrite(zeros, length, 1, file) != 1)
+            return RS_FAILURE;
+        size -= length;
+    }
+    return RS_SUCCESS;
+}
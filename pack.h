@@ -0,0 +1,178 @@
+#pragma once
+
+// Asset packs
+//
+// Many small files are stored in one pack file, so they can be opened with a
+// single mmap instead of an open, stat and close each. A pack has an aligned
+// data section, and an index sorted by the hash of each files name, so a file
+// is found in constant time and returned as a view straight into the map.
+//
+// File names are keys made with the same rules as
+// cutil_platform_localize_file_name, relative to the executable folder. The
+// path used to read a loose file finds the same file in a pack, so callers can
+// switch between the two without changing their paths.
+//
+// Kael Johnston
+
+#include "types.h"
+#include "platform.h"
+
+// the alignment of files in a pack, if the builder is not given one
+#define CUTIL_PACK_DEFAULT_ALIGNMENT 64
+
+/**
+ * A file in a pack. Everything points into the pack map, and is only valid
+ * until the pack is closed.
+ */
+typedef struct CutilPackFile
+{
+    const char *name; // the key of the file, NULL terminated
+    u32 nameLength;
+    const void *data;
+    u64 size;
+} CutilPackFile;
+
+/**
+ * An open pack. The fields are internal, use the functions below.
+ */
+typedef struct CutilPack
+{
+    CutilFileMap map;
+    const void *entries;
+    const u32 *buckets;
+    const char *names;
+    u32 fileCount;
+    u32 bucketBits;
+} CutilPack;
+
+typedef struct CutilPackBuilder CutilPackBuilder;
+
+/**
+ * Start building a pack. Files are only read when the pack is written.
+ *
+ * @param builder will be set to the new builder
+ * @param alignment the alignment of each file in the pack, must be a power of
+ * two. 0 uses CUTIL_PACK_DEFAULT_ALIGNMENT
+ *
+ * @return Result
+ *
+ * @author Kael Johnston
+ */
+Result cutil_pack_builder_create(CutilPackBuilder **builder, u32 alignment);
+
+/**
+ * Free a builder, without writing it.
+ *
+ * @author Kael Johnston
+ */
+void cutil_pack_builder_destroy(CutilPackBuilder *builder);
+
+/**
+ * Add a file on disk to the pack.
+ *
+ * @param builder the builder
+ * @param name the path the file is found with in the pack. It is localized,
+ * so use the same path that is used to read the loose file
+ * @param filepath the file to copy into the pack, it is read when the pack is
+ * written
+ *
+ * @return Result
+ *
+ * @author Kael Johnston
+ */
+Result cutil_pack_builder_add_file(
+    CutilPackBuilder *restrict builder,
+    const char *restrict name,
+    const char *restrict filepath);
+
+/**
+ * Add a file from memory to the pack. The data is copied.
+ *
+ * @param builder the builder
+ * @param name the path the file is found with in the pack
+ * @param data the contents of the file
+ * @param size the size of data
+ *
+ * @return Result
+ *
+ * @author Kael Johnston
+ */
+Result cutil_pack_builder_add_memory(
+    CutilPackBuilder *restrict builder,
+    const char *restrict name,
+    const void *restrict data,
+    const u64 size);
+
+/**
+ * Write the pack to a file. The builder can still be written again or
+ * destroyed afterwards.
+ *
+ * @param builder the builder
+ * @param filepath the pack file to write
+ *
+ * @return RS_FAILURE if a file could not be read, two files have the same
+ * name or the pack could not be written
+ *
+ * @author Kael Johnston
+ */
+Result cutil_pack_builder_write(
+    CutilPackBuilder *restrict builder, const char *restrict filepath);
+
+/**
+ * Open a pack by mapping it into memory. The index is checked, so a corrupted
+ * pack fails to open instead of returning bad views.
+ *
+ * @param pack the pack to open
+ * @param filepath the pack file
+ * @param flags CutilFileMapFlags for the map, see cutil_platform_map_file
+ *
+ * @return Result
+ *
+ * @author Kael Johnston
+ */
+Result cutil_pack_open(
+    CutilPack *restrict pack, const char *restrict filepath, u32 flags);
+
+/**
+ * Close a pack. Views into it are no longer valid.
+ *
+ * @author Kael Johnston
+ */
+void cutil_pack_close(CutilPack *pack);
+
+/**
+ * Find a file in a pack without copying it.
+ *
+ * @param pack the pack to search
+ * @param filepath the path of the file, the same path used to read the loose
+ * file
+ * @param file will be set to the file, if it is found
+ *
+ * @return true if the file is in the pack
+ *
+ * @author Kael Johnston
+ */
+bool cutil_pack_find(
+    const CutilPack *restrict pack,
+    const char *restrict filepath,
+    CutilPackFile *restrict file);
+
+/**
+ * Get a file by its position in the index, to list the contents of a pack.
+ * Files are ordered by the hash of their name.
+ *
+ * @param pack the pack
+ * @param index the position of the file, less than cutil_pack_get_file_count
+ * @param file will be set to the file
+ *
+ * @author Kael Johnston
+ */
+void cutil_pack_get_file(
+    const CutilPack *restrict pack, u32 index, CutilPackFile *restrict file);
+
+/**
+ * @return the number of files in a pack
+ *
+ * @author Kael Johnston
+ */
+u32 cutil_pack_get_file_count(const CutilPack *pack);
@@ -42,6 +42,110 @@
 
 #include "types.h"
 
+/**
+ * @brief The kind of file a path points to.
+ */
+typedef enum CutilFileType
+{
+    CUTIL_FILE_TYPE_MISSING = 0, // nothing exists at the path
+    CUTIL_FILE_TYPE_REGULAR,
+    CUTIL_FILE_TYPE_DIRECTORY,
+    CUTIL_FILE_TYPE_SYMLINK,
+    CUTIL_FILE_TYPE_OTHER, // devices, sockets, fifos
+} CutilFileType;
+
+/**
+ * @brief Everything commonly needed to know about a file, from a single query.
+ */
+typedef struct CutilFileInfo
+{
+    bool exists;
+    CutilFileType type;
+    u64 size;         // in bytes
+    i64 modifiedTime; // last modification in nanoseconds since 1970
+    u64 inode;
+    u64 device;
+} CutilFileInfo;
+
+/**
+ * @brief Flags changing how a file is mapped by cutil_platform_map_file.
+ */
+typedef enum CutilFileMapFlags
+{
+    CUTIL_FILE_MAP_DEFAULT    = 0,
+    CUTIL_FILE_MAP_POPULATE   = 1 << 0, // fault every page in while mapping
+    CUTIL_FILE_MAP_HUGE_PAGES = 1 << 1, // ask for transparent huge pages
+    CUTIL_FILE_MAP_SEQUENTIAL = 1 << 2, // pages will be read front to back
+    CUTIL_FILE_MAP_RANDOM     = 1 << 3, // pages will be read in no order
+    CUTIL_FILE_MAP_WILL_NEED  = 1 << 4, // start reading every page, no waiting
+} CutilFileMapFlags;
+
+/**
+ * @brief How a file is going to be read, so the system can read ahead (or
+ * not) to match. See cutil_platform_advise_map.
+ */
+typedef enum CutilFileAccessHint
+{
+    CUTIL_FILE_ACCESS_NORMAL = 0, // the default read ahead
+    CUTIL_FILE_ACCESS_SEQUENTIAL, // read front to back, read ahead further
+    CUTIL_FILE_ACCESS_RANDOM,     // read in no order, do not read ahead
+    CUTIL_FILE_ACCESS_WILL_NEED,  // read soon, load it into the cache now
+    CUTIL_FILE_ACCESS_DONT_NEED,  // not read again, drop it from the cache
+} CutilFileAccessHint;
+
+/**
+ * @brief One piece of the data passed to cutil_platform_write_file_iov.
+ */
+typedef struct CutilFileSegment
+{
+    const void *data;
+    u64 size;
+} CutilFileSegment;
+
+typedef enum CutilFileWriteFlags
+{
+    // reserve the disk space for the whole write before writing, so large
+    // files are not fragmented and running out of space fails up front
+    CUTIL_FILE_WRITE_PREALLOCATE = 1 << 0,
+    // add to the end of the file instead of replacing its contents
+    CUTIL_FILE_WRITE_APPEND = 1 << 1,
+    // end the file with a CRC32C of its contents, which
+    // cutil_read_file_checked verifies. Only for the write functions in
+    // file.h, and not with CUTIL_FILE_WRITE_APPEND
+    CUTIL_FILE_WRITE_CHECKSUM = 1 << 2,
+} CutilFileWriteFlags;
+
+/**
+ * @brief A read only view of a file's contents. data is NULL for empty files.
+ */
+typedef struct CutilFileMap
+{
+    const void *data;
+    u64 size;
+} CutilFileMap;
+
+/**
+ * @brief Flags changing how a file is mapped by
+ * cutil_platform_map_file_shared.
+ */
+typedef enum CutilSharedMapFlags
+{
+    CUTIL_SHARED_MAP_DEFAULT   = 0,      // read and write, create if missing
+    CUTIL_SHARED_MAP_READ_ONLY = 1 << 0, // only read, the file must exist
+} CutilSharedMapFlags;
+
+/**
+ * @brief A file mapped so that writes to data change the file. data keeps its
+ * address while the file grows, up to capacity.
+ */
+typedef struct CutilSharedFileMap
+{
+    u8 *data;
+    u64 size;     // of the file
+    u64 capacity; // the address space reserved for the file
+    i64 handle;   // the open file
+} CutilSharedFileMap;
+
 /**
  * Get the directory the program was run from.
  * This is NOT the directory the program file is in, it is the
@@ -174,6 +278,35 @@ time_t cutil_platform_get_file_modified_date(const char *filepath);
  */
 Result cutil_platform_create_folder(const char *restrict filepath);
 
+/**
+ * Create many folders, and their parent folders, at once. The paths are
+ * localized and sorted, so folders that share parents are created relative to
+ * the open parent instead of walking the whole path again.
+ *
+ * Folders created or found by this function and cutil_platform_create_folder
+ * are remembered, so creating them again does not touch the file system. The
+ * memory is cleared by the delete functions here, but not if a folder is
+ * deleted some other way. Call cutil_platform_forget_known_folders then.
+ *
+ * @param filepaths the folders to create, they must all be inside the
+ * executable folder
+ * @param count the number of folders
+ *
+ * @return RS_FAILURE if any folder could not be created. The other folders are
+ * still created.
+ *
+ * @author Kael Johnston
+ */
+Result cutil_platform_create_folders(
+    const char *const *filepaths, const u32 count);
+
+/**
+ * Forget which folders are known to exist. See cutil_platform_create_folders.
+ *
+ * @author Kael Johnston
+ */
+void cutil_platform_forget_known_folders(void);
+
 /**
  * @brief Delete folders contents. Be careful and do not
  * misuse this function. This operation is permanent.
@@ -199,3 +332,540 @@ Result cutil_platform_delete_file(const char *restrict filepath);
  * @return Result
  */
 Result cutil_platform_delete_folder(const char *restrict);
+
+/**
+ * @brief Counters filled in by cutil_platform_delete_folder_parallel.
+ */
+typedef struct CutilDeleteStats
+{
+    u64 filesDeleted;   // includes symbolic links and other non folders
+    u64 foldersDeleted; // includes the folder passed in
+    u64 errors;         // files and folders that could not be deleted
+} CutilDeleteStats;
+
+/**
+ * @brief Delete a folder and everything inside it, using several threads.
+ * Files and sub folders are opened and deleted relative to their open
+ * folder, so paths are not walked again, and a folder stays open until its
+ * sub folders are gone. At most a few hundred folders are kept open like
+ * this, deeper ones are opened by their path. Symbolic links are deleted, not
+ * followed. Like
+ * cutil_platform_delete_folder, the folder must be inside the executable
+ * folder. This operation is permanent.
+ *
+ * @param filepath the folder to delete
+ * @param threadCount the number of threads to use, 0 to pick automatically.
+ * It is capped at 64
+ * @param stats can be NULL, otherwise it is filled in with what was deleted
+ * @return RS_FAILURE if anything could not be deleted. Deleting continues
+ * past errors, so as much as possible is deleted either way.
+ */
+Result cutil_platform_delete_folder_parallel(
+    const char *restrict filepath,
+    u32 threadCount,
+    CutilDeleteStats *restrict stats);
+
+/**
+ * @brief Map a file into memory read only. The file name is localized, like
+ * all other file utilities. The view stays valid until it is passed to
+ * cutil_platform_unmap_file, even if the file is deleted.
+ *
+ * @param map will be written with the mapped view
+ * @param filepath the file to map
+ * @param flags a combination of CutilFileMapFlags. They are hints, and are
+ * ignored if the system does not support them.
+ * @return Result
+ */
+Result cutil_platform_map_file(
+    CutilFileMap *restrict map, const char *restrict filepath, u32 flags);
+
+/**
+ * @brief Release a view created by cutil_platform_map_file. The map is zeroed.
+ *
+ * @param map the view to release
+ */
+void cutil_platform_unmap_file(CutilFileMap *map);
+
+/**
+ * @brief Open a file and map it so writes through the mapping change the
+ * file. The file is locked until it is unmapped, so only one process can map
+ * it for writing, or any number for reading. The path is localized, and a
+ * file mapped for writing must be inside the executable folder.
+ *
+ * @param map will be written with the mapping
+ * @param filepath the file to map
+ * @param capacity address space to reserve, the largest the file can grow to
+ * while it is mapped
+ * @param flags a combination of CutilSharedMapFlags
+ * @return RS_FAILURE if the file could not be opened or mapped, or another
+ * process has it locked
+ */
+Result cutil_platform_map_file_shared(
+    CutilSharedFileMap *restrict map,
+    const char *restrict filepath,
+    const u64 capacity,
+    const u32 flags);
+
+/**
+ * @brief Grow a file mapped by cutil_platform_map_file_shared. The disk space
+ * is allocated now, because writing to a page with no space behind it when
+ * the disk is full would crash instead of failing here.
+ *
+ * @param map the mapping
+ * @param size the new size of the file, at most the capacity
+ * @return Result
+ */
+Result cutil_platform_grow_shared_map(
+    CutilSharedFileMap *map, const u64 size);
+
+/**
+ * @brief Shrink a file mapped by cutil_platform_map_file_shared. The mapping
+ * past the new size must not be touched until the file grows again.
+ *
+ * @param map the mapping
+ * @param size the new size of the file
+ * @return Result
+ */
+Result cutil_platform_shrink_shared_map(
+    CutilSharedFileMap *map, const u64 size);
+
+/**
+ * @brief Write the changes made through a mapping to the disk, and wait for
+ * them to get there.
+ *
+ * @param map the mapping
+ * @return Result
+ */
+Result cutil_platform_sync_shared_map(const CutilSharedFileMap *map);
+
+/**
+ * @brief Unmap, unlock and close a file mapped by
+ * cutil_platform_map_file_shared. Changes that were not synced still reach
+ * the file eventually. The map is zeroed.
+ *
+ * @param map the mapping
+ */
+void cutil_platform_unmap_file_shared(CutilSharedFileMap *map);
+
+/**
+ * @brief Tell the system how a mapped view is going to be read. It can be
+ * called again as the access pattern changes, for example with
+ * CUTIL_FILE_ACCESS_DONT_NEED once the view has been processed.
+ *
+ * @param map the view
+ * @param hint how the view will be read
+ * @return Result
+ */
+Result cutil_platform_advise_map(
+    const CutilFileMap *map, const CutilFileAccessHint hint);
+
+/**
+ * @brief Tell the system what to do with a file's cached pages.
+ * CUTIL_FILE_ACCESS_WILL_NEED reads the file into the page cache, and
+ * CUTIL_FILE_ACCESS_DONT_NEED drops it. The other hints only apply to files
+ * that are open and are rejected here, pass them to
+ * cutil_platform_advise_map instead.
+ *
+ * @param filepath the file, it is localized like all other file utilities
+ * @param hint CUTIL_FILE_ACCESS_WILL_NEED or CUTIL_FILE_ACCESS_DONT_NEED
+ * @return Result. RS_FAILURE for any other hint.
+ */
+Result cutil_platform_advise_file(
+    const char *filepath, const CutilFileAccessHint hint);
+
+/**
+ * @brief Read files into the page cache on a background thread, so loading
+ * them later does not wait on the disk. The function returns right away, and
+ * files that do not exist are skipped.
+ *
+ * @param filepaths the files to read, in the order they will be needed
+ * @param count the number of files
+ * @return RS_FAILURE if the background thread could not be started
+ */
+Result cutil_platform_prefetch_files(
+    const char *const *filepaths, const u32 count);
+
+/**
+ * @brief Write several buffers to a file with as few system calls as
+ * possible, as if they had been copied together first. Use it to write a
+ * header and its payload without staging them in one buffer.
+ *
+ * @param filepath the file to write
+ * @param segments the buffers to write, in order. Empty segments are skipped
+ * @param count the number of segments
+ * @param flags CutilFileWriteFlags
+ * @return Result
+ */
+Result cutil_platform_write_file_iov(
+    const char *restrict filepath,
+    const CutilFileSegment *restrict segments,
+    const u32 count,
+    const u32 flags);
+
+/**
+ * @brief Replace the contents of a file, only writing the parts that changed.
+ * The existing file is mapped and compared with contents in 4 KiB blocks,
+ * runs of blocks that differ are written in place, and the file is extended
+ * or truncated to size. Files that change a little between saves cost a few
+ * blocks of disk writes instead of the whole file.
+ *
+ * Unlike cutil_platform_write_file_atomic, a crash part way through can leave
+ * a mix of old and new blocks.
+ *
+ * @param filepath the file to write, it is created if it does not exist
+ * @param contents the new contents
+ * @param size the size of contents
+ * @param bytesWritten set to the number of bytes written to the file, may be
+ * NULL
+ * @return Result
+ */
+Result cutil_platform_write_file_delta(
+    const char *restrict filepath,
+    const void *restrict contents,
+    const u64 size,
+    u64 *restrict bytesWritten);
+
+// alignment of buffers, offsets and lengths for direct I/O
+#define CUTIL_PLATFORM_DIRECT_ALIGNMENT 4096
+
+/**
+ * @brief Allocate a buffer aligned to CUTIL_PLATFORM_DIRECT_ALIGNMENT. Direct
+ * reads and writes on aligned buffers go straight between the disk and the
+ * buffer, without being copied.
+ *
+ * @param size the size of the buffer, it does not have to be aligned
+ * @return the buffer, or NULL if it could not be allocated. Free it with
+ * cutil_platform_free_aligned
+ */
+void *cutil_platform_alloc_aligned(const u64 size);
+
+/**
+ * @brief Free a buffer from cutil_platform_alloc_aligned.
+ *
+ * @param buffer the buffer, may be NULL
+ */
+void cutil_platform_free_aligned(void *buffer);
+
+/**
+ * @brief Read a file with direct I/O, which skips the page cache. It is meant
+ * for very large files that are read once, where copying through the cache
+ * costs more than it saves and pushes out files that are used again. The file
+ * is read in large aligned blocks, and the tail of an unaligned file is read
+ * through a buffer. If the filesystem does not support direct I/O, the file is
+ * read normally and dropped from the cache afterwards.
+ *
+ * @param dest the file will be read into this pointer. It does not have to be
+ * aligned, but aligned buffers are not copied
+ * @param filepath the file to read
+ * @param size the maximum number of bytes to read
+ * @param bytesRead set to the number of bytes read, may be NULL
+ * @return Result
+ */
+Result cutil_platform_read_file_direct(
+    void *restrict dest,
+    const char *restrict filepath,
+    const u64 size,
+    u64 *restrict bytesRead);
+
+/**
+ * @brief Write a file with direct I/O, replacing its contents. See
+ * cutil_platform_read_file_direct. The aligned part is written straight to
+ * the disk, and the unaligned tail through the page cache. Falls back to
+ * normal writes if the filesystem does not support direct I/O.
+ *
+ * @param filepath the file to write
+ * @param contents the data to write, aligned buffers are not copied
+ * @param size the number of bytes to write
+ * @return Result
+ */
+Result cutil_platform_write_file_direct(
+    const char *restrict filepath,
+    const void *restrict contents,
+    const u64 size);
+
+/**
+ * @brief Replace a file so that it either has its old contents or all of
+ * contents, even if the system crashes. The data is written to a temporary
+ * file next to filepath, synced, renamed over filepath, and then the folder is
+ * synced. A replaced file keeps its permissions.
+ *
+ * Concurrent calls for files in the same folder share folder syncs. A call
+ * that finishes its rename while another thread is syncing the folder waits
+ * for the next sync, and that sync covers every rename made while waiting.
+ *
+ * @param filepath the file to replace, it is localized
+ * @param contents the data to write
+ * @param size the amount of data to write
+ * @return Result. RS_FAILURE is also returned if the folder sync that covered
+ * this call's rename failed.
+ */
+Result cutil_platform_write_file_atomic(
+    const char *restrict filepath, const void *restrict contents, u64 size);
+
+/**
+ * @brief Like cutil_platform_write_file_atomic, but the contents are several
+ * buffers written one after another.
+ *
+ * @param filepath the file to replace, it is localized
+ * @param segments the buffers to write, in order
+ * @param count the number of segments
+ * @return Result
+ */
+Result cutil_platform_write_file_atomic_iov(
+    const char *restrict filepath,
+    const CutilFileSegment *restrict segments,
+    const u32 count);
+
+/**
+ * @brief Copy a file without moving its contents through user space. The
+ * copy is a reflink (sharing blocks with the source) where the filesystem
+ * supports it, otherwise copy_file_range or sendfile are used. Both paths are
+ * localized, and the destination must be inside the executable folder.
+ *
+ * @param destpath the file to create or overwrite. It can not be the source,
+ * or a link to it
+ * @param srcpath the file to copy
+ * @return Result
+ */
+Result cutil_platform_copy_file(
+    const char *restrict destpath, const char *restrict srcpath);
+
+/**
+ * @brief Rename a file, replacing destpath if it exists. Other processes see
+ * either the old file or the new one, never a mix. Both paths are localized,
+ * must be inside the executable folder, and must be on the same filesystem.
+ *
+ * @param destpath the new path of the file
+ * @param srcpath the file to move
+ * @return Result
+ */
+Result cutil_platform_move_file(
+    const char *restrict destpath, const char *restrict srcpath);
+
+/**
+ * @brief Query a files existence, type, size, modification time and inode
+ * with one system call (statx on linux). The file name is localized like all
+ * other file utilities. Symbolic links are followed.
+ *
+ * If the file info cache is enabled, the result of earlier queries is reused
+ * until the file or its folder changes, and no system call is made at all.
+ *
+ * @param filepath the file to query
+ * @param info will be written with the files info. info->exists is false if
+ * the file does not exist, which is not a failure.
+ * @return RS_FAILURE if the file could not be queried for another reason, like
+ * missing permissions
+ */
+Result cutil_platform_get_file_info(
+    const char *restrict filepath, CutilFileInfo *restrict info);
+
+/**
+ * @brief Start caching the results of cutil_platform_get_file_info for the
+ * whole process. Cached entries are invalidated by a background thread
+ * watching their folders with inotify, so the cache is never stale for
+ * longer than it takes the thread to wake up. Not available on every platform.
+ *
+ * @return Result
+ */
+Result cutil_platform_enable_file_info_cache(void);
+
+/**
+ * @brief Stop caching file info, and free the cache.
+ */
+void cutil_platform_disable_file_info_cache(void);
+
+/**
+ * @brief The kinds of change a CutilWatcher reports. Changes to a path within
+ * the debounce window are merged, so several can be set at once. When the
+ * system drops changes because too many happened at once, every watched path
+ * is reported with CUTIL_WATCH_OVERFLOW, and for folders the files in them
+ * may have changed without an event of their own.
+ */
+typedef enum CutilWatchEventFlags
+{
+    CUTIL_WATCH_MODIFIED = 1 << 0, // contents or attributes changed
+    CUTIL_WATCH_CREATED  = 1 << 1, // created, or moved to the path
+    CUTIL_WATCH_DELETED  = 1 << 2, // deleted, or moved away from the path
+    CUTIL_WATCH_MOVED    = 1 << 3, // renamed to or from the path
+    CUTIL_WATCH_OVERFLOW = 1 << 4, // changes were lost, check the path again
+} CutilWatchEventFlags;
+
+/**
+ * @brief A change to a watched path. path is the folder passed to
+ * cutil_platform_watcher_add followed by the name of the file that changed,
+ * or the watched file itself.
+ */
+typedef struct CutilWatchEvent
+{
+    const char *path;
+    u32 pathLength;
+    u32 flags; // CutilWatchEventFlags
+} CutilWatchEvent;
+
+// watches files and folders for changes, see cutil_platform_watcher_create
+typedef struct CutilWatcher CutilWatcher;
+
+/**
+ * @brief called by cutil_platform_watcher_dispatch with a batch of events
+ */
+typedef void (*CutilWatchCallback)(
+    const CutilWatchEvent *events, u32 count, void *userData);
+
+/**
+ * @brief Create a watcher. A watcher reports changes to files and folders
+ * without polling them, using inotify on linux. It is not thread safe.
+ *
+ * @param watcher will be set to the new watcher
+ * @param debounceTime in seconds. A change is only reported once its path has
+ * not changed for this long, so a file written in many pieces is reported
+ * once. Changes are timed from when the watcher first sees them, so poll
+ * regularly (or wait on the watchers file descriptor).
+ * @return Result
+ */
+Result cutil_platform_watcher_create(
+    CutilWatcher **watcher, const f64 debounceTime);
+
+/**
+ * @brief Stop watching everything and free a watcher.
+ *
+ * @param watcher the watcher to destroy
+ */
+void cutil_platform_watcher_destroy(CutilWatcher *watcher);
+
+/**
+ * @brief Watch a file or folder. The path is localized. For folders, changes
+ * to the files directly inside it are reported. Files are watched through
+ * their folder, so they are still watched after being replaced by a rename,
+ * and can be watched before they exist.
+ *
+ * @param watcher the watcher
+ * @param filepath the file or folder to watch
+ * @return Result
+ */
+Result cutil_platform_watcher_add(
+    CutilWatcher *restrict watcher, const char *restrict filepath);
+
+/**
+ * @brief Get a file descriptor that becomes readable when the watcher has new
+ * changes, so the watcher can be part of an external poll loop. Do not read
+ * from it, call cutil_platform_watcher_poll instead.
+ *
+ * @param watcher the watcher
+ * @return int the file descriptor
+ */
+int cutil_platform_watcher_get_fd(CutilWatcher *watcher);
+
+/**
+ * @brief Get how long until a change that has already happened finishes its
+ * debounce window. Use it as the timeout of an external poll loop.
+ *
+ * @param watcher the watcher
+ * @return f64 seconds, or a negative number if no changes are waiting
+ */
+f64 cutil_platform_watcher_get_timeout(CutilWatcher *watcher);
+
+/**
+ * @brief Collect changes without blocking. Paths in the returned events are
+ * valid until the next call to poll or dispatch.
+ *
+ * @param watcher the watcher
+ * @param events written with up to maxEvents changes
+ * @param maxEvents the length of events. Changes that do not fit are returned
+ * by the next call, nothing is returned if it is 0.
+ * @return u32 the number of events written
+ */
+u32 cutil_platform_watcher_poll(
+    CutilWatcher *restrict watcher,
+    CutilWatchEvent *restrict events,
+    const u32 maxEvents);
+
+/**
+ * @brief Collect changes without blocking, and pass them all to callback in
+ * one batch. callback is not called if nothing changed.
+ *
+ * @param watcher the watcher
+ * @param callback called with the changes
+ * @param userData passed to callback
+ * @return u32 the number of events passed to callback
+ */
+u32 cutil_platform_watcher_dispatch(
+    CutilWatcher *watcher, CutilWatchCallback callback, void *userData);
+
+/**
+ * @brief Options for cutil_platform_directory_open. Zero initialize it for a
+ * plain listing of one folder.
+ */
+typedef struct CutilDirectoryOptions
+{
+    bool recursive;      // also list the contents of sub folders
+    u32 maxDepth;        // the deepest sub folder entered, 0 for no limit
+    const char *pattern; // a glob (see fnmatch) names must match, or NULL
+} CutilDirectoryOptions;
+
+/**
+ * @brief A file found by a CutilDirectoryIterator. The strings are only valid
+ * until the next call to cutil_platform_directory_next.
+ */
+typedef struct CutilDirectoryEntry
+{
+    const char *name; // the file name
+    const char *path; // the path relative to the listed folder
+    u32 pathLength;
+    u32 depth; // 0 for files directly inside the listed folder
+    CutilFileType type;
+    u64 inode;
+} CutilDirectoryEntry;
+
+// lists the contents of a folder, see cutil_platform_directory_open
+typedef struct CutilDirectoryIterator CutilDirectoryIterator;
+
+/**
+ * @brief Start listing a folder. The path is localized. Entries are read from
+ * the kernel in large batches, and their type comes from the listing itself,
+ * so nothing is stat'd unless cutil_platform_directory_entry_info is called.
+ * Symbolic links to folders inside it are listed but not entered, the folder
+ * itself may be a link.
+ *
+ * @param iterator will be set to the new iterator
+ * @param filepath the folder to list
+ * @param options can be NULL
+ * @return Result
+ */
+Result cutil_platform_directory_open(
+    CutilDirectoryIterator **restrict iterator,
+    const char *restrict filepath,
+    const CutilDirectoryOptions *restrict options);
+
+/**
+ * @brief Get the next entry. "." and ".." are skipped. When listing
+ * recursively, a folder is returned before its contents. Folders are entered
+ * even if their name does not match the pattern.
+ *
+ * @param iterator the iterator
+ * @param entry will be set to the next entry
+ * @return true if an entry was returned, false when there are no more entries
+ * or reading failed
+ */
+bool cutil_platform_directory_next(
+    CutilDirectoryIterator *restrict iterator,
+    CutilDirectoryEntry *restrict entry);
+
+/**
+ * @brief Get the full info of the entry last returned by
+ * cutil_platform_directory_next. It is queried relative to the open folder,
+ * so the path is not walked again.
+ *
+ * @param iterator the iterator
+ * @param info the entries info
+ * @return Result
+ */
+Result cutil_platform_directory_entry_info(
+    CutilDirectoryIterator *restrict iterator, CutilFileInfo *restrict info);
+
+/**
+ * @brief Stop listing and free the iterator.
+ *
+ * @param iterator the iterator to close
+ * @return RS_FAILURE if any folder could not be read while listing
+ */
+Result cutil_platform_directory_close(CutilDirectoryIterator *iterator);
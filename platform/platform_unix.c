@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // copy_file_range
 #include "../platform.h"
 
 #ifdef __unix__
@@ -6,33 +7,24 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
 #include <errno.h>
 #include <stdio.h>
 #include <dirent.h>
-#include <ftw.h>
 #include <string.h>
+#include <pthread.h>
 #include "../types.h"
 #include "../messenger.h"
 
 #include "../string_util.h"
-
-/**
- * @brief Localize a file name. This macro is more convientent then writing the
- * same code over and over again.
- *
- * @param inputpath the variable storing the path to localize
- * @param outputpathname the name of the localized path name. the macro
- * creates it.
- * @param outputpathlength the name of the variable storing the localized
- * filepaths length. the macro creates it
- *
- */
-#define localize_path(inputPath, outputPathName, outputPathLength)         \
-    u32 outputPathLength = 0;                                              \
-    cutil_platform_localize_file_name(NULL, inputPath, &outputPathLength); \
-    char outputPathName[outputPathLength];                                 \
-    cutil_platform_localize_file_name(                                     \
-        outputPathName, inputPath, &outputPathLength);
+#include "platform_unix.h"
 
 #define assert_executable_directory_set()                                      \
     if (g_executableDirectory == NULL)                                         \
@@ -46,9 +38,36 @@
         abort();                                                               \
     }
 
-#define assert_allowed_file_operation(path)              \
-    if (!cutil_platform_is_allowed_file_operation(path)) \
-        abort();
+// folders with atomic writes waiting for them to be synced. See
+// cutil_platform_write_file_atomic
+struct FolderSyncWaiter
+{
+    u64 ticket;
+    bool done;     // a sync started after the ticket has finished
+    Result result; // result of that sync
+    LIST_ENTRY(FolderSyncWaiter) data;
+};
+
+struct FolderSyncGroup
+{
+    char *path;
+    u64 requested; // tickets handed to writers
+    u32 users;     // writers in the group, it is freed when none are left
+    bool syncing;  // a writer is syncing the folder
+    LIST_HEAD(FolderSyncWaiterHead, FolderSyncWaiter) waiters;
+    LIST_ENTRY(FolderSyncGroup) data;
+};
+
+struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t synced;
+    u64 tempCounter;
+    LIST_HEAD(FolderSyncGroupHead, FolderSyncGroup) groups;
+} g_folderSync = {
+    .lock   = PTHREAD_MUTEX_INITIALIZER,
+    .synced = PTHREAD_COND_INITIALIZER,
+};
 
 // store the exectutable files directory
 // so that assets and other relative directories
@@ -110,18 +129,20 @@ cutil_platform_localize_file_name(char *output, const char *path, u32 *max)
     if (path[0] == '/' || path[0] == '\\' || // win thingy
         path[0] == '.')
     {
+        // the length includes the terminator, like relative paths
         if (*max == 0 || !output)
         {
-            *max = pathLength;
+            *max = pathLength + 1;
             return RS_SUCCESS;
         }
         strncpy(output, path, *max);
+        output[*max - 1] = '\0';
         for (u32 i = 0; i < *max && output[i] != '\0'; i++)
         {
             if (output[i] == '\\')
                 output[i] = CUTIL_PLATFORM_FOLDER_BREAK;
         }
-        *max = pathLength;
+        *max = pathLength + 1;
         return RS_SUCCESS;
     }
 
@@ -209,37 +230,6 @@ time_t cutil_platform_get_file_modified_date(const char *filepath)
     return data.st_ctime;
 }
 
-Result cutil_platform_create_folder(const char *filepath)
-{
-    localize_path(filepath, path, pathLength);
-
-    assert_allowed_file_operation(path);
-
-    if (path[pathLength - 2] == CUTIL_PLATFORM_FOLDER_BREAK)
-        path[pathLength - 2] = '\0';
-
-    for (char *p = path + 1; *p != '\0'; p++)
-        if (*p == CUTIL_PLATFORM_FOLDER_BREAK)
-        {
-            *p = '\0';
-            if (mkdir(path, S_IRWXU) && errno != EEXIST)
-            {
-                log_perror("Error creating file %s", path);
-                return RS_FAILURE;
-            }
-
-            *p = CUTIL_PLATFORM_FOLDER_BREAK;
-        }
-
-    if (mkdir(path, S_IRWXU) && errno != EEXIST)
-    {
-        log_perror("Failed to create file %s", path);
-        return RS_FAILURE;
-    }
-
-    return RS_SUCCESS;
-}
-
 bool cutil_platform_is_directory_empty(char *filepath)
 {
     localize_path(filepath, path, pathLength);
@@ -261,73 +251,535 @@ bool cutil_platform_is_directory_empty(char *filepath)
         return false;
 }
 
-int ftw_deleteFolderCallback(
-    const char *fpath,
-    const struct stat *sb __attribute_maybe_unused__,
-    int typeflag)
+Result cutil_platform_delete_file(const char *restrict filepath)
 {
-    if (typeflag & FTW_D)
+    localize_path(filepath, path, pathLength);
+
+    assert_allowed_file_operation(path);
+
+    // check to be sure folders are empty
+    struct stat file_stats;
+    if (stat(path, &file_stats) == -1)
+    {
+        if (errno != EEXIST)
+            log_perror("%s", path);
+        return RS_FAILURE;
+    }
+    if (!S_ISREG(file_stats.st_mode))
     {
-        DIR *folder = opendir(fpath);
-        if (readdir(folder))
+        if (!cutil_platform_is_directory_empty(path))
         {
-            return 0; // shouldn't delete folders
+            log_warning("Cannot delete file that is not empty");
+            return RS_FAILURE;
         }
     }
 
-    remove(fpath);
-    return 0;
+    if (remove(path) == -1)
+    {
+        log_perror("%s", path);
+        return RS_FAILURE;
+    }
+
+    if (!S_ISREG(file_stats.st_mode))
+        cutil_platform_forget_known_folders();
+    return RS_SUCCESS;
 }
 
-Result cutil_platform_delete_folder(const char *restrict filepath)
+Result cutil_platform_map_file(
+    CutilFileMap *restrict map, const char *restrict filepath, u32 flags)
 {
     localize_path(filepath, path, pathLength);
 
-    assert_allowed_file_operation(path);
+    *map = (CutilFileMap){0};
 
-    // get rid of the slash so the rest of the function works properly
-    if (path[pathLength - 2] == CUTIL_PLATFORM_FOLDER_BREAK)
-        path[pathLength - 2] = '\0';
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        log_perror("Failed to open file '%s'", path);
+        return RS_FAILURE;
+    }
 
-    ftw(path, &ftw_deleteFolderCallback, 256);
+    struct stat data;
+    if (fstat(fd, &data) == -1)
+    {
+        log_perror("fstat('%s') failed", path);
+        close(fd);
+        return RS_FAILURE;
+    }
 
-    if (cutil_platform_is_directory_empty(path))
+    // mmap refuses zero length mappings, an empty view is still valid
+    if (data.st_size == 0)
     {
-        remove(path);
+        close(fd);
         return RS_SUCCESS;
     }
 
-    return RS_FAILURE;
+    int mapFlags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if (flags & CUTIL_FILE_MAP_POPULATE)
+        mapFlags |= MAP_POPULATE;
+#endif
+
+    void *view = mmap(NULL, data.st_size, PROT_READ, mapFlags, fd, 0);
+    close(fd); // the mapping keeps its own reference to the file
+    if (view == MAP_FAILED)
+    {
+        log_perror("Failed to map file '%s'", path);
+        return RS_FAILURE;
+    }
+
+#ifdef MADV_HUGEPAGE
+    // only a hint, plenty of filesystems cannot back files with huge pages
+    if (flags & CUTIL_FILE_MAP_HUGE_PAGES)
+        madvise(view, data.st_size, MADV_HUGEPAGE);
+#endif
+
+    map->data = view;
+    map->size = data.st_size;
+
+    if (flags & CUTIL_FILE_MAP_SEQUENTIAL)
+        cutil_platform_advise_map(map, CUTIL_FILE_ACCESS_SEQUENTIAL);
+    else if (flags & CUTIL_FILE_MAP_RANDOM)
+        cutil_platform_advise_map(map, CUTIL_FILE_ACCESS_RANDOM);
+    if (flags & CUTIL_FILE_MAP_WILL_NEED)
+        cutil_platform_advise_map(map, CUTIL_FILE_ACCESS_WILL_NEED);
+
+    return RS_SUCCESS;
 }
 
-Result cutil_platform_delete_file(const char *restrict filepath)
+void cutil_platform_unmap_file(CutilFileMap *map)
+{
+    if (map->data && munmap((void *)map->data, map->size) == -1)
+        log_perror("munmap failed");
+    *map = (CutilFileMap){0};
+}
+
+Result cutil_platform_map_file_shared(
+    CutilSharedFileMap *restrict map,
+    const char *restrict filepath,
+    const u64 capacity,
+    const u32 flags)
 {
     localize_path(filepath, path, pathLength);
 
-    assert_allowed_file_operation(path);
+    *map = (CutilSharedFileMap){.handle = -1};
 
-    // check to be sure folders are empty
-    struct stat file_stats;
-    if (stat(path, &file_stats) == -1)
+    const bool readOnly = flags & CUTIL_SHARED_MAP_READ_ONLY;
+    if (!readOnly)
+        assert_allowed_file_operation(path);
+
+    int fd = open(
+        path, readOnly ? O_RDONLY | O_CLOEXEC : O_RDWR | O_CREAT | O_CLOEXEC,
+        0644);
+    if (fd == -1)
     {
-        if (errno != EEXIST)
-            log_perror("%s", path);
+        log_perror("Failed to open file '%s'", path);
         return RS_FAILURE;
     }
-    if (!S_ISREG(file_stats.st_mode))
+
+    if (flock(fd, (readOnly ? LOCK_SH : LOCK_EX) | LOCK_NB) == -1)
     {
-        if (!cutil_platform_is_directory_empty(path))
+        log_perror("File '%s' is open in another process", path);
+        close(fd);
+        return RS_FAILURE;
+    }
+
+    struct stat data;
+    if (fstat(fd, &data) == -1)
+    {
+        log_perror("fstat('%s') failed", path);
+        close(fd);
+        return RS_FAILURE;
+    }
+
+    // mapping past the end of the file is allowed, and the file grows into it
+    const int protection = readOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+    void *view = mmap(NULL, capacity, protection, MAP_SHARED, fd, 0);
+    if (view == MAP_FAILED)
+    {
+        log_perror("Failed to map file '%s'", path);
+        close(fd);
+        return RS_FAILURE;
+    }
+
+    *map = (CutilSharedFileMap){
+        .data     = view,
+        .size     = data.st_size,
+        .capacity = capacity,
+        .handle   = fd,
+    };
+    return RS_SUCCESS;
+}
+
+Result cutil_platform_grow_shared_map(CutilSharedFileMap *map, const u64 size)
+{
+    if (size <= map->size)
+        return RS_SUCCESS;
+
+    if (size > map->capacity)
+    {
+        log_error("The file can not grow past its mapping");
+        return RS_FAILURE;
+    }
+
+    const int error = posix_fallocate(map->handle, map->size, size - map->size);
+    if (error)
+    {
+        errno = error;
+        log_perror("Failed to grow file");
+        return RS_FAILURE;
+    }
+
+    map->size = size;
+    return RS_SUCCESS;
+}
+
+Result cutil_platform_shrink_shared_map(
+    CutilSharedFileMap *map, const u64 size)
+{
+    if (size >= map->size)
+        return RS_SUCCESS;
+
+    if (ftruncate(map->handle, size) == -1)
+    {
+        log_perror("Failed to shrink file");
+        return RS_FAILURE;
+    }
+
+    map->size = size;
+    return RS_SUCCESS;
+}
+
+Result cutil_platform_sync_shared_map(const CutilSharedFileMap *map)
+{
+    // writes through a shared mapping are in the page cache, like any other
+    if (fdatasync(map->handle) == -1)
+    {
+        log_perror("Failed to sync file");
+        return RS_FAILURE;
+    }
+    return RS_SUCCESS;
+}
+
+void cutil_platform_unmap_file_shared(CutilSharedFileMap *map)
+{
+    if (map->data && munmap(map->data, map->capacity) == -1)
+        log_perror("munmap failed");
+    if (map->handle != -1)
+        close(map->handle); // releases the lock
+    *map = (CutilSharedFileMap){.handle = -1};
+}
+
+// write all of size to fd
+static Result write_all(int fd, const void *contents, u64 size)
+{
+    const u8 *p = contents;
+    while (size)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return RS_FAILURE;
+        p += n;
+        size -= n;
+    }
+    return RS_SUCCESS;
+}
+
+// sync a folder, sharing the sync with every other writer waiting on it.
+// folder must already be localized
+static Result sync_folder_grouped(const char *folder)
+{
+    pthread_mutex_lock(&g_folderSync.lock);
+
+    struct FolderSyncGroup *group = NULL;
+    LIST_FOREACH(group, &g_folderSync.groups, data)
+    {
+        if (strcmp(group->path, folder) == 0)
+            break;
+    }
+
+    if (!group)
+    {
+        group = calloc(1, sizeof(struct FolderSyncGroup));
+        if (!group || !(group->path = strdup(folder)))
         {
-            log_warning("Cannot delete file that is not empty");
+            free(group);
+            pthread_mutex_unlock(&g_folderSync.lock);
+            log_error("Failed to allocate sync group for '%s'", folder);
             return RS_FAILURE;
         }
+        LIST_INIT(&group->waiters);
+        LIST_INSERT_HEAD(&g_folderSync.groups, group, data);
     }
 
-    if (remove(path) == -1)
+    // any sync started after this point covers our rename
+    struct FolderSyncWaiter waiter = {.ticket = ++group->requested};
+    LIST_INSERT_HEAD(&group->waiters, &waiter, data);
+    group->users++;
+
+    while (!waiter.done)
     {
-        log_perror("%s", path);
+        if (group->syncing)
+        {
+            pthread_cond_wait(&g_folderSync.synced, &g_folderSync.lock);
+            continue;
+        }
+
+        // become the leader, and sync on behalf of everyone queued so far
+        group->syncing   = true;
+        const u64 target = group->requested;
+        pthread_mutex_unlock(&g_folderSync.lock);
+
+        Result result = RS_SUCCESS;
+        int fd        = open(folder, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1 || fsync(fd) == -1)
+        {
+            log_perror("Failed to sync folder '%s'", folder);
+            result = RS_FAILURE;
+        }
+        if (fd != -1)
+            close(fd);
+
+        pthread_mutex_lock(&g_folderSync.lock);
+
+        // hand the result to the writers this sync covered, and only them
+        struct FolderSyncWaiter *covered = LIST_FIRST(&group->waiters);
+        while (covered)
+        {
+            struct FolderSyncWaiter *next = LIST_NEXT(covered, data);
+            if (covered->ticket <= target)
+            {
+                covered->done   = true;
+                covered->result = result;
+                LIST_REMOVE(covered, data);
+            }
+            covered = next;
+        }
+
+        group->syncing = false;
+        pthread_cond_broadcast(&g_folderSync.synced);
+    }
+
+    const Result result = waiter.result;
+    if (--group->users == 0)
+    {
+        LIST_REMOVE(group, data);
+        free(group->path);
+        free(group);
+    }
+    pthread_mutex_unlock(&g_folderSync.lock);
+
+    return result;
+}
+
+Result cutil_platform_write_file_atomic(
+    const char *restrict filepath, const void *restrict contents, u64 size)
+{
+    const CutilFileSegment segment = {.data = contents, .size = size};
+    return cutil_platform_write_file_atomic_iov(filepath, &segment, 1);
+}
+
+Result cutil_platform_write_file_atomic_iov(
+    const char *restrict filepath,
+    const CutilFileSegment *restrict segments,
+    const u32 count)
+{
+    localize_path(filepath, path, pathLength);
+
+    assert_allowed_file_operation(path);
+
+    // the temporary file must be in the same folder for rename to be atomic
+    pthread_mutex_lock(&g_folderSync.lock);
+    const u64 tempId = g_folderSync.tempCounter++;
+    pthread_mutex_unlock(&g_folderSync.lock);
+
+    char tempPath[pathLength + 64];
+    snprintf(
+        tempPath,
+        sizeof(tempPath),
+        "%s.tmp.%ld.%llu",
+        path,
+        (long)getpid(),
+        (unsigned long long)tempId);
+
+    int fd = open(tempPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        log_perror("Failed to create temporary file '%s'", tempPath);
+        return RS_FAILURE;
+    }
+
+    // the replaced file keeps its permissions
+    struct stat original;
+    if (stat(path, &original) == 0 &&
+        fchmod(fd, original.st_mode & 07777) == -1)
+    {
+        log_perror("Failed to set permissions of '%s'", tempPath);
+        close(fd);
+        unlink(tempPath);
+        return RS_FAILURE;
+    }
+
+    Result written = RS_SUCCESS;
+    for (u32 i = 0; i < count && !written; i++)
+        written = write_all(fd, segments[i].data, segments[i].size);
+
+    if (written || fsync(fd) == -1)
+    {
+        log_perror("Failed to write file '%s'", tempPath);
+        close(fd);
+        unlink(tempPath);
+        return RS_FAILURE;
+    }
+
+    if (close(fd) == -1 || rename(tempPath, path) == -1)
+    {
+        log_perror("Failed to replace file '%s'", path);
+        unlink(tempPath);
+        return RS_FAILURE;
+    }
+
+    // the rename is only durable once the folder is synced
+    char *folderBreak = strrchr(path, CUTIL_PLATFORM_FOLDER_BREAK);
+    if (folderBreak == path)
+        return sync_folder_grouped("/");
+    if (folderBreak)
+    {
+        *folderBreak = '\0';
+        return sync_folder_grouped(path);
+    }
+    return sync_folder_grouped(".");
+}
+
+// copy size bytes from src to dest, using the fastest method that works
+static Result copy_file_contents(int dest, int src, u64 size)
+{
+#ifdef __linux__
+    // share the blocks, nothing is copied at all
+    if (ioctl(dest, FICLONE, src) == 0)
+        return RS_SUCCESS;
+
+    u64 copied = 0;
+    while (copied < size)
+    {
+        ssize_t n = copy_file_range(src, NULL, dest, NULL, size - copied, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        copied += n;
+    }
+    if (copied == size)
+        return RS_SUCCESS;
+
+    // copy_file_range is missing, or refuses to copy between filesystems on
+    // old kernels. sendfile still keeps the data in the kernel
+    while (copied < size)
+    {
+        off_t offset = copied;
+        ssize_t n    = sendfile(dest, src, &offset, size - copied);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        copied += n;
+    }
+    if (copied == size)
+        return RS_SUCCESS;
+#else
+    u64 copied = 0;
+#endif
+
+    // last resort, copy through a buffer
+    char buffer[1 << 16];
+    while (copied < size)
+    {
+        ssize_t n = pread(src, buffer, sizeof(buffer), copied);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return RS_FAILURE;
+        if (pwrite(dest, buffer, n, copied) != n)
+            return RS_FAILURE;
+        copied += n;
+    }
+
+    return RS_SUCCESS;
+}
+
+Result cutil_platform_copy_file(
+    const char *restrict destpath, const char *restrict srcpath)
+{
+    localize_path(srcpath, src, srcLength);
+    localize_path(destpath, dest, destLength);
+
+    assert_allowed_file_operation(dest);
+
+    int srcFd = open(src, O_RDONLY | O_CLOEXEC);
+    if (srcFd == -1)
+    {
+        log_perror("Failed to open file '%s'", src);
+        return RS_FAILURE;
+    }
+
+    struct stat data;
+    if (fstat(srcFd, &data) == -1)
+    {
+        log_perror("fstat('%s') failed", src);
+        close(srcFd);
+        return RS_FAILURE;
+    }
+
+    // not truncated until it is known to be another file, copying a file
+    // onto itself, or a link to it, would empty it
+    int destFd =
+        open(dest, O_WRONLY | O_CREAT | O_CLOEXEC, data.st_mode & 0777);
+    if (destFd == -1)
+    {
+        log_perror("Failed to create file '%s'", dest);
+        close(srcFd);
         return RS_FAILURE;
     }
+
+    struct stat destData;
+    Result result = RS_FAILURE;
+    if (fstat(destFd, &destData) == -1)
+        log_perror("fstat('%s') failed", dest);
+    else if (destData.st_dev == data.st_dev && destData.st_ino == data.st_ino)
+        log_error("Cannot copy '%s' onto itself", src);
+    else if (ftruncate(destFd, 0) == -1)
+        log_perror("Failed to truncate '%s'", dest);
+    else
+    {
+        result = copy_file_contents(destFd, srcFd, data.st_size);
+        if (result)
+            log_perror("Failed to copy '%s' to '%s'", src, dest);
+    }
+
+    close(srcFd);
+    if (close(destFd) == -1)
+        result = RS_FAILURE;
+
+    return result;
+}
+
+Result cutil_platform_move_file(
+    const char *restrict destpath, const char *restrict srcpath)
+{
+    localize_path(srcpath, src, srcLength);
+    localize_path(destpath, dest, destLength);
+
+    assert_allowed_file_operation(src);
+    assert_allowed_file_operation(dest);
+
+    if (rename(src, dest) == -1)
+    {
+        log_perror("Failed to move '%s' to '%s'", src, dest);
+        return RS_FAILURE;
+    }
+
     return RS_SUCCESS;
 }
 
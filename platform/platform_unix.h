@@ -0,0 +1,30 @@
+#pragma once
+
+// Helpers shared by the unix platform sources. Not part of the public api.
+//
+// Kael Johnston
+
+#include "../platform.h"
+#include "../types.h"
+
+/**
+ * @brief Localize a file name. This macro is more convientent then writing the
+ * same code over and over again.
+ *
+ * @param inputpath the variable storing the path to localize
+ * @param outputpathname the name of the localized path name. the macro
+ * creates it.
+ * @param outputpathlength the name of the variable storing the localized
+ * filepaths length. the macro creates it
+ *
+ */
+#define localize_path(inputPath, outputPathName, outputPathLength)         \
+    u32 outputPathLength = 0;                                              \
+    cutil_platform_localize_file_name(NULL, inputPath, &outputPathLength); \
+    char outputPathName[outputPathLength];                                 \
+    cutil_platform_localize_file_name(                                     \
+        outputPathName, inputPath, &outputPathLength);
+
+#define assert_allowed_file_operation(path)              \
+    if (!cutil_platform_is_allowed_file_operation(path)) \
+        abort();
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE // readahead
+#include "../platform.h"
+
+#ifdef __unix__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../messenger.h"
+#include "../types.h"
+#include "platform_unix.h"
+
+//
+// Types
+//
+
+// files read by a prefetch thread. The paths are stored after the struct
+struct PrefetchJob
+{
+    u32 count;
+    char *paths[];
+};
+
+//
+// Helper Declerations
+//
+
+// read a whole open file into the page cache
+static void read_into_cache(int fd, u64 size);
+
+static void *prefetch_worker(void *job);
+
+//
+// Public methods
+//
+
+Result cutil_platform_advise_map(
+    const CutilFileMap *map, const CutilFileAccessHint hint)
+{
+    // empty files are not mapped
+    if (!map->data)
+        return RS_SUCCESS;
+
+    int advice = MADV_NORMAL;
+    switch (hint)
+    {
+    case CUTIL_FILE_ACCESS_NORMAL:
+        advice = MADV_NORMAL;
+        break;
+    case CUTIL_FILE_ACCESS_SEQUENTIAL:
+        advice = MADV_SEQUENTIAL;
+        break;
+    case CUTIL_FILE_ACCESS_RANDOM:
+        advice = MADV_RANDOM;
+        break;
+    case CUTIL_FILE_ACCESS_WILL_NEED:
+        advice = MADV_WILLNEED;
+        break;
+    case CUTIL_FILE_ACCESS_DONT_NEED:
+        // the map is private and read only, so pages are just read again
+        advice = MADV_DONTNEED;
+        break;
+    }
+
+    if (madvise((void *)map->data, map->size, advice) == -1)
+    {
+        log_perror("madvise failed");
+        return RS_FAILURE;
+    }
+    return RS_SUCCESS;
+}
+
+Result cutil_platform_advise_file(
+    const char *filepath, const CutilFileAccessHint hint)
+{
+    // the other hints belong to the open file, and would be dropped with the
+    // file descriptor below
+    int advice = POSIX_FADV_NORMAL;
+    switch (hint)
+    {
+    case CUTIL_FILE_ACCESS_WILL_NEED:
+        advice = POSIX_FADV_WILLNEED;
+        break;
+    case CUTIL_FILE_ACCESS_DONT_NEED:
+        advice = POSIX_FADV_DONTNEED;
+        break;
+    default:
+        log_error("Only WILL_NEED and DONT_NEED can be given for a path");
+        return RS_FAILURE;
+    }
+
+    localize_path(filepath, path, pathLength);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        log_perror("Failed to open file '%s'", path);
+        return RS_FAILURE;
+    }
+
+    const int error = posix_fadvise(fd, 0, 0, advice);
+    close(fd);
+
+    if (error)
+    {
+        errno = error;
+        log_perror("posix_fadvise('%s') failed", path);
+        return RS_FAILURE;
+    }
+    return RS_SUCCESS;
+}
+
+Result cutil_platform_prefetch_files(
+    const char *const *filepaths, const u32 count)
+{
+    if (!count)
+        return RS_SUCCESS;
+
+    // the paths are localized here, the caller's strings may not live long
+    // enough for the thread
+    u64 size = sizeof(struct PrefetchJob) + count * sizeof(char *);
+    for (u32 i = 0; i < count; i++)
+    {
+        u32 pathLength = 0;
+        cutil_platform_localize_file_name(NULL, filepaths[i], &pathLength);
+        size += pathLength;
+    }
+
+    struct PrefetchJob *job = malloc(size);
+    if (!job)
+        return RS_FAILURE;
+    job->count = count;
+
+    char *buffer = (char *)(job->paths + count);
+    for (u32 i = 0; i < count; i++)
+    {
+        u32 pathLength = 0;
+        cutil_platform_localize_file_name(NULL, filepaths[i], &pathLength);
+        cutil_platform_localize_file_name(buffer, filepaths[i], &pathLength);
+
+        job->paths[i] = buffer;
+        buffer += pathLength;
+    }
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    const int error =
+        pthread_create(&thread, &attributes, prefetch_worker, job);
+    pthread_attr_destroy(&attributes);
+
+    if (error)
+    {
+        errno = error;
+        log_perror("Failed to start prefetch thread");
+        free(job);
+        return RS_FAILURE;
+    }
+    return RS_SUCCESS;
+}
+
+//
+// Helper implementations
+//
+
+static void read_into_cache(int fd, u64 size)
+{
+#ifdef __linux__
+    // unlike WILLNEED, readahead waits until the reads have been submitted,
+    // so files are fetched in order instead of all competing at once
+    if (readahead(fd, 0, size) == 0)
+        return;
+#endif
+    posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+}
+
+static void *prefetch_worker(void *data)
+{
+    struct PrefetchJob *job = data;
+
+    for (u32 i = 0; i < job->count; i++)
+    {
+        int fd = open(job->paths[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            continue;
+
+        struct stat stats;
+        if (fstat(fd, &stats) == 0 && S_ISREG(stats.st_mode))
+            read_into_cache(fd, stats.st_size);
+        close(fd);
+    }
+
+    free(job);
+    return NULL;
+}
+
+#endif // __unix__
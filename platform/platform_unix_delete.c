@@ -0,0 +1,490 @@
+#define _GNU_SOURCE // dirent64
+#include "../platform.h"
+
+#ifdef __unix__
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "../messenger.h"
+#include "../types.h"
+#include "platform_unix.h"
+
+#define min_value(a, b) (a < b ? a : b)
+
+// the most threads used when the caller lets us pick
+#define DELETE_MAX_AUTO_THREADS 8
+// the most threads used at all
+#define DELETE_MAX_THREADS (DELETE_MAX_AUTO_THREADS * 8)
+#define DELETE_BATCH_SIZE  (64 * 1024)
+
+// folders kept open while their sub folders are deleted, at most half of
+// the descriptors the process may open. Past this, sub folders are opened and
+// removed by their whole path instead
+#define DELETE_MAX_OPEN_FOLDERS 256
+
+//
+// Types
+//
+
+// a folder that still has to be emptied and removed
+struct DeleteTask
+{
+    // sub folders are opened and removed relative to their parent while it
+    // is pinned, which keeps it open until they are gone
+    struct DeleteTask *parent;
+    int fd; // -1 until the folder is opened, and after it is read if unpinned
+    bool pinned;
+    // the folder is removed when this reaches 0. It counts the folder itself
+    // until it has been read, and each sub folder that still exists
+    atomic_uint pending;
+    char name[]; // the whole path for the folder passed in
+};
+
+struct DeleteJob
+{
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+
+    // tasks waiting to be read. It is used as a stack, so threads work depth
+    // first and the tree is removed from the bottom up as soon as possible
+    struct DeleteTask **stack;
+    u32 stackCount;
+    u32 stackCapacity;
+
+    u32 activeThreads; // threads currently reading a folder
+
+    atomic_uint pinnedFolders;
+    u32 maxPinnedFolders;
+
+    atomic_ullong filesDeleted;
+    atomic_ullong foldersDeleted;
+    atomic_ullong errors;
+};
+
+//
+// Helper Declerations
+//
+
+// add a folder to the stack
+static Result push_task(struct DeleteJob *job, struct DeleteTask *task);
+
+// read a folder, delete its files and queue its sub folders. buffer is used
+// to read the folder
+static void empty_folder(
+    struct DeleteJob *job,
+    struct DeleteTask *task,
+    u8 *buffer,
+    const u32 bufferSize);
+
+// delete a file, or queue a sub folder, of a folder being read
+static void delete_entry(
+    struct DeleteJob *job,
+    struct DeleteTask *task,
+    const char *name,
+    bool isFolder,
+    bool typeKnown);
+
+// mark one pending item of a folder as done, removing it if it was the last
+static void finish_task(struct DeleteJob *job, struct DeleteTask *task);
+
+// the whole path of a folder, for when its parent is not pinned. Free it
+static char *task_path(const struct DeleteTask *task);
+
+static void *delete_worker(void *job);
+
+//
+// Public methods
+//
+
+Result cutil_platform_delete_folder(const char *restrict filepath)
+{
+    return cutil_platform_delete_folder_parallel(filepath, 0, NULL);
+}
+
+Result cutil_platform_delete_folder_parallel(
+    const char *restrict filepath,
+    u32 threadCount,
+    CutilDeleteStats *restrict stats)
+{
+    localize_path(filepath, path, pathLength);
+
+    assert_allowed_file_operation(path);
+
+    if (stats)
+        *stats = (CutilDeleteStats){0};
+
+    // get rid of the slash so the rest of the function works properly
+    u32 length = strlen(path);
+    while (length > 1 && path[length - 1] == CUTIL_PLATFORM_FOLDER_BREAK)
+        path[--length] = '\0';
+
+    if (threadCount == 0)
+    {
+        long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount   = cpuCount > 0 ? cpuCount : 1;
+        threadCount   = min_value(threadCount, DELETE_MAX_AUTO_THREADS);
+    }
+    threadCount = min_value(threadCount, DELETE_MAX_THREADS);
+
+    struct DeleteTask *root = malloc(sizeof(struct DeleteTask) + length + 1);
+    if (!root)
+        return RS_FAILURE;
+    root->parent = NULL;
+    root->fd     = -1;
+    root->pinned = false;
+    atomic_init(&root->pending, 1);
+    memcpy(root->name, path, length + 1);
+
+    struct DeleteJob job = {
+        .lock             = PTHREAD_MUTEX_INITIALIZER,
+        .available        = PTHREAD_COND_INITIALIZER,
+        .maxPinnedFolders = DELETE_MAX_OPEN_FOLDERS,
+    };
+
+    // each thread also has the folder it is reading open
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY)
+    {
+        const u64 spare =
+            limit.rlim_cur / 2 > threadCount ? limit.rlim_cur / 2 - threadCount
+                                             : 0;
+        job.maxPinnedFolders = min_value(job.maxPinnedFolders, spare);
+    }
+
+    // folders inside are about to disappear
+    cutil_platform_forget_known_folders();
+
+    if (push_task(&job, root))
+    {
+        free(root);
+        return RS_FAILURE;
+    }
+
+    // this thread is one of the workers
+    pthread_t threads[DELETE_MAX_THREADS];
+    u32 started = 0;
+    for (; started + 1 < threadCount; started++)
+        if (pthread_create(&threads[started], NULL, delete_worker, &job))
+            break;
+
+    delete_worker(&job);
+
+    for (u32 i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    free(job.stack);
+    pthread_cond_destroy(&job.available);
+    pthread_mutex_destroy(&job.lock);
+
+    if (stats)
+        *stats = (CutilDeleteStats){
+            .filesDeleted   = atomic_load(&job.filesDeleted),
+            .foldersDeleted = atomic_load(&job.foldersDeleted),
+            .errors         = atomic_load(&job.errors),
+        };
+
+    return atomic_load(&job.errors) ? RS_FAILURE : RS_SUCCESS;
+}
+
+//
+// Helper implementations
+//
+
+static Result push_task(struct DeleteJob *job, struct DeleteTask *task)
+{
+    if (job->stackCount == job->stackCapacity)
+    {
+        u32 capacity = job->stackCapacity ? job->stackCapacity * 2 : 256;
+        struct DeleteTask **stack =
+            realloc(job->stack, capacity * sizeof(struct DeleteTask *));
+        if (!stack)
+            return RS_FAILURE;
+        job->stack         = stack;
+        job->stackCapacity = capacity;
+    }
+
+    job->stack[job->stackCount++] = task;
+    pthread_cond_signal(&job->available);
+    return RS_SUCCESS;
+}
+
+static void *delete_worker(void *data)
+{
+    struct DeleteJob *job = data;
+
+    // folders are read in large batches, which is too much for the stack. A
+    // small batch still works if it can not be allocated
+    u8 fallback[4096] __attribute__((aligned(16)));
+    u8 *batch      = malloc(DELETE_BATCH_SIZE);
+    u8 *buffer     = batch ? batch : fallback;
+    const u32 size = batch ? DELETE_BATCH_SIZE : sizeof(fallback);
+
+    pthread_mutex_lock(&job->lock);
+    for (;;)
+    {
+        // with nothing queued and nobody reading, no more work can appear
+        while (!job->stackCount && job->activeThreads)
+            pthread_cond_wait(&job->available, &job->lock);
+        if (!job->stackCount)
+            break;
+
+        struct DeleteTask *task = job->stack[--job->stackCount];
+        job->activeThreads++;
+        pthread_mutex_unlock(&job->lock);
+
+        empty_folder(job, task, buffer, size);
+
+        pthread_mutex_lock(&job->lock);
+        job->activeThreads--;
+        if (!job->activeThreads && !job->stackCount)
+            pthread_cond_broadcast(&job->available);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    free(batch);
+    return NULL;
+}
+
+static void empty_folder(
+    struct DeleteJob *job,
+    struct DeleteTask *task,
+    u8 *buffer,
+    const u32 bufferSize)
+{
+    const int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    if (task->parent && task->parent->pinned)
+        task->fd = openat(task->parent->fd, task->name, flags);
+    else if (!task->parent)
+        task->fd = open(task->name, flags);
+    else
+    {
+        char *path = task_path(task);
+        task->fd   = path ? open(path, flags) : -1;
+        free(path);
+    }
+
+    if (task->fd == -1)
+    {
+        log_perror("Failed to open folder '%s'", task->name);
+        atomic_fetch_add(&job->errors, 1);
+        finish_task(job, task);
+        return;
+    }
+
+    // sub folders check this, so it is decided before any are queued
+    task->pinned =
+        atomic_fetch_add(&job->pinnedFolders, 1) < job->maxPinnedFolders;
+    if (!task->pinned)
+        atomic_fetch_sub(&job->pinnedFolders, 1);
+
+#ifdef __linux__
+    for (;;)
+    {
+        long n = syscall(SYS_getdents64, task->fd, buffer, bufferSize);
+        if (n == -1)
+        {
+            log_perror("Failed to read folder '%s'", task->name);
+            atomic_fetch_add(&job->errors, 1);
+        }
+        if (n <= 0)
+            break;
+
+        for (long offset = 0; offset < n;)
+        {
+            const struct dirent64 *entry = (struct dirent64 *)(buffer + offset);
+            offset += entry->d_reclen;
+
+            delete_entry(
+                job,
+                task,
+                entry->d_name,
+                entry->d_type == DT_DIR,
+                entry->d_type != DT_UNKNOWN);
+        }
+    }
+#else
+    (void)buffer;
+    (void)bufferSize;
+
+    // the stream owns the descriptor it is given, so it gets a copy
+    const int streamFd = dup(task->fd);
+    DIR *folder        = streamFd == -1 ? NULL : fdopendir(streamFd);
+    if (!folder)
+    {
+        log_perror("Failed to read folder '%s'", task->name);
+        atomic_fetch_add(&job->errors, 1);
+        if (streamFd != -1)
+            close(streamFd);
+    }
+
+    struct dirent *entry;
+    while (folder && (entry = readdir(folder)))
+    {
+#ifdef DT_DIR
+        delete_entry(
+            job,
+            task,
+            entry->d_name,
+            entry->d_type == DT_DIR,
+            entry->d_type != DT_UNKNOWN);
+#else
+        delete_entry(job, task, entry->d_name, false, false);
+#endif
+    }
+
+    if (folder)
+        closedir(folder);
+#endif
+
+    // the folder has been read, what is left is waiting on sub folders. They
+    // do not use the descriptor unless the folder is pinned
+    if (!task->pinned)
+    {
+        close(task->fd);
+        task->fd = -1;
+    }
+    finish_task(job, task);
+}
+
+static void delete_entry(
+    struct DeleteJob *job,
+    struct DeleteTask *task,
+    const char *name,
+    bool isFolder,
+    bool typeKnown)
+{
+    if (name[0] == '.' &&
+        (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        return;
+
+    if (!typeKnown)
+    {
+        struct stat data;
+        isFolder = fstatat(task->fd, name, &data, AT_SYMLINK_NOFOLLOW) == 0 &&
+                   S_ISDIR(data.st_mode);
+    }
+
+    if (!isFolder)
+    {
+        if (unlinkat(task->fd, name, 0) == 0)
+            atomic_fetch_add(&job->filesDeleted, 1);
+        else if (errno != ENOENT)
+        {
+            log_perror("Failed to delete '%s'", name);
+            atomic_fetch_add(&job->errors, 1);
+        }
+        return;
+    }
+
+    // empty folders can be removed right away, without queueing
+    if (unlinkat(task->fd, name, AT_REMOVEDIR) == 0)
+    {
+        atomic_fetch_add(&job->foldersDeleted, 1);
+        return;
+    }
+
+    const u32 nameLength = strlen(name);
+    struct DeleteTask *child =
+        malloc(sizeof(struct DeleteTask) + nameLength + 1);
+    if (!child)
+    {
+        atomic_fetch_add(&job->errors, 1);
+        return;
+    }
+    child->parent = task;
+    child->fd     = -1;
+    child->pinned = false;
+    atomic_init(&child->pending, 1);
+    memcpy(child->name, name, nameLength + 1);
+
+    atomic_fetch_add(&task->pending, 1);
+
+    pthread_mutex_lock(&job->lock);
+    Result pushed = push_task(job, child);
+    pthread_mutex_unlock(&job->lock);
+
+    if (pushed)
+    {
+        // the folder is still being read, so this is never its last item
+        log_error("Failed to queue folder '%s'", name);
+        atomic_fetch_add(&job->errors, 1);
+        atomic_fetch_sub(&task->pending, 1);
+        free(child);
+    }
+}
+
+static void finish_task(struct DeleteJob *job, struct DeleteTask *task)
+{
+    while (task && atomic_fetch_sub(&task->pending, 1) == 1)
+    {
+        if (task->fd != -1)
+            close(task->fd);
+        if (task->pinned)
+            atomic_fetch_sub(&job->pinnedFolders, 1);
+
+        // the parent waits for this folder to be gone, so a pinned parent is
+        // still open
+        struct DeleteTask *parent = task->parent;
+        int removed;
+        if (parent && parent->pinned)
+            removed = unlinkat(parent->fd, task->name, AT_REMOVEDIR);
+        else if (!parent)
+            removed = rmdir(task->name);
+        else
+        {
+            char *path = task_path(task);
+            removed    = path ? rmdir(path) : -1;
+            free(path);
+        }
+
+        if (removed == 0)
+            atomic_fetch_add(&job->foldersDeleted, 1);
+        else if (errno != ENOENT)
+        {
+            log_perror("Failed to delete folder '%s'", task->name);
+            atomic_fetch_add(&job->errors, 1);
+        }
+
+        free(task);
+        task = parent;
+    }
+}
+
+static char *task_path(const struct DeleteTask *task)
+{
+    u64 length = strlen(task->name) + 1;
+    for (const struct DeleteTask *t = task->parent; t; t = t->parent)
+        length += strlen(t->name) + 1;
+
+    char *path = malloc(length);
+    if (!path)
+        return NULL;
+
+    // filled in from the end, the root holds the start of the path
+    u64 end   = length - 1;
+    path[end] = '\0';
+    for (const struct DeleteTask *t = task; t; t = t->parent)
+    {
+        const u64 nameLength = strlen(t->name);
+        end -= nameLength;
+        memcpy(path + end, t->name, nameLength);
+        if (t->parent)
+            path[--end] = CUTIL_PLATFORM_FOLDER_BREAK;
+    }
+    return path;
+}
+
+#endif // __unix__
@@ -0,0 +1,305 @@
+#define _GNU_SOURCE // O_DIRECT
+#include "../platform.h"
+
+#ifdef __unix__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../messenger.h"
+#include "../types.h"
+#include "platform_unix.h"
+
+#define min_value(a, b) (a < b ? a : b)
+
+// bytes moved by each read or write. Large requests let the disk queue deep
+// transfers without the page cache doing readahead for us
+#define DIRECT_BLOCK_SIZE (8 * 1024 * 1024)
+
+#define align_down(value) \
+    ((value) & ~(u64)(CUTIL_PLATFORM_DIRECT_ALIGNMENT - 1))
+
+#define is_aligned(pointer) \
+    (((uintptr_t)(pointer) & (CUTIL_PLATFORM_DIRECT_ALIGNMENT - 1)) == 0)
+
+//
+// Types
+//
+
+// an open file, and whether it still bypasses the page cache
+struct DirectFile
+{
+    int fd;
+    bool direct;
+    u8 *bounce; // aligned buffer for callers with unaligned memory
+};
+
+//
+// Helper Declerations
+//
+
+// open path with O_DIRECT, or normally if the filesystem rejects it
+static Result open_direct(
+    struct DirectFile *file, const char *path, int flags, mode_t mode);
+
+static void close_direct(struct DirectFile *file);
+
+// go back to using the page cache, for the tail or after a failed transfer
+static void disable_direct(struct DirectFile *file);
+
+// get the bounce buffer if memory can not be used for direct I/O as is
+static u8 *get_bounce(struct DirectFile *file, const void *memory);
+
+// read up to length bytes at offset. Returns the number of bytes read, which
+// is only short at the end of the file, or -1
+static i64 read_blocks(
+    struct DirectFile *file, u8 *dest, const u64 offset, const u64 length);
+
+// write length bytes at offset
+static Result write_blocks(
+    struct DirectFile *file,
+    const u8 *contents,
+    const u64 offset,
+    const u64 length);
+
+//
+// Public methods
+//
+
+void *cutil_platform_alloc_aligned(const u64 size)
+{
+    void *buffer = NULL;
+    const int error =
+        posix_memalign(&buffer, CUTIL_PLATFORM_DIRECT_ALIGNMENT, size);
+    if (error)
+        return NULL;
+    return buffer;
+}
+
+void cutil_platform_free_aligned(void *buffer) { free(buffer); }
+
+Result cutil_platform_read_file_direct(
+    void *restrict dest,
+    const char *restrict filepath,
+    const u64 size,
+    u64 *restrict bytesRead)
+{
+    localize_path(filepath, path, pathLength);
+
+    if (bytesRead)
+        *bytesRead = 0;
+
+    struct DirectFile file;
+    if (open_direct(&file, path, O_RDONLY, 0))
+        return RS_FAILURE;
+
+    struct stat data;
+    if (fstat(file.fd, &data) == -1)
+    {
+        log_perror("fstat('%s') failed", path);
+        close_direct(&file);
+        return RS_FAILURE;
+    }
+
+    const u64 length = min_value(size, (u64)data.st_size);
+    const u64 body   = align_down(length);
+
+    i64 read = read_blocks(&file, dest, 0, body);
+    if (read == (i64)body && length > body)
+    {
+        // the file ends part way through a block, which O_DIRECT can only
+        // read into an aligned buffer. Read the few bytes left normally
+        disable_direct(&file);
+        const i64 tail =
+            read_blocks(&file, (u8 *)dest + body, body, length - body);
+        read = tail == -1 ? -1 : read + tail;
+    }
+
+    if (read == -1)
+    {
+        log_perror("Failed to read file '%s'", path);
+        close_direct(&file);
+        return RS_FAILURE;
+    }
+
+    // anything that went through the page cache is not needed again
+    posix_fadvise(file.fd, 0, 0, POSIX_FADV_DONTNEED);
+    close_direct(&file);
+
+    if (bytesRead)
+        *bytesRead = read;
+    return RS_SUCCESS;
+}
+
+Result cutil_platform_write_file_direct(
+    const char *restrict filepath,
+    const void *restrict contents,
+    const u64 size)
+{
+    localize_path(filepath, path, pathLength);
+    assert_allowed_file_operation(path);
+
+    struct DirectFile file;
+    if (open_direct(&file, path, O_WRONLY | O_CREAT | O_TRUNC, 0644))
+        return RS_FAILURE;
+
+    const u64 body = align_down(size);
+
+    Result result = write_blocks(&file, contents, 0, body);
+    if (result == RS_SUCCESS && size > body)
+    {
+        // O_DIRECT can only write whole blocks, so the tail is written through
+        // the page cache
+        disable_direct(&file);
+        result = write_blocks(
+            &file, (const u8 *)contents + body, body, size - body);
+    }
+
+    if (result)
+    {
+        log_perror("Failed to write file '%s'", path);
+        close_direct(&file);
+        return RS_FAILURE;
+    }
+
+    close_direct(&file);
+    return RS_SUCCESS;
+}
+
+//
+// Helper implementations
+//
+
+static Result open_direct(
+    struct DirectFile *file, const char *path, int flags, mode_t mode)
+{
+    *file = (struct DirectFile){.fd = -1};
+
+#ifdef O_DIRECT
+    file->fd     = open(path, flags | O_DIRECT | O_CLOEXEC, mode);
+    file->direct = file->fd != -1;
+
+    // tmpfs and some network filesystems refuse O_DIRECT
+    if (file->fd == -1 && errno == EINVAL)
+        file->fd = open(path, flags | O_CLOEXEC, mode);
+#else
+    file->fd = open(path, flags | O_CLOEXEC, mode);
+#endif
+
+    if (file->fd == -1)
+    {
+        log_perror("Failed to open file '%s'", path);
+        return RS_FAILURE;
+    }
+    return RS_SUCCESS;
+}
+
+static void close_direct(struct DirectFile *file)
+{
+    cutil_platform_free_aligned(file->bounce);
+    close(file->fd);
+    *file = (struct DirectFile){.fd = -1};
+}
+
+static void disable_direct(struct DirectFile *file)
+{
+#ifdef O_DIRECT
+    if (!file->direct)
+        return;
+
+    const int flags = fcntl(file->fd, F_GETFL);
+    if (flags != -1)
+        fcntl(file->fd, F_SETFL, flags & ~O_DIRECT);
+    file->direct = false;
+#else
+    (void)file;
+#endif
+}
+
+static u8 *get_bounce(struct DirectFile *file, const void *memory)
+{
+    if (!file->direct || is_aligned(memory))
+        return NULL;
+
+    if (!file->bounce)
+    {
+        file->bounce = cutil_platform_alloc_aligned(DIRECT_BLOCK_SIZE);
+
+        // a plain read is still better than failing
+        if (!file->bounce)
+            disable_direct(file);
+    }
+    return file->bounce;
+}
+
+static i64 read_blocks(
+    struct DirectFile *file, u8 *dest, const u64 offset, const u64 length)
+{
+    u64 done = 0;
+    while (done < length)
+    {
+        const u64 count = min_value(length - done, DIRECT_BLOCK_SIZE);
+        u8 *bounce      = get_bounce(file, dest + done);
+        u8 *target      = bounce ? bounce : dest + done;
+
+        ssize_t n = pread(file->fd, target, count, offset + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EINVAL && file->direct)
+        {
+            // the open succeeded but the filesystem still refuses the
+            // transfer, for example with a larger block size than ours
+            disable_direct(file);
+            continue;
+        }
+        if (n == -1)
+            return -1;
+        if (n == 0)
+            break; // the file was truncated while reading
+
+        if (bounce)
+            memcpy(dest + done, bounce, n);
+        done += n;
+    }
+    return done;
+}
+
+static Result write_blocks(
+    struct DirectFile *file,
+    const u8 *contents,
+    const u64 offset,
+    const u64 length)
+{
+    u64 done = 0;
+    while (done < length)
+    {
+        const u64 count  = min_value(length - done, DIRECT_BLOCK_SIZE);
+        u8 *bounce       = get_bounce(file, contents + done);
+        const u8 *source = contents + done;
+        if (bounce)
+        {
+            memcpy(bounce, source, count);
+            source = bounce;
+        }
+
+        ssize_t n = pwrite(file->fd, source, count, offset + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EINVAL && file->direct)
+        {
+            disable_direct(file);
+            continue;
+        }
+        if (n == -1)
+            return RS_FAILURE;
+        done += n;
+    }
+    return RS_SUCCESS;
+}
+
+#endif // __unix__
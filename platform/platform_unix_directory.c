@@ -0,0 +1,387 @@
+#define _GNU_SOURCE // statx
+#include "../platform.h"
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "../messenger.h"
+#include "../types.h"
+#include "platform_unix.h"
+
+// bytes of entries read from the kernel at once, for each open folder
+#define DIRECTORY_BATCH_SIZE (64 * 1024)
+
+//
+// Types
+//
+
+// the layout getdents64 writes
+struct LinuxDirent64
+{
+    u64 d_ino;
+    i64 d_off;
+    u16 d_reclen;
+    u8 d_type;
+    char d_name[];
+};
+
+// an open folder in the stack of folders being listed
+struct DirectoryLevel
+{
+    int fd;
+    u8 *buffer;
+    u32 used;       // bytes in buffer
+    u32 offset;     // the next entry in buffer
+    u32 pathLength; // the length of the path of this folder
+};
+
+struct CutilDirectoryIterator
+{
+    CutilDirectoryOptions options;
+    char *pattern;
+
+    struct DirectoryLevel *levels;
+    u32 levelCount;
+    u32 levelCapacity;
+
+    // the path of the current entry, relative to the listed folder
+    char *path;
+    u32 pathCapacity;
+
+    // the last entry returned, and whether it should be entered next
+    const char *lastName;
+    bool lastIsFolder;
+
+    bool failed;
+};
+
+//
+// Helper Declerations
+//
+
+// open a folder and push it on the stack
+static Result push_level(
+    CutilDirectoryIterator *iterator, int parentFd, const char *name);
+
+// close the folder on the top of the stack
+static void pop_level(CutilDirectoryIterator *iterator);
+
+// push the folder last returned by next
+static void enter_last_folder(CutilDirectoryIterator *iterator);
+
+// make sure the path buffer can hold length bytes
+static Result reserve_path(CutilDirectoryIterator *iterator, u32 length);
+
+static CutilFileType file_type_from_dirent(u8 type);
+static CutilFileType file_type_from_mode(u32 mode);
+
+//
+// Public methods
+//
+
+Result cutil_platform_directory_open(
+    CutilDirectoryIterator **restrict iterator,
+    const char *restrict filepath,
+    const CutilDirectoryOptions *restrict options)
+{
+    localize_path(filepath, path, pathLength);
+
+    *iterator = NULL;
+
+    CutilDirectoryIterator *it = calloc(1, sizeof(CutilDirectoryIterator));
+    if (!it)
+        return RS_FAILURE;
+
+    if (options)
+        it->options = *options;
+    if (options && options->pattern)
+    {
+        if (!(it->pattern = strdup(options->pattern)))
+        {
+            free(it);
+            return RS_FAILURE;
+        }
+        it->options.pattern = it->pattern;
+    }
+
+    if (reserve_path(it, 256) || push_level(it, AT_FDCWD, path))
+    {
+        cutil_platform_directory_close(it);
+        return RS_FAILURE;
+    }
+    it->levels[0].pathLength = 0;
+    it->path[0]              = '\0';
+
+    *iterator = it;
+    return RS_SUCCESS;
+}
+
+bool cutil_platform_directory_next(
+    CutilDirectoryIterator *restrict iterator,
+    CutilDirectoryEntry *restrict entry)
+{
+    while (iterator->levelCount)
+    {
+        // enter the folder found last time
+        if (iterator->lastIsFolder)
+            enter_last_folder(iterator);
+
+        struct DirectoryLevel *level =
+            &iterator->levels[iterator->levelCount - 1];
+
+        if (level->offset >= level->used)
+        {
+            long n = syscall(
+                SYS_getdents64, level->fd, level->buffer, DIRECTORY_BATCH_SIZE);
+            if (n == -1)
+            {
+                log_perror("Failed to read folder entries");
+                iterator->failed = true;
+            }
+            if (n <= 0)
+            {
+                pop_level(iterator);
+                continue;
+            }
+            level->used   = n;
+            level->offset = 0;
+        }
+
+        const struct LinuxDirent64 *dirent =
+            (const struct LinuxDirent64 *)(level->buffer + level->offset);
+        level->offset += dirent->d_reclen;
+
+        const char *name = dirent->d_name;
+        if (name[0] == '.' &&
+            (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+
+        CutilFileType type = file_type_from_dirent(dirent->d_type);
+        if (dirent->d_type == DT_UNKNOWN)
+        {
+            // some filesystems do not fill in the type
+            struct stat data;
+            if (fstatat(level->fd, name, &data, AT_SYMLINK_NOFOLLOW) == 0)
+                type = file_type_from_mode(data.st_mode);
+        }
+
+        const u32 depth      = iterator->levelCount - 1;
+        const u32 nameLength = strlen(name);
+        if (reserve_path(iterator, level->pathLength + nameLength + 1))
+        {
+            iterator->failed = true;
+            return false;
+        }
+        memcpy(iterator->path + level->pathLength, name, nameLength + 1);
+
+        iterator->lastName     = name;
+        iterator->lastIsFolder = type == CUTIL_FILE_TYPE_DIRECTORY &&
+                                 iterator->options.recursive &&
+                                 (!iterator->options.maxDepth ||
+                                  depth < iterator->options.maxDepth);
+
+        // folders that do not match are still entered
+        if (iterator->options.pattern &&
+            fnmatch(iterator->options.pattern, name, 0) != 0)
+            continue;
+
+        *entry = (CutilDirectoryEntry){
+            .name       = name,
+            .path       = iterator->path,
+            .pathLength = level->pathLength + nameLength,
+            .depth      = depth,
+            .type       = type,
+            .inode      = dirent->d_ino,
+        };
+        return true;
+    }
+
+    return false;
+}
+
+Result cutil_platform_directory_entry_info(
+    CutilDirectoryIterator *restrict iterator, CutilFileInfo *restrict info)
+{
+    *info = (CutilFileInfo){0};
+
+    if (!iterator->levelCount || !iterator->lastName)
+        return RS_FAILURE;
+
+    const int fd = iterator->levels[iterator->levelCount - 1].fd;
+
+    struct statx data;
+    if (statx(
+            fd,
+            iterator->lastName,
+            AT_STATX_SYNC_AS_STAT,
+            STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO,
+            &data) == -1)
+    {
+        if (errno == ENOENT)
+            return RS_SUCCESS; // deleted since it was listed
+        log_perror("Failed to query '%s'", iterator->path);
+        return RS_FAILURE;
+    }
+
+    info->exists = true;
+    info->type   = file_type_from_mode(data.stx_mode);
+    info->size   = data.stx_size;
+    info->modifiedTime =
+        data.stx_mtime.tv_sec * 1000000000ll + data.stx_mtime.tv_nsec;
+    info->inode  = data.stx_ino;
+    info->device = ((u64)data.stx_dev_major << 32) | data.stx_dev_minor;
+    return RS_SUCCESS;
+}
+
+Result cutil_platform_directory_close(CutilDirectoryIterator *iterator)
+{
+    while (iterator->levelCount)
+        pop_level(iterator);
+
+    for (u32 i = 0; i < iterator->levelCapacity; i++)
+        free(iterator->levels[i].buffer);
+
+    const bool failed = iterator->failed;
+
+    free(iterator->levels);
+    free(iterator->path);
+    free(iterator->pattern);
+    free(iterator);
+
+    return failed ? RS_FAILURE : RS_SUCCESS;
+}
+
+//
+// Helper implementations
+//
+
+static Result push_level(
+    CutilDirectoryIterator *iterator, int parentFd, const char *name)
+{
+    if (iterator->levelCount == iterator->levelCapacity)
+    {
+        const u32 capacity =
+            iterator->levelCapacity ? iterator->levelCapacity * 2 : 8;
+        struct DirectoryLevel *levels = realloc(
+            iterator->levels, capacity * sizeof(struct DirectoryLevel));
+        if (!levels)
+            return RS_FAILURE;
+        memset(
+            levels + iterator->levelCapacity,
+            0,
+            (capacity - iterator->levelCapacity) *
+                sizeof(struct DirectoryLevel));
+        iterator->levels        = levels;
+        iterator->levelCapacity = capacity;
+    }
+
+    struct DirectoryLevel *level = &iterator->levels[iterator->levelCount];
+
+    // buffers are kept when a level is popped, and reused
+    if (!level->buffer && !(level->buffer = malloc(DIRECTORY_BATCH_SIZE)))
+        return RS_FAILURE;
+
+    // the folder being listed may be a link to a folder, like the listing
+    // before it. Links inside it are not followed
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    if (iterator->levelCount)
+        flags |= O_NOFOLLOW;
+    level->fd = openat(parentFd, name, flags);
+    if (level->fd == -1)
+    {
+        log_perror("Failed to open folder '%s'", name);
+        iterator->failed = true;
+        return RS_FAILURE;
+    }
+
+    level->used   = 0;
+    level->offset = 0;
+    iterator->levelCount++;
+    return RS_SUCCESS;
+}
+
+static void pop_level(CutilDirectoryIterator *iterator)
+{
+    struct DirectoryLevel *level = &iterator->levels[--iterator->levelCount];
+    close(level->fd);
+    level->fd = -1;
+
+    // the entry names pointed into this levels buffer
+    iterator->lastName     = NULL;
+    iterator->lastIsFolder = false;
+}
+
+static void enter_last_folder(CutilDirectoryIterator *iterator)
+{
+    iterator->lastIsFolder = false;
+
+    const int parentFd   = iterator->levels[iterator->levelCount - 1].fd;
+    const u32 pathLength = strlen(iterator->path);
+
+    if (reserve_path(iterator, pathLength + 2))
+    {
+        iterator->failed = true;
+        return;
+    }
+
+    if (push_level(iterator, parentFd, iterator->lastName))
+        return;
+
+    iterator->path[pathLength]     = CUTIL_PLATFORM_FOLDER_BREAK;
+    iterator->path[pathLength + 1] = '\0';
+    iterator->levels[iterator->levelCount - 1].pathLength = pathLength + 1;
+}
+
+static Result reserve_path(CutilDirectoryIterator *iterator, u32 length)
+{
+    if (length <= iterator->pathCapacity)
+        return RS_SUCCESS;
+
+    u32 capacity = iterator->pathCapacity ? iterator->pathCapacity : 256;
+    while (capacity < length)
+        capacity *= 2;
+
+    char *path = realloc(iterator->path, capacity);
+    if (!path)
+        return RS_FAILURE;
+    iterator->path         = path;
+    iterator->pathCapacity = capacity;
+    return RS_SUCCESS;
+}
+
+static CutilFileType file_type_from_dirent(u8 type)
+{
+    switch (type)
+    {
+    case DT_REG:
+        return CUTIL_FILE_TYPE_REGULAR;
+    case DT_DIR:
+        return CUTIL_FILE_TYPE_DIRECTORY;
+    case DT_LNK:
+        return CUTIL_FILE_TYPE_SYMLINK;
+    default:
+        return CUTIL_FILE_TYPE_OTHER;
+    }
+}
+
+static CutilFileType file_type_from_mode(u32 mode)
+{
+    if (S_ISREG(mode))
+        return CUTIL_FILE_TYPE_REGULAR;
+    if (S_ISDIR(mode))
+        return CUTIL_FILE_TYPE_DIRECTORY;
+    if (S_ISLNK(mode))
+        return CUTIL_FILE_TYPE_SYMLINK;
+    return CUTIL_FILE_TYPE_OTHER;
+}
+
+#endif // __linux__
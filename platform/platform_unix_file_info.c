@@ -0,0 +1,589 @@
+#define _GNU_SOURCE // statx
+#include "../platform.h"
+
+#ifdef __unix__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "../messenger.h"
+#include "../string_util.h"
+#include "../types.h"
+#include "platform_unix.h"
+
+// the cache grows when it is more than this full
+#define INFO_CACHE_MAX_LOAD 0.7
+#define INFO_CACHE_INITIAL_CAPACITY 1024
+
+// changes that invalidate the info of a file or its folder
+#define INFO_CACHE_WATCH_MASK                                                \
+    (IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |       \
+     IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+//
+// Types
+//
+
+struct InfoCacheEntry
+{
+    char *path; // NULL for empty slots
+    u64 hash;
+    bool valid; // false once the file might have changed
+    CutilFileInfo info;
+};
+
+// a spelling of a watched folder. The same folder can be reached by more than
+// one path, and inotify gives all of them one watch
+struct WatchedFolder
+{
+    char *path;
+    u32 pathLength;
+    struct WatchedFolder *next;
+};
+
+struct
+{
+    bool enabled;
+    pthread_rwlock_t lock;
+
+    struct InfoCacheEntry *entries;
+    u64 capacity;
+    u64 count;
+
+    // bumped by every invalidation, so a query racing with a change does not
+    // cache what it read
+    u64 generation;
+
+    int inotifyFd;
+    int stopPipe[2];
+    pthread_t thread;
+
+    // indexed by watch descriptor
+    struct WatchedFolder **folders;
+    u32 folderCapacity;
+} g_infoCache = {
+    .lock      = PTHREAD_RWLOCK_INITIALIZER,
+    .inotifyFd = -1,
+    .stopPipe  = {-1, -1},
+};
+
+//
+// Helper Declerations
+//
+
+// query the file system directly
+static Result query_file_info(const char *path, CutilFileInfo *info);
+
+// find the slot of a path, or the empty slot it would be placed in.
+// the lock must be held
+static struct InfoCacheEntry *find_entry(const char *path, u64 hash);
+
+// add or update an entry. the write lock must be held
+static void store_entry(const char *path, u64 hash, const CutilFileInfo *info);
+
+// mark an entry as changed. the write lock must be held
+static void invalidate_path(const char *path, u64 length);
+
+// mark every entry under a folder as changed. the write lock must be held
+static void invalidate_prefix(const char *path, u32 length);
+
+// watch the folder a path is in, and the path itself if it is a folder.
+// selfWatched is set if the path itself is watched. RS_FAILURE if the folder
+// is not watched, then changes would be missed and nothing can be cached
+static Result watch_path(const char *path, bool *selfWatched);
+
+#ifdef __linux__
+// remember a watch descriptor and the folder it watches. the write lock must
+// be held
+static Result remember_watch(int wd, const char *folder);
+
+// drains inotify and invalidates entries
+static void *info_cache_thread(void *data);
+#endif
+
+//
+// Public methods
+//
+
+Result cutil_platform_get_file_info(
+    const char *restrict filepath, CutilFileInfo *restrict info)
+{
+    localize_path(filepath, path, pathLength);
+
+    if (!__atomic_load_n(&g_infoCache.enabled, __ATOMIC_ACQUIRE))
+        return query_file_info(path, info);
+
+    const u64 hash = cutil_string_hash(path, strlen(path));
+
+    pthread_rwlock_rdlock(&g_infoCache.lock);
+    struct InfoCacheEntry *entry = find_entry(path, hash);
+    if (entry && entry->path && entry->valid)
+    {
+        *info = entry->info;
+        pthread_rwlock_unlock(&g_infoCache.lock);
+        return RS_SUCCESS;
+    }
+    pthread_rwlock_unlock(&g_infoCache.lock);
+
+    // watch before querying, so any change after the query is seen. The
+    // folder may not exist yet, or the watch limit may be reached
+    bool selfWatched     = false;
+    const bool cacheable = watch_path(path, &selfWatched) == RS_SUCCESS;
+
+    pthread_rwlock_rdlock(&g_infoCache.lock);
+    const u64 generation = g_infoCache.generation;
+    pthread_rwlock_unlock(&g_infoCache.lock);
+
+    if (query_file_info(path, info))
+        return RS_FAILURE;
+
+    // folders are only up to date if they are watched themselves
+    if (!cacheable || (info->type == CUTIL_FILE_TYPE_DIRECTORY && !selfWatched))
+        return RS_SUCCESS;
+
+    // if anything was invalidated while querying, the result may already be
+    // stale, so it is returned but not cached
+    pthread_rwlock_wrlock(&g_infoCache.lock);
+    if (g_infoCache.enabled && g_infoCache.generation == generation)
+        store_entry(path, hash, info);
+    pthread_rwlock_unlock(&g_infoCache.lock);
+
+    return RS_SUCCESS;
+}
+
+#ifdef __linux__
+
+Result cutil_platform_enable_file_info_cache(void)
+{
+    pthread_rwlock_wrlock(&g_infoCache.lock);
+
+    if (g_infoCache.enabled)
+    {
+        pthread_rwlock_unlock(&g_infoCache.lock);
+        return RS_SUCCESS;
+    }
+
+    g_infoCache.entries =
+        calloc(INFO_CACHE_INITIAL_CAPACITY, sizeof(struct InfoCacheEntry));
+    g_infoCache.capacity = INFO_CACHE_INITIAL_CAPACITY;
+    g_infoCache.count    = 0;
+
+    g_infoCache.inotifyFd = inotify_init1(IN_CLOEXEC);
+    if (!g_infoCache.entries || g_infoCache.inotifyFd == -1 ||
+        pipe2(g_infoCache.stopPipe, O_CLOEXEC) == -1)
+    {
+        log_perror("Failed to set up the file info cache");
+        goto fail;
+    }
+
+    if (pthread_create(&g_infoCache.thread, NULL, info_cache_thread, NULL))
+    {
+        log_error("Failed to start the file info cache thread");
+        goto fail;
+    }
+
+    __atomic_store_n(&g_infoCache.enabled, true, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&g_infoCache.lock);
+    return RS_SUCCESS;
+
+fail:
+    free(g_infoCache.entries);
+    g_infoCache.entries = NULL;
+    if (g_infoCache.inotifyFd != -1)
+        close(g_infoCache.inotifyFd);
+    for (u32 i = 0; i < 2; i++)
+        if (g_infoCache.stopPipe[i] != -1)
+            close(g_infoCache.stopPipe[i]);
+    g_infoCache.inotifyFd   = -1;
+    g_infoCache.stopPipe[0] = g_infoCache.stopPipe[1] = -1;
+    pthread_rwlock_unlock(&g_infoCache.lock);
+    return RS_FAILURE;
+}
+
+void cutil_platform_disable_file_info_cache(void)
+{
+    pthread_rwlock_wrlock(&g_infoCache.lock);
+    if (!g_infoCache.enabled)
+    {
+        pthread_rwlock_unlock(&g_infoCache.lock);
+        return;
+    }
+    __atomic_store_n(&g_infoCache.enabled, false, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&g_infoCache.lock);
+
+    // wake the thread, it exits when the pipe is readable
+    const char stop = 0;
+    if (write(g_infoCache.stopPipe[1], &stop, 1) == -1)
+        log_perror("Failed to stop the file info cache thread");
+    pthread_join(g_infoCache.thread, NULL);
+
+    pthread_rwlock_wrlock(&g_infoCache.lock);
+
+    for (u64 i = 0; i < g_infoCache.capacity; i++)
+        free(g_infoCache.entries[i].path);
+    free(g_infoCache.entries);
+    g_infoCache.entries  = NULL;
+    g_infoCache.capacity = 0;
+    g_infoCache.count    = 0;
+
+    for (u32 i = 0; i < g_infoCache.folderCapacity; i++)
+    {
+        struct WatchedFolder *folder = g_infoCache.folders[i];
+        while (folder)
+        {
+            struct WatchedFolder *next = folder->next;
+            free(folder->path);
+            free(folder);
+            folder = next;
+        }
+    }
+    free(g_infoCache.folders);
+    g_infoCache.folders        = NULL;
+    g_infoCache.folderCapacity = 0;
+
+    close(g_infoCache.inotifyFd);
+    close(g_infoCache.stopPipe[0]);
+    close(g_infoCache.stopPipe[1]);
+    g_infoCache.inotifyFd   = -1;
+    g_infoCache.stopPipe[0] = g_infoCache.stopPipe[1] = -1;
+
+    pthread_rwlock_unlock(&g_infoCache.lock);
+}
+
+#else
+
+Result cutil_platform_enable_file_info_cache(void)
+{
+    log_warning("The file info cache is not supported on this platform");
+    return RS_FAILURE;
+}
+
+void cutil_platform_disable_file_info_cache(void) {}
+
+#endif
+
+//
+// Helper implementations
+//
+
+static CutilFileType file_type_from_mode(u32 mode)
+{
+    if (S_ISREG(mode))
+        return CUTIL_FILE_TYPE_REGULAR;
+    if (S_ISDIR(mode))
+        return CUTIL_FILE_TYPE_DIRECTORY;
+    if (S_ISLNK(mode))
+        return CUTIL_FILE_TYPE_SYMLINK;
+    return CUTIL_FILE_TYPE_OTHER;
+}
+
+static Result query_file_info(const char *path, CutilFileInfo *info)
+{
+    *info = (CutilFileInfo){0};
+
+#ifdef STATX_BASIC_STATS
+    struct statx data;
+    if (statx(
+            AT_FDCWD,
+            path,
+            AT_STATX_SYNC_AS_STAT,
+            STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO,
+            &data) == 0)
+    {
+        info->exists       = true;
+        info->type         = file_type_from_mode(data.stx_mode);
+        info->size         = data.stx_size;
+        info->modifiedTime = data.stx_mtime.tv_sec * 1000000000ll +
+                             data.stx_mtime.tv_nsec;
+        info->inode  = data.stx_ino;
+        info->device = ((u64)data.stx_dev_major << 32) | data.stx_dev_minor;
+        return RS_SUCCESS;
+    }
+#else
+    struct stat data;
+    if (stat(path, &data) == 0)
+    {
+        info->exists       = true;
+        info->type         = file_type_from_mode(data.st_mode);
+        info->size         = data.st_size;
+        info->modifiedTime = data.st_mtim.tv_sec * 1000000000ll +
+                             data.st_mtim.tv_nsec;
+        info->inode  = data.st_ino;
+        info->device = data.st_dev;
+        return RS_SUCCESS;
+    }
+#endif
+
+    if (errno == ENOENT || errno == ENOTDIR)
+        return RS_SUCCESS; // the file does not exist, which is not a failure
+
+    log_perror("Failed to query file '%s'", path);
+    return RS_FAILURE;
+}
+
+static struct InfoCacheEntry *find_entry(const char *path, u64 hash)
+{
+    if (!g_infoCache.capacity)
+        return NULL;
+
+    const u64 mask = g_infoCache.capacity - 1;
+    for (u64 i = hash & mask;; i = (i + 1) & mask)
+    {
+        struct InfoCacheEntry *entry = &g_infoCache.entries[i];
+        if (!entry->path ||
+            (entry->hash == hash && strcmp(entry->path, path) == 0))
+            return entry;
+    }
+}
+
+static void store_entry(const char *path, u64 hash, const CutilFileInfo *info)
+{
+    // entries are never removed, only invalidated, so the table only grows
+    if (g_infoCache.count + 1 > g_infoCache.capacity * INFO_CACHE_MAX_LOAD)
+    {
+        struct InfoCacheEntry *old = g_infoCache.entries;
+        const u64 oldCapacity      = g_infoCache.capacity;
+
+        struct InfoCacheEntry *entries =
+            calloc(oldCapacity * 2, sizeof(struct InfoCacheEntry));
+        if (!entries)
+            return; // not fatal, the entry is just not cached
+
+        g_infoCache.entries  = entries;
+        g_infoCache.capacity = oldCapacity * 2;
+        for (u64 i = 0; i < oldCapacity; i++)
+            if (old[i].path)
+                *find_entry(old[i].path, old[i].hash) = old[i];
+        free(old);
+    }
+
+    struct InfoCacheEntry *entry = find_entry(path, hash);
+    if (!entry->path)
+    {
+        if (!(entry->path = strdup(path)))
+            return;
+        entry->hash = hash;
+        g_infoCache.count++;
+    }
+    entry->info  = *info;
+    entry->valid = true;
+}
+
+static void invalidate_path(const char *path, u64 length)
+{
+    char key[length + 1];
+    memcpy(key, path, length);
+    key[length] = '\0';
+
+    struct InfoCacheEntry *entry =
+        find_entry(key, cutil_string_hash(key, length));
+    if (entry && entry->path)
+        entry->valid = false;
+}
+
+static void invalidate_prefix(const char *path, u32 length)
+{
+    for (u64 i = 0; i < g_infoCache.capacity; i++)
+    {
+        struct InfoCacheEntry *entry = &g_infoCache.entries[i];
+        if (entry->path && strncmp(entry->path, path, length) == 0 &&
+            entry->path[length] == CUTIL_PLATFORM_FOLDER_BREAK)
+            entry->valid = false;
+    }
+}
+
+#ifdef __linux__
+
+static Result watch_path(const char *path, bool *selfWatched)
+{
+    // the folder the path is in
+    const char *folderBreak = strrchr(path, CUTIL_PLATFORM_FOLDER_BREAK);
+    u32 folderLength        = folderBreak ? folderBreak - path : 1;
+    if (folderLength == 0)
+        folderLength = 1; // the root folder
+    char folder[folderLength + 1];
+    memcpy(folder, folderBreak ? path : ".", folderLength);
+    folder[folderLength] = '\0';
+
+    const int folderWd =
+        inotify_add_watch(g_infoCache.inotifyFd, folder, INFO_CACHE_WATCH_MASK);
+
+    // folders also have to be watched themselves, their modification time
+    // changes when their contents do. This fails for anything else
+    const int selfWd = inotify_add_watch(
+        g_infoCache.inotifyFd, path, INFO_CACHE_WATCH_MASK | IN_ONLYDIR);
+
+    pthread_rwlock_wrlock(&g_infoCache.lock);
+    Result result = RS_FAILURE;
+    if (folderWd >= 0)
+        result = remember_watch(folderWd, folder);
+    if (selfWd >= 0)
+        *selfWatched = remember_watch(selfWd, path) == RS_SUCCESS;
+    pthread_rwlock_unlock(&g_infoCache.lock);
+
+    return result;
+}
+
+static Result remember_watch(int wd, const char *folder)
+{
+    if ((u32)wd >= g_infoCache.folderCapacity)
+    {
+        u32 capacity = g_infoCache.folderCapacity ? g_infoCache.folderCapacity
+                                                  : 64;
+        while (capacity <= (u32)wd)
+            capacity *= 2;
+
+        struct WatchedFolder **folders =
+            realloc(g_infoCache.folders, capacity * sizeof(*folders));
+        if (!folders)
+            return RS_FAILURE;
+        memset(
+            folders + g_infoCache.folderCapacity,
+            0,
+            (capacity - g_infoCache.folderCapacity) * sizeof(*folders));
+        g_infoCache.folders        = folders;
+        g_infoCache.folderCapacity = capacity;
+    }
+
+    for (struct WatchedFolder *f = g_infoCache.folders[wd]; f; f = f->next)
+        if (strcmp(f->path, folder) == 0)
+            return RS_SUCCESS;
+
+    struct WatchedFolder *f = malloc(sizeof(struct WatchedFolder));
+    if (!f || !(f->path = strdup(folder)))
+    {
+        free(f);
+        return RS_FAILURE;
+    }
+    f->pathLength           = strlen(folder);
+    f->next                 = g_infoCache.folders[wd];
+    g_infoCache.folders[wd] = f;
+    return RS_SUCCESS;
+}
+
+// forget a watch the kernel removed. the write lock must be held
+static void forget_watch(int wd)
+{
+    if ((u32)wd >= g_infoCache.folderCapacity)
+        return;
+
+    struct WatchedFolder *folder = g_infoCache.folders[wd];
+    while (folder)
+    {
+        struct WatchedFolder *next = folder->next;
+        free(folder->path);
+        free(folder);
+        folder = next;
+    }
+    g_infoCache.folders[wd] = NULL;
+}
+
+// apply one inotify event to the cache. the write lock must be held
+static void handle_event(const struct inotify_event *event)
+{
+    if (event->mask & IN_Q_OVERFLOW)
+    {
+        // events were lost, nothing in the cache can be trusted
+        for (u64 i = 0; i < g_infoCache.capacity; i++)
+            g_infoCache.entries[i].valid = false;
+        return;
+    }
+
+    if (event->wd < 0 || (u32)event->wd >= g_infoCache.folderCapacity)
+        return;
+
+    for (struct WatchedFolder *folder = g_infoCache.folders[event->wd]; folder;
+         folder                       = folder->next)
+    {
+        // whatever happened, the folder itself may have changed
+        invalidate_path(folder->path, folder->pathLength);
+
+        if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+            invalidate_prefix(folder->path, folder->pathLength);
+
+        if (!event->len)
+            continue;
+
+        const u32 nameLength = strlen(event->name);
+        char child[folder->pathLength + nameLength + 2];
+        memcpy(child, folder->path, folder->pathLength);
+        child[folder->pathLength] = CUTIL_PLATFORM_FOLDER_BREAK;
+        memcpy(child + folder->pathLength + 1, event->name, nameLength + 1);
+        const u32 childLength = folder->pathLength + nameLength + 1;
+
+        invalidate_path(child, childLength);
+
+        // paths inside a folder that was moved or deleted are gone too
+        if ((event->mask & IN_ISDIR) &&
+            (event->mask & (IN_DELETE | IN_MOVED_FROM)))
+            invalidate_prefix(child, childLength);
+    }
+
+    if (event->mask & IN_IGNORED)
+        forget_watch(event->wd);
+}
+
+static void *info_cache_thread(void *data)
+{
+    (void)data;
+
+    char buffer[16384]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    struct pollfd fds[2] = {
+        {.fd = g_infoCache.inotifyFd, .events = POLLIN},
+        {.fd = g_infoCache.stopPipe[0], .events = POLLIN},
+    };
+
+    for (;;)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            log_perror("poll failed in the file info cache thread");
+            break;
+        }
+
+        if (fds[1].revents)
+            break;
+
+        ssize_t length = read(g_infoCache.inotifyFd, buffer, sizeof(buffer));
+        if (length <= 0)
+            continue;
+
+        pthread_rwlock_wrlock(&g_infoCache.lock);
+        g_infoCache.generation++;
+        for (char *p = buffer; p < buffer + length;)
+        {
+            const struct inotify_event *event = (struct inotify_event *)p;
+            handle_event(event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        pthread_rwlock_unlock(&g_infoCache.lock);
+    }
+
+    return NULL;
+}
+
+#else
+
+static Result watch_path(const char *path, bool *selfWatched)
+{
+    (void)path;
+    *selfWatched = false;
+    return RS_FAILURE;
+}
+
+#endif
+
+#endif // __unix__
@@ -0,0 +1,376 @@
+#include "../platform.h"
+
+#ifdef __unix__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../messenger.h"
+#include "../string_util.h"
+#include "../types.h"
+#include "platform_unix.h"
+
+#ifndef O_PATH
+#define O_PATH O_RDONLY
+#endif
+
+#define KNOWN_FOLDERS_INITIAL_CAPACITY 256
+
+//
+// Types
+//
+
+// folders known to exist, so they are not created again
+struct
+{
+    pthread_rwlock_t lock;
+    char **paths;
+    u64 *hashes;
+    u64 capacity;
+    u64 count;
+} g_knownFolders = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+
+// an open folder, that the rest of a path is created relative to
+struct OpenFolder
+{
+    const char *path; // the path the folder is a part of
+    u32 length;       // the length of the folders part of path
+    int fd;
+};
+
+//
+// Helper Declerations
+//
+
+static bool is_known_folder(const char *path, u32 length);
+static void add_known_folder(const char *path, u32 length);
+
+// check if the folder in the stack is path, or a parent of it
+static bool is_parent_folder(const struct OpenFolder *folder, const char *path);
+
+static int compare_paths(const void *a, const void *b);
+
+//
+// Public methods
+//
+
+Result cutil_platform_create_folder(const char *filepath)
+{
+    return cutil_platform_create_folders(&filepath, 1);
+}
+
+Result cutil_platform_create_folders(
+    const char *const *filepaths, const u32 count)
+{
+    if (!count)
+        return RS_SUCCESS;
+
+    // localize every path into one buffer
+    u64 bufferSize = 0;
+    for (u32 i = 0; i < count; i++)
+    {
+        u32 pathLength = 0;
+        cutil_platform_localize_file_name(NULL, filepaths[i], &pathLength);
+        bufferSize += pathLength;
+    }
+
+    char **paths = malloc(count * sizeof(char *) + bufferSize);
+    if (!paths)
+        return RS_FAILURE;
+
+    // the stack holds at most the root and one folder per part of a path
+    u32 stackCapacity = 1;
+
+    char *buffer = (char *)(paths + count);
+    for (u32 i = 0; i < count; i++)
+    {
+        u32 pathLength = 0;
+        cutil_platform_localize_file_name(NULL, filepaths[i], &pathLength);
+        cutil_platform_localize_file_name(buffer, filepaths[i], &pathLength);
+
+        assert_allowed_file_operation(buffer);
+
+        u32 length = strlen(buffer);
+        while (length > 1 && buffer[length - 1] == CUTIL_PLATFORM_FOLDER_BREAK)
+            buffer[--length] = '\0';
+
+        u32 parts = 2;
+        for (u32 j = 0; j < length; j++)
+            parts += buffer[j] == CUTIL_PLATFORM_FOLDER_BREAK;
+        stackCapacity = parts > stackCapacity ? parts : stackCapacity;
+
+        paths[i] = buffer;
+        buffer += pathLength;
+    }
+
+    // folders that share parents end up next to each other
+    qsort(paths, count, sizeof(char *), compare_paths);
+
+    // the open parents of the last path created
+    struct OpenFolder *stack =
+        malloc(stackCapacity * sizeof(struct OpenFolder));
+    u32 stackCount = 0;
+    if (!stack)
+    {
+        free(paths);
+        return RS_FAILURE;
+    }
+
+    Result result = RS_SUCCESS;
+
+    for (u32 i = 0; i < count; i++)
+    {
+        char *path       = paths[i];
+        const u32 length = strlen(path);
+
+        if ((i && strcmp(path, paths[i - 1]) == 0) ||
+            is_known_folder(path, length))
+            continue;
+
+        while (stackCount && !is_parent_folder(&stack[stackCount - 1], path))
+        {
+            stackCount--;
+            if (stack[stackCount].fd != AT_FDCWD)
+                close(stack[stackCount].fd);
+        }
+
+        // start from the deepest folder known to exist, or the root
+        if (!stackCount)
+        {
+            struct OpenFolder base = {
+                .path   = path,
+                .length = 0,
+                .fd     = AT_FDCWD,
+            };
+
+            for (u32 j = length - 1; j > 0; j--)
+            {
+                if (path[j] != CUTIL_PLATFORM_FOLDER_BREAK ||
+                    !is_known_folder(path, j))
+                    continue;
+
+                path[j]  = '\0';
+                int fd   = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+                path[j]  = CUTIL_PLATFORM_FOLDER_BREAK;
+                if (fd != -1)
+                {
+                    base.length = j;
+                    base.fd     = fd;
+                }
+                break;
+            }
+
+            if (base.fd == AT_FDCWD && path[0] == CUTIL_PLATFORM_FOLDER_BREAK)
+                base.fd = open("/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+            if (base.fd == -1)
+            {
+                log_perror("Failed to open parent of '%s'", path);
+                result = RS_FAILURE;
+                continue;
+            }
+            stack[stackCount++] = base;
+        }
+
+        // create each missing part of the path
+        u32 start = stack[stackCount - 1].length;
+        while (start < length)
+        {
+            if (path[start] == CUTIL_PLATFORM_FOLDER_BREAK)
+                start++;
+
+            u32 end = start;
+            while (end < length && path[end] != CUTIL_PLATFORM_FOLDER_BREAK)
+                end++;
+
+            const int parentFd = stack[stackCount - 1].fd;
+
+            path[end] = '\0';
+            bool failed =
+                mkdirat(parentFd, path + start, S_IRWXU) && errno != EEXIST;
+
+            // the folder is only needed open if there is more to create in it
+            const bool isLast   = end == length;
+            const char *next    = i + 1 < count ? paths[i + 1] : NULL;
+            const bool keepOpen = !isLast ||
+                                  (next && strncmp(next, path, length) == 0 &&
+                                   next[length] == CUTIL_PLATFORM_FOLDER_BREAK);
+
+            int fd = -1;
+            if (!failed && keepOpen)
+            {
+                fd = openat(
+                    parentFd, path + start, O_PATH | O_DIRECTORY | O_CLOEXEC);
+                failed = fd == -1;
+            }
+            else if (!failed)
+            {
+                // make sure an existing path really is a folder
+                struct stat data;
+                failed = fstatat(parentFd, path + start, &data, 0) == -1 ||
+                         !S_ISDIR(data.st_mode);
+                if (failed)
+                    errno = ENOTDIR;
+            }
+
+            if (failed)
+            {
+                log_perror("Failed to create folder '%s'", path);
+                path[end] = isLast ? '\0' : CUTIL_PLATFORM_FOLDER_BREAK;
+                result    = RS_FAILURE;
+                break;
+            }
+
+            add_known_folder(path, end);
+            path[end] = isLast ? '\0' : CUTIL_PLATFORM_FOLDER_BREAK;
+
+            if (fd != -1)
+                stack[stackCount++] = (struct OpenFolder){
+                    .path   = path,
+                    .length = end,
+                    .fd     = fd,
+                };
+
+            start = end;
+        }
+    }
+
+    while (stackCount--)
+        if (stack[stackCount].fd != AT_FDCWD)
+            close(stack[stackCount].fd);
+
+    free(stack);
+    free(paths);
+    return result;
+}
+
+void cutil_platform_forget_known_folders(void)
+{
+    pthread_rwlock_wrlock(&g_knownFolders.lock);
+
+    for (u64 i = 0; i < g_knownFolders.capacity; i++)
+        free(g_knownFolders.paths[i]);
+    free(g_knownFolders.paths);
+    free(g_knownFolders.hashes);
+
+    g_knownFolders.paths    = NULL;
+    g_knownFolders.hashes   = NULL;
+    g_knownFolders.capacity = 0;
+    g_knownFolders.count    = 0;
+
+    pthread_rwlock_unlock(&g_knownFolders.lock);
+}
+
+//
+// Helper implementations
+//
+
+// find the slot of a path. the lock must be held
+static u64 find_known_slot(const char *path, u32 length, u64 hash)
+{
+    const u64 mask = g_knownFolders.capacity - 1;
+    for (u64 i = hash & mask;; i = (i + 1) & mask)
+    {
+        const char *known = g_knownFolders.paths[i];
+        if (!known || (g_knownFolders.hashes[i] == hash &&
+                       strncmp(known, path, length) == 0 &&
+                       known[length] == '\0'))
+            return i;
+    }
+}
+
+static bool is_known_folder(const char *path, u32 length)
+{
+    const u64 hash = cutil_string_hash(path, length);
+
+    pthread_rwlock_rdlock(&g_knownFolders.lock);
+    const bool known =
+        g_knownFolders.capacity &&
+        g_knownFolders.paths[find_known_slot(path, length, hash)];
+    pthread_rwlock_unlock(&g_knownFolders.lock);
+
+    return known;
+}
+
+static void add_known_folder(const char *path, u32 length)
+{
+    const u64 hash = cutil_string_hash(path, length);
+
+    pthread_rwlock_wrlock(&g_knownFolders.lock);
+
+    // keep the table at most half full
+    if ((g_knownFolders.count + 1) * 2 > g_knownFolders.capacity)
+    {
+        const u64 oldCapacity = g_knownFolders.capacity;
+        char **oldPaths       = g_knownFolders.paths;
+        u64 *oldHashes        = g_knownFolders.hashes;
+
+        const u64 capacity =
+            oldCapacity ? oldCapacity * 2 : KNOWN_FOLDERS_INITIAL_CAPACITY;
+        char **paths = calloc(capacity, sizeof(char *));
+        u64 *hashes  = calloc(capacity, sizeof(u64));
+        if (!paths || !hashes)
+        {
+            free(paths);
+            free(hashes);
+            pthread_rwlock_unlock(&g_knownFolders.lock);
+            return; // not fatal, the folder is just not remembered
+        }
+
+        g_knownFolders.paths    = paths;
+        g_knownFolders.hashes   = hashes;
+        g_knownFolders.capacity = capacity;
+
+        for (u64 i = 0; i < oldCapacity; i++)
+        {
+            if (!oldPaths[i])
+                continue;
+            const u64 slot = find_known_slot(
+                oldPaths[i], strlen(oldPaths[i]), oldHashes[i]);
+            paths[slot]  = oldPaths[i];
+            hashes[slot] = oldHashes[i];
+        }
+        free(oldPaths);
+        free(oldHashes);
+    }
+
+    const u64 slot = find_known_slot(path, length, hash);
+    if (!g_knownFolders.paths[slot])
+    {
+        char *copy = malloc(length + 1);
+        if (copy)
+        {
+            memcpy(copy, path, length);
+            copy[length]                = '\0';
+            g_knownFolders.paths[slot]  = copy;
+            g_knownFolders.hashes[slot] = hash;
+            g_knownFolders.count++;
+        }
+    }
+
+    pthread_rwlock_unlock(&g_knownFolders.lock);
+}
+
+static bool is_parent_folder(const struct OpenFolder *folder, const char *path)
+{
+    // the root, or the working folder for relative paths
+    if (folder->length == 0)
+        return (path[0] == CUTIL_PLATFORM_FOLDER_BREAK) ==
+               (folder->path[0] == CUTIL_PLATFORM_FOLDER_BREAK);
+
+    return strncmp(folder->path, path, folder->length) == 0 &&
+           (path[folder->length] == CUTIL_PLATFORM_FOLDER_BREAK ||
+            path[folder->length] == '\0');
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+#endif // __unix__
@@ -0,0 +1,551 @@
+#include "../platform.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../messenger.h"
+#include "../string_util.h"
+#include "../types.h"
+#include "platform_unix.h"
+
+#define min_value(a, b) (a < b ? a : b)
+
+#define WATCHER_MASK                                                        \
+    (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |       \
+     IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+//
+// Types
+//
+
+// a watched folder. A file is watched through its folder, with a filter
+struct WatchedFolder
+{
+    int wd;
+    char *path; // the folder as the user wrote it, ending in a folder break
+    u32 pathLength;
+    bool allFiles;   // a folder was added, report everything in it
+    char **names;    // the files added in this folder
+    u32 nameCount;
+};
+
+// a change waiting for its debounce window to end
+struct PendingEvent
+{
+    char *path;
+    u32 pathLength;
+    u32 flags;
+    f64 lastChange;
+};
+
+struct CutilWatcher
+{
+    int fd;
+    f64 debounceTime;
+
+    struct WatchedFolder *folders;
+    u32 folderCount;
+
+    struct PendingEvent *pending;
+    u32 pendingCount;
+    u32 pendingCapacity;
+
+    // hash index into pending, rebuilt whenever events are removed
+    u32 *index;
+    u32 indexCapacity;
+
+    // paths returned by the last poll, freed by the next one
+    char **returned;
+    u32 returnedCount;
+};
+
+//
+// Helper Declerations
+//
+
+// read every queued inotify event into pending
+static void read_events(CutilWatcher *watcher);
+
+// add a change to pending, merging it with earlier changes to the same path
+static void add_pending(
+    CutilWatcher *watcher, const char *path, u32 pathLength, u32 flags);
+
+// rebuild the hash index of pending
+static void rebuild_index(CutilWatcher *watcher);
+
+// report every watched path as overflowed, after the kernel dropped events
+static void add_overflow(CutilWatcher *watcher);
+
+//
+// Public methods
+//
+
+Result cutil_platform_watcher_create(
+    CutilWatcher **watcher, const f64 debounceTime)
+{
+    *watcher = NULL;
+
+    CutilWatcher *w = calloc(1, sizeof(CutilWatcher));
+    if (!w)
+        return RS_FAILURE;
+
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->fd == -1)
+    {
+        log_perror("Failed to create inotify instance");
+        free(w);
+        return RS_FAILURE;
+    }
+
+    w->debounceTime = debounceTime;
+    *watcher        = w;
+    return RS_SUCCESS;
+}
+
+void cutil_platform_watcher_destroy(CutilWatcher *watcher)
+{
+    close(watcher->fd);
+
+    for (u32 i = 0; i < watcher->folderCount; i++)
+    {
+        struct WatchedFolder *folder = &watcher->folders[i];
+        for (u32 j = 0; j < folder->nameCount; j++)
+            free(folder->names[j]);
+        free(folder->names);
+        free(folder->path);
+    }
+    free(watcher->folders);
+
+    for (u32 i = 0; i < watcher->pendingCount; i++)
+        free(watcher->pending[i].path);
+    free(watcher->pending);
+    free(watcher->index);
+
+    for (u32 i = 0; i < watcher->returnedCount; i++)
+        free(watcher->returned[i]);
+    free(watcher->returned);
+
+    free(watcher);
+}
+
+Result cutil_platform_watcher_add(
+    CutilWatcher *restrict watcher, const char *restrict filepath)
+{
+    localize_path(filepath, path, pathLength);
+
+    // files that do not exist yet can be watched, their folder must exist
+    struct stat data;
+    const bool exists = stat(path, &data) == 0;
+    if (!exists && errno != ENOENT)
+    {
+        log_perror("Failed to watch '%s'", path);
+        return RS_FAILURE;
+    }
+
+    const bool isFolder = exists && S_ISDIR(data.st_mode);
+
+    // split the users path into the folder and file name
+    u32 userLength = strlen(filepath);
+    while (isFolder && userLength &&
+           (filepath[userLength - 1] == '/' ||
+            filepath[userLength - 1] == '\\'))
+        userLength--;
+
+    u32 nameStart = 0;
+    if (!isFolder)
+        for (u32 i = 0; i < userLength; i++)
+            if (filepath[i] == '/' || filepath[i] == '\\')
+                nameStart = i + 1;
+
+    const u32 folderLength = isFolder ? userLength : nameStart;
+    char folderPath[folderLength + 2];
+    memcpy(folderPath, filepath, folderLength);
+    folderPath[folderLength] = '\0';
+
+    // watch the folder, localized
+    const char *watchPath = path;
+    char localFolder[pathLength];
+    if (!isFolder)
+    {
+        memcpy(localFolder, path, pathLength);
+        char *folderBreak = strrchr(localFolder, CUTIL_PLATFORM_FOLDER_BREAK);
+        if (folderBreak == localFolder)
+            folderBreak[1] = '\0';
+        else if (folderBreak)
+            *folderBreak = '\0';
+        else
+            strcpy(localFolder, ".");
+        watchPath = localFolder;
+    }
+
+    const int wd = inotify_add_watch(watcher->fd, watchPath, WATCHER_MASK);
+    if (wd == -1)
+    {
+        log_perror("Failed to watch '%s'", watchPath);
+        return RS_FAILURE;
+    }
+
+    // events are reported with a folder break between folder and name
+    if (folderLength &&
+        folderPath[folderLength - 1] != '/' &&
+        folderPath[folderLength - 1] != '\\')
+    {
+        folderPath[folderLength]     = CUTIL_PLATFORM_FOLDER_BREAK;
+        folderPath[folderLength + 1] = '\0';
+    }
+
+    struct WatchedFolder *folder = NULL;
+    for (u32 i = 0; i < watcher->folderCount; i++)
+        if (watcher->folders[i].wd == wd)
+            folder = &watcher->folders[i];
+
+    if (!folder)
+    {
+        struct WatchedFolder *folders = realloc(
+            watcher->folders,
+            (watcher->folderCount + 1) * sizeof(struct WatchedFolder));
+        if (!folders)
+            return RS_FAILURE;
+        watcher->folders = folders;
+
+        folder  = &watcher->folders[watcher->folderCount];
+        *folder = (struct WatchedFolder){
+            .wd         = wd,
+            .path       = strdup(folderPath),
+            .pathLength = strlen(folderPath),
+        };
+        if (!folder->path)
+            return RS_FAILURE;
+        watcher->folderCount++;
+    }
+
+    if (isFolder)
+    {
+        folder->allFiles = true;
+        return RS_SUCCESS;
+    }
+
+    char **names =
+        realloc(folder->names, (folder->nameCount + 1) * sizeof(char *));
+    if (!names)
+        return RS_FAILURE;
+    folder->names = names;
+
+    if (!(folder->names[folder->nameCount] = strdup(filepath + nameStart)))
+        return RS_FAILURE;
+    folder->nameCount++;
+
+    return RS_SUCCESS;
+}
+
+int cutil_platform_watcher_get_fd(CutilWatcher *watcher) { return watcher->fd; }
+
+f64 cutil_platform_watcher_get_timeout(CutilWatcher *watcher)
+{
+    read_events(watcher);
+
+    if (!watcher->pendingCount)
+        return -1.0;
+
+    f64 oldest = watcher->pending[0].lastChange;
+    for (u32 i = 1; i < watcher->pendingCount; i++)
+        if (watcher->pending[i].lastChange < oldest)
+            oldest = watcher->pending[i].lastChange;
+
+    const f64 timeout =
+        oldest + watcher->debounceTime - cutil_platform_get_time();
+    return timeout > 0 ? timeout : 0;
+}
+
+u32 cutil_platform_watcher_poll(
+    CutilWatcher *restrict watcher,
+    CutilWatchEvent *restrict events,
+    const u32 maxEvents)
+{
+    for (u32 i = 0; i < watcher->returnedCount; i++)
+        free(watcher->returned[i]);
+    watcher->returnedCount = 0;
+
+    read_events(watcher);
+
+    if (!watcher->pendingCount || !maxEvents)
+        return 0;
+
+    char **returned = realloc(
+        watcher->returned,
+        min_value(maxEvents, watcher->pendingCount) * sizeof(char *));
+    if (!returned)
+        return 0;
+    watcher->returned = returned;
+
+    const f64 now = cutil_platform_get_time();
+
+    u32 count = 0;
+    u32 kept  = 0;
+    for (u32 i = 0; i < watcher->pendingCount; i++)
+    {
+        struct PendingEvent *pending = &watcher->pending[i];
+        if (count < maxEvents &&
+            now - pending->lastChange >= watcher->debounceTime)
+        {
+            events[count++] = (CutilWatchEvent){
+                .path       = pending->path,
+                .pathLength = pending->pathLength,
+                .flags      = pending->flags,
+            };
+            watcher->returned[watcher->returnedCount++] = pending->path;
+        }
+        else
+            watcher->pending[kept++] = *pending;
+    }
+
+    if (count)
+    {
+        watcher->pendingCount = kept;
+        rebuild_index(watcher);
+    }
+
+    return count;
+}
+
+u32 cutil_platform_watcher_dispatch(
+    CutilWatcher *watcher, CutilWatchCallback callback, void *userData)
+{
+    read_events(watcher);
+
+    const u32 maxEvents = watcher->pendingCount;
+    if (!maxEvents)
+        return 0;
+
+    CutilWatchEvent *events = malloc(maxEvents * sizeof(CutilWatchEvent));
+    if (!events)
+        return 0;
+
+    const u32 count = cutil_platform_watcher_poll(watcher, events, maxEvents);
+    if (count)
+        callback(events, count, userData);
+
+    free(events);
+    return count;
+}
+
+//
+// Helper implementations
+//
+
+static u32 flags_from_mask(u32 mask)
+{
+    u32 flags = 0;
+    if (mask & (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE))
+        flags |= CUTIL_WATCH_MODIFIED;
+    if (mask & IN_CREATE)
+        flags |= CUTIL_WATCH_CREATED;
+    if (mask & (IN_DELETE | IN_DELETE_SELF))
+        flags |= CUTIL_WATCH_DELETED;
+    if (mask & IN_MOVED_TO)
+        flags |= CUTIL_WATCH_MOVED | CUTIL_WATCH_CREATED;
+    if (mask & (IN_MOVED_FROM | IN_MOVE_SELF))
+        flags |= CUTIL_WATCH_MOVED | CUTIL_WATCH_DELETED;
+    return flags;
+}
+
+static void handle_event(
+    CutilWatcher *watcher, const struct inotify_event *event)
+{
+    if (event->mask & IN_Q_OVERFLOW)
+    {
+        add_overflow(watcher);
+        return;
+    }
+
+    struct WatchedFolder *folder = NULL;
+    for (u32 i = 0; i < watcher->folderCount; i++)
+        if (watcher->folders[i].wd == event->wd)
+            folder = &watcher->folders[i];
+    if (!folder)
+        return;
+
+    const u32 flags = flags_from_mask(event->mask);
+    if (!flags)
+        return;
+
+    // the watched folder itself changed
+    if (!event->len)
+    {
+        u32 length = folder->pathLength;
+        if (length > 1)
+            length--; // without the trailing folder break
+        add_pending(watcher, folder->path, length, flags);
+        return;
+    }
+
+    if (!folder->allFiles)
+    {
+        bool watched = false;
+        for (u32 i = 0; i < folder->nameCount && !watched; i++)
+            watched = strcmp(folder->names[i], event->name) == 0;
+        if (!watched)
+            return;
+    }
+
+    const u32 nameLength = strlen(event->name);
+    char path[folder->pathLength + nameLength + 1];
+    memcpy(path, folder->path, folder->pathLength);
+    memcpy(path + folder->pathLength, event->name, nameLength + 1);
+
+    add_pending(watcher, path, folder->pathLength + nameLength, flags);
+}
+
+static void read_events(CutilWatcher *watcher)
+{
+    char buffer[16384]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;)
+    {
+        ssize_t length = read(watcher->fd, buffer, sizeof(buffer));
+        if (length == -1 && errno == EINTR)
+            continue;
+        if (length <= 0)
+            return; // EAGAIN, nothing left to read
+
+        for (char *p = buffer; p < buffer + length;)
+        {
+            const struct inotify_event *event = (struct inotify_event *)p;
+            handle_event(watcher, event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+static void rebuild_index(CutilWatcher *watcher)
+{
+    // keep the index at most half full
+    if (watcher->pendingCount * 2 >= watcher->indexCapacity)
+    {
+        u32 capacity = watcher->indexCapacity ? watcher->indexCapacity : 64;
+        while (watcher->pendingCount * 2 >= capacity)
+            capacity *= 2;
+
+        u32 *index = realloc(watcher->index, capacity * sizeof(u32));
+        if (!index)
+            return;
+        watcher->index         = index;
+        watcher->indexCapacity = capacity;
+    }
+
+    memset(watcher->index, 0xff, watcher->indexCapacity * sizeof(u32));
+
+    const u32 mask = watcher->indexCapacity - 1;
+    for (u32 i = 0; i < watcher->pendingCount; i++)
+    {
+        u32 slot = cutil_string_hash(
+                       watcher->pending[i].path,
+                       watcher->pending[i].pathLength) &
+                   mask;
+        while (watcher->index[slot] != UINT32_MAX)
+            slot = (slot + 1) & mask;
+        watcher->index[slot] = i;
+    }
+}
+
+static void add_pending(
+    CutilWatcher *watcher, const char *path, u32 pathLength, u32 flags)
+{
+    const f64 now = cutil_platform_get_time();
+
+    if (watcher->indexCapacity)
+    {
+        const u32 mask = watcher->indexCapacity - 1;
+        for (u32 slot = cutil_string_hash(path, pathLength) & mask;
+             watcher->index[slot] != UINT32_MAX;
+             slot = (slot + 1) & mask)
+        {
+            struct PendingEvent *pending =
+                &watcher->pending[watcher->index[slot]];
+            if (pending->pathLength == pathLength &&
+                memcmp(pending->path, path, pathLength) == 0)
+            {
+                pending->flags |= flags;
+                pending->lastChange = now;
+                return;
+            }
+        }
+    }
+
+    if (watcher->pendingCount == watcher->pendingCapacity)
+    {
+        u32 capacity =
+            watcher->pendingCapacity ? watcher->pendingCapacity * 2 : 32;
+        struct PendingEvent *pending =
+            realloc(watcher->pending, capacity * sizeof(struct PendingEvent));
+        if (!pending)
+            return;
+        watcher->pending         = pending;
+        watcher->pendingCapacity = capacity;
+    }
+
+    char *copy = malloc(pathLength + 1);
+    if (!copy)
+        return;
+    memcpy(copy, path, pathLength);
+    copy[pathLength] = '\0';
+
+    watcher->pending[watcher->pendingCount++] = (struct PendingEvent){
+        .path       = copy,
+        .pathLength = pathLength,
+        .flags      = flags,
+        .lastChange = now,
+    };
+
+    if (watcher->pendingCount * 2 >= watcher->indexCapacity)
+    {
+        rebuild_index(watcher);
+        return;
+    }
+
+    const u32 mask = watcher->indexCapacity - 1;
+    u32 slot       = cutil_string_hash(path, pathLength) & mask;
+    while (watcher->index[slot] != UINT32_MAX)
+        slot = (slot + 1) & mask;
+    watcher->index[slot] = watcher->pendingCount - 1;
+}
+
+static void add_overflow(CutilWatcher *watcher)
+{
+    for (u32 i = 0; i < watcher->folderCount; i++)
+    {
+        const struct WatchedFolder *folder = &watcher->folders[i];
+
+        if (folder->allFiles)
+        {
+            u32 length = folder->pathLength;
+            if (length > 1)
+                length--; // without the trailing folder break
+            add_pending(watcher, folder->path, length, CUTIL_WATCH_OVERFLOW);
+        }
+
+        for (u32 j = 0; j < folder->nameCount; j++)
+        {
+            const u32 nameLength = strlen(folder->names[j]);
+            char path[folder->pathLength + nameLength + 1];
+            memcpy(path, folder->path, folder->pathLength);
+            memcpy(path + folder->pathLength, folder->names[j], nameLength + 1);
+
+            add_pending(
+                watcher,
+                path,
+                folder->pathLength + nameLength,
+                CUTIL_WATCH_OVERFLOW);
+        }
+    }
+}
+
+#endif // __linux__
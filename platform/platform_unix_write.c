@@ -0,0 +1,326 @@
+#define _GNU_SOURCE // fallocate
+#include "../platform.h"
+
+#ifdef __unix__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "../messenger.h"
+#include "../types.h"
+#include "platform_unix.h"
+
+#define min_value(a, b) (a < b ? a : b)
+
+// segments handed to the kernel per call. Well under IOV_MAX, and still
+// enough that small segments do not cost a call each
+#define IOV_BATCH 256
+
+// linux never moves more than this in one call, so larger batches are split
+#define MAX_WRITE_SIZE 0x7ffff000ull
+
+// the unit compared by delta writes. Matches the page and filesystem block
+// size, so a changed byte rewrites one block on disk
+#define DELTA_BLOCK_SIZE 4096
+
+//
+// Helper Declerations
+//
+
+// reserve the disk space for size bytes at offset
+static Result preallocate(int fd, off_t offset, u64 size);
+
+// write every segment to fd, at the file offset when positioned is false
+static Result write_segments(
+    int fd, const CutilFileSegment *segments, u32 count, bool positioned);
+
+// write all of size at offset
+static Result pwrite_all(int fd, const u8 *contents, u64 size, off_t offset);
+
+// write the blocks of contents that differ from old, a view of the first size
+// bytes of the file. Adds the bytes written to bytesWritten
+static Result write_changed_blocks(
+    int fd,
+    const u8 *old,
+    const u8 *contents,
+    const u64 size,
+    u64 *bytesWritten);
+
+//
+// Public methods
+//
+
+Result cutil_platform_write_file_iov(
+    const char *restrict filepath,
+    const CutilFileSegment *restrict segments,
+    const u32 count,
+    const u32 flags)
+{
+    localize_path(filepath, path, pathLength);
+    assert_allowed_file_operation(path);
+
+    const bool append = flags & CUTIL_FILE_WRITE_APPEND;
+
+    int fd = open(
+        path,
+        O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC),
+        0644);
+    if (fd == -1)
+    {
+        log_perror("Failed to open file '%s'", path);
+        return RS_FAILURE;
+    }
+
+    if (flags & CUTIL_FILE_WRITE_PREALLOCATE)
+    {
+        u64 total = 0;
+        for (u32 i = 0; i < count; i++)
+            total += segments[i].size;
+
+        const off_t start = append ? lseek(fd, 0, SEEK_END) : 0;
+        if (total && preallocate(fd, start, total))
+        {
+            log_perror("Failed to reserve space for file '%s'", path);
+            close(fd);
+            return RS_FAILURE;
+        }
+    }
+
+    // O_APPEND moves every write to the end, so appends use the file offset
+    if (write_segments(fd, segments, count, !append))
+    {
+        log_perror("Failed to write file '%s'", path);
+        close(fd);
+        return RS_FAILURE;
+    }
+
+    if (close(fd) == -1)
+    {
+        log_perror("Failed to write file '%s'", path);
+        return RS_FAILURE;
+    }
+    return RS_SUCCESS;
+}
+
+Result cutil_platform_write_file_delta(
+    const char *restrict filepath,
+    const void *restrict contents,
+    const u64 size,
+    u64 *restrict bytesWritten)
+{
+    localize_path(filepath, path, pathLength);
+    assert_allowed_file_operation(path);
+
+    u64 written = 0;
+    if (bytesWritten)
+        *bytesWritten = 0;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        log_perror("Failed to open file '%s'", path);
+        return RS_FAILURE;
+    }
+
+    struct stat data;
+    if (fstat(fd, &data) == -1)
+    {
+        log_perror("fstat('%s') failed", path);
+        close(fd);
+        return RS_FAILURE;
+    }
+
+    const u64 oldSize = data.st_size;
+    const u64 compare = min_value(size, oldSize);
+
+    Result result = RS_SUCCESS;
+    if (compare)
+    {
+        // shared, so the view is the file itself and not a copy
+        void *old = mmap(NULL, compare, PROT_READ, MAP_SHARED, fd, 0);
+        if (old == MAP_FAILED)
+        {
+            log_perror("Failed to map file '%s'", path);
+            close(fd);
+            return RS_FAILURE;
+        }
+        madvise(old, compare, MADV_SEQUENTIAL);
+
+        result = write_changed_blocks(fd, old, contents, compare, &written);
+        munmap(old, compare);
+    }
+
+    // new data past the end of the old file
+    if (result == RS_SUCCESS && size > oldSize)
+    {
+        result = pwrite_all(
+            fd, (const u8 *)contents + oldSize, size - oldSize, oldSize);
+        if (result == RS_SUCCESS)
+            written += size - oldSize;
+    }
+
+    if (result == RS_SUCCESS && size < oldSize && ftruncate(fd, size) == -1)
+        result = RS_FAILURE;
+
+    if (result)
+    {
+        log_perror("Failed to write file '%s'", path);
+        close(fd);
+        return RS_FAILURE;
+    }
+
+    if (close(fd) == -1)
+    {
+        log_perror("Failed to write file '%s'", path);
+        return RS_FAILURE;
+    }
+
+    if (bytesWritten)
+        *bytesWritten = written;
+    return RS_SUCCESS;
+}
+
+//
+// Helper implementations
+//
+
+static Result preallocate(int fd, off_t offset, u64 size)
+{
+#ifdef __linux__
+    // keep the size, so the file does not end in zeros if a write fails
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, size) == 0)
+        return RS_SUCCESS;
+    const int error = errno;
+#else
+    const int error = posix_fallocate(fd, offset, size);
+    if (!error)
+        return RS_SUCCESS;
+#endif
+
+    // only a hint on filesystems that cannot reserve space
+    if (error == EOPNOTSUPP || error == ENOSYS || error == EINVAL)
+        return RS_SUCCESS;
+
+    errno = error;
+    return RS_FAILURE;
+}
+
+static Result write_segments(
+    int fd, const CutilFileSegment *segments, u32 count, bool positioned)
+{
+    struct iovec iov[IOV_BATCH];
+
+    u32 index      = 0; // the first segment that is not fully written
+    u64 written    = 0; // the bytes of segments[index] already written
+    off_t position = 0;
+
+    while (index < count)
+    {
+        // gather the next batch, starting part way into the first segment
+        int iovCount  = 0;
+        u64 batchSize = 0;
+        for (u32 i = index;
+             i < count && iovCount < IOV_BATCH && batchSize < MAX_WRITE_SIZE;
+             i++)
+        {
+            const u64 skip = i == index ? written : 0;
+            u64 size       = segments[i].size - skip;
+            if (!size)
+                continue;
+
+            size            = min_value(size, MAX_WRITE_SIZE - batchSize);
+            iov[iovCount++] = (struct iovec){
+                .iov_base = (u8 *)segments[i].data + skip, .iov_len = size};
+            batchSize += size;
+        }
+
+        // only empty segments are left
+        if (!iovCount)
+            break;
+
+        ssize_t n = positioned ? pwritev(fd, iov, iovCount, position)
+                               : writev(fd, iov, iovCount);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return RS_FAILURE;
+        position += n;
+
+        // skip the segments that were written, a partial write stops inside
+        // one of them
+        u64 left = n;
+        while (index < count && left >= segments[index].size - written)
+        {
+            left -= segments[index].size - written;
+            written = 0;
+            index++;
+        }
+        written += left;
+    }
+    return RS_SUCCESS;
+}
+
+static Result pwrite_all(int fd, const u8 *contents, u64 size, off_t offset)
+{
+    while (size)
+    {
+        const u64 count = min_value(size, MAX_WRITE_SIZE);
+        ssize_t n       = pwrite(fd, contents, count, offset);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return RS_FAILURE;
+        contents += n;
+        offset += n;
+        size -= n;
+    }
+    return RS_SUCCESS;
+}
+
+static Result write_changed_blocks(
+    int fd,
+    const u8 *old,
+    const u8 *contents,
+    const u64 size,
+    u64 *bytesWritten)
+{
+    // neighbouring blocks that changed are written with one call
+    u64 runStart = 0;
+    bool inRun   = false;
+    for (u64 offset = 0; offset < size; offset += DELTA_BLOCK_SIZE)
+    {
+        const u64 length = min_value(size - offset, DELTA_BLOCK_SIZE);
+        const bool changed =
+            memcmp(old + offset, contents + offset, length) != 0;
+
+        if (changed && !inRun)
+        {
+            runStart = offset;
+            inRun    = true;
+        }
+        else if (!changed && inRun)
+        {
+            const u64 runLength = offset - runStart;
+            if (pwrite_all(fd, contents + runStart, runLength, runStart))
+                return RS_FAILURE;
+            *bytesWritten += runLength;
+            inRun = false;
+        }
+    }
+
+    if (inRun)
+    {
+        if (pwrite_all(fd, contents + runStart, size - runStart, runStart))
+            return RS_FAILURE;
+        *bytesWritten += size - runStart;
+    }
+    return RS_SUCCESS;
+}
+
+#endif // __unix__
@@ -0,0 +1,731 @@
+#include "serialize.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file.h"
+#include "hash.h"
+#include "messenger.h"
+
+#define SERIAL_MAGIC          0x53545543 // "CUTS"
+#define SERIAL_FORMAT_VERSION 1
+
+// the header, followed by a description of each field
+#define HEADER_SIZE     32
+#define FIELD_DESC_SIZE 8
+
+// the most bytes a varint takes
+#define MAX_VARINT_SIZE 10
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SERIAL_NATIVE_ENDIAN 1
+#else
+#define SERIAL_NATIVE_ENDIAN 0
+#endif
+
+//
+// Types
+//
+
+typedef enum ValueKind
+{
+    KIND_UNSIGNED,
+    KIND_SIGNED,
+    KIND_FLOAT,
+    KIND_BOOL,
+} ValueKind;
+
+struct SerialTypeInfo
+{
+    u8 size; // in memory, and on disk for fixed size types
+    u8 kind; // ValueKind
+    bool varint;
+};
+
+static const struct SerialTypeInfo g_typeInfo[CUTIL_SERIAL_TYPE_COUNT] = {
+    [CUTIL_SERIAL_U8]         = {1, KIND_UNSIGNED, false},
+    [CUTIL_SERIAL_U16]        = {2, KIND_UNSIGNED, false},
+    [CUTIL_SERIAL_U32]        = {4, KIND_UNSIGNED, false},
+    [CUTIL_SERIAL_U64]        = {8, KIND_UNSIGNED, false},
+    [CUTIL_SERIAL_I8]         = {1, KIND_SIGNED, false},
+    [CUTIL_SERIAL_I16]        = {2, KIND_SIGNED, false},
+    [CUTIL_SERIAL_I32]        = {4, KIND_SIGNED, false},
+    [CUTIL_SERIAL_I64]        = {8, KIND_SIGNED, false},
+    [CUTIL_SERIAL_F32]        = {4, KIND_FLOAT, false},
+    [CUTIL_SERIAL_F64]        = {8, KIND_FLOAT, false},
+    [CUTIL_SERIAL_BOOL]       = {1, KIND_BOOL, false},
+    [CUTIL_SERIAL_VARINT_U32] = {4, KIND_UNSIGNED, true},
+    [CUTIL_SERIAL_VARINT_U64] = {8, KIND_UNSIGNED, true},
+    [CUTIL_SERIAL_VARINT_I32] = {4, KIND_SIGNED, true},
+    [CUTIL_SERIAL_VARINT_I64] = {8, KIND_SIGNED, true},
+};
+
+// the header of encoded data, stored little endian
+typedef struct SerialHeader
+{
+    u32 magic;
+    u16 formatVersion;
+    u16 fieldCount;
+    u32 schemaVersion;
+    u32 reserved;
+    u64 recordCount;
+    u64 layoutHash; // of the field descriptions, to skip matching fields
+} SerialHeader;
+
+//
+// Helper Declerations
+//
+
+// check that every field fits its member and the struct
+static Result check_schema(const CutilSerialSchema *schema);
+
+// true if encoded records are a copy of the records in memory
+static bool is_native(const CutilSerialSchema *schema);
+
+static u64 layout_hash(const CutilSerialSchema *schema);
+
+// the description of a field as it is stored
+static void describe_field(u8 *desc, const CutilSerialField *field);
+
+static void write_header(
+    u8 *dest, const CutilSerialSchema *schema, const u64 count);
+
+// read and check a header. Returns false if src is not encoded data
+static bool read_header(const u8 *src, const u64 size, SerialHeader *header);
+
+static void put_le(u8 *dest, u64 value, const u32 size);
+static u64 get_le(const u8 *src, const u32 size);
+
+// read a value of type from a struct, sign extended or as float bits
+static u64 load_value(const u8 *src, const u32 type);
+static void store_value(u8 *dest, const u32 type, const u64 value);
+
+// change a value from one type to another, for fields that changed type
+static u64 convert_value(const u64 value, const u32 from, const u32 to);
+
+// encode a value. Returns the end of the value, or NULL if it does not fit
+static u8 *encode_value(u8 *dest, const u8 *end, const u32 type, u64 value);
+
+// decode a value. Returns the end of the value, or NULL if src is too short
+static const u8 *decode_value(
+    const u8 *src, const u8 *end, const u32 type, u64 *value);
+
+//
+// Public methods
+//
+
+u64 cutil_serial_bound(const CutilSerialSchema *schema, const u64 count)
+{
+    u64 recordSize = 0;
+    for (u32 i = 0; i < schema->fieldCount; i++)
+    {
+        const CutilSerialField *field     = &schema->fields[i];
+        const struct SerialTypeInfo *info = &g_typeInfo[field->type];
+        recordSize +=
+            field->count * (info->varint ? MAX_VARINT_SIZE : info->size);
+    }
+    return HEADER_SIZE + FIELD_DESC_SIZE * schema->fieldCount +
+           count * recordSize;
+}
+
+u64 cutil_serial_encode(
+    void *restrict dest,
+    const u64 capacity,
+    const CutilSerialSchema *restrict schema,
+    const void *restrict records,
+    const u64 count)
+{
+    if (check_schema(schema))
+        return 0;
+
+    const u64 headerSize = HEADER_SIZE + FIELD_DESC_SIZE * schema->fieldCount;
+    if (capacity < headerSize)
+        return 0;
+
+    u8 *start = dest;
+    u8 *out   = start + headerSize;
+    u8 *end   = start + capacity;
+    write_header(start, schema, count);
+
+    if (is_native(schema))
+    {
+        const u64 size = count * schema->structSize;
+        if ((u64)(end - out) < size)
+            return 0;
+
+        memcpy(out, records, size);
+        return headerSize + size;
+    }
+
+    const u8 *record = records;
+    for (u64 r = 0; r < count; r++, record += schema->structSize)
+    {
+        for (u32 f = 0; f < schema->fieldCount; f++)
+        {
+            const CutilSerialField *field = &schema->fields[f];
+            const u8 *member              = record + field->offset;
+            const u32 size                = g_typeInfo[field->type].size;
+
+            for (u32 e = 0; e < field->count; e++)
+            {
+                const u64 value = load_value(member + e * size, field->type);
+                out = encode_value(out, end, field->type, value);
+                if (!out)
+                    return 0;
+            }
+        }
+    }
+    return out - start;
+}
+
+Result cutil_serial_get_info(
+    const void *restrict src,
+    const u64 size,
+    u32 *restrict version,
+    u64 *restrict count)
+{
+    SerialHeader header;
+    if (!read_header(src, size, &header))
+    {
+        log_error("Serialized data is corrupted");
+        return RS_FAILURE;
+    }
+
+    if (version)
+        *version = header.schemaVersion;
+    if (count)
+        *count = header.recordCount;
+    return RS_SUCCESS;
+}
+
+Result cutil_serial_decode(
+    void *restrict records,
+    const u64 maxCount,
+    const CutilSerialSchema *restrict schema,
+    const void *restrict src,
+    const u64 size)
+{
+    if (check_schema(schema))
+        return RS_FAILURE;
+
+    SerialHeader header;
+    if (!read_header(src, size, &header))
+    {
+        log_error("Serialized data is corrupted");
+        return RS_FAILURE;
+    }
+    if (header.recordCount > maxCount)
+    {
+        log_error(
+            "Serialized data has %llu records, more than the %llu expected",
+            (unsigned long long)header.recordCount,
+            (unsigned long long)maxCount);
+        return RS_FAILURE;
+    }
+
+    const u8 *descs = (const u8 *)src + HEADER_SIZE;
+    const u8 *in    = descs + FIELD_DESC_SIZE * header.fieldCount;
+    const u8 *end   = (const u8 *)src + size;
+
+    const bool sameLayout = header.fieldCount == schema->fieldCount &&
+                            header.layoutHash == layout_hash(schema);
+    if (sameLayout && is_native(schema))
+    {
+        const u64 bytes = header.recordCount * schema->structSize;
+        if ((u64)(end - in) < bytes)
+        {
+            log_error("Serialized data is corrupted");
+            return RS_FAILURE;
+        }
+        memcpy(records, in, bytes);
+        return RS_SUCCESS;
+    }
+
+    // match the stored fields to the schema by name
+    const CutilSerialField **targets =
+        malloc(header.fieldCount * sizeof(CutilSerialField *));
+    if (!targets)
+        return RS_FAILURE;
+
+    for (u32 i = 0; i < header.fieldCount; i++)
+    {
+        const u32 nameHash = get_le(descs + i * FIELD_DESC_SIZE, 4);
+        targets[i]         = NULL;
+        for (u32 f = 0; f < schema->fieldCount && !targets[i]; f++)
+        {
+            const char *name = schema->fields[f].name;
+            if ((u32)cutil_hash64(name, strlen(name), 0) == nameHash)
+                targets[i] = &schema->fields[f];
+        }
+    }
+
+    // fields the data does not have stay zero
+    if (!sameLayout)
+        memset(records, 0, header.recordCount * schema->structSize);
+
+    u8 *record = records;
+    for (u64 r = 0; r < header.recordCount; r++, record += schema->structSize)
+    {
+        for (u32 i = 0; i < header.fieldCount; i++)
+        {
+            const u8 *desc              = descs + i * FIELD_DESC_SIZE;
+            const u32 count             = get_le(desc + 4, 2);
+            const u32 type              = desc[6];
+            const CutilSerialField *out = targets[i];
+
+            for (u32 e = 0; e < count; e++)
+            {
+                u64 value;
+                in = decode_value(in, end, type, &value);
+                if (!in)
+                {
+                    log_error("Serialized data is corrupted");
+                    free(targets);
+                    return RS_FAILURE;
+                }
+
+                // elements past the end of a shrunk array are dropped
+                if (!out || e >= out->count)
+                    continue;
+
+                const u32 size = g_typeInfo[out->type].size;
+                store_value(
+                    record + out->offset + e * size,
+                    out->type,
+                    convert_value(value, type, out->type));
+            }
+        }
+    }
+
+    free(targets);
+    return RS_SUCCESS;
+}
+
+const void *cutil_serial_view(
+    const CutilSerialSchema *restrict schema,
+    const void *restrict src,
+    const u64 size,
+    u64 *restrict count)
+{
+    SerialHeader header;
+    if (!read_header(src, size, &header) ||
+        header.fieldCount != schema->fieldCount ||
+        header.layoutHash != layout_hash(schema) || !is_native(schema))
+        return NULL;
+
+    const u8 *records = (const u8 *)src + HEADER_SIZE +
+                        FIELD_DESC_SIZE * header.fieldCount;
+    if (header.recordCount * schema->structSize >
+        size - (records - (const u8 *)src))
+        return NULL;
+
+    // every member has to be aligned to be used in place
+    for (u32 i = 0; i < schema->fieldCount; i++)
+    {
+        const u32 alignment = g_typeInfo[schema->fields[i].type].size;
+        if ((uintptr_t)(records + schema->fields[i].offset) % alignment ||
+            schema->structSize % alignment)
+            return NULL;
+    }
+
+    *count = header.recordCount;
+    return records;
+}
+
+Result cutil_serial_write_file(
+    const char *restrict filepath,
+    const CutilSerialSchema *restrict schema,
+    const void *restrict records,
+    const u64 count)
+{
+    if (check_schema(schema))
+        return RS_FAILURE;
+
+    // native records are written from where they are, after the header
+    if (is_native(schema))
+    {
+        const u64 headerSize =
+            HEADER_SIZE + FIELD_DESC_SIZE * schema->fieldCount;
+        u8 *header = malloc(headerSize);
+        if (!header)
+            return RS_FAILURE;
+        write_header(header, schema, count);
+
+        const CutilFileSegment segments[] = {
+            {.data = header, .size = headerSize},
+            {.data = records, .size = count * schema->structSize},
+        };
+        const Result result = cutil_write_file_iov(filepath, segments, 2, 0);
+        free(header);
+        return result;
+    }
+
+    const u64 bound = cutil_serial_bound(schema, count);
+    void *buffer    = malloc(bound);
+    if (!buffer)
+    {
+        log_error("Failed to allocate %llu bytes", (unsigned long long)bound);
+        return RS_FAILURE;
+    }
+
+    const u64 size = cutil_serial_encode(buffer, bound, schema, records, count);
+    const Result result =
+        size ? cutil_write_file_binary(filepath, buffer, size) : RS_FAILURE;
+    free(buffer);
+    return result;
+}
+
+Result cutil_serial_read_file(
+    const char *restrict filepath,
+    const CutilSerialSchema *restrict schema,
+    void **restrict records,
+    u64 *restrict count)
+{
+    *records = NULL;
+    *count   = 0;
+
+    CutilFileMap map;
+    if (cutil_file_map(&map, filepath, CUTIL_FILE_MAP_SEQUENTIAL))
+        return RS_FAILURE;
+
+    u64 recordCount = 0;
+    if (cutil_serial_get_info(map.data, map.size, NULL, &recordCount))
+    {
+        cutil_file_unmap(&map);
+        return RS_FAILURE;
+    }
+
+    // at least one byte for each record, so one extra for empty files
+    void *decoded = malloc(recordCount * schema->structSize + 1);
+    if (!decoded ||
+        cutil_serial_decode(decoded, recordCount, schema, map.data, map.size))
+    {
+        free(decoded);
+        cutil_file_unmap(&map);
+        return RS_FAILURE;
+    }
+
+    cutil_file_unmap(&map);
+    *records = decoded;
+    *count   = recordCount;
+    return RS_SUCCESS;
+}
+
+//
+// Helper implementations
+//
+
+static Result check_schema(const CutilSerialSchema *schema)
+{
+    if (!schema->fieldCount || schema->fieldCount > UINT16_MAX)
+    {
+        log_error("A serial schema needs 1 to %u fields", UINT16_MAX);
+        return RS_FAILURE;
+    }
+
+    for (u32 i = 0; i < schema->fieldCount; i++)
+    {
+        const CutilSerialField *field = &schema->fields[i];
+        if (field->type >= CUTIL_SERIAL_TYPE_COUNT || !field->count ||
+            field->count > UINT16_MAX ||
+            field->memberSize != field->count * g_typeInfo[field->type].size ||
+            field->offset + field->memberSize > schema->structSize)
+        {
+            log_error(
+                "Serial field '%s' does not match its member", field->name);
+            return RS_FAILURE;
+        }
+    }
+    return RS_SUCCESS;
+}
+
+static bool is_native(const CutilSerialSchema *schema)
+{
+    if (!SERIAL_NATIVE_ENDIAN)
+        return false;
+
+    // fields in memory order, with no padding between or after them
+    u32 offset = 0;
+    for (u32 i = 0; i < schema->fieldCount; i++)
+    {
+        const CutilSerialField *field = &schema->fields[i];
+        if (g_typeInfo[field->type].varint || field->offset != offset)
+            return false;
+        offset += field->memberSize;
+    }
+    return offset == schema->structSize;
+}
+
+static u64 layout_hash(const CutilSerialSchema *schema)
+{
+    u64 hash = 0;
+    for (u32 i = 0; i < schema->fieldCount; i++)
+    {
+        u8 desc[FIELD_DESC_SIZE];
+        describe_field(desc, &schema->fields[i]);
+        hash = cutil_hash64(desc, sizeof(desc), hash);
+    }
+    return hash;
+}
+
+static void describe_field(u8 *desc, const CutilSerialField *field)
+{
+    put_le(desc, cutil_hash64(field->name, strlen(field->name), 0), 4);
+    put_le(desc + 4, field->count, 2);
+    desc[6] = field->type;
+    desc[7] = 0;
+}
+
+static void write_header(
+    u8 *dest, const CutilSerialSchema *schema, const u64 count)
+{
+    put_le(dest, SERIAL_MAGIC, 4);
+    put_le(dest + 4, SERIAL_FORMAT_VERSION, 2);
+    put_le(dest + 6, schema->fieldCount, 2);
+    put_le(dest + 8, schema->version, 4);
+    put_le(dest + 12, 0, 4);
+    put_le(dest + 16, count, 8);
+    put_le(dest + 24, layout_hash(schema), 8);
+
+    for (u32 i = 0; i < schema->fieldCount; i++)
+    {
+        u8 *desc = dest + HEADER_SIZE + i * FIELD_DESC_SIZE;
+        describe_field(desc, &schema->fields[i]);
+    }
+}
+
+static bool read_header(const u8 *src, const u64 size, SerialHeader *header)
+{
+    if (size < HEADER_SIZE)
+        return false;
+
+    header->magic         = get_le(src, 4);
+    header->formatVersion = get_le(src + 4, 2);
+    header->fieldCount    = get_le(src + 6, 2);
+    header->schemaVersion = get_le(src + 8, 4);
+    header->reserved      = get_le(src + 12, 4);
+    header->recordCount   = get_le(src + 16, 8);
+    header->layoutHash    = get_le(src + 24, 8);
+
+    const u64 headerSize = HEADER_SIZE + FIELD_DESC_SIZE * header->fieldCount;
+    if (header->magic != SERIAL_MAGIC ||
+        header->formatVersion != SERIAL_FORMAT_VERSION ||
+        !header->fieldCount || headerSize > size)
+        return false;
+
+    // every record has at least one byte, which also bounds allocations made
+    // from the record count
+    if (header->recordCount > size - headerSize)
+        return false;
+
+    for (u32 i = 0; i < header->fieldCount; i++)
+    {
+        const u8 *desc = src + HEADER_SIZE + i * FIELD_DESC_SIZE;
+        if (desc[6] >= CUTIL_SERIAL_TYPE_COUNT || !get_le(desc + 4, 2))
+            return false;
+    }
+    return true;
+}
+
+static void put_le(u8 *dest, u64 value, const u32 size)
+{
+    for (u32 i = 0; i < size; i++)
+    {
+        dest[i] = value;
+        value >>= 8;
+    }
+}
+
+static u64 get_le(const u8 *src, const u32 size)
+{
+    u64 value = 0;
+    for (u32 i = 0; i < size; i++)
+        value |= (u64)src[i] << (8 * i);
+    return value;
+}
+
+static u64 load_value(const u8 *src, const u32 type)
+{
+    const bool isSigned = g_typeInfo[type].kind == KIND_SIGNED;
+    switch (g_typeInfo[type].size)
+    {
+    case 1:
+    {
+        u8 value;
+        memcpy(&value, src, 1);
+        return isSigned ? (u64)(i64)(i8)value : value;
+    }
+    case 2:
+    {
+        u16 value;
+        memcpy(&value, src, 2);
+        return isSigned ? (u64)(i64)(i16)value : value;
+    }
+    case 4:
+    {
+        u32 value;
+        memcpy(&value, src, 4);
+        return isSigned ? (u64)(i64)(i32)value : value;
+    }
+    default:
+    {
+        u64 value;
+        memcpy(&value, src, 8);
+        return value;
+    }
+    }
+}
+
+static void store_value(u8 *dest, const u32 type, const u64 value)
+{
+    switch (g_typeInfo[type].size)
+    {
+    case 1:
+    {
+        // a corrupted bool could otherwise hold something other than 0 or 1
+        const bool isBool = g_typeInfo[type].kind == KIND_BOOL;
+        const u8 narrow   = isBool ? value != 0 : value;
+        memcpy(dest, &narrow, 1);
+        break;
+    }
+    case 2:
+    {
+        const u16 narrow = value;
+        memcpy(dest, &narrow, 2);
+        break;
+    }
+    case 4:
+    {
+        const u32 narrow = value;
+        memcpy(dest, &narrow, 4);
+        break;
+    }
+    default:
+        memcpy(dest, &value, 8);
+        break;
+    }
+}
+
+static u64 convert_value(const u64 value, const u32 from, const u32 to)
+{
+    const struct SerialTypeInfo *source = &g_typeInfo[from];
+    const struct SerialTypeInfo *target = &g_typeInfo[to];
+
+    if (source->kind == target->kind &&
+        (source->kind != KIND_FLOAT || source->size == target->size))
+        return value;
+
+    // go through a double or an integer, whichever the source is
+    f64 number = 0;
+    if (source->kind == KIND_FLOAT && source->size == 4)
+    {
+        f32 single;
+        const u32 bits = value;
+        memcpy(&single, &bits, 4);
+        number = single;
+    }
+    else if (source->kind == KIND_FLOAT)
+        memcpy(&number, &value, 8);
+    else if (source->kind == KIND_SIGNED)
+        number = (f64)(i64)value;
+    else
+        number = (f64)value;
+
+    switch (target->kind)
+    {
+    case KIND_BOOL:
+        return number != 0;
+    case KIND_FLOAT:
+        if (target->size == 4)
+        {
+            const f32 single = number;
+            u32 bits;
+            memcpy(&bits, &single, 4);
+            return bits;
+        }
+        else
+        {
+            u64 bits;
+            memcpy(&bits, &number, 8);
+            return bits;
+        }
+    case KIND_SIGNED:
+        return source->kind == KIND_FLOAT ? (u64)(i64)number : value;
+    default:
+        return source->kind == KIND_FLOAT ? (u64)number : value;
+    }
+}
+
+static u8 *encode_value(u8 *dest, const u8 *end, const u32 type, u64 value)
+{
+    const struct SerialTypeInfo *info = &g_typeInfo[type];
+    if (!info->varint)
+    {
+        if ((u64)(end - dest) < info->size)
+            return NULL;
+
+#if SERIAL_NATIVE_ENDIAN
+        store_value(dest, type, value);
+#else
+        put_le(dest, value, info->size);
+#endif
+        return dest + info->size;
+    }
+
+    // zigzag, so small negative numbers stay small
+    if (info->kind == KIND_SIGNED)
+        value = (value << 1) ^ (u64)((i64)value >> 63);
+
+    while (value >= 0x80)
+    {
+        if (dest == end)
+            return NULL;
+        *dest++ = (u8)value | 0x80;
+        value >>= 7;
+    }
+    if (dest == end)
+        return NULL;
+    *dest++ = value;
+    return dest;
+}
+
+static const u8 *decode_value(
+    const u8 *src, const u8 *end, const u32 type, u64 *value)
+{
+    const struct SerialTypeInfo *info = &g_typeInfo[type];
+    if (!info->varint)
+    {
+        if ((u64)(end - src) < info->size)
+            return NULL;
+
+#if SERIAL_NATIVE_ENDIAN
+        *value = load_value(src, type);
+#else
+        *value = get_le(src, info->size);
+        if (info->kind == KIND_SIGNED && info->size < 8)
+        {
+            const u32 shift = 64 - 8 * info->size;
+            *value          = (u64)((i64)(*value << shift) >> shift);
+        }
+#endif
+        return src + info->size;
+    }
+
+    u64 result = 0;
+    for (u32 shift = 0;; shift += 7)
+    {
+        if (src == end || shift > 63)
+            return NULL;
+
+        const u8 byte = *src++;
+        result |= (u64)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+
+    if (info->kind == KIND_SIGNED)
+        result = (result >> 1) ^ -(result & 1);
+    *value = result;
+    return src;
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+// Binary serialization
+//
+// Arrays of structs are written to disk in a fixed little endian format
+// described by a schema, a list of the struct's fields. The data starts with a
+// header holding the schema it was written with, so data written before a
+// field was added, removed, reordered or widened can still be read: fields are
+// matched by name, missing fields are zeroed, and numbers are converted.
+//
+// When the layout in memory is the same as on disk (little endian, fixed size
+// fields in order with no padding) and the schema has not changed, records are
+// copied with one memcpy, or used straight from a mapped file.
+//
+// Kael Johnston
+
+#include <stddef.h>
+
+#include "types.h"
+
+typedef enum CutilSerialType
+{
+    CUTIL_SERIAL_U8 = 0,
+    CUTIL_SERIAL_U16,
+    CUTIL_SERIAL_U32,
+    CUTIL_SERIAL_U64,
+    CUTIL_SERIAL_I8,
+    CUTIL_SERIAL_I16,
+    CUTIL_SERIAL_I32,
+    CUTIL_SERIAL_I64,
+    CUTIL_SERIAL_F32,
+    CUTIL_SERIAL_F64,
+    CUTIL_SERIAL_BOOL,
+    // a u32 or u64 in memory, stored in as few bytes as the value needs
+    CUTIL_SERIAL_VARINT_U32,
+    CUTIL_SERIAL_VARINT_U64,
+    // a i32 or i64 in memory, small negative values are small too
+    CUTIL_SERIAL_VARINT_I32,
+    CUTIL_SERIAL_VARINT_I64,
+    CUTIL_SERIAL_TYPE_COUNT,
+} CutilSerialType;
+
+/**
+ * A field of a struct. Use CUTIL_SERIAL_FIELD or CUTIL_SERIAL_ARRAY to make
+ * them.
+ */
+typedef struct CutilSerialField
+{
+    const char *name; // matches the field to the data, so keep it stable
+    u32 type;         // CutilSerialType
+    u32 offset;       // in the struct
+    u32 count;        // elements, for fixed size arrays
+    u32 memberSize;   // sizeof the member, to check the type against
+} CutilSerialField;
+
+/**
+ * The fields of a struct, see CUTIL_SERIAL_SCHEMA.
+ */
+typedef struct CutilSerialSchema
+{
+    const CutilSerialField *fields;
+    u32 fieldCount;
+    u32 structSize;
+    u32 version; // stored in the data for the caller, not used to decode
+} CutilSerialSchema;
+
+/**
+ * Describe a field of a struct.
+ *
+ * Example:
+ *     static const CutilSerialField fields[] = {
+ *         CUTIL_SERIAL_FIELD(Item, id, CUTIL_SERIAL_U32),
+ *         CUTIL_SERIAL_ARRAY(Item, position, CUTIL_SERIAL_F32),
+ *     };
+ *     static const CutilSerialSchema schema =
+ *         CUTIL_SERIAL_SCHEMA(Item, 1, fields);
+ */
+#define CUTIL_SERIAL_FIELD(structType, member, serialType) \
+    {                                                      \
+        .name       = #member,                             \
+        .type       = serialType,                          \
+        .offset     = offsetof(structType, member),        \
+        .count      = 1,                                   \
+        .memberSize = sizeof(((structType *)0)->member),   \
+    }
+
+// describe a fixed size array in a struct, every element has the same type
+#define CUTIL_SERIAL_ARRAY(structType, member, serialType) \
+    {                                                      \
+        .name       = #member,                             \
+        .type       = serialType,                          \
+        .offset     = offsetof(structType, member),        \
+        .count      = sizeof(((structType *)0)->member) /  \
+                 sizeof(((structType *)0)->member[0]),     \
+        .memberSize = sizeof(((structType *)0)->member),   \
+    }
+
+#define CUTIL_SERIAL_SCHEMA(structType, schemaVersion, fieldArray) \
+    {                                                              \
+        .fields     = fieldArray,                                  \
+        .fieldCount = sizeof(fieldArray) / sizeof(fieldArray[0]),  \
+        .structSize = sizeof(structType),                          \
+        .version    = schemaVersion,                               \
+    }
+
+/**
+ * Get the most bytes cutil_serial_encode can write for count records.
+ *
+ * @author Kael Johnston
+ */
+u64 cutil_serial_bound(const CutilSerialSchema *schema, const u64 count);
+
+/**
+ * Encode an array of structs.
+ *
+ * @param dest the buffer to write to
+ * @param capacity the size of dest, cutil_serial_bound is always enough
+ * @param schema the fields of the structs
+ * @param records the structs
+ * @param count the number of structs
+ *
+ * @return the number of bytes written, or 0 if the schema does not match its
+ * struct or dest is too small
+ *
+ * @author Kael Johnston
+ */
+u64 cutil_serial_encode(
+    void *restrict dest,
+    const u64 capacity,
+    const CutilSerialSchema *restrict schema,
+    const void *restrict records,
+    const u64 count);
+
+/**
+ * Read the header of encoded data.
+ *
+ * @param src the encoded data
+ * @param size the size of src
+ * @param version set to the schema version the data was written with, may be
+ * NULL
+ * @param count set to the number of records, may be NULL
+ *
+ * @return RS_FAILURE if src is not encoded data
+ *
+ * @author Kael Johnston
+ */
+Result cutil_serial_get_info(
+    const void *restrict src,
+    const u64 size,
+    u32 *restrict version,
+    u64 *restrict count);
+
+/**
+ * Decode data into an array of structs. Fields are matched to the data by
+ * name, so data written with an older schema can be read. Fields the data
+ * does not have are zeroed.
+ *
+ * @param records the structs to decode into
+ * @param maxCount the number of structs records has room for, see
+ * cutil_serial_get_info
+ * @param schema the fields of the structs
+ * @param src the encoded data, for example a mapped file
+ * @param size the size of src
+ *
+ * @return RS_FAILURE if the data is corrupted or has more than maxCount
+ * records
+ *
+ * @author Kael Johnston
+ */
+Result cutil_serial_decode(
+    void *restrict records,
+    const u64 maxCount,
+    const CutilSerialSchema *restrict schema,
+    const void *restrict src,
+    const u64 size);
+
+/**
+ * Use encoded records without decoding them. This works when the data was
+ * written with the same schema, the layout in memory matches the layout on
+ * disk, and src is aligned, for example in a mapped file. Otherwise use
+ * cutil_serial_decode.
+ *
+ * @param schema the fields of the structs
+ * @param src the encoded data
+ * @param size the size of src
+ * @param count set to the number of records
+ *
+ * @return the records inside src, or NULL if they have to be decoded
+ *
+ * @author Kael Johnston
+ */
+const void *cutil_serial_view(
+    const CutilSerialSchema *restrict schema,
+    const void *restrict src,
+    const u64 size,
+    u64 *restrict count);
+
+/**
+ * Encode an array of structs into a file. Records with a native layout are
+ * written straight from memory, after the header.
+ *
+ * @return Result
+ *
+ * @author Kael Johnston
+ */
+Result cutil_serial_write_file(
+    const char *restrict filepath,
+    const CutilSerialSchema *restrict schema,
+    const void *restrict records,
+    const u64 count);
+
+/**
+ * Decode a file into a new array of structs.
+ *
+ * @param filepath the file to read
+ * @param schema the fields of the structs
+ * @param records set to the structs, free them with free()
+ * @param count set to the number of structs
+ *
+ * @return Result
+ *
+ * @author Kael Johnston
+ */
+Result cutil_serial_read_file(
+    const char *restrict filepath,
+    const CutilSerialSchema *restrict schema,
+    void **restrict records,
+    u64 *restrict count);
@@ -0,0 +1,1086 @@
+#include "snapshot.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "messenger.h"
+#include "serialize.h"
+
+#define min_value(a, b) (a < b ? a : b)
+
+#define SNAPSHOT_MAGIC          0x50414e53 // "SNAP"
+#define SNAPSHOT_FORMAT_VERSION 1
+
+// the most threads used when the caller lets us pick, scanning waits on the
+// disk more than the cpu
+#define SNAPSHOT_MAX_AUTO_THREADS 8
+// the most threads used at all
+#define SNAPSHOT_MAX_THREADS (SNAPSHOT_MAX_AUTO_THREADS * 8)
+
+//
+// Types
+//
+
+struct CutilSnapshot
+{
+    // sorted by path, with '/' before every other character, so a folder is
+    // followed by everything inside it
+    CutilSnapshotEntry *entries;
+    u32 entryCount;
+    u32 flags; // CutilSnapshotFlags it was created with
+
+    char *paths; // the strings the entries point into
+};
+
+// an entry found while scanning, its path is in the paths of its output
+struct ScanRecord
+{
+    CutilSnapshotEntry entry;
+    u64 pathOffset;
+};
+
+// the entries one thread found
+struct ScanOutput
+{
+    struct ScanRecord *records;
+    u32 recordCount;
+    u32 recordCapacity;
+
+    char *paths;
+    u64 pathsSize;
+    u64 pathsCapacity;
+};
+
+// a folder that still has to be scanned
+struct ScanTask
+{
+    bool hasInfo; // info was read while listing the parent
+    CutilFileInfo info;
+    u32 pathLength;
+    char path[]; // relative to the scanned folder
+};
+
+struct ScanJob
+{
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+
+    struct ScanTask **stack;
+    u32 stackCount;
+    u32 stackCapacity;
+
+    u32 activeThreads; // threads currently scanning a folder
+
+    const char *root;
+    u32 rootLength;
+    const CutilSnapshot *previous;
+    u32 flags;
+
+    atomic_ullong errors;
+};
+
+struct ScanWorker
+{
+    struct ScanJob *job;
+    struct ScanOutput output;
+};
+
+// the start of a snapshot file, followed by the serialized records and the
+// path suffixes
+struct SnapshotHeader
+{
+    u32 magic;
+    u32 version;
+    u32 flags;
+    u32 entryCount;
+    u64 recordsSize;
+    u64 suffixesSize;
+};
+
+// an entry on disk. Its path is the first prefixLength bytes of the path
+// before it, followed by the next suffixLength bytes of the suffixes
+struct SnapshotRecord
+{
+    u64 size;
+    i64 modifiedTime;
+    u64 inode;
+    u64 hashLow;
+    u64 hashHigh;
+    u32 prefixLength;
+    u32 suffixLength;
+    u32 type;
+};
+
+static const CutilSerialField g_recordFields[] = {
+    CUTIL_SERIAL_FIELD(struct SnapshotRecord, size, CUTIL_SERIAL_VARINT_U64),
+    CUTIL_SERIAL_FIELD(struct SnapshotRecord, modifiedTime, CUTIL_SERIAL_I64),
+    CUTIL_SERIAL_FIELD(struct SnapshotRecord, inode, CUTIL_SERIAL_VARINT_U64),
+    CUTIL_SERIAL_FIELD(struct SnapshotRecord, hashLow, CUTIL_SERIAL_U64),
+    CUTIL_SERIAL_FIELD(struct SnapshotRecord, hashHigh, CUTIL_SERIAL_U64),
+    CUTIL_SERIAL_FIELD(
+        struct SnapshotRecord, prefixLength, CUTIL_SERIAL_VARINT_U32),
+    CUTIL_SERIAL_FIELD(
+        struct SnapshotRecord, suffixLength, CUTIL_SERIAL_VARINT_U32),
+    CUTIL_SERIAL_FIELD(struct SnapshotRecord, type, CUTIL_SERIAL_VARINT_U32),
+};
+
+static const CutilSerialSchema g_recordSchema =
+    CUTIL_SERIAL_SCHEMA(struct SnapshotRecord, 1, g_recordFields);
+
+//
+// Helper Declerations
+//
+
+// order paths by their components, with '/' before every other character
+static int compare_paths(
+    const char *a, const u32 aLength, const char *b, const u32 bLength);
+
+static int compare_entries(const void *a, const void *b);
+
+// get the index after the last entry inside the folder at index
+static u32 subtree_end(const CutilSnapshot *snapshot, const u32 index);
+
+// add a folder to the stack, the lock must be held
+static Result push_task(struct ScanJob *job, struct ScanTask *task);
+
+static struct ScanTask *new_task(
+    const char *path, const u32 pathLength, const CutilFileInfo *info);
+
+static void *scan_worker(void *worker);
+
+// record a folder and queue its sub folders
+static void scan_folder(struct ScanWorker *worker, struct ScanTask *task);
+
+// list a folder that changed since the previous snapshot
+static void list_folder(
+    struct ScanWorker *worker,
+    const struct ScanTask *task,
+    const char *fullPath);
+
+// check the entries a folder had in the previous snapshot, the folder has not
+// changed so it has no others
+static void check_known_folder(struct ScanWorker *worker, const u32 index);
+
+// record a file, hashing it if needed
+static void record_file(
+    struct ScanWorker *worker,
+    const char *path,
+    const u32 pathLength,
+    const CutilFileType type,
+    const CutilFileInfo *info,
+    const CutilSnapshotEntry *old);
+
+static Result add_record(
+    struct ScanOutput *output,
+    const char *path,
+    const u32 pathLength,
+    const CutilSnapshotEntry *entry);
+
+// join the root and a path relative to it, dest needs rootLength +
+// pathLength + 2 bytes
+static void build_path(
+    char *dest,
+    const struct ScanJob *job,
+    const char *path,
+    const u32 pathLength);
+
+// merge what every thread found into a sorted snapshot
+static CutilSnapshot *merge_outputs(
+    struct ScanWorker *workers, const u32 workerCount, const u32 flags);
+
+static bool is_modified(
+    const CutilSnapshotEntry *old,
+    const CutilSnapshotEntry *current,
+    const bool compareHashes);
+
+//
+// Public methods
+//
+
+Result cutil_snapshot_create(
+    CutilSnapshot **restrict snapshot,
+    const char *restrict folder,
+    const CutilSnapshot *restrict previous,
+    const u32 flags,
+    u32 threadCount)
+{
+    *snapshot = NULL;
+
+    // get rid of the slash so paths can be joined to it
+    u32 rootLength = strlen(folder);
+    while (rootLength > 1 && folder[rootLength - 1] == '/')
+        rootLength--;
+    char root[rootLength + 2];
+    memcpy(root, folder, rootLength);
+    if (!rootLength)
+        root[rootLength++] = '.';
+    root[rootLength] = '\0';
+
+    if (threadCount == 0)
+    {
+        long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount   = cpuCount > 0 ? cpuCount : 1;
+        threadCount   = min_value(threadCount, SNAPSHOT_MAX_AUTO_THREADS);
+    }
+    threadCount = min_value(threadCount, SNAPSHOT_MAX_THREADS);
+
+    struct ScanTask *rootTask = new_task("", 0, NULL);
+    if (!rootTask)
+        return RS_FAILURE;
+
+    struct ScanJob job = {
+        .lock       = PTHREAD_MUTEX_INITIALIZER,
+        .available  = PTHREAD_COND_INITIALIZER,
+        .root       = root,
+        .rootLength = rootLength,
+        .previous   = previous,
+        .flags      = flags,
+    };
+
+    if (push_task(&job, rootTask))
+    {
+        free(rootTask);
+        return RS_FAILURE;
+    }
+
+    struct ScanWorker workers[SNAPSHOT_MAX_THREADS];
+    for (u32 i = 0; i < threadCount; i++)
+        workers[i] = (struct ScanWorker){.job = &job};
+
+    // this thread is one of the workers
+    pthread_t threads[SNAPSHOT_MAX_THREADS];
+    u32 started = 0;
+    for (; started + 1 < threadCount; started++)
+        if (pthread_create(
+                &threads[started], NULL, scan_worker, &workers[started + 1]))
+            break;
+
+    scan_worker(&workers[0]);
+
+    for (u32 i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    free(job.stack);
+    pthread_cond_destroy(&job.available);
+    pthread_mutex_destroy(&job.lock);
+
+    CutilSnapshot *result = NULL;
+    if (!atomic_load(&job.errors))
+        result = merge_outputs(workers, started + 1, flags);
+
+    for (u32 i = 0; i < threadCount; i++)
+    {
+        free(workers[i].output.records);
+        free(workers[i].output.paths);
+    }
+
+    if (!result)
+        return RS_FAILURE;
+
+    *snapshot = result;
+    return RS_SUCCESS;
+}
+
+void cutil_snapshot_destroy(CutilSnapshot *snapshot)
+{
+    if (!snapshot)
+        return;
+
+    free(snapshot->entries);
+    free(snapshot->paths);
+    free(snapshot);
+}
+
+Result cutil_snapshot_write(
+    const CutilSnapshot *restrict snapshot, const char *restrict filepath)
+{
+    u64 suffixesSize = 0;
+    struct SnapshotRecord *records =
+        malloc((snapshot->entryCount + 1) * sizeof(struct SnapshotRecord));
+    if (!records)
+        return RS_FAILURE;
+
+    // share the start of each path with the one before it, which is usually
+    // the whole folder
+    const CutilSnapshotEntry *last = NULL;
+    for (u32 i = 0; i < snapshot->entryCount; i++)
+    {
+        const CutilSnapshotEntry *entry = &snapshot->entries[i];
+
+        u32 prefixLength = 0;
+        if (last)
+        {
+            const u32 length = min_value(last->pathLength, entry->pathLength);
+            while (prefixLength < length &&
+                   last->path[prefixLength] == entry->path[prefixLength])
+                prefixLength++;
+        }
+
+        records[i] = (struct SnapshotRecord){
+            .size         = entry->size,
+            .modifiedTime = entry->modifiedTime,
+            .inode        = entry->inode,
+            .hashLow      = entry->hash.low,
+            .hashHigh     = entry->hash.high,
+            .prefixLength = prefixLength,
+            .suffixLength = entry->pathLength - prefixLength,
+            .type         = entry->type,
+        };
+        suffixesSize += entry->pathLength - prefixLength;
+        last          = entry;
+    }
+
+    const u64 bound = cutil_serial_bound(&g_recordSchema, snapshot->entryCount);
+    u8 *buffer      = malloc(bound + suffixesSize + 1);
+    if (!buffer)
+    {
+        log_error(
+            "Failed to allocate %llu bytes",
+            (unsigned long long)(bound + suffixesSize));
+        free(records);
+        return RS_FAILURE;
+    }
+
+    const u64 recordsSize = cutil_serial_encode(
+        buffer, bound, &g_recordSchema, records, snapshot->entryCount);
+
+    char *suffixes = (char *)buffer + recordsSize;
+    u64 offset     = 0;
+    for (u32 i = 0; i < snapshot->entryCount; i++)
+    {
+        const CutilSnapshotEntry *entry = &snapshot->entries[i];
+        memcpy(
+            suffixes + offset,
+            entry->path + records[i].prefixLength,
+            records[i].suffixLength);
+        offset += records[i].suffixLength;
+    }
+    free(records);
+
+    if (!recordsSize)
+    {
+        free(buffer);
+        return RS_FAILURE;
+    }
+
+    const struct SnapshotHeader header = {
+        .magic        = SNAPSHOT_MAGIC,
+        .version      = SNAPSHOT_FORMAT_VERSION,
+        .flags        = snapshot->flags,
+        .entryCount   = snapshot->entryCount,
+        .recordsSize  = recordsSize,
+        .suffixesSize = suffixesSize,
+    };
+
+    const CutilFileSegment segments[] = {
+        {.data = &header, .size = sizeof(header)},
+        {.data = buffer, .size = recordsSize + suffixesSize},
+    };
+    const Result result = cutil_write_file_iov(filepath, segments, 2, 0);
+    free(buffer);
+    return result;
+}
+
+Result cutil_snapshot_read(
+    CutilSnapshot **restrict snapshot, const char *restrict filepath)
+{
+    *snapshot = NULL;
+
+    CutilFileMap map;
+    if (cutil_file_map(&map, filepath, CUTIL_FILE_MAP_SEQUENTIAL))
+        return RS_FAILURE;
+
+    struct SnapshotHeader header = {0};
+    if (map.size >= sizeof(header))
+        memcpy(&header, map.data, sizeof(header));
+
+    u64 recordCount = 0;
+    if (header.magic != SNAPSHOT_MAGIC ||
+        header.version != SNAPSHOT_FORMAT_VERSION ||
+        header.recordsSize > map.size - sizeof(header) ||
+        header.suffixesSize !=
+            map.size - sizeof(header) - header.recordsSize ||
+        cutil_serial_get_info(
+            (const u8 *)map.data + sizeof(header),
+            header.recordsSize,
+            NULL,
+            &recordCount) ||
+        recordCount != header.entryCount)
+    {
+        log_error("'%s' is not a snapshot", filepath);
+        cutil_file_unmap(&map);
+        return RS_FAILURE;
+    }
+
+    const char *suffixes =
+        (const char *)map.data + sizeof(header) + header.recordsSize;
+
+    CutilSnapshot *result = calloc(1, sizeof(CutilSnapshot));
+    struct SnapshotRecord *records =
+        malloc((recordCount + 1) * sizeof(struct SnapshotRecord));
+    if (!result || !records ||
+        cutil_serial_decode(
+            records,
+            recordCount,
+            &g_recordSchema,
+            (const u8 *)map.data + sizeof(header),
+            header.recordsSize))
+        goto corrupted;
+
+    // check every prefix and suffix is in bounds before building the paths
+    u64 pathsSize  = 0;
+    u64 suffixSize = 0;
+    u32 lastLength = 0;
+    for (u32 i = 0; i < recordCount; i++)
+    {
+        const struct SnapshotRecord *record = &records[i];
+        const u64 length = (u64)record->prefixLength + record->suffixLength;
+        if (record->prefixLength > lastLength ||
+            record->suffixLength > header.suffixesSize - suffixSize ||
+            length > UINT32_MAX || record->type > CUTIL_FILE_TYPE_OTHER)
+            goto corrupted;
+
+        suffixSize += record->suffixLength;
+        pathsSize  += length + 1;
+        lastLength  = length;
+    }
+
+    result->entries = malloc((recordCount + 1) * sizeof(CutilSnapshotEntry));
+    result->paths   = malloc(pathsSize + 1);
+    if (!result->entries || !result->paths)
+        goto corrupted;
+    result->entryCount = recordCount;
+    result->flags      = header.flags;
+
+    char *path                     = result->paths;
+    const char *suffix             = suffixes;
+    const CutilSnapshotEntry *last = NULL;
+    for (u32 i = 0; i < recordCount; i++)
+    {
+        const struct SnapshotRecord *record = &records[i];
+        const u32 length = record->prefixLength + record->suffixLength;
+
+        if (last)
+            memcpy(path, last->path, record->prefixLength);
+        memcpy(path + record->prefixLength, suffix, record->suffixLength);
+        path[length] = '\0';
+        suffix      += record->suffixLength;
+
+        CutilSnapshotEntry *entry = &result->entries[i];
+        *entry                    = (CutilSnapshotEntry){
+            .path         = path,
+            .pathLength   = length,
+            .type         = record->type,
+            .size         = record->size,
+            .modifiedTime = record->modifiedTime,
+            .inode        = record->inode,
+            .hash         = {record->hashLow, record->hashHigh},
+        };
+
+        // lookups need the entries in order
+        if (last && compare_paths(
+                        last->path, last->pathLength, path, length) >= 0)
+            goto corrupted;
+
+        last  = entry;
+        path += length + 1;
+    }
+
+    free(records);
+    cutil_file_unmap(&map);
+    *snapshot = result;
+    return RS_SUCCESS;
+
+corrupted:
+    log_error("Snapshot '%s' is corrupted", filepath);
+    free(records);
+    cutil_snapshot_destroy(result);
+    cutil_file_unmap(&map);
+    return RS_FAILURE;
+}
+
+Result cutil_snapshot_diff(
+    const CutilSnapshot *restrict old,
+    const CutilSnapshot *restrict current,
+    CutilSnapshotDiff *restrict diff)
+{
+    *diff = (CutilSnapshotDiff){0};
+
+    // nothing can be in a list more often than there are entries
+    diff->added    = malloc((current->entryCount + 1) * sizeof(void *));
+    diff->removed  = malloc((old->entryCount + 1) * sizeof(void *));
+    diff->modified = malloc((current->entryCount + 1) * sizeof(void *));
+    if (!diff->added || !diff->removed || !diff->modified)
+    {
+        cutil_snapshot_diff_free(diff);
+        return RS_FAILURE;
+    }
+
+    const bool compareHashes = (old->flags & CUTIL_SNAPSHOT_HASH_CONTENTS) &&
+                               (current->flags & CUTIL_SNAPSHOT_HASH_CONTENTS);
+
+    // both are sorted, so walk them side by side
+    u32 i = 0;
+    u32 j = 0;
+    while (i < old->entryCount || j < current->entryCount)
+    {
+        const CutilSnapshotEntry *a =
+            i < old->entryCount ? &old->entries[i] : NULL;
+        const CutilSnapshotEntry *b =
+            j < current->entryCount ? &current->entries[j] : NULL;
+
+        int order = !a ? 1 : !b ? -1 : 0;
+        if (a && b)
+            order = compare_paths(
+                a->path, a->pathLength, b->path, b->pathLength);
+
+        if (order == 0)
+        {
+            i++;
+            j++;
+
+            // a file replaced by a folder or the other way around is removed
+            // and added, folders themselves are not listed
+            const bool aFolder = a->type == CUTIL_FILE_TYPE_DIRECTORY;
+            const bool bFolder = b->type == CUTIL_FILE_TYPE_DIRECTORY;
+            if (!aFolder && bFolder)
+                diff->removed[diff->removedCount++] = a;
+            else if (aFolder && !bFolder)
+                diff->added[diff->addedCount++] = b;
+            else if (!aFolder && is_modified(a, b, compareHashes))
+                diff->modified[diff->modifiedCount++] = b;
+        }
+        else if (order < 0)
+        {
+            i++;
+            if (a->type != CUTIL_FILE_TYPE_DIRECTORY)
+                diff->removed[diff->removedCount++] = a;
+        }
+        else
+        {
+            j++;
+            if (b->type != CUTIL_FILE_TYPE_DIRECTORY)
+                diff->added[diff->addedCount++] = b;
+        }
+    }
+
+    return RS_SUCCESS;
+}
+
+void cutil_snapshot_diff_free(CutilSnapshotDiff *diff)
+{
+    free(diff->added);
+    free(diff->removed);
+    free(diff->modified);
+    *diff = (CutilSnapshotDiff){0};
+}
+
+const CutilSnapshotEntry *cutil_snapshot_find(
+    const CutilSnapshot *restrict snapshot, const char *restrict path)
+{
+    const u32 length = strlen(path);
+
+    u32 low  = 0;
+    u32 high = snapshot->entryCount;
+    while (low < high)
+    {
+        const u32 middle                = low + (high - low) / 2;
+        const CutilSnapshotEntry *entry = &snapshot->entries[middle];
+
+        const int order =
+            compare_paths(entry->path, entry->pathLength, path, length);
+        if (order == 0)
+            return entry;
+        if (order < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return NULL;
+}
+
+u32 cutil_snapshot_get_entry_count(const CutilSnapshot *snapshot)
+{
+    return snapshot->entryCount;
+}
+
+const CutilSnapshotEntry *cutil_snapshot_get_entry(
+    const CutilSnapshot *snapshot, const u32 index)
+{
+    return index < snapshot->entryCount ? &snapshot->entries[index] : NULL;
+}
+
+//
+// Helper implementations
+//
+
+static int compare_paths(
+    const char *a, const u32 aLength, const char *b, const u32 bLength)
+{
+    const u32 length = min_value(aLength, bLength);
+    for (u32 i = 0; i < length; i++)
+    {
+        if (a[i] == b[i])
+            continue;
+
+        const u32 aRank = a[i] == '/' ? 0 : (u8)a[i] + 1;
+        const u32 bRank = b[i] == '/' ? 0 : (u8)b[i] + 1;
+        return aRank < bRank ? -1 : 1;
+    }
+
+    return aLength < bLength ? -1 : aLength > bLength;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const CutilSnapshotEntry *first  = a;
+    const CutilSnapshotEntry *second = b;
+    return compare_paths(
+        first->path, first->pathLength, second->path, second->pathLength);
+}
+
+static u32 subtree_end(const CutilSnapshot *snapshot, const u32 index)
+{
+    const CutilSnapshotEntry *folder = &snapshot->entries[index];
+
+    // the root holds everything
+    if (!folder->pathLength)
+        return snapshot->entryCount;
+
+    // everything inside comes right after the folder, find where it stops
+    u32 low  = index + 1;
+    u32 high = snapshot->entryCount;
+    while (low < high)
+    {
+        const u32 middle                = low + (high - low) / 2;
+        const CutilSnapshotEntry *entry = &snapshot->entries[middle];
+
+        const bool inside =
+            entry->pathLength > folder->pathLength &&
+            entry->path[folder->pathLength] == '/' &&
+            !memcmp(entry->path, folder->path, folder->pathLength);
+        if (inside)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+static Result push_task(struct ScanJob *job, struct ScanTask *task)
+{
+    if (job->stackCount == job->stackCapacity)
+    {
+        u32 capacity = job->stackCapacity ? job->stackCapacity * 2 : 256;
+        struct ScanTask **stack =
+            realloc(job->stack, capacity * sizeof(struct ScanTask *));
+        if (!stack)
+            return RS_FAILURE;
+        job->stack         = stack;
+        job->stackCapacity = capacity;
+    }
+
+    job->stack[job->stackCount++] = task;
+    pthread_cond_signal(&job->available);
+    return RS_SUCCESS;
+}
+
+static struct ScanTask *new_task(
+    const char *path, const u32 pathLength, const CutilFileInfo *info)
+{
+    struct ScanTask *task = malloc(sizeof(struct ScanTask) + pathLength + 1);
+    if (!task)
+        return NULL;
+
+    task->hasInfo    = info != NULL;
+    task->info       = info ? *info : (CutilFileInfo){0};
+    task->pathLength = pathLength;
+    memcpy(task->path, path, pathLength);
+    task->path[pathLength] = '\0';
+    return task;
+}
+
+static void *scan_worker(void *data)
+{
+    struct ScanWorker *worker = data;
+    struct ScanJob *job       = worker->job;
+
+    pthread_mutex_lock(&job->lock);
+    for (;;)
+    {
+        // with nothing queued and nobody scanning, no more work can appear
+        while (!job->stackCount && job->activeThreads)
+            pthread_cond_wait(&job->available, &job->lock);
+        if (!job->stackCount)
+            break;
+
+        struct ScanTask *task = job->stack[--job->stackCount];
+        job->activeThreads++;
+        pthread_mutex_unlock(&job->lock);
+
+        scan_folder(worker, task);
+        free(task);
+
+        pthread_mutex_lock(&job->lock);
+        job->activeThreads--;
+        if (!job->activeThreads && !job->stackCount)
+            pthread_cond_broadcast(&job->available);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    return NULL;
+}
+
+static void scan_folder(struct ScanWorker *worker, struct ScanTask *task)
+{
+    struct ScanJob *job = worker->job;
+
+    char fullPath[job->rootLength + task->pathLength + 2];
+    build_path(fullPath, job, task->path, task->pathLength);
+
+    CutilFileInfo info = task->info;
+    if (!task->hasInfo && cutil_read_file_info(fullPath, &info))
+        info.exists = false;
+
+    if (!info.exists || info.type != CUTIL_FILE_TYPE_DIRECTORY)
+    {
+        // sub folders can disappear while scanning, but the root has to be
+        // there
+        if (!task->pathLength)
+        {
+            log_error("'%s' is not a folder", fullPath);
+            atomic_fetch_add(&job->errors, 1);
+        }
+        return;
+    }
+
+    const CutilSnapshotEntry entry = {
+        .type         = CUTIL_FILE_TYPE_DIRECTORY,
+        .size         = info.size,
+        .modifiedTime = info.modifiedTime,
+        .inode        = info.inode,
+    };
+    if (add_record(&worker->output, task->path, task->pathLength, &entry))
+        atomic_fetch_add(&job->errors, 1);
+
+    // a folder's time changes when anything is added, removed or renamed in
+    // it, so an unchanged folder has the same entries as before
+    const CutilSnapshotEntry *old =
+        job->previous ? cutil_snapshot_find(job->previous, task->path) : NULL;
+    if (old && old->type == CUTIL_FILE_TYPE_DIRECTORY &&
+        old->modifiedTime == info.modifiedTime && old->inode == info.inode)
+        check_known_folder(worker, old - job->previous->entries);
+    else
+        list_folder(worker, task, fullPath);
+}
+
+static void list_folder(
+    struct ScanWorker *worker,
+    const struct ScanTask *task,
+    const char *fullPath)
+{
+    struct ScanJob *job = worker->job;
+
+    CutilDirectoryIterator *iterator;
+    if (cutil_platform_directory_open(&iterator, fullPath, NULL))
+    {
+        atomic_fetch_add(&job->errors, 1);
+        return;
+    }
+
+    CutilDirectoryEntry entry;
+    while (cutil_platform_directory_next(iterator, &entry))
+    {
+        // files can be deleted between listing and asking for their info
+        CutilFileInfo info;
+        if (cutil_platform_directory_entry_info(iterator, &info) ||
+            !info.exists)
+            continue;
+
+        u32 pathLength = task->pathLength + entry.pathLength;
+        char path[pathLength + 2];
+        memcpy(path, task->path, task->pathLength);
+        if (task->pathLength)
+            path[task->pathLength] = '/';
+        pathLength += task->pathLength != 0;
+        memcpy(
+            path + pathLength - entry.pathLength,
+            entry.path,
+            entry.pathLength);
+        path[pathLength] = '\0';
+
+        if (entry.type == CUTIL_FILE_TYPE_DIRECTORY)
+        {
+            struct ScanTask *child = new_task(path, pathLength, &info);
+            if (!child)
+            {
+                atomic_fetch_add(&job->errors, 1);
+                continue;
+            }
+
+            pthread_mutex_lock(&job->lock);
+            Result pushed = push_task(job, child);
+            pthread_mutex_unlock(&job->lock);
+
+            if (pushed)
+            {
+                // no room on the stack, scan it on this thread instead
+                scan_folder(worker, child);
+                free(child);
+            }
+            continue;
+        }
+
+        // the old entry is only needed for its hash
+        const CutilSnapshotEntry *old = NULL;
+        if (job->previous && (job->flags & CUTIL_SNAPSHOT_HASH_CONTENTS))
+            old = cutil_snapshot_find(job->previous, path);
+
+        record_file(worker, path, pathLength, entry.type, &info, old);
+    }
+
+    if (cutil_platform_directory_close(iterator))
+        atomic_fetch_add(&job->errors, 1);
+}
+
+static void check_known_folder(struct ScanWorker *worker, const u32 index)
+{
+    struct ScanJob *job           = worker->job;
+    const CutilSnapshot *previous = job->previous;
+    const u32 end                 = subtree_end(previous, index);
+    const bool trustFolders = job->flags & CUTIL_SNAPSHOT_TRUST_FOLDER_TIMES;
+
+    // only the entries directly inside, sub folders check their own
+    for (u32 i = index + 1; i < end;)
+    {
+        const CutilSnapshotEntry *old = &previous->entries[i];
+
+        if (old->type == CUTIL_FILE_TYPE_DIRECTORY)
+        {
+            i = subtree_end(previous, i);
+
+            struct ScanTask *child = new_task(old->path, old->pathLength, NULL);
+            if (!child)
+            {
+                atomic_fetch_add(&job->errors, 1);
+                continue;
+            }
+
+            pthread_mutex_lock(&job->lock);
+            Result pushed = push_task(job, child);
+            pthread_mutex_unlock(&job->lock);
+
+            if (pushed)
+            {
+                scan_folder(worker, child);
+                free(child);
+            }
+            continue;
+        }
+        i++;
+
+        if (trustFolders)
+        {
+            // hashes are only valid if the old snapshot made them
+            CutilSnapshotEntry entry = *old;
+            if (!(job->flags & CUTIL_SNAPSHOT_HASH_CONTENTS) ||
+                !(previous->flags & CUTIL_SNAPSHOT_HASH_CONTENTS))
+                entry.hash = (CutilHash128){0};
+            if (add_record(&worker->output, old->path, old->pathLength, &entry))
+                atomic_fetch_add(&job->errors, 1);
+            continue;
+        }
+
+        // files written in place do not change the folder's time
+        char fullPath[job->rootLength + old->pathLength + 2];
+        build_path(fullPath, job, old->path, old->pathLength);
+
+        CutilFileInfo info;
+        if (cutil_read_file_info(fullPath, &info) || !info.exists)
+            continue;
+
+        record_file(worker, old->path, old->pathLength, old->type, &info, old);
+    }
+}
+
+static void record_file(
+    struct ScanWorker *worker,
+    const char *path,
+    const u32 pathLength,
+    const CutilFileType type,
+    const CutilFileInfo *info,
+    const CutilSnapshotEntry *old)
+{
+    struct ScanJob *job = worker->job;
+
+    CutilSnapshotEntry entry = {
+        .type         = type,
+        .size         = info->size,
+        .modifiedTime = info->modifiedTime,
+        .inode        = info->inode,
+    };
+
+    if ((job->flags & CUTIL_SNAPSHOT_HASH_CONTENTS) &&
+        type == CUTIL_FILE_TYPE_REGULAR)
+    {
+        const bool unchanged =
+            old && (job->previous->flags & CUTIL_SNAPSHOT_HASH_CONTENTS) &&
+            old->type == type && old->size == entry.size &&
+            old->modifiedTime == entry.modifiedTime &&
+            old->inode == entry.inode;
+
+        if (unchanged)
+            entry.hash = old->hash;
+        else
+        {
+            // the scan is already spread over the threads
+            char fullPath[job->rootLength + pathLength + 2];
+            build_path(fullPath, job, path, pathLength);
+            if (cutil_file_hash(fullPath, &entry.hash, 1))
+                entry.hash = (CutilHash128){0};
+        }
+    }
+
+    if (add_record(&worker->output, path, pathLength, &entry))
+        atomic_fetch_add(&job->errors, 1);
+}
+
+static Result add_record(
+    struct ScanOutput *output,
+    const char *path,
+    const u32 pathLength,
+    const CutilSnapshotEntry *entry)
+{
+    if (output->recordCount == output->recordCapacity)
+    {
+        u32 capacity =
+            output->recordCapacity ? output->recordCapacity * 2 : 1024;
+        struct ScanRecord *records =
+            realloc(output->records, capacity * sizeof(struct ScanRecord));
+        if (!records)
+            return RS_FAILURE;
+        output->records        = records;
+        output->recordCapacity = capacity;
+    }
+
+    if (output->pathsSize + pathLength + 1 > output->pathsCapacity)
+    {
+        u64 capacity = output->pathsCapacity ? output->pathsCapacity : 16384;
+        while (output->pathsSize + pathLength + 1 > capacity)
+            capacity *= 2;
+        char *paths = realloc(output->paths, capacity);
+        if (!paths)
+            return RS_FAILURE;
+        output->paths         = paths;
+        output->pathsCapacity = capacity;
+    }
+
+    struct ScanRecord *record = &output->records[output->recordCount++];
+    record->entry             = *entry;
+    record->entry.path        = NULL;
+    record->entry.pathLength  = pathLength;
+    record->pathOffset        = output->pathsSize;
+
+    memcpy(output->paths + output->pathsSize, path, pathLength);
+    output->paths[output->pathsSize + pathLength] = '\0';
+    output->pathsSize += pathLength + 1;
+    return RS_SUCCESS;
+}
+
+static void build_path(
+    char *dest,
+    const struct ScanJob *job,
+    const char *path,
+    const u32 pathLength)
+{
+    memcpy(dest, job->root, job->rootLength);
+    u32 length = job->rootLength;
+    if (pathLength)
+    {
+        dest[length++] = '/';
+        memcpy(dest + length, path, pathLength);
+        length += pathLength;
+    }
+    dest[length] = '\0';
+}
+
+static CutilSnapshot *merge_outputs(
+    struct ScanWorker *workers, const u32 workerCount, const u32 flags)
+{
+    u64 entryCount = 0;
+    u64 pathsSize  = 0;
+    for (u32 i = 0; i < workerCount; i++)
+    {
+        entryCount += workers[i].output.recordCount;
+        pathsSize  += workers[i].output.pathsSize;
+    }
+
+    if (entryCount > UINT32_MAX)
+    {
+        log_error("A snapshot can hold at most %u entries", UINT32_MAX);
+        return NULL;
+    }
+
+    CutilSnapshot *snapshot = calloc(1, sizeof(CutilSnapshot));
+    if (!snapshot)
+        return NULL;
+    snapshot->entries = malloc((entryCount + 1) * sizeof(CutilSnapshotEntry));
+    snapshot->paths   = malloc(pathsSize + 1);
+    if (!snapshot->entries || !snapshot->paths)
+    {
+        cutil_snapshot_destroy(snapshot);
+        return NULL;
+    }
+    snapshot->entryCount = entryCount;
+    snapshot->flags      = flags;
+
+    u32 index  = 0;
+    u64 offset = 0;
+    for (u32 i = 0; i < workerCount; i++)
+    {
+        const struct ScanOutput *output = &workers[i].output;
+        if (!output->recordCount)
+            continue;
+
+        memcpy(snapshot->paths + offset, output->paths, output->pathsSize);
+        for (u32 j = 0; j < output->recordCount; j++)
+        {
+            CutilSnapshotEntry *entry = &snapshot->entries[index++];
+            *entry                    = output->records[j].entry;
+            entry->path =
+                snapshot->paths + offset + output->records[j].pathOffset;
+        }
+        offset += output->pathsSize;
+    }
+
+    qsort(
+        snapshot->entries,
+        snapshot->entryCount,
+        sizeof(CutilSnapshotEntry),
+        compare_entries);
+
+    return snapshot;
+}
+
+static bool is_modified(
+    const CutilSnapshotEntry *old,
+    const CutilSnapshotEntry *current,
+    const bool compareHashes)
+{
+    if (old->type != current->type)
+        return true;
+
+    if (compareHashes && current->type == CUTIL_FILE_TYPE_REGULAR)
+        return old->hash.low != current->hash.low ||
+               old->hash.high != current->hash.high;
+
+    return old->size != current->size ||
+           old->modifiedTime != current->modifiedTime ||
+           old->inode != current->inode;
+}
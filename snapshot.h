@@ -0,0 +1,172 @@
+#pragma once
+
+// Folder snapshots
+//
+// A snapshot records the size, modified time, inode and optionally a content
+// hash of everything in a folder tree, and can be saved to a compact index
+// file. Scanning the tree again with the last snapshot as a reference, and
+// diffing the two, lists the files that were added, removed and modified.
+//
+// Scans run on several threads, one folder at a time each. A folder whose own
+// modified time did not change has the same entries as before, so it is not
+// listed again and only its known files are checked. File contents are only
+// hashed again when their size, time or inode changed.
+//
+// Kael Johnston
+
+#include "types.h"
+#include "hash.h"
+#include "platform.h"
+
+typedef enum CutilSnapshotFlags
+{
+    // hash the contents of each file. A file that was saved again with the
+    // same contents is then not reported as modified
+    CUTIL_SNAPSHOT_HASH_CONTENTS = 1 << 0,
+    // a folder with an unchanged modified time is assumed to be unchanged,
+    // files and all, so they are not checked. A folder's time only changes
+    // when files are added, removed or renamed in it, so only use this when
+    // files are replaced instead of written in place, for example with
+    // cutil_write_file_atomic
+    CUTIL_SNAPSHOT_TRUST_FOLDER_TIMES = 1 << 1,
+} CutilSnapshotFlags;
+
+/**
+ * A file or folder in a snapshot.
+ */
+typedef struct CutilSnapshotEntry
+{
+    const char *path; // relative to the snapshot folder, "" for the folder
+    u32 pathLength;
+    CutilFileType type;
+    u64 size;
+    i64 modifiedTime; // in nanoseconds since 1970
+    u64 inode;
+    CutilHash128 hash; // 0 unless the snapshot hashes contents
+} CutilSnapshotEntry;
+
+/**
+ * The changes between two snapshots. Folders are not listed, only what is in
+ * them. Added and modified entries are from the new snapshot, removed ones
+ * from the old one, so both must outlive the diff.
+ */
+typedef struct CutilSnapshotDiff
+{
+    const CutilSnapshotEntry **added;
+    u32 addedCount;
+    const CutilSnapshotEntry **removed;
+    u32 removedCount;
+    const CutilSnapshotEntry **modified;
+    u32 modifiedCount;
+} CutilSnapshotDiff;
+
+typedef struct CutilSnapshot CutilSnapshot;
+
+/**
+ * Scan a folder tree.
+ *
+ * @param snapshot will be set to the new snapshot
+ * @param folder the folder to scan, it is localized like all other file
+ * utilities
+ * @param previous an earlier snapshot of the same folder, or NULL. Unchanged
+ * folders and hashes are taken from it instead of the disk
+ * @param flags CutilSnapshotFlags
+ * @param threadCount the number of threads to scan with, 0 picks for you. At
+ * most 64 are used
+ *
+ * @return RS_FAILURE if any folder could not be read
+ *
+ * @author Kael Johnston
+ */
+Result cutil_snapshot_create(
+    CutilSnapshot **restrict snapshot,
+    const char *restrict folder,
+    const CutilSnapshot *restrict previous,
+    const u32 flags,
+    u32 threadCount);
+
+/**
+ * Free a snapshot.
+ *
+ * @author Kael Johnston
+ */
+void cutil_snapshot_destroy(CutilSnapshot *snapshot);
+
+/**
+ * Save a snapshot. Paths are stored once, sharing their start with the path
+ * before them, and numbers as varints (see serialize.h).
+ *
+ * @return Result
+ *
+ * @author Kael Johnston
+ */
+Result cutil_snapshot_write(
+    const CutilSnapshot *restrict snapshot, const char *restrict filepath);
+
+/**
+ * Load a snapshot saved with cutil_snapshot_write.
+ *
+ * @param snapshot will be set to the snapshot
+ * @param filepath the file to read
+ *
+ * @return RS_FAILURE if the file could not be read or is corrupted
+ *
+ * @author Kael Johnston
+ */
+Result cutil_snapshot_read(
+    CutilSnapshot **restrict snapshot, const char *restrict filepath);
+
+/**
+ * Compare two snapshots of the same folder. An entry is modified if its type,
+ * size, time or inode changed. When both snapshots hash contents, files are
+ * only modified if their hash changed.
+ *
+ * @param old the earlier snapshot
+ * @param current the later snapshot
+ * @param diff will be set to the changes, free it with
+ * cutil_snapshot_diff_free
+ *
+ * @return RS_FAILURE if memory could not be allocated
+ *
+ * @author Kael Johnston
+ */
+Result cutil_snapshot_diff(
+    const CutilSnapshot *restrict old,
+    const CutilSnapshot *restrict current,
+    CutilSnapshotDiff *restrict diff);
+
+/**
+ * Free the lists of a diff.
+ *
+ * @author Kael Johnston
+ */
+void cutil_snapshot_diff_free(CutilSnapshotDiff *diff);
+
+/**
+ * Find an entry by its path.
+ *
+ * @param snapshot the snapshot
+ * @param path relative to the snapshot folder
+ *
+ * @return the entry, or NULL if it is not in the snapshot
+ *
+ * @author Kael Johnston
+ */
+const CutilSnapshotEntry *cutil_snapshot_find(
+    const CutilSnapshot *restrict snapshot, const char *restrict path);
+
+/**
+ * Get the number of entries, to iterate over them with
+ * cutil_snapshot_get_entry.
+ *
+ * @author Kael Johnston
+ */
+u32 cutil_snapshot_get_entry_count(const CutilSnapshot *snapshot);
+
+/**
+ * Get an entry by index. Entries are sorted by path.
+ *
+ * @author Kael Johnston
+ */
+const CutilSnapshotEntry *cutil_snapshot_get_entry(
+    const CutilSnapshot *snapshot, const u32 index);
@@ -1,6 +1,112 @@
 #include "string_util.h"
 
+#include <pthread.h>
 #include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// scalar search, 8 bytes at a time
+static const char *find_char_scalar(const char *str, u64 length, const char c)
+{
+    const u64 ones  = 0x0101010101010101ull;
+    const u64 highs = 0x8080808080808080ull;
+    const u64 match = ones * (u8)c;
+
+    u64 i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        u64 word;
+        memcpy(&word, str + i, sizeof(word));
+        word ^= match; // matching bytes become 0
+        if ((word - ones) & ~word & highs)
+            break;
+    }
+
+    for (; i < length; i++)
+        if (str[i] == c)
+            return str + i;
+
+    return NULL;
+}
+
+#ifdef __SSE2__
+static const char *find_char_sse2(const char *str, u64 length, const char c)
+{
+    const __m128i match = _mm_set1_epi8(c);
+
+    u64 i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(str + i));
+        int mask      = _mm_movemask_epi8(_mm_cmpeq_epi8(block, match));
+        if (mask)
+            return str + i + __builtin_ctz(mask);
+    }
+
+    return find_char_scalar(str + i, length - i, c);
+}
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2"))) static const char *
+find_char_avx2(const char *str, u64 length, const char c)
+{
+    const __m256i match = _mm256_set1_epi8(c);
+
+    u64 i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(str + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(str + i + 32));
+        u32 maskA = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, match));
+        u32 maskB = _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, match));
+        if (maskA | maskB)
+        {
+            u64 mask = ((u64)maskB << 32) | maskA;
+            return str + i + __builtin_ctzll(mask);
+        }
+    }
+
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(str + i));
+        u32 mask      = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, match));
+        if (mask)
+            return str + i + __builtin_ctz(mask);
+    }
+
+    return find_char_scalar(str + i, length - i, c);
+}
+#endif
+
+typedef const char *(*FindCharFunction)(
+    const char *str, u64 length, const char c);
+
+// the fastest search the cpu supports, see init_find_char
+static FindCharFunction g_findChar   = NULL;
+static pthread_once_t g_findCharOnce = PTHREAD_ONCE_INIT;
+
+static void init_find_char(void)
+{
+#ifdef __SSE2__
+    g_findChar = find_char_sse2;
+#else
+    g_findChar = find_char_scalar;
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2"))
+        g_findChar = find_char_avx2;
+#endif
+}
+
+const char *cutil_string_find_char(const char *str, u64 length, const char c)
+{
+    // searches run on many threads at once, the first ones included
+    pthread_once(&g_findCharOnce, init_find_char);
+    return g_findChar(str, length, c);
+}
 // it will strip everything before the last instance of stripper
 // Example: "/home/path/to/file/config.txt" -> "config.txt"
 Result
@@ -81,3 +187,14 @@ Result cutil_string_truncate(
 
     return RS_SUCCESS;
 }
+
+u64 cutil_string_hash(const char *str, u64 length)
+{
+    u64 hash = 0xcbf29ce484222325ull;
+    for (u64 i = 0; i < length; i++)
+    {
+        hash ^= (u8)str[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
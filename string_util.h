@@ -11,6 +11,15 @@
 
 #include "types.h"
 
+/**
+ * A string that is not NULL terminated, usually pointing into a larger buffer.
+ */
+typedef struct CutilStringView
+{
+    const char *data;
+    u64 length;
+} CutilStringView;
+
 /**
  * Remove the front of a string up to the last instance of a character.
  * Example(stripper='/'): "/home/user/document.txt" -> "document.txt"
@@ -58,3 +67,31 @@ Result cutil_string_truncate(
     const char *restrict str,
     const char slicer,
     bool inclusive);
+
+/**
+ * Find the first instance of a character in a buffer. It uses AVX2 or SSE2
+ * when the cpu supports them, so it is much faster than a simple loop for long
+ * buffers. Unlike strchr, it does not stop at a NULL terminator.
+ *
+ * @param str the buffer to search, must be a valid pointer if length is not 0
+ * @param length the number of bytes to search
+ * @param c the character to find
+ *
+ * @return a pointer to the character, or NULL if it is not in the buffer
+ *
+ * @author Kael Johnston
+ */
+const char *cutil_string_find_char(const char *str, u64 length, const char c);
+
+/**
+ * Hash a string with FNV-1a. It is fast for short strings like paths, and is
+ * used to key hash tables. It is not suitable for large buffers.
+ *
+ * @param str the string to hash, does not have to be NULL terminated
+ * @param length the length of the string
+ *
+ * @return the hash
+ *
+ * @author Kael Johnston
+ */
+u64 cutil_string_hash(const char *str, u64 length);